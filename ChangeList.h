@@ -33,7 +33,9 @@ struct ChangeListItem
 {
     ChangeListItem();
     ChangeListItem(int globalIndex_, const std::complex<double> * values_);
+    ChangeListItem(const MatrixPosition & pos, int globalIndex_, const std::complex<double> * values_);
     ChangeListItem(const ChangeListItem &);
+    MatrixPosition position_; // Changed voxel, since table version 0x03 entries may cover several voxels
     int globalIndex_;
     SystemMatrix::complex values_[4]; // 0 & 2 = old values, 1 & 3 = new values, 0 & 1 = uncorrected, 2 & 3 corrected
 };
@@ -46,14 +48,17 @@ QTextStream & operator << (QTextStream &, const ChangeListItem &);
 struct ChangeListEntry
 {
     ChangeListEntry();
-    ChangeListEntry(const MatrixPosition & pos, const QList<ChangeListItem> & changes)
-        : changeTime(QDateTime::currentDateTime()), position(pos), changeItems(changes) {}
+    ChangeListEntry(const MatrixPosition & pos, const QList<ChangeListItem> & changes);
     ChangeListEntry(const MatrixPosition & pos, const ChangeListItem & change);
     ChangeListEntry(const MatrixPosition & pos, int globalIndex, const std::complex<double> * values);
     ChangeListEntry(const ChangeListEntry & c)
         : changeTime(c.changeTime), position(c.position), changeItems(c.changeItems) {}
+    /**
+     * @brief positions Distinct voxels changed by the entry
+     */
+    QList<MatrixPosition> positions() const;
     QDateTime changeTime;
-    MatrixPosition position;
+    MatrixPosition position; // Voxel or center of the region
     QList<ChangeListItem> changeItems;
 };
 
@@ -63,4 +68,9 @@ QTextStream & operator << (QTextStream &, const ChangeListEntry &);
 
 typedef QList<ChangeListEntry> ChangeList;
 
+/**
+ * @brief readChangeListV2 Read a change table of version 0x02, whose items do not store their position
+ */
+QDataStream & readChangeListV2(QDataStream &, ChangeList &);
+
 #endif // CHANGELIST_H
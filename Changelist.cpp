@@ -36,8 +36,15 @@ ChangeListItem::ChangeListItem(int globalIndex, const std::complex<double> *valu
         values_[i]=values[i];
 }
 
+ChangeListItem::ChangeListItem(const MatrixPosition & pos, int globalIndex, const std::complex<double> *values)
+    : position_(pos), globalIndex_(globalIndex)
+{
+    for ( unsigned int i=0; i<4; i++)
+        values_[i]=values[i];
+}
+
 ChangeListItem::ChangeListItem(const ChangeListItem & c)
-    : globalIndex_(c.globalIndex_)
+    : position_(c.position_), globalIndex_(c.globalIndex_)
 {
     for ( unsigned int i=0; i<4; i++)
         values_[i]=c.values_[i];
@@ -45,6 +52,7 @@ ChangeListItem::ChangeListItem(const ChangeListItem & c)
 
 QDataStream & operator << (QDataStream & d, const ChangeListItem & c)
 {
+    d << c.position_;
     d << c.globalIndex_;
     for ( unsigned int i=0; i<4; i++ )
         d << c.values_[i].real() << c.values_[i].imag();
@@ -53,6 +61,7 @@ QDataStream & operator << (QDataStream & d, const ChangeListItem & c)
 
 QDataStream & operator >> (QDataStream & d, ChangeListItem & c)
 {
+    d >> c.position_;
     d >> c.globalIndex_;
     for ( unsigned int i=0; i<4; i++ )
     {
@@ -82,16 +91,36 @@ ChangeListEntry::ChangeListEntry()
 {
 }
 
+ChangeListEntry::ChangeListEntry(const MatrixPosition & pos, const QList<ChangeListItem> & changes)
+    : changeTime(QDateTime::currentDateTime()), position(pos), changeItems(changes)
+{
+    // Items without a position of their own belong to the voxel of the entry
+    for ( int i=0; i<changeItems.count(); i++ )
+        if ( !changeItems.at(i).position_.isValid() )
+            changeItems[i].position_ = pos;
+}
+
 ChangeListEntry::ChangeListEntry(const MatrixPosition & pos, const ChangeListItem & change)
     : changeTime(QDateTime::currentDateTime()), position(pos)
 {
     changeItems.append(change);
+    if ( !change.position_.isValid() )
+        changeItems.first().position_ = pos;
 }
 
 ChangeListEntry::ChangeListEntry(const MatrixPosition & pos, int globalIndex, const std::complex<double> * values)
     : changeTime(QDateTime::currentDateTime()), position(pos)
 {
-    changeItems.append(ChangeListItem(globalIndex,values));
+    changeItems.append(ChangeListItem(pos,globalIndex,values));
+}
+
+QList<MatrixPosition> ChangeListEntry::positions() const
+{
+    QList<MatrixPosition> res;
+    foreach(const ChangeListItem & i, changeItems)
+        if ( !res.contains(i.position_) )
+            res.append(i.position_);
+    return res;
 }
 
 QDataStream & operator << (QDataStream & d, const ChangeListEntry & c)
@@ -114,7 +143,40 @@ QTextStream & operator << (QTextStream & t, const ChangeListEntry & c )
 {
     t << c.changeTime.toString(Qt::SystemLocaleShortDate) << ": Change of matrix position " << c.position << "\n";
     foreach(const ChangeListItem & i, c.changeItems)
+    {
+        // Only items of a region name their voxel
+        if ( i.position_!=c.position )
+            t << "[" << i.position_ << "] ";
         t << i << "\n";
+    }
     return t;
 }
 
+QDataStream & readChangeListV2(QDataStream & d, ChangeList & changeList)
+{
+    changeList.clear();
+    quint32 entries;
+    d >> entries;
+    for ( quint32 e=0; e<entries && d.status()==QDataStream::Ok; e++ )
+    {
+        ChangeListEntry c;
+        quint32 items;
+        d >> c.changeTime >> c.position >> items;
+        for ( quint32 n=0; n<items && d.status()==QDataStream::Ok; n++ )
+        {
+            ChangeListItem i;
+            i.position_ = c.position;
+            d >> i.globalIndex_;
+            for ( unsigned int k=0; k<4; k++ )
+            {
+                double a,b;
+                d >> a >> b;
+                i.values_[k]=std::complex<double>(a,b);
+            }
+            c.changeItems.append(i);
+        }
+        changeList.append(c);
+    }
+    return d;
+}
+
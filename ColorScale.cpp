@@ -19,6 +19,9 @@
  * $Id: ChangeList.h 58 2016-08-24 13:03:50Z uhei $
  */
 
+// Standard includes
+#include <cmath>
+
 // Qt includes
 #include <QList>
 #include <QCoreApplication>
@@ -32,6 +35,40 @@
 #include "ColorScale.h"
 #include "utility.h"
 
+static void drawTick(QPainter * p, const QFontMetrics & fm, const QRect & colorBar, double fraction, const QString & label)
+{
+    QPoint tickStart(colorBar.right()+1,colorBar.top()+qRound((1.0-fraction)*colorBar.height()));
+    QPoint tickEnd = tickStart;
+    tickEnd.rx() +=4;
+    p->drawLine(tickStart,tickEnd);
+    QRect r(tickEnd.x()+4,tickEnd.y()-fm.height()/2,fm.width("XXXXXXXX"),fm.height());
+    p->drawText(r,label,Qt::AlignLeft|Qt::AlignVCenter);
+}
+
+// Labels the magnitude bar right of colorBar, logarithmic as SFRenderer maps it: over at most three
+// decades below max with a tick at every power of ten
+static void drawMagnitudeTicks(QPainter * p, const QFontMetrics & fm, const QRect & colorBar, double min, double max, bool logarithmic)
+{
+    double lower = qMax(min,1e-3*max);
+    if ( !logarithmic || max<=lower )
+    {
+        drawTick(p,fm,colorBar,1.0,QString::number(max,'f',0));
+        drawTick(p,fm,colorBar,0.0,QString::number(min,'f',0));
+        return;
+    }
+    double decades = std::log10(max/lower);
+    drawTick(p,fm,colorBar,1.0,QString::number(max,'g',3));
+    drawTick(p,fm,colorBar,0.0,QString::number(lower,'g',3));
+    // Keep the labels of intermediate ticks apart from the end labels
+    double gap = colorBar.height()>0 ? double(fm.height())/colorBar.height() : 1.0;
+    for ( double e=std::ceil(std::log10(lower)); e<std::log10(max); e+=1.0 )
+    {
+        double fraction = (e-std::log10(lower))/decades;
+        if ( fraction>gap && fraction<1.0-gap )
+            drawTick(p,fm,colorBar,fraction,QString::number(std::pow(10.0,e),'g',3));
+    }
+}
+
 class ColorScaleIconEngine : public QIconEngine
 {
 public:
@@ -69,12 +106,24 @@ struct ColorScale::Impl
 {
     QString name;
     QVector<QColor> colors;
+    QVector<QRgb> table;
 };
 
 class PhaseColorScale : public ColorScale {
 public:
-    PhaseColorScale() : ColorScale( qApp->translate("ColorScale","Phase") )
+    PhaseColorScale() : ColorScale( qApp->translate("ColorScale","Phase") ), table(hues*values)
+    {
+        for ( int h=0; h<hues; h++ )
+            for ( int v=0; v<values; v++ )
+                table[h*values+v] = QColor::fromHsvF( double(h)/hues, 1.0, double(v)/(values-1) ).rgb();
+    }
+    virtual QRgb rgb(const std::complex<double> & value) const
     {
+        double gray = std::min(1.0,abs ( value ) );
+        double hue = 0.5 * arg( value ) / M_PI;
+        if ( hue<0.0 ) hue+=1.0;
+        int h = static_cast<int>(hue*hues) % hues;
+        return table[h*values+static_cast<int>(gray*(values-1))];
     }
     virtual QColor color(const std::complex<double> & value) const
     {
@@ -83,7 +132,7 @@ public:
         if ( hue<0.0 ) hue+=1.0;
         return QColor::fromHsvF( hue , 1.0, gray);
     }
-    void drawLegend(QPainter * p, const QRect &area, double min, double max) const
+    void drawLegend(QPainter * p, const QRect &area, double min, double max, bool logarithmic) const
     {
         QFont labelFont ("Helvetica", 8);
         QFontMetrics fm (labelFont);
@@ -100,18 +149,7 @@ public:
         p->drawImage(colorBar,image);
         p->setPen ( Qt::black );
         p->drawRect(colorBar);
-        QPoint tickStart = colorBar.topRight();
-        tickStart.rx() += 1;
-        QPoint tickEnd = tickStart;
-        tickEnd.rx() +=4;
-        p->drawLine(tickStart,tickEnd);
-        QRect r(tickEnd.x()+4,tickEnd.y()-fm.height()/2,fm.width("XXXXXXXX"),fm.height());
-        p->drawText(r,QString::number(max,'f',0),Qt::AlignLeft|Qt::AlignVCenter);
-        tickStart.ry()+=colorBar.height();
-        tickEnd.ry()+=colorBar.height();
-        p->drawLine(tickStart,tickEnd);
-        r.translate(0,colorBar.height());
-        p->drawText(r,QString::number(min,'f',0),Qt::AlignLeft|Qt::AlignVCenter);
+        drawMagnitudeTicks(p,fm,colorBar,min,max,logarithmic);
 
         image =QImage( 1, 360, QImage::Format_RGB32 );
         for ( unsigned int i=0; i<360; i++ )
@@ -135,7 +173,11 @@ public:
         p->restore();
 
     }
-
+private:
+    // One degree of hue and 256 brightness levels
+    static const int hues = 360;
+    static const int values = 256;
+    QVector<QRgb> table;
 };
 
 QList<ColorScale *> ColorScale::defaultColorScales()
@@ -173,6 +215,9 @@ ColorScale::ColorScale(const QString & name, const QVector<QColor> & colors, QOb
 {
     d->name = name;
     d->colors = colors;
+    d->table.reserve(colors.size());
+    foreach ( const QColor & c, colors )
+        d->table.append(c.rgb());
 }
 
 ColorScale::ColorScale(const QString & name, QObject *parent) : QObject(parent), d(new Impl)
@@ -199,7 +244,18 @@ QColor ColorScale::color(const std::complex<double> &value) const
     return d->colors[index];
 }
 
-void ColorScale::drawLegend(QPainter * p, const QRect &area, double min, double max) const
+QRgb ColorScale::rgb(const std::complex<double> &value) const
+{
+    if ( d->table.isEmpty() )
+        return color(value).rgb();
+    double v=abs(value);
+    v=std::min(v,1.0);
+    v=std::max(v,0.0);
+    int index=v*(d->table.size()-1);
+    return d->table[index];
+}
+
+void ColorScale::drawLegend(QPainter * p, const QRect &area, double min, double max, bool logarithmic) const
 {
     QFont labelFont ("Helvetica", 8);
     QFontMetrics fm (labelFont);
@@ -216,18 +272,7 @@ void ColorScale::drawLegend(QPainter * p, const QRect &area, double min, double
     p->drawImage(colorBar,image);
     p->setPen ( Qt::black );
     p->drawRect(colorBar);
-    QPoint tickStart = colorBar.topRight();
-    tickStart.rx() += 1;
-    QPoint tickEnd = tickStart;
-    tickEnd.rx() +=4;
-    p->drawLine(tickStart,tickEnd);
-    QRect r(tickEnd.x()+4,tickEnd.y()-fm.height()/2,fm.width("XXXXXXXX"),fm.height());
-    p->drawText(r,QString::number(max,'f',0),Qt::AlignLeft|Qt::AlignVCenter);
-    tickStart.ry()+=colorBar.height();
-    tickEnd.ry()+=colorBar.height();
-    p->drawLine(tickStart,tickEnd);
-    r.translate(0,colorBar.height());
-    p->drawText(r,QString::number(min,'f',0),Qt::AlignLeft|Qt::AlignVCenter);
+    drawMagnitudeTicks(p,fm,colorBar,min,max,logarithmic);
     p->restore();
 }
 
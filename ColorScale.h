@@ -44,7 +44,15 @@ public:
     virtual ~ColorScale();
     const QString & name() const;
     virtual QColor color(const std::complex<double> & value) const;
-    virtual void drawLegend(QPainter *, const QRect & rect, double min, double max) const;
+    /**
+     * @brief rgb Same as color() from a table filled at construction, cheap enough for every pixel
+     */
+    virtual QRgb rgb(const std::complex<double> & value) const;
+    /**
+     * @brief drawLegend Color bar for magnitudes from min to max, logarithmic labels the bar as
+     *                   SFRenderer::setLogMagnitude maps it
+     */
+    virtual void drawLegend(QPainter *, const QRect & rect, double min, double max, bool logarithmic=false) const;
 protected:
     QIconEngine * createIconEngine();
     static QList<ColorScale *> defaultColorScales();
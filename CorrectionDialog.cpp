@@ -25,8 +25,10 @@
 #include <QtCore/QPointer>
 #if QT_VERSION >= 0x050000
 #include <QtWidgets/QProgressBar>
+#include <QtWidgets/QPushButton>
 #else
 #include <QtGui/QProgressBar>
+#include <QtGui/QPushButton>
 #endif
 
 #include "CorrectionDialog.h"
@@ -34,41 +36,65 @@
 
 #include "SystemMatrix.h"
 #include "MatrixPosition.h"
+#include "CorrectionJob.h"
 
 struct CorrectionDialog::Impl
 {
     QPointer<SystemMatrix> systemMatrix;
     int receiver;
     MatrixPosition pos;
+    QList<MatrixPosition> region;
     int numChanges;
     Ui::CorrectionDialog * ui;
+    CorrectionJob job;
 };
 
-int CorrectionDialog::performCorrection(SystemMatrix *matrix, int receiver, const MatrixPosition &pos, QWidget * parent)
+int CorrectionDialog::performCorrection(SystemMatrix *matrix, int receiver, const MatrixPosition &pos,
+                                        const QList<MatrixPosition> & region, QWidget * parent)
 {
-    CorrectionDialog dialog(matrix, receiver, pos, parent);
+    CorrectionDialog dialog(matrix, receiver, pos, region, parent);
     if ( QDialog::Accepted == dialog.exec())
         return dialog.numChanges();
     return 0;
 }
 
-CorrectionDialog::CorrectionDialog(SystemMatrix * matrix, int receiver, const MatrixPosition &pos, QWidget * parent, Qt::WindowFlags f )
+CorrectionDialog::CorrectionDialog(SystemMatrix * matrix, int receiver, const MatrixPosition &pos, const QList<MatrixPosition> & region,
+                                   QWidget * parent, Qt::WindowFlags f )
     : QDialog(parent,f), d(new Impl)
 {
     d->systemMatrix = matrix;
     d->receiver = receiver;
     d->pos = pos;
+    d->region = region;
     d->numChanges = 0;
 
     d->ui = new Ui::CorrectionDialog;
     d->ui->setupUi(this);
 
-    d->ui->introText->setText(tr("Replace voxel values at position (%1/%2/%3) in channel %4 by a value "
-                                 "interpolated from the nearest neighbours.").arg(pos.x()).arg(pos.y()).arg(pos.z()).arg(QChar('X'+receiver)));
     QSettings settings;
     int threshold = settings.value("interpolationThreshold",10).toInt();
     d->ui->thresholdSpinBox->setValue(threshold);
     d->ui->thresholdSlider->setValue(threshold);
+    d->ui->allReceivers->setChecked(settings.value("correctAllReceivers",false).toBool());
+    updateIntroText();
+    connect(d->ui->allReceivers,SIGNAL(toggled(bool)),SLOT(updateIntroText()));
+
+    connect(&d->job,SIGNAL(progress(int)),d->ui->progressBar,SLOT(setValue(int)));
+    connect(&d->job,SIGNAL(finished(bool)),SLOT(finishCorrection(bool)));
+}
+
+void CorrectionDialog::updateIntroText()
+{
+    QString channels = d->ui->allReceivers->isChecked() ? tr("all channels")
+                                                        : tr("channel %1").arg(QChar('X'+d->receiver));
+    if ( d->region.count()>1 )
+        d->ui->introText->setText(tr("Replace the values of %1 voxels around position (%2/%3/%4) in %5 by values "
+                                     "interpolated from the nearest neighbours.").arg(d->region.count())
+                                  .arg(d->pos.x()).arg(d->pos.y()).arg(d->pos.z()).arg(channels));
+    else
+        d->ui->introText->setText(tr("Replace voxel values at position (%1/%2/%3) in %4 by a value "
+                                     "interpolated from the nearest neighbours.")
+                                  .arg(d->pos.x()).arg(d->pos.y()).arg(d->pos.z()).arg(channels));
 }
 
 CorrectionDialog::~CorrectionDialog()
@@ -78,25 +104,70 @@ CorrectionDialog::~CorrectionDialog()
 
 void CorrectionDialog::accept()
 {
-    if ( ! d->systemMatrix.isNull() )
+    if ( d->job.isRunning() )
+        return;
+    if ( d->systemMatrix.isNull() )
     {
-        qApp->setOverrideCursor(Qt::BusyCursor);
-        QSettings settings;
+        QDialog::accept();
+        return;
+    }
+    QSettings settings;
 
-        int threshold=d->ui->thresholdSpinBox->value();
-        settings.setValue("interpolationThreshold",threshold);
+    int threshold=d->ui->thresholdSpinBox->value();
+    settings.setValue("interpolationThreshold",threshold);
+    bool allReceivers=d->ui->allReceivers->isChecked();
+    settings.setValue("correctAllReceivers",allReceivers);
 
-        QList<int> indices;
-        int n = d->systemMatrix->numberOfFrequencies();
-        for ( int f=0; f<n; f++ )
+    // With all receivers the components of a frequency are neighbours in the list, so that
+    // the worker threads read the same voxel of every receiver in one sweep
+    QList<int> indices;
+    int n = d->systemMatrix->numberOfFrequencies();
+    for ( int f=0; f<n; f++ )
+    {
+        if ( allReceivers )
+        {
+            for ( int r=0; r<d->systemMatrix->numberOfReceivers(); r++ )
+                indices.append(d->systemMatrix->globalIndex(r,f));
+        }
+        else
             indices.append(d->systemMatrix->globalIndex(d->receiver,f));
+    }
 
-        d->ui->progressBar->setRange(0,n-1);
-        d->ui->progressBar->setValue(0);
-        d->numChanges=d->systemMatrix->interpolateDatapoints(indices,d->pos,0.01*threshold,d->ui->progressBar,"setValue");
-        qApp->restoreOverrideCursor();
+    d->ui->progressBar->setRange(0,indices.count()*qMax(1,d->region.count()));
+    d->ui->progressBar->setValue(0);
+    d->job.setSystemMatrix(d->systemMatrix);
+    d->job.setComponents(indices);
+    d->job.setPosition(d->pos);
+    d->job.setRegion(d->region);
+    d->job.setThreshold(0.01*threshold);
+    if ( !d->job.start() )
+    {
+        QDialog::accept();
+        return;
+    }
+    // Only cancelling is possible while the corrections are computed
+    d->ui->groupBox->setEnabled(false);
+    d->ui->buttonBox->button(QDialogButtonBox::Ok)->setEnabled(false);
+}
+
+void CorrectionDialog::reject()
+{
+    // The dialog closes when the cancelled job has finished
+    if ( d->job.isRunning() )
+        d->job.cancel();
+    else
+        QDialog::reject();
+}
+
+void CorrectionDialog::finishCorrection(bool success)
+{
+    if ( success )
+    {
+        d->numChanges = d->job.numChanges();
+        QDialog::accept();
     }
-    QDialog::accept();
+    else
+        QDialog::reject();
 }
 
 int CorrectionDialog::numChanges() const
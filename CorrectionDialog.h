@@ -28,21 +28,35 @@
 #else
 #include <QtGui/QDialog>
 #endif
+#include <QtCore/QList>
+
+#include "MatrixPosition.h"
 
-class MatrixPosition;
 class SystemMatrix;
 
 class CorrectionDialog : public QDialog
 {
     Q_OBJECT
 public:
-    static int performCorrection(SystemMatrix * matrix, int receiver, const MatrixPosition & pos, QWidget *parent=0);
+    /**
+     * @brief performCorrection Ask for the threshold and interpolate a voxel or, if given, all voxels of a
+     *                          region around it for all frequencies of a receiver, or of
+     *                          all receivers if "Correct all receivers" is checked
+     * @return                  Number of changes, one per changed voxel and component
+     */
+    static int performCorrection(SystemMatrix * matrix, int receiver, const MatrixPosition & pos,
+                                 const QList<MatrixPosition> & region=QList<MatrixPosition>(), QWidget *parent=0);
     virtual ~CorrectionDialog();
     int numChanges() const;
 public slots:
     virtual void accept();
+    virtual void reject();
+private slots:
+    void finishCorrection(bool success);
+    void updateIntroText();
 private:
-    CorrectionDialog(SystemMatrix * matrix, int receiver, const MatrixPosition & pos, QWidget *parent=0, Qt::WindowFlags f=0);
+    CorrectionDialog(SystemMatrix * matrix, int receiver, const MatrixPosition & pos, const QList<MatrixPosition> & region,
+                     QWidget *parent=0, Qt::WindowFlags f=0);
     struct Impl;
     Impl * d;
 };
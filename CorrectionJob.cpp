@@ -0,0 +1,212 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QPointer>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "CorrectionJob.h"
+#include "SystemMatrix.h"
+#include "ChangeList.h"
+
+// Components per task
+static const int componentsPerTask = 256;
+// Interval of progress reports in ms, the workers only count
+static const int progressInterval = 100;
+
+struct CorrectionJob::Impl
+{
+    struct Task
+    {
+        int index;         // Index of the result list
+        int position;      // Index in positions
+        int first, count;  // Range in components
+    };
+
+    // Computes the corrections of the components of a task in a worker thread
+    struct Compute
+    {
+        explicit Compute(Impl * d) : d(d) {}
+        void operator()(const Task & task) const;
+        Impl * d;
+    };
+
+    CorrectionJob * q;
+    QPointer<SystemMatrix> systemMatrix;
+    QList<int> components;
+    MatrixPosition position;
+    QList<MatrixPosition> region;
+    QList<MatrixPosition> positions; // Voxels of the running job
+    double threshold;
+    int numChanges;
+
+    QVector<Task> tasks;
+    QVector< QList<ChangeListItem> > results;
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+    QTimer progressTimer;
+    int reported;
+
+    void run()
+    {
+        QtConcurrent::blockingMap(tasks,Compute(this));
+    }
+};
+
+void CorrectionJob::Impl::Compute::operator()(const Task & task) const
+{
+    if ( d->cancelled.load() )
+        return;
+    // Nothing is written before all tasks are done, so every interpolation reads the original neighbours.
+    // The components of a task share the neighbour lookup of their voxel.
+    d->systemMatrix->computeCorrections(d->components.mid(task.first,task.count),d->positions.at(task.position),
+                                        d->threshold,&d->results[task.index]);
+    d->done.fetchAndAddOrdered(task.count);
+}
+
+CorrectionJob::CorrectionJob(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->threshold = 0.0;
+    d->numChanges = 0;
+    d->reported = 0;
+    d->progressTimer.setInterval(progressInterval);
+    connect(&d->progressTimer,SIGNAL(timeout()),SLOT(reportProgress()));
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishCorrection()));
+}
+
+CorrectionJob::~CorrectionJob()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void CorrectionJob::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+}
+
+void CorrectionJob::setComponents(const QList<int> & globalIndices)
+{
+    d->components = globalIndices;
+}
+
+void CorrectionJob::setPosition(const MatrixPosition & pos)
+{
+    d->position = pos;
+}
+
+void CorrectionJob::setRegion(const QList<MatrixPosition> & positions)
+{
+    d->region = positions;
+}
+
+void CorrectionJob::setThreshold(double threshold)
+{
+    d->threshold = threshold;
+}
+
+bool CorrectionJob::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+int CorrectionJob::numChanges() const
+{
+    return d->numChanges;
+}
+
+bool CorrectionJob::start()
+{
+    if ( isRunning() || d->systemMatrix==0 || !d->systemMatrix->validPosition(d->position) )
+        return false;
+    // The configured region stays untouched, a later setPosition() applies to the next run
+    d->positions = d->region;
+    if ( d->positions.isEmpty() )
+        d->positions.append(d->position);
+    d->numChanges = 0;
+    d->tasks.clear();
+    for ( int p=0; p<d->positions.count(); p++ )
+    {
+        if ( !d->systemMatrix->validPosition(d->positions.at(p)) )
+            continue;
+        for ( int first=0; first<d->components.count(); first+=componentsPerTask )
+        {
+            Impl::Task task;
+            task.index = d->tasks.count();
+            task.position = p;
+            task.first = first;
+            task.count = qMin(componentsPerTask,d->components.count()-first);
+            d->tasks.append(task);
+        }
+    }
+    d->results.fill(QList<ChangeListItem>(),d->tasks.count());
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->reported = 0;
+    d->progressTimer.start();
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void CorrectionJob::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void CorrectionJob::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void CorrectionJob::reportProgress()
+{
+    int done = d->done.load();
+    if ( done==d->reported )
+        return;
+    d->reported = done;
+    emit progress(done);
+}
+
+void CorrectionJob::finishCorrection()
+{
+    d->progressTimer.stop();
+    reportProgress();
+    bool success = d->cancelled.load()==0 && d->systemMatrix!=0;
+    if ( success )
+    {
+        // One change for the whole region, ordered by voxel and component
+        QList<ChangeListItem> changes;
+        foreach(const QList<ChangeListItem> & result, d->results)
+            changes += result;
+        d->numChanges = d->systemMatrix->commitCorrections(d->position,changes);
+    }
+    d->tasks.clear();
+    d->results.clear();
+    emit finished(success);
+}
@@ -0,0 +1,81 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef CORRECTIONJOB_H
+#define CORRECTIONJOB_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+
+// Local includes
+#include "MatrixPosition.h"
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The CorrectionJob class replaces the voxels of a region by the interpolation of their
+ *        neighbours in a list of components. The corrections are computed by worker threads
+ *        without touching the matrix and committed as a single change when all of them are
+ *        done, a cancelled job leaves the matrix unchanged.
+ */
+class CorrectionJob : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CorrectionJob(QObject * parent=0);
+    virtual ~CorrectionJob();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setComponents(const QList<int> & globalIndices);
+    /**
+     * @brief setPosition Voxel recorded in the change table, also the region if none is set
+     */
+    void setPosition(const MatrixPosition & pos);
+    void setRegion(const QList<MatrixPosition> & positions);
+    /**
+     * @brief setThreshold Minimum relative reduction of the magnitude for a voxel to be replaced
+     */
+    void setThreshold(double threshold);
+    bool isRunning() const;
+    /**
+     * @brief numChanges Number of modified voxels over all components of the last successful run
+     */
+    int numChanges() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+signals:
+    /**
+     * @brief progress Number of computed voxel components, emitted at most every 100 ms
+     */
+    void progress(int components);
+    void finished(bool success);
+private slots:
+    void finishCorrection();
+    void reportProgress();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // CORRECTIONJOB_H
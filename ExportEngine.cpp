@@ -0,0 +1,362 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <cmath>
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QBuffer>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QQueue>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QVector>
+#include <QtCore/QWaitCondition>
+#include <QtGui/QImage>
+#include <QtGui/QPainter>
+
+// Local includes
+#include "ExportEngine.h"
+#include "SFRenderer.h"
+#include "SystemMatrix.h"
+
+// Rendered and encoded images waiting for the writer, per worker thread
+static const int queueSlotsPerThread = 4;
+
+// Gap between the slices of an atlas
+static const int atlasSpacing = 2;
+
+struct ExportEngine::Impl
+{
+    struct File
+    {
+        File() : componentDone(false) {}
+        QString fileName;        // Empty for the end of the export
+        QByteArray data;
+        bool componentDone;      // Last file of a component
+    };
+
+    // Renders all slices of one component
+    struct Task : public QRunnable
+    {
+        Task(Impl * d, int globalIndex) : d(d), globalIndex(globalIndex) {}
+        virtual void run();
+        QImage render(SFRenderer & renderer, const SystemMatrix::complex * data, int slice);
+        Impl * d;
+        int globalIndex;
+    };
+
+    // Writes the encoded images to disk in the order they are queued
+    struct Writer : public QThread
+    {
+        Writer(Impl * d) : d(d) {}
+        virtual void run();
+        Impl * d;
+    };
+
+    ExportEngine * q;
+    QPointer<SystemMatrix> systemMatrix;
+    const ColorScale * colorScale;
+    bool backgroundCorrection;
+    Layout layout;
+    int scaleFactor;
+    QString outputDirectory;
+
+    QThreadPool pool;
+    Writer * writer;
+    QMutex mutex;
+    QWaitCondition fileQueued;
+    QSemaphore freeSlots;
+    QQueue<File> queue;
+    QAtomicInt cancelled;
+    QAtomicInt pendingTasks;
+    QString error;
+    int completed;
+
+    void enqueue(const File & file)
+    {
+        freeSlots.acquire();
+        QMutexLocker lock(&mutex);
+        queue.enqueue(file);
+        fileQueued.wakeOne();
+    }
+
+    void enqueue(const QString & fileName, const QImage & image, bool componentDone)
+    {
+        File file;
+        file.fileName = fileName;
+        file.componentDone = componentDone;
+        QBuffer buffer(&file.data);
+        buffer.open(QIODevice::WriteOnly);
+        image.save(&buffer,"PNG");
+        enqueue(file);
+    }
+
+    void taskDone()
+    {
+        // The last task terminates the writer
+        if ( !pendingTasks.deref() )
+            enqueue(File());
+    }
+
+    void fail(const QString & message)
+    {
+        QMutexLocker lock(&mutex);
+        if ( error.isEmpty() )
+            error = message;
+        cancelled.store(1);
+    }
+
+    QString baseName(int globalIndex) const
+    {
+        return QString("%1/r%2_f%3").arg(outputDirectory)
+                .arg(systemMatrix->receiver(globalIndex)+1)
+                .arg(systemMatrix->frequencyIndex(globalIndex),5,10,QChar('0'));
+    }
+};
+
+QImage ExportEngine::Impl::Task::render(SFRenderer & renderer, const SystemMatrix::complex * data, int slice)
+{
+    QImage image = renderer.image(data,slice,SFRenderer::PerFrame);
+    if ( d->scaleFactor>1 )
+        image = image.scaled(image.size()*d->scaleFactor,Qt::IgnoreAspectRatio,Qt::FastTransformation);
+    return image;
+}
+
+void ExportEngine::Impl::Task::run()
+{
+    static const Qt::Axis planes[3][2] = {
+        { Qt::XAxis, Qt::YAxis },
+        { Qt::XAxis, Qt::ZAxis },
+        { Qt::YAxis, Qt::ZAxis }
+    };
+    static const char * planeNames[3] = { "xy", "xz", "yz" };
+
+    const SystemMatrix * m = d->systemMatrix;
+    if ( d->cancelled.load() || m==0 )
+    {
+        d->taskDone();
+        return;
+    }
+
+    int block = 1;
+    for ( int i=0; i<3; i++ )
+        block *= m->dimension(static_cast<Qt::Axis>(i));
+    QVector<SystemMatrix::complex> data(block);
+    if ( !m->readBlock(globalIndex,d->backgroundCorrection,data.data()) )
+    {
+        d->taskDone();
+        return;
+    }
+
+    SFRenderer renderer;
+    renderer.setSystemMatrix(d->systemMatrix);
+    renderer.setColorScale(d->colorScale);
+    renderer.setBackgroundCorrection(d->backgroundCorrection);
+
+    QString baseName = d->baseName(globalIndex);
+
+    if ( d->layout==Tiles )
+    {
+        for ( int plane=0; plane<3 && !d->cancelled.load(); plane++ )
+        {
+            renderer.setAxes(planes[plane][0],planes[plane][1]);
+            int slices = m->numSlices(renderer.sliceDirection());
+            for ( int slice=0; slice<slices && !d->cancelled.load(); slice++ )
+            {
+                QString fileName = QString("%1_%2_%3.png").arg(baseName).arg(planeNames[plane]).arg(slice,3,10,QChar('0'));
+                bool last = ( plane==2 && slice==slices-1 );
+                d->enqueue(fileName,render(renderer,data.constData(),slice),last);
+            }
+        }
+    }
+    else
+    {
+        // The slices of each orientation are arranged in a roughly square block, blocks are stacked vertically
+        QSize tile[3];
+        int columns[3], rows[3];
+        QSize atlasSize(0,0);
+        for ( int plane=0; plane<3; plane++ )
+        {
+            tile[plane] = m->sliceMatrix(planes[plane][0],planes[plane][1])*d->scaleFactor;
+            renderer.setAxes(planes[plane][0],planes[plane][1]);
+            int slices = m->numSlices(renderer.sliceDirection());
+            columns[plane] = static_cast<int>(ceil(sqrt(static_cast<double>(slices))));
+            rows[plane] = (slices+columns[plane]-1)/columns[plane];
+            atlasSize.setWidth(qMax(atlasSize.width(),columns[plane]*(tile[plane].width()+atlasSpacing)));
+            atlasSize.rheight() += rows[plane]*(tile[plane].height()+atlasSpacing);
+        }
+
+        QImage atlas(atlasSize,QImage::Format_RGB32);
+        atlas.fill(Qt::black);
+        QPainter painter(&atlas);
+        int top = 0;
+        for ( int plane=0; plane<3 && !d->cancelled.load(); plane++ )
+        {
+            renderer.setAxes(planes[plane][0],planes[plane][1]);
+            int slices = m->numSlices(renderer.sliceDirection());
+            for ( int slice=0; slice<slices; slice++ )
+            {
+                QPoint pos((slice%columns[plane])*(tile[plane].width()+atlasSpacing),
+                           top+(slice/columns[plane])*(tile[plane].height()+atlasSpacing));
+                painter.drawImage(pos,render(renderer,data.constData(),slice));
+            }
+            top += rows[plane]*(tile[plane].height()+atlasSpacing);
+        }
+        painter.end();
+        if ( !d->cancelled.load() )
+            d->enqueue(baseName+".png",atlas,true);
+    }
+
+    d->taskDone();
+}
+
+void ExportEngine::Impl::Writer::run()
+{
+    forever
+    {
+        QMutexLocker lock(&d->mutex);
+        while ( d->queue.isEmpty() )
+            d->fileQueued.wait(&d->mutex);
+        File file = d->queue.dequeue();
+        lock.unlock();
+        d->freeSlots.release();
+
+        if ( file.fileName.isEmpty() )
+            break;
+        // Keep draining the queue after cancellation, so that no task stays blocked
+        if ( d->cancelled.load() )
+            continue;
+
+        QFile output(file.fileName);
+        if ( !output.open(QIODevice::WriteOnly) || output.write(file.data)!=file.data.size() )
+        {
+            d->fail(ExportEngine::tr("Cannot write file %1.").arg(file.fileName));
+            continue;
+        }
+        if ( file.componentDone )
+            emit d->q->progress(++d->completed);
+    }
+}
+
+ExportEngine::ExportEngine(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->colorScale = 0;
+    d->backgroundCorrection = false;
+    d->layout = Tiles;
+    d->scaleFactor = 1;
+    d->completed = 0;
+    d->writer = new Impl::Writer(d);
+    connect(d->writer,SIGNAL(finished()),SLOT(finishExport()));
+}
+
+ExportEngine::~ExportEngine()
+{
+    cancel();
+    d->pool.waitForDone();
+    d->writer->wait();
+    delete d->writer;
+    delete d;
+}
+
+void ExportEngine::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+}
+
+void ExportEngine::setColorScale(const ColorScale * colorScale)
+{
+    d->colorScale = colorScale;
+}
+
+void ExportEngine::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void ExportEngine::setLayout(Layout layout)
+{
+    d->layout = layout;
+}
+
+void ExportEngine::setScaleFactor(int factor)
+{
+    d->scaleFactor = qMax(1,factor);
+}
+
+void ExportEngine::setOutputDirectory(const QString & directory)
+{
+    d->outputDirectory = directory;
+}
+
+bool ExportEngine::isRunning() const
+{
+    return d->writer->isRunning();
+}
+
+QString ExportEngine::errorString() const
+{
+    QMutexLocker lock(&d->mutex);
+    return d->error;
+}
+
+bool ExportEngine::start(const QList<int> & globalIndices)
+{
+    if ( isRunning() || d->systemMatrix==0 || globalIndices.isEmpty() )
+        return false;
+
+    d->error.clear();
+    if ( !QDir().mkpath(d->outputDirectory) )
+    {
+        d->error = tr("Cannot create directory %1.").arg(d->outputDirectory);
+        return false;
+    }
+
+    d->cancelled.store(0);
+    d->completed = 0;
+    d->queue.clear();
+    d->freeSlots.acquire(d->freeSlots.available());
+    d->freeSlots.release(queueSlotsPerThread*d->pool.maxThreadCount());
+    d->pendingTasks.store(globalIndices.count());
+
+    d->writer->start();
+    foreach(int globalIndex, globalIndices)
+        d->pool.start(new Impl::Task(d,globalIndex));
+    return true;
+}
+
+void ExportEngine::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void ExportEngine::finishExport()
+{
+    d->pool.waitForDone();
+    emit finished(d->cancelled.load()==0 && errorString().isEmpty());
+}
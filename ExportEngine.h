@@ -0,0 +1,85 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef EXPORTENGINE_H
+#define EXPORTENGINE_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+#include <QtCore/QString>
+
+// Forward declarations
+class ColorScale;
+class SystemMatrix;
+
+/**
+ * @brief The ExportEngine class renders all slices of all three orientations of a list of
+ *        components to PNG files. Components are rendered in parallel by a thread pool,
+ *        the encoded images are handed to a separate writer thread through a bounded queue.
+ */
+class ExportEngine : public QObject
+{
+    Q_OBJECT
+public:
+    enum Layout { Tiles, Atlas };
+    explicit ExportEngine(QObject * parent=0);
+    virtual ~ExportEngine();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    /**
+     * @brief setColorScale Color scale used for rendering, must stay valid during the export
+     */
+    void setColorScale(const ColorScale * colorScale);
+    void setBackgroundCorrection(bool);
+    /**
+     * @brief setLayout Write one file per slice (Tiles) or one file per component (Atlas)
+     */
+    void setLayout(Layout layout);
+    /**
+     * @brief setScaleFactor Integer magnification of every slice, without interpolation
+     */
+    void setScaleFactor(int factor);
+    void setOutputDirectory(const QString & directory);
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief start         Start exporting in the background
+     * @param globalIndices Components to be exported
+     * @return              false if the export could not be started, see errorString()
+     */
+    bool start(const QList<int> & globalIndices);
+public slots:
+    void cancel();
+signals:
+    /**
+     * @brief progress Emitted after all files of a component were written
+     * @param count    Number of completed components
+     */
+    void progress(int count);
+    void finished(bool success);
+private slots:
+    void finishExport();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // EXPORTENGINE_H
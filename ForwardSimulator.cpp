@@ -0,0 +1,444 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <cstring>
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QPointer>
+#include <QtCore/QtEndian>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "ForwardSimulator.h"
+#include "SystemMatrix.h"
+#include "VectorMath.h"
+
+typedef ForwardSimulator::complex complex;
+
+// Components per task and voxels per tile, a tile of the phantom stays in the L1 cache
+static const int componentsPerTask = 16;
+static const int voxelsPerTile = 2048;
+// Phantoms with a smaller fraction of non-zero voxels are treated as sparse
+static const double sparseFraction = 0.25;
+
+// Accumulate sum(a[j]*c[j]) over j in [begin,end) for c = re + i*im, im may be 0 for real phantoms
+static complex dot(const complex * a, const double * re, const double * im, int begin, int end)
+{
+#ifdef SFVIEW_USE_SSE2
+    // (ar,ai)*cr and (ar,ai)*ci are accumulated separately, the complex product is formed once at the end
+    const double * p = reinterpret_cast<const double*>(a);
+    __m128d realPart0 = _mm_setzero_pd(), realPart1 = _mm_setzero_pd();
+    __m128d imagPart0 = _mm_setzero_pd(), imagPart1 = _mm_setzero_pd();
+    int j = begin;
+    if ( im==0 )
+    {
+        for ( ; j+1<end; j+=2 )
+        {
+            realPart0 = _mm_add_pd(realPart0,_mm_mul_pd(_mm_loadu_pd(p+2*j),_mm_set1_pd(re[j])));
+            realPart1 = _mm_add_pd(realPart1,_mm_mul_pd(_mm_loadu_pd(p+2*j+2),_mm_set1_pd(re[j+1])));
+        }
+    }
+    else
+    {
+        for ( ; j+1<end; j+=2 )
+        {
+            __m128d a0 = _mm_loadu_pd(p+2*j), a1 = _mm_loadu_pd(p+2*j+2);
+            realPart0 = _mm_add_pd(realPart0,_mm_mul_pd(a0,_mm_set1_pd(re[j])));
+            realPart1 = _mm_add_pd(realPart1,_mm_mul_pd(a1,_mm_set1_pd(re[j+1])));
+            imagPart0 = _mm_add_pd(imagPart0,_mm_mul_pd(a0,_mm_set1_pd(im[j])));
+            imagPart1 = _mm_add_pd(imagPart1,_mm_mul_pd(a1,_mm_set1_pd(im[j+1])));
+        }
+    }
+    double r[2], i[2];
+    _mm_storeu_pd(r,_mm_add_pd(realPart0,realPart1));
+    _mm_storeu_pd(i,_mm_add_pd(imagPart0,imagPart1));
+    complex sum(r[0]-i[1],r[1]+i[0]);
+    for ( ; j<end; j++ )
+        sum += a[j]*complex(re[j],im?im[j]:0.0);
+    return sum;
+#else
+    complex sum = 0.0;
+    for ( int j=begin; j<end; j++ )
+        sum += a[j]*complex(re[j],im?im[j]:0.0);
+    return sum;
+#endif
+}
+
+struct ForwardSimulator::Impl
+{
+    struct Task
+    {
+        int first, count;  // Range in components
+    };
+
+    // Simulates the components of a task in a worker thread
+    struct Kernel
+    {
+        explicit Kernel(Impl * d) : d(d) {}
+        void operator()(const Task & task) const;
+        Impl * d;
+    };
+
+    ForwardSimulator * q;
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    QList<int> selection;
+    int positions;
+
+    // Phantom as separate real and imaginary parts, the imaginary part is empty for real phantoms
+    QVector<double> real, imag;
+    // Non-zero voxels of sparse phantoms, empty for dense ones
+    QVector<int> sparseIndex;
+    QVector<double> sparseReal, sparseImag;
+
+    QVector<int> components;
+    QVector<complex> spectrum;
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+    // Global index+1 of the first component that could not be read, 0 if none
+    QAtomicInt failed;
+    QString error;
+
+    void prepare()
+    {
+        sparseIndex.clear();
+        sparseReal.clear();
+        sparseImag.clear();
+        int nonZero = 0;
+        for ( int j=0; j<real.count(); j++ )
+            if ( real.at(j)!=0.0 || (!imag.isEmpty() && imag.at(j)!=0.0) )
+                nonZero++;
+        if ( nonZero>=sparseFraction*real.count() )
+            return;
+        sparseIndex.reserve(nonZero);
+        for ( int j=0; j<real.count(); j++ )
+        {
+            if ( real.at(j)!=0.0 || (!imag.isEmpty() && imag.at(j)!=0.0) )
+            {
+                sparseIndex.append(j);
+                sparseReal.append(real.at(j));
+                sparseImag.append(imag.isEmpty() ? 0.0 : imag.at(j));
+            }
+        }
+    }
+
+    void run()
+    {
+        QVector<Task> tasks;
+        for ( int first=0; first<components.count(); first+=componentsPerTask )
+        {
+            Task task;
+            task.first = first;
+            task.count = qMin(componentsPerTask,components.count()-first);
+            tasks.append(task);
+        }
+        QtConcurrent::blockingMap(tasks,Kernel(this));
+    }
+
+    // Reports a failed read or cancellation after the workers finished
+    bool finish()
+    {
+        int globalIndex = failed.load()-1;
+        if ( globalIndex>=0 )
+            error = ForwardSimulator::tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+        bool success = cancelled.load()==0;
+        if ( !success )
+            spectrum.clear();
+        return success;
+    }
+};
+
+void ForwardSimulator::Impl::Kernel::operator()(const Task & task) const
+{
+    if ( d->cancelled.load() )
+        return;
+    const complex * rows[componentsPerTask];
+    complex factors[componentsPerTask], sums[componentsPerTask];
+    QVector<complex> buffer;
+    for ( int r=0; r<task.count; r++ )
+    {
+        int globalIndex = d->components.at(task.first+r);
+        sums[r] = 0.0;
+        rows[r] = d->systemMatrix->mappedData(globalIndex,d->backgroundCorrection);
+        factors[r] = d->systemMatrix->calibrationFactor(globalIndex);
+        if ( rows[r]==0 )
+        {
+            // Not memory mapped, read calibrated copies
+            if ( buffer.isEmpty() )
+                buffer.resize(task.count*d->positions);
+            complex * p = buffer.data()+r*d->positions;
+            if ( !d->systemMatrix->readBlock(globalIndex,d->backgroundCorrection,p) )
+            {
+                // A zero filled component would silently falsify the spectrum
+                d->failed.testAndSetOrdered(0,globalIndex+1);
+                d->cancelled.store(1);
+                return;
+            }
+            rows[r] = p;
+            factors[r] = 1.0;
+        }
+    }
+
+    if ( !d->sparseIndex.isEmpty() )
+    {
+        const int * index = d->sparseIndex.constData();
+        const double * re = d->sparseReal.constData();
+        const double * im = d->sparseImag.constData();
+        int n = d->sparseIndex.count();
+        for ( int r=0; r<task.count; r++ )
+        {
+            const complex * a = rows[r];
+            complex sum = 0.0;
+            for ( int j=0; j<n; j++ )
+                sum += a[index[j]]*complex(re[j],im[j]);
+            sums[r] = sum;
+        }
+    }
+    else
+    {
+        // The same phantom tile is applied to all components of the task
+        const double * re = d->real.constData();
+        const double * im = d->imag.isEmpty() ? 0 : d->imag.constData();
+        for ( int begin=0; begin<d->positions; begin+=voxelsPerTile )
+        {
+            int end = qMin(begin+voxelsPerTile,d->positions);
+            for ( int r=0; r<task.count; r++ )
+                sums[r] += dot(rows[r],re,im,begin,end);
+        }
+    }
+
+    for ( int r=0; r<task.count; r++ )
+        d->spectrum[d->components.at(task.first+r)] = factors[r]*sums[r];
+    emit d->q->progress(d->done.fetchAndAddOrdered(task.count)+task.count);
+}
+
+ForwardSimulator::ForwardSimulator(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->backgroundCorrection = true;
+    d->positions = 0;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishSimulation()));
+}
+
+ForwardSimulator::~ForwardSimulator()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void ForwardSimulator::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+    d->spectrum.clear();
+}
+
+void ForwardSimulator::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void ForwardSimulator::setComponents(const QList<int> & globalIndices)
+{
+    d->selection = globalIndices;
+}
+
+void ForwardSimulator::setPhantom(const QVector<complex> & concentration)
+{
+    d->real.resize(concentration.count());
+    d->imag.clear();
+    bool isReal = true;
+    for ( int j=0; j<concentration.count(); j++ )
+    {
+        d->real[j] = concentration.at(j).real();
+        if ( concentration.at(j).imag()!=0.0 )
+            isReal = false;
+    }
+    if ( !isReal )
+    {
+        d->imag.resize(concentration.count());
+        for ( int j=0; j<concentration.count(); j++ )
+            d->imag[j] = concentration.at(j).imag();
+    }
+    d->prepare();
+}
+
+bool ForwardSimulator::loadPhantom(const QString & fileName)
+{
+    d->error.clear();
+    if ( d->systemMatrix==0 )
+        return false;
+    qint64 n = 1;
+    for ( int i=0; i<3; i++ )
+        n *= d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+    QFile file(fileName);
+    if ( !file.open(QIODevice::ReadOnly) )
+    {
+        d->error = tr("Cannot open file %1.").arg(fileName);
+        return false;
+    }
+    QByteArray data = file.readAll();
+    qint64 size = data.size();
+    QVector<complex> phantom(n);
+    const uchar * p = reinterpret_cast<const uchar*>(data.constData());
+    if ( size==n*static_cast<qint64>(sizeof(float)) )
+    {
+        for ( int j=0; j<n; j++, p+=sizeof(float) )
+        {
+            quint32 bits = qFromLittleEndian<quint32>(p);
+            float f;
+            memcpy(&f,&bits,sizeof(float));
+            phantom[j] = f;
+        }
+    }
+    else if ( size==n*static_cast<qint64>(sizeof(double)) || size==n*static_cast<qint64>(sizeof(complex)) )
+    {
+        int valuesPerVoxel = size/n/sizeof(double);
+        for ( int j=0; j<n; j++ )
+        {
+            double v[2] = { 0.0, 0.0 };
+            for ( int k=0; k<valuesPerVoxel; k++, p+=sizeof(double) )
+            {
+                quint64 bits = qFromLittleEndian<quint64>(p);
+                memcpy(&v[k],&bits,sizeof(double));
+            }
+            phantom[j] = complex(v[0],v[1]);
+        }
+    }
+    else
+    {
+        d->error = tr("The phantom file has %1 bytes, expected %2 voxels.").arg(size).arg(n);
+        return false;
+    }
+    setPhantom(phantom);
+    return true;
+}
+
+bool ForwardSimulator::hasPhantom() const
+{
+    return !d->real.isEmpty();
+}
+
+bool ForwardSimulator::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QString ForwardSimulator::errorString() const
+{
+    return d->error;
+}
+
+QVector<complex> ForwardSimulator::result() const
+{
+    if ( isRunning() )
+        return QVector<complex>();
+    return d->spectrum;
+}
+
+bool ForwardSimulator::saveResult(const QString & fileName)
+{
+    d->error.clear();
+    QFile file(fileName);
+    if ( !file.open(QIODevice::WriteOnly|QIODevice::Truncate) )
+    {
+        d->error = tr("Cannot open %1 for writing.").arg(fileName);
+        return false;
+    }
+    QByteArray data(d->spectrum.count()*static_cast<int>(sizeof(complex)),Qt::Uninitialized);
+    uchar * p = reinterpret_cast<uchar*>(data.data());
+    foreach(const complex & c, d->spectrum)
+    {
+        double v[2] = { c.real(), c.imag() };
+        for ( int k=0; k<2; k++, p+=sizeof(double) )
+        {
+            quint64 bits;
+            memcpy(&bits,&v[k],sizeof(double));
+            qToLittleEndian<quint64>(bits,p);
+        }
+    }
+    if ( file.write(data)!=data.size() )
+    {
+        d->error = tr("Cannot write file %1.").arg(fileName);
+        return false;
+    }
+    return true;
+}
+
+bool ForwardSimulator::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    d->positions = 1;
+    for ( int i=0; i<3; i++ )
+        d->positions *= d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+    if ( d->real.count()!=d->positions )
+    {
+        d->error = tr("The phantom does not match the grid of the system matrix.");
+        return false;
+    }
+
+    // Simulate in storage order, so the mapped files are read sequentially
+    int numComponents = d->systemMatrix->numberOfReceivers()*d->systemMatrix->numberOfFrequencies();
+    d->components.clear();
+    if ( d->selection.isEmpty() )
+    {
+        d->components.reserve(numComponents);
+        for ( int globalIndex=0; globalIndex<numComponents; globalIndex++ )
+            d->components.append(globalIndex);
+    }
+    else
+    {
+        foreach(int globalIndex, d->selection)
+            if ( globalIndex>=0 && globalIndex<numComponents )
+                d->components.append(globalIndex);
+        std::sort(d->components.begin(),d->components.end());
+    }
+    d->spectrum.fill(complex(0.0),numComponents);
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->failed.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+bool ForwardSimulator::waitForFinished()
+{
+    d->watcher.waitForFinished();
+    return d->finish();
+}
+
+void ForwardSimulator::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void ForwardSimulator::finishSimulation()
+{
+    emit finished(d->finish());
+}
@@ -0,0 +1,96 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef FORWARDSIMULATOR_H
+#define FORWARDSIMULATOR_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The ForwardSimulator class computes the spectrum S*c a phantom concentration c
+ *        would produce with the calibrated system matrix S. Components are processed in
+ *        blocks by the thread pool, the phantom is applied in cache sized voxel tiles,
+ *        sparse phantoms only touch their non-zero voxels.
+ */
+class ForwardSimulator : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::complex<double> complex;
+    explicit ForwardSimulator(QObject * parent=0);
+    virtual ~ForwardSimulator();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setBackgroundCorrection(bool);
+    /**
+     * @brief setComponents Global indices to simulate, all components if empty
+     */
+    void setComponents(const QList<int> & globalIndices);
+    /**
+     * @brief setPhantom Concentration in the voxels of the system matrix, x fastest
+     */
+    void setPhantom(const QVector<complex> & concentration);
+    /**
+     * @brief loadPhantom Read a phantom from a raw file of little endian values in voxel order,
+     *                    real single or double precision or complex double precision
+     */
+    bool loadPhantom(const QString & fileName);
+    bool hasPhantom() const;
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief result Simulated value for every global index, 0 for components not simulated
+     */
+    QVector<complex> result() const;
+    /**
+     * @brief saveResult Write the result as little endian complex double values in global index
+     *                   order, the measurement format read by the reconstruction
+     */
+    bool saveResult(const QString & fileName);
+    bool start();
+    /**
+     * @brief waitForFinished Block until the simulation is done
+     * @return                False if it was cancelled or a component could not be read,
+     *                        see errorString()
+     */
+    bool waitForFinished();
+public slots:
+    void cancel();
+signals:
+    void progress(int components);
+    void finished(bool success);
+private slots:
+    void finishSimulation();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // FORWARDSIMULATOR_H
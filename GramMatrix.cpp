@@ -0,0 +1,507 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDataStream>
+#include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QHash>
+#include <QtCore/QPointer>
+#include <QtCore/QVector>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "GramMatrix.h"
+#include "SidecarFile.h"
+#include "SystemMatrix.h"
+#include "VectorMath.h"
+
+typedef std::complex<double> complex;
+
+// Components per tile side and voxels per chunk, two chunks of a tile fit into the L2 cache
+static const int tileSize = 32;
+static const int voxelsPerChunk = 256;
+static const char fileMagic[] = "SFGRAM01";
+
+struct GramMatrix::Impl
+{
+    struct Tile
+    {
+        int row, column;  // First component of the tile
+    };
+
+    // Reads a component and computes its norm in a worker thread
+    struct Gather
+    {
+        explicit Gather(Impl * d) : d(d) {}
+        void operator()(int i) const;
+        Impl * d;
+    };
+
+    // Computes a tile of the Gram matrix in a worker thread
+    struct Kernel
+    {
+        explicit Kernel(Impl * d) : d(d) {}
+        void operator()(const Tile & tile) const;
+        Impl * d;
+    };
+
+    // Correlates an edited component of the result with all others in a worker thread
+    struct RowKernel
+    {
+        explicit RowKernel(Impl * d) : d(d) {}
+        void operator()(int row) const;
+        Impl * d;
+    };
+
+    GramMatrix * q;
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    QList<int> selection;
+    int positions;
+
+    // Current computation
+    QVector<int> pending;
+    QVector<const complex*> data;
+    QVector<QVector<complex> > copies;  // Only used if the matrix is not memory mapped
+    QVector<double> norms;
+    QVector<float> computed;
+    QVector<Tile> tiles;
+    QVector<bool> edited;     // Rows recomputed by updateComponents()
+    float * target;           // Correlations written by RowKernel
+    QList<int> changedWhileRunning;
+
+    // Result, correlations of all pairs of components in row-major order
+    QVector<int> components;
+    QHash<int,int> position;
+    QVector<float> correlations;
+    bool resultBackgroundCorrection;
+
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+    // Global index+1 of the first component that could not be read, 0 if none
+    QAtomicInt failed;
+    QString error;
+
+    void setResult(const QVector<int> & indices, const QVector<float> & values, bool correction)
+    {
+        components = indices;
+        correlations = values;
+        resultBackgroundCorrection = correction;
+        position.clear();
+        for ( int i=0; i<components.count(); i++ )
+            position.insert(components.at(i),i);
+    }
+
+    // Buffers for reading the pending components
+    void prepare()
+    {
+        positions = 1;
+        for ( int i=0; i<3; i++ )
+            positions *= systemMatrix->dimension(static_cast<Qt::Axis>(i));
+        int n = pending.count();
+        data.fill(0,n);
+        copies.clear();
+        copies.resize(n);
+        norms.fill(0.0,n);
+    }
+
+    // Sets the error if a component could not be read
+    bool readFailed()
+    {
+        int globalIndex = failed.load()-1;
+        if ( globalIndex<0 )
+            return false;
+        error = GramMatrix::tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+        return true;
+    }
+
+    void gather()
+    {
+        QVector<int> indices;
+        for ( int i=0; i<pending.count(); i++ )
+            indices.append(i);
+        QtConcurrent::blockingMap(indices,Gather(this));
+    }
+
+    void run()
+    {
+        gather();
+        if ( cancelled.load() )
+            return;
+        QtConcurrent::blockingMap(tiles,Kernel(this));
+        // Correlations are normalized, the diagonal is one by definition
+        for ( int i=0; i<pending.count(); i++ )
+            computed[i*pending.count()+i] = norms.at(i)>0.0 ? 1.0f : 0.0f;
+    }
+};
+
+void GramMatrix::Impl::Gather::operator()(int i) const
+{
+    if ( d->cancelled.load() )
+        return;
+    // The calibration only changes the phase of a whole component and cancels in the normalized magnitude
+    int globalIndex = d->pending.at(i);
+    d->data[i] = d->systemMatrix->mappedData(globalIndex,d->backgroundCorrection);
+    if ( d->data[i]==0 )
+    {
+        d->copies[i].resize(d->positions);
+        if ( !d->systemMatrix->readBlock(globalIndex,d->backgroundCorrection,d->copies[i].data()) )
+        {
+            // A zero filled component would look like one uncorrelated to all others
+            d->failed.testAndSetOrdered(0,globalIndex+1);
+            d->cancelled.store(1);
+            return;
+        }
+        d->data[i] = d->copies.at(i).constData();
+    }
+    d->norms[i] = std::sqrt(conjugateDot(d->data.at(i),d->data.at(i),d->positions).real());
+}
+
+void GramMatrix::Impl::Kernel::operator()(const Tile & tile) const
+{
+    if ( d->cancelled.load() )
+        return;
+    int n = d->pending.count();
+    int rows = qMin(tileSize,n-tile.row);
+    int columns = qMin(tileSize,n-tile.column);
+    bool diagonal = tile.row==tile.column;
+    QVector<complex> sums(tileSize*tileSize,complex(0.0));
+    for ( int begin=0; begin<d->positions; begin+=voxelsPerChunk )
+    {
+        int length = qMin(voxelsPerChunk,d->positions-begin);
+        for ( int i=0; i<rows; i++ )
+        {
+            const complex * a = d->data.at(tile.row+i)+begin;
+            // Only the upper triangle of diagonal tiles is needed
+            for ( int j=diagonal?i+1:0; j<columns; j++ )
+                sums[i*tileSize+j] += conjugateDot(a,d->data.at(tile.column+j)+begin,length);
+        }
+    }
+    for ( int i=0; i<rows; i++ )
+    {
+        for ( int j=diagonal?i+1:0; j<columns; j++ )
+        {
+            int r = tile.row+i, c = tile.column+j;
+            double norm = d->norms.at(r)*d->norms.at(c);
+            float value = norm>0.0 ? static_cast<float>(std::abs(sums.at(i*tileSize+j))/norm) : 0.0f;
+            d->computed[r*n+c] = value;
+            d->computed[c*n+r] = value;
+        }
+    }
+    emit d->q->progress(d->done.fetchAndAddOrdered(1)+1);
+}
+
+void GramMatrix::Impl::RowKernel::operator()(int row) const
+{
+    int n = d->pending.count();
+    for ( int j=0; j<n; j++ )
+    {
+        // A pair of two edited rows is computed by the lower one
+        if ( j==row || (d->edited.at(j) && j<row) )
+            continue;
+        double norm = d->norms.at(row)*d->norms.at(j);
+        float value = norm>0.0 ? static_cast<float>(std::abs(conjugateDot(d->data.at(row),d->data.at(j),d->positions))/norm) : 0.0f;
+        d->target[row*n+j] = value;
+        d->target[j*n+row] = value;
+    }
+    d->target[row*n+row] = d->norms.at(row)>0.0 ? 1.0f : 0.0f;
+}
+
+GramMatrix::GramMatrix(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->target = 0;
+    d->backgroundCorrection = true;
+    d->resultBackgroundCorrection = true;
+    d->positions = 0;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishComputation()));
+}
+
+GramMatrix::~GramMatrix()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void GramMatrix::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    cancel();
+    waitForFinished();
+    if ( d->systemMatrix )
+        disconnect(d->systemMatrix,0,this,0);
+    d->systemMatrix = systemMatrix;
+    d->changedWhileRunning.clear();
+    d->setResult(QVector<int>(),QVector<float>(),true);
+    if ( systemMatrix )
+        connect(systemMatrix,SIGNAL(componentsChanged(QList<int>)),SLOT(updateComponents(QList<int>)));
+}
+
+void GramMatrix::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void GramMatrix::setComponents(const QList<int> & globalIndices)
+{
+    d->selection = globalIndices;
+}
+
+QList<int> GramMatrix::components() const
+{
+    return d->components.toList();
+}
+
+bool GramMatrix::contains(int globalIndex) const
+{
+    return d->position.contains(globalIndex);
+}
+
+float GramMatrix::correlation(int globalIndex1, int globalIndex2) const
+{
+    if ( !contains(globalIndex1) || !contains(globalIndex2) )
+        return -1.0f;
+    return d->correlations.at(d->position.value(globalIndex1)*d->components.count()+d->position.value(globalIndex2));
+}
+
+static bool moreSimilar(const GramMatrix::Similarity & a, const GramMatrix::Similarity & b)
+{
+    return a.second>b.second;
+}
+
+QList<GramMatrix::Similarity> GramMatrix::mostSimilar(int globalIndex, int count) const
+{
+    QList<Similarity> result;
+    if ( !contains(globalIndex) )
+        return result;
+    int n = d->components.count();
+    const float * row = d->correlations.constData()+d->position.value(globalIndex)*n;
+    QVector<Similarity> all;
+    all.reserve(n);
+    for ( int j=0; j<n; j++ )
+        if ( d->components.at(j)!=globalIndex )
+            all.append(qMakePair(d->components.at(j),row[j]));
+    count = qMin(count,all.count());
+    std::partial_sort(all.begin(),all.begin()+count,all.end(),moreSimilar);
+    for ( int i=0; i<count; i++ )
+        result.append(all.at(i));
+    return result;
+}
+
+QString GramMatrix::defaultFileName(const SystemMatrix * systemMatrix)
+{
+    return SidecarFile::fileName(systemMatrix,".similarity","componentSimilarity");
+}
+
+bool GramMatrix::load(const QString & fileName)
+{
+    d->error.clear();
+    SidecarFile file(fileName,fileMagic);
+    if ( !file.openForReading() )
+        return false;
+    QDataStream & in = file.stream();
+    quint32 n, correction;
+    if ( !file.hasMagic() )
+    {
+        d->error = tr("%1 is not a component similarity file.").arg(fileName);
+        return false;
+    }
+    in >> n >> correction;
+    if ( in.status()==QDataStream::Ok && (correction!=0)!=d->backgroundCorrection )
+    {
+        d->error = tr("The component similarity file %1 was computed with different background correction.").arg(fileName);
+        return false;
+    }
+    int maxIndex = d->systemMatrix ? d->systemMatrix->maxGlobalIndex() : -1;
+    QVector<int> indices(n);
+    for ( quint32 i=0; i<n && in.status()==QDataStream::Ok; i++ )
+    {
+        qint32 globalIndex;
+        in >> globalIndex;
+        if ( globalIndex<0 || globalIndex>maxIndex )
+            in.setStatus(QDataStream::ReadCorruptData);
+        indices[i] = globalIndex;
+    }
+    QVector<float> values;
+    if ( in.status()==QDataStream::Ok && file.bytesAvailable()==static_cast<qint64>(n)*n*sizeof(float) )
+    {
+        values.resize(n*n);
+        for ( int i=0; i<values.count(); i++ )
+            in >> values[i];
+    }
+    if ( in.status()!=QDataStream::Ok || values.isEmpty() )
+    {
+        d->error = tr("The component similarity file %1 is damaged.").arg(fileName);
+        return false;
+    }
+    d->setResult(indices,values,correction!=0);
+    return true;
+}
+
+bool GramMatrix::save(const QString & fileName)
+{
+    d->error.clear();
+    SidecarFile file(fileName,fileMagic);
+    if ( !file.openForWriting(&d->error) )
+        return false;
+    QDataStream & out = file.stream();
+    out << static_cast<quint32>(d->components.count()) << static_cast<quint32>(d->resultBackgroundCorrection?1:0);
+    foreach(int globalIndex, d->components)
+        out << static_cast<qint32>(globalIndex);
+    foreach(float value, d->correlations)
+        out << value;
+    return file.finishWriting(&d->error);
+}
+
+bool GramMatrix::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QString GramMatrix::errorString() const
+{
+    return d->error;
+}
+
+int GramMatrix::tileCount() const
+{
+    return d->tiles.count();
+}
+
+bool GramMatrix::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    d->pending.clear();
+    foreach(int globalIndex, d->selection)
+        if ( globalIndex>=0 && globalIndex<=d->systemMatrix->maxGlobalIndex() && !d->pending.contains(globalIndex) )
+            d->pending.append(globalIndex);
+    if ( d->pending.count()<2 )
+    {
+        d->error = tr("At least two components are needed.");
+        return false;
+    }
+
+    d->prepare();
+    int n = d->pending.count();
+    d->computed.fill(0.0f,n*n);
+    d->tiles.clear();
+    for ( int row=0; row<n; row+=tileSize )
+    {
+        for ( int column=row; column<n; column+=tileSize )
+        {
+            Impl::Tile tile;
+            tile.row = row;
+            tile.column = column;
+            d->tiles.append(tile);
+        }
+    }
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->failed.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void GramMatrix::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void GramMatrix::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void GramMatrix::finishComputation()
+{
+    d->readFailed();
+    bool success = d->cancelled.load()==0;
+    if ( success )
+        d->setResult(d->pending,d->computed,d->backgroundCorrection);
+    d->data.clear();
+    d->copies.clear();
+    d->computed.clear();
+    QList<int> changed = d->changedWhileRunning;
+    d->changedWhileRunning.clear();
+    // Components edited during the computation may have been read before the change
+    if ( success && !changed.isEmpty() )
+        updateComponents(changed);
+    emit finished(success);
+}
+
+void GramMatrix::updateComponents(const QList<int> & globalIndices)
+{
+    if ( isRunning() )
+    {
+        d->changedWhileRunning += globalIndices;
+        return;
+    }
+    if ( d->components.isEmpty() || d->systemMatrix==0 )
+        return;
+    // Edited components are correlated again right away with all components of the result
+    int n = d->components.count();
+    d->edited.fill(false,n);
+    QVector<int> rows;
+    foreach(int globalIndex, globalIndices)
+    {
+        if ( !contains(globalIndex) || d->edited.at(d->position.value(globalIndex)) )
+            continue;
+        rows.append(d->position.value(globalIndex));
+        d->edited[rows.last()] = true;
+    }
+    if ( rows.isEmpty() )
+        return;
+    d->pending = d->components;
+    bool correction = d->backgroundCorrection;
+    d->backgroundCorrection = d->resultBackgroundCorrection;
+    d->prepare();
+    d->error.clear();
+    d->cancelled.store(0);
+    d->failed.store(0);
+    d->gather();
+    if ( d->readFailed() )
+    {
+        // The edited rows cannot be trusted anymore, neither can the stored file
+        d->setResult(QVector<int>(),QVector<float>(),true);
+        QFile::remove(defaultFileName(d->systemMatrix));
+    }
+    else
+    {
+        d->target = d->correlations.data();
+        QtConcurrent::blockingMap(rows,Impl::RowKernel(d));
+        d->target = 0;
+    }
+    d->backgroundCorrection = correction;
+    d->data.clear();
+    d->copies.clear();
+    d->edited.clear();
+    emit updated();
+}
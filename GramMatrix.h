@@ -0,0 +1,104 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef GRAMMATRIX_H
+#define GRAMMATRIX_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QString>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The GramMatrix class computes the normalized correlation |<a_i,a_j>|/(|a_i||a_j|)
+ *        between selected components of a system matrix. Tiles of the Hermitian Gram matrix
+ *        are computed by the thread pool, each tile in voxel chunks that stay in cache.
+ *        Results can be stored in a sidecar file next to the system matrix.
+ */
+class GramMatrix : public QObject
+{
+    Q_OBJECT
+public:
+    typedef QPair<int,float> Similarity;
+    explicit GramMatrix(QObject * parent=0);
+    virtual ~GramMatrix();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setBackgroundCorrection(bool);
+    /**
+     * @brief setComponents Global indices of the components to correlate
+     */
+    void setComponents(const QList<int> & globalIndices);
+    /**
+     * @brief components Components of the current result, empty if there is none
+     */
+    QList<int> components() const;
+    bool contains(int globalIndex) const;
+    /**
+     * @brief correlation Normalized correlation between 0 and 1, -1 if a component is not contained
+     */
+    float correlation(int globalIndex1, int globalIndex2) const;
+    /**
+     * @brief mostSimilar Components with the highest correlation to globalIndex, best first
+     */
+    QList<Similarity> mostSimilar(int globalIndex, int count) const;
+    /**
+     * @brief defaultFileName Sidecar file of the system matrix
+     */
+    static QString defaultFileName(const SystemMatrix * systemMatrix);
+    /**
+     * @brief load Read a sidecar file, fails if it was computed with other background correction
+     */
+    bool load(const QString & fileName);
+    bool save(const QString & fileName);
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief tileCount Number of tiles of the current computation, progress() counts up to it
+     */
+    int tileCount() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+    /**
+     * @brief updateComponents Correlate edited components of the result again
+     */
+    void updateComponents(const QList<int> & globalIndices);
+signals:
+    void progress(int tiles);
+    void finished(bool success);
+    /**
+     * @brief updated Correlations of edited components were recomputed, a stored file is out of date.
+     *                The result is empty if a component could not be read, see errorString().
+     */
+    void updated();
+private slots:
+    void finishComputation();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // GRAMMATRIX_H
@@ -0,0 +1,489 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <cmath>
+#include <cstring>
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QtEndian>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "KaczmarzSolver.h"
+#include "SystemMatrix.h"
+
+// Below this number of voxels per thread the synchronization after every row costs more than it saves
+static const int minimumVoxelsPerThread = 8192;
+
+// Blocks all threads of a team until every thread has arrived
+class Barrier
+{
+public:
+    explicit Barrier(int count) : count(count), waiting(0), generation(0) {}
+    void wait()
+    {
+        if ( count==1 )
+            return;
+        QMutexLocker lock(&mutex);
+        int current = generation;
+        if ( ++waiting==count )
+        {
+            waiting = 0;
+            generation++;
+            condition.wakeAll();
+        }
+        else
+        {
+            while ( current==generation )
+                condition.wait(&mutex);
+        }
+    }
+private:
+    QMutex mutex;
+    QWaitCondition condition;
+    int count, waiting, generation;
+};
+
+struct KaczmarzSolver::Impl
+{
+    // A row of the linear system: measured value u = factor * <data,c>
+    struct Row
+    {
+        int globalIndex;
+        const complex * data;
+        QVector<complex> copy;  // Only used if the matrix is not memory mapped
+        complex factor;
+        double energy;
+        complex measurement;
+    };
+
+    // Fetches the data of a row and computes its energy in the thread pool
+    struct Gather
+    {
+        explicit Gather(const Impl * d) : d(d) {}
+        void operator()(Row & row) const;
+        const Impl * d;
+    };
+
+    // Additional member of the thread team, thread 0 is the driver thread itself
+    class Worker : public QThread
+    {
+    public:
+        Worker(Impl * d, int thread) : d(d), thread(thread) {}
+    protected:
+        virtual void run() { d->solve(thread); }
+    private:
+        Impl * d;
+        int thread;
+    };
+
+    KaczmarzSolver * q;
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    double minimumSnr;
+    int iterations;
+    double lambda;
+    bool realPositive;
+    QVector<complex> measurement;
+    int positions;
+
+    QVector<Row> rows;
+    int usedRows;
+    QVector<complex> solution;
+    double sqrtLambda, measurementNorm;
+    int numThreads;
+    Barrier * barrier;
+    QVector<complex> partialProducts[2];
+    QVector<double> partialResiduals;
+    bool stop;
+
+    QFutureWatcher<bool> watcher;
+    QAtomicInt cancelled;
+    // Global index+1 of the first component that could not be read, 0 if none
+    QAtomicInt failed;
+    QString error;
+
+    // Kaczmarz sweeps, each thread of the team updates its own range of voxels
+    void solve(int thread)
+    {
+        int begin = static_cast<int>(static_cast<qint64>(positions)*thread/numThreads);
+        int end = static_cast<int>(static_cast<qint64>(positions)*(thread+1)/numThreads);
+        complex * c = solution.data();
+        // Every thread keeps an identical copy of the auxiliary variables of the regularization
+        QVector<complex> v(rows.count(),complex(0.0));
+        QElapsedTimer timer;
+        int parity = 0;
+
+        for ( int iteration=1; iteration<=iterations; iteration++ )
+        {
+            timer.start();
+            for ( int r=0; r<rows.count(); r++ )
+            {
+                const Row & row = rows.at(r);
+                const complex * a = row.data;
+                complex dot = 0.0;
+                for ( int j=begin; j<end; j++ )
+                    dot += a[j]*c[j];
+                // Partial products alternate between two buffers, so one barrier per row suffices
+                partialProducts[parity][thread] = dot;
+                if ( thread==0 && r%256==0 )
+                    stop = cancelled.load()!=0;
+                barrier->wait();
+                if ( stop )
+                    break;
+                dot = 0.0;
+                for ( int t=0; t<numThreads; t++ )
+                    dot += partialProducts[parity][t];
+                parity ^= 1;
+
+                complex alpha = (row.measurement-row.factor*dot-sqrtLambda*v[r])/(row.energy+lambda);
+                v[r] += sqrtLambda*alpha;
+                complex update = alpha*std::conj(row.factor);
+                for ( int j=begin; j<end; j++ )
+                    c[j] += update*std::conj(a[j]);
+            }
+            if ( realPositive )
+            {
+                for ( int j=begin; j<end; j++ )
+                    c[j] = complex(qMax(0.0,c[j].real()),0.0);
+            }
+            barrier->wait();
+
+            // Residual of the unregularized system, rows are distributed over the team
+            double residual = 0.0;
+            for ( int r=thread; r<rows.count(); r+=numThreads )
+            {
+                const Row & row = rows.at(r);
+                complex dot = 0.0;
+                for ( int j=0; j<positions; j++ )
+                    dot += row.data[j]*c[j];
+                residual += std::norm(row.measurement-row.factor*dot);
+            }
+            partialResiduals[thread] = residual;
+            barrier->wait();
+            if ( thread==0 )
+            {
+                residual = 0.0;
+                foreach(double p, partialResiduals)
+                    residual += p;
+                emit q->iterationFinished(iteration,measurementNorm>0.0?std::sqrt(residual)/measurementNorm:0.0,
+                                          timer.nsecsElapsed()*1e-6);
+                stop = cancelled.load()!=0;
+            }
+            barrier->wait();
+            if ( stop )
+                break;
+        }
+    }
+
+    bool run()
+    {
+        // Gather rows and their energies in parallel
+        QtConcurrent::blockingMap(rows,Gather(this));
+        int globalIndex = failed.load()-1;
+        if ( globalIndex>=0 )
+        {
+            error = KaczmarzSolver::tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+            return false;
+        }
+        QVector<Row> valid;
+        double trace = 0.0;
+        foreach(const Row & row, rows)
+        {
+            if ( row.energy>0.0 )
+            {
+                valid.append(row);
+                trace += row.energy;
+            }
+        }
+        rows = valid;
+        usedRows = rows.count();
+        if ( rows.isEmpty() )
+        {
+            error = KaczmarzSolver::tr("The selected components contain no data.");
+            return false;
+        }
+
+        // Regularization relative to the mean energy per voxel
+        double relativeLambda = lambda;
+        lambda = relativeLambda*trace/positions;
+        sqrtLambda = std::sqrt(lambda);
+        measurementNorm = 0.0;
+        foreach(const Row & row, rows)
+            measurementNorm += std::norm(row.measurement);
+        measurementNorm = std::sqrt(measurementNorm);
+
+        solution.fill(complex(0.0),positions);
+        numThreads = qBound(1,positions/minimumVoxelsPerThread,qMax(1,QThread::idealThreadCount()));
+        partialProducts[0].fill(complex(0.0),numThreads);
+        partialProducts[1].fill(complex(0.0),numThreads);
+        partialResiduals.fill(0.0,numThreads);
+        stop = false;
+        barrier = new Barrier(numThreads);
+        QList<Worker*> team;
+        for ( int t=1; t<numThreads; t++ )
+        {
+            team.append(new Worker(this,t));
+            team.last()->start();
+        }
+        solve(0);
+        foreach(Worker * worker, team)
+        {
+            worker->wait();
+            delete worker;
+        }
+        delete barrier;
+        barrier = 0;
+        lambda = relativeLambda;
+        return true;
+    }
+};
+
+void KaczmarzSolver::Impl::Gather::operator()(Row & row) const
+{
+    row.energy = 0.0;
+    row.data = d->systemMatrix->mappedData(row.globalIndex,d->backgroundCorrection);
+    if ( row.data )
+        row.factor = d->systemMatrix->calibrationFactor(row.globalIndex);
+    else
+    {
+        // readBlock already applies the calibration
+        row.copy.resize(d->positions);
+        if ( !d->systemMatrix->readBlock(row.globalIndex,d->backgroundCorrection,row.copy.data()) )
+        {
+            d->failed.testAndSetOrdered(0,row.globalIndex+1);
+            row.copy.clear();
+            return;
+        }
+        row.data = row.copy.constData();
+        row.factor = 1.0;
+    }
+    double energy = 0.0;
+    for ( int j=0; j<d->positions; j++ )
+        energy += std::norm(row.data[j]);
+    row.energy = std::norm(row.factor)*energy;
+}
+
+KaczmarzSolver::KaczmarzSolver(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->backgroundCorrection = true;
+    d->minimumSnr = 3.0;
+    d->iterations = 3;
+    d->lambda = 1e-3;
+    d->realPositive = true;
+    d->positions = 0;
+    d->usedRows = 0;
+    d->sqrtLambda = 0.0;
+    d->measurementNorm = 0.0;
+    d->numThreads = 1;
+    d->barrier = 0;
+    d->stop = false;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishReconstruction()));
+}
+
+KaczmarzSolver::~KaczmarzSolver()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void KaczmarzSolver::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+    d->measurement.clear();
+    d->solution.clear();
+}
+
+void KaczmarzSolver::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void KaczmarzSolver::setMinimumSnr(double snr)
+{
+    d->minimumSnr = snr;
+}
+
+void KaczmarzSolver::setIterations(int iterations)
+{
+    d->iterations = qMax(1,iterations);
+}
+
+void KaczmarzSolver::setRegularization(double lambda)
+{
+    d->lambda = qMax(0.0,lambda);
+}
+
+void KaczmarzSolver::setRealPositive(bool b)
+{
+    d->realPositive = b;
+}
+
+bool KaczmarzSolver::loadMeasurement(const QString & fileName)
+{
+    d->error.clear();
+    if ( d->systemMatrix==0 )
+        return false;
+    qint64 n = static_cast<qint64>(d->systemMatrix->numberOfReceivers())*d->systemMatrix->numberOfFrequencies();
+    QFile file(fileName);
+    if ( !file.open(QIODevice::ReadOnly) )
+    {
+        d->error = tr("Cannot open file %1.").arg(fileName);
+        return false;
+    }
+    QByteArray data = file.readAll();
+    qint64 size = data.size();
+    int valueSize;
+    if ( size==n*2*static_cast<qint64>(sizeof(double)) )
+        valueSize = sizeof(double);
+    else if ( size==n*2*static_cast<qint64>(sizeof(float)) )
+        valueSize = sizeof(float);
+    else
+    {
+        d->error = tr("The measurement file has %1 bytes, expected %2 complex values.").arg(data.size()).arg(n);
+        return false;
+    }
+
+    d->measurement.resize(n);
+    const uchar * p = reinterpret_cast<const uchar*>(data.constData());
+    for ( int i=0; i<n; i++ )
+    {
+        double v[2];
+        for ( int k=0; k<2; k++, p+=valueSize )
+        {
+            if ( valueSize==sizeof(double) )
+            {
+                quint64 bits = qFromLittleEndian<quint64>(p);
+                memcpy(&v[k],&bits,sizeof(double));
+            }
+            else
+            {
+                quint32 bits = qFromLittleEndian<quint32>(p);
+                float f;
+                memcpy(&f,&bits,sizeof(float));
+                v[k] = f;
+            }
+        }
+        d->measurement[i] = complex(v[0],v[1]);
+    }
+    return true;
+}
+
+bool KaczmarzSolver::hasMeasurement() const
+{
+    return !d->measurement.isEmpty();
+}
+
+bool KaczmarzSolver::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QString KaczmarzSolver::errorString() const
+{
+    return d->error;
+}
+
+int KaczmarzSolver::rowCount() const
+{
+    return d->usedRows;
+}
+
+QVector<KaczmarzSolver::complex> KaczmarzSolver::result() const
+{
+    if ( isRunning() )
+        return QVector<complex>();
+    return d->solution;
+}
+
+bool KaczmarzSolver::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    if ( d->measurement.isEmpty() )
+    {
+        d->error = tr("No measurement loaded.");
+        return false;
+    }
+
+    d->positions = 1;
+    for ( int i=0; i<3; i++ )
+        d->positions *= d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+
+    // Rows in SNR order down to the threshold
+    d->rows.clear();
+    d->solution.clear();
+    d->usedRows = 0;
+    for ( int rank=0; rank<=d->systemMatrix->maxGlobalIndex(); rank++ )
+    {
+        int globalIndex = d->systemMatrix->globalIndex(rank);
+        if ( globalIndex<0 || d->systemMatrix->snr(globalIndex)<d->minimumSnr )
+            break;
+        Impl::Row row;
+        row.globalIndex = globalIndex;
+        row.data = 0;
+        row.factor = 1.0;
+        row.energy = 0.0;
+        row.measurement = d->measurement.at(globalIndex);
+        d->rows.append(row);
+    }
+    if ( d->rows.isEmpty() )
+    {
+        d->error = tr("No component exceeds the SNR threshold.");
+        return false;
+    }
+
+    d->cancelled.store(0);
+    d->failed.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void KaczmarzSolver::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void KaczmarzSolver::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void KaczmarzSolver::finishReconstruction()
+{
+    bool success = d->watcher.result() && d->cancelled.load()==0;
+    // Row copies are only needed during the reconstruction
+    d->rows.clear();
+    emit finished(success);
+}
@@ -0,0 +1,98 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef KACZMARZSOLVER_H
+#define KACZMARZSOLVER_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The KaczmarzSolver class reconstructs a particle concentration from a measured
+ *        spectrum with the Tikhonov regularized Kaczmarz method (ART). The components above an
+ *        SNR threshold are used as rows, read directly from the mapped system matrix if
+ *        possible. Each row update is split over several threads for large grids.
+ */
+class KaczmarzSolver : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::complex<double> complex;
+    explicit KaczmarzSolver(QObject * parent=0);
+    virtual ~KaczmarzSolver();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setBackgroundCorrection(bool);
+    void setMinimumSnr(double snr);
+    void setIterations(int iterations);
+    /**
+     * @brief setRegularization Tikhonov parameter relative to the mean energy of the rows per voxel
+     */
+    void setRegularization(double lambda);
+    /**
+     * @brief setRealPositive Project the solution to real, non-negative values after each sweep
+     */
+    void setRealPositive(bool);
+    /**
+     * @brief loadMeasurement Read a measured spectrum, numberOfReceivers()*numberOfFrequencies()
+     *                        little endian complex values of single or double precision in
+     *                        global index order
+     */
+    bool loadMeasurement(const QString & fileName);
+    bool hasMeasurement() const;
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief rowCount Number of rows used by the current reconstruction
+     */
+    int rowCount() const;
+    /**
+     * @brief result Concentration in the voxels of the system matrix, x fastest
+     */
+    QVector<complex> result() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+signals:
+    /**
+     * @brief iterationFinished Emitted after each sweep over all rows
+     * @param iteration         Number of finished iterations
+     * @param residual          Relative residual norm |u-Ac|/|u|
+     * @param milliseconds      Duration of the iteration
+     */
+    void iterationFinished(int iteration, double residual, double milliseconds);
+    void finished(bool success);
+private slots:
+    void finishReconstruction();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // KACZMARZSOLVER_H
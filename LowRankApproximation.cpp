@@ -0,0 +1,653 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDataStream>
+#include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QPointer>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "LowRankApproximation.h"
+#include "SidecarFile.h"
+#include "SystemMatrix.h"
+
+typedef LowRankApproximation::complex complex;
+typedef std::complex<float> complexFloat;
+
+// Extra columns of the random sketch, components read per block and voxels per tile of the adjoint product
+static const int oversampling = 10;
+static const int rowsPerBlock = 64;
+static const int voxelsPerTile = 1024;
+static const char fileMagic[] = "SFLRA001";
+
+// Orthonormalizes the columns of a row-major rows x columns matrix, twice for numerical stability
+static void orthonormalize(QVector<complex> & m, int rows, int columns)
+{
+    for ( int pass=0; pass<2; pass++ )
+    {
+        for ( int j=0; j<columns; j++ )
+        {
+            for ( int i=0; i<j; i++ )
+            {
+                complex r = 0.0;
+                for ( int n=0; n<rows; n++ )
+                    r += std::conj(m.at(n*columns+i))*m.at(n*columns+j);
+                for ( int n=0; n<rows; n++ )
+                    m[n*columns+j] -= r*m.at(n*columns+i);
+            }
+            double norm = 0.0;
+            for ( int n=0; n<rows; n++ )
+                norm += std::norm(m.at(n*columns+j));
+            // Columns without a new direction are dropped, they end up with a zero singular value
+            norm = norm>1e-200 ? 1.0/std::sqrt(norm) : 0.0;
+            for ( int n=0; n<rows; n++ )
+                m[n*columns+j] *= norm;
+        }
+    }
+}
+
+// Cyclic Jacobi diagonalization of a Hermitian row-major n x n matrix, eigenvectors are the columns of v
+static void hermitianEigen(QVector<complex> & a, int n, QVector<complex> & v)
+{
+    v.fill(complex(0.0),n*n);
+    for ( int i=0; i<n; i++ )
+        v[i*n+i] = 1.0;
+    for ( int sweep=0; sweep<100; sweep++ )
+    {
+        double off = 0.0, diagonal = 0.0;
+        for ( int p=0; p<n; p++ )
+        {
+            diagonal += std::norm(a.at(p*n+p));
+            for ( int q=p+1; q<n; q++ )
+                off += std::norm(a.at(p*n+q));
+        }
+        if ( off<=1e-30*diagonal )
+            break;
+        for ( int p=0; p<n; p++ )
+        {
+            for ( int q=p+1; q<n; q++ )
+            {
+                complex apq = a.at(p*n+q);
+                double c = std::abs(apq);
+                if ( c<1e-300 )
+                    continue;
+                // The phase of apq is moved into the rotation, the rest is the real symmetric case
+                complex phase = std::conj(apq/c);
+                double theta = (a.at(q*n+q).real()-a.at(p*n+p).real())/(2.0*c);
+                double t = (theta>=0.0 ? 1.0 : -1.0)/(std::fabs(theta)+std::sqrt(theta*theta+1.0));
+                double cs = 1.0/std::sqrt(t*t+1.0), sn = t*cs;
+                complex gpp = cs, gpq = sn, gqp = -sn*phase, gqq = cs*phase;
+                for ( int k=0; k<n; k++ )
+                {
+                    complex x = a.at(k*n+p), y = a.at(k*n+q);
+                    a[k*n+p] = x*gpp+y*gqp;
+                    a[k*n+q] = x*gpq+y*gqq;
+                    x = v.at(k*n+p);
+                    y = v.at(k*n+q);
+                    v[k*n+p] = x*gpp+y*gqp;
+                    v[k*n+q] = x*gpq+y*gqq;
+                }
+                for ( int k=0; k<n; k++ )
+                {
+                    complex x = a.at(p*n+k), y = a.at(q*n+k);
+                    a[p*n+k] = std::conj(gpp)*x+std::conj(gqp)*y;
+                    a[q*n+k] = std::conj(gpq)*x+std::conj(gqq)*y;
+                }
+            }
+        }
+    }
+}
+
+struct LowRankApproximation::Impl
+{
+    struct Row
+    {
+        int row;             // Frequency index within the receiver
+        const complex * data;
+        complex factor;      // Calibration still to apply to data
+        QVector<complex> copy;
+    };
+
+    // Reads a component in a worker thread
+    struct Gather
+    {
+        explicit Gather(Impl * d) : d(d) {}
+        void operator()(Row & row) const;
+        Impl * d;
+    };
+
+    // narrow(row,:) = a_row * wide for one component of the block
+    struct Multiply
+    {
+        explicit Multiply(Impl * d) : d(d) {}
+        void operator()(const Row & row) const;
+        Impl * d;
+    };
+
+    // wide(p,:) += sum over the block of conj(a_row[p]) * narrow(row,:) for a tile of voxels
+    struct Adjoint
+    {
+        explicit Adjoint(Impl * d) : d(d) {}
+        void operator()(int begin) const;
+        Impl * d;
+    };
+
+    LowRankApproximation * q;
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    int requestedRank, powerIterations;
+
+    // Current computation, wide is positions x sketch and narrow is frequencies x sketch
+    int positions, frequencies, receivers, sketch, computedRank, currentReceiver;
+    bool computedCorrection;
+    QVector<Row> block;
+    QVector<complex> wide, narrow, scaled;
+    QVector<int> tiles;
+    QVector<QVector<complexFloat> > computedLeft, computedRight;
+    QVector<QVector<float> > computedSingularValues;
+
+    // Result, left factors are frequencies x rank and already scaled by the singular values
+    int resultRank, resultPositions, resultFrequencies;
+    bool resultBackgroundCorrection;
+    QVector<QVector<complexFloat> > left, right;
+    QVector<QVector<float> > singularValues;
+
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+    // Global index+1 of the first component that could not be read, 0 if none
+    QAtomicInt failed;
+    QString error;
+
+    void gather(int receiver, int first)
+    {
+        block.resize(qMin(rowsPerBlock,frequencies-first));
+        for ( int i=0; i<block.count(); i++ )
+            block[i].row = first+i;
+        currentReceiver = receiver;
+        QtConcurrent::blockingMap(block,Gather(this));
+        emit q->progress(done.fetchAndAddOrdered(block.count())+block.count());
+    }
+
+    void multiply(int receiver)
+    {
+        for ( int first=0; first<frequencies && !cancelled.load(); first+=rowsPerBlock )
+        {
+            gather(receiver,first);
+            QtConcurrent::blockingMap(block,Multiply(this));
+        }
+    }
+
+    void adjoint(int receiver)
+    {
+        wide.fill(complex(0.0));
+        for ( int first=0; first<frequencies && !cancelled.load(); first+=rowsPerBlock )
+        {
+            gather(receiver,first);
+            // The calibration of a row is moved to the narrow side of the product
+            scaled.resize(block.count()*sketch);
+            for ( int i=0; i<block.count(); i++ )
+                for ( int j=0; j<sketch; j++ )
+                    scaled[i*sketch+j] = std::conj(block.at(i).factor)*narrow.at(block.at(i).row*sketch+j);
+            QtConcurrent::blockingMap(tiles,Adjoint(this));
+        }
+    }
+
+    // With wide = A^H Q the small matrix B = Q^H A = wide^H is decomposed through B B^H
+    void factorize(int receiver)
+    {
+        QVector<complex> gram(sketch*sketch,complex(0.0));
+        for ( int p=0; p<positions; p++ )
+        {
+            const complex * z = wide.constData()+p*sketch;
+            for ( int i=0; i<sketch; i++ )
+            {
+                complex zi = std::conj(z[i]);
+                for ( int j=i; j<sketch; j++ )
+                    gram[i*sketch+j] += zi*z[j];
+            }
+        }
+        for ( int i=0; i<sketch; i++ )
+            for ( int j=0; j<i; j++ )
+                gram[i*sketch+j] = std::conj(gram.at(j*sketch+i));
+
+        QVector<complex> vectors;
+        hermitianEigen(gram,sketch,vectors);
+        QVector<QPair<double,int> > order;
+        for ( int i=0; i<sketch; i++ )
+            order.append(qMakePair(-gram.at(i*sketch+i).real(),i));
+        std::sort(order.begin(),order.end());
+
+        QVector<complexFloat> & u = computedLeft[receiver];
+        QVector<complexFloat> & w = computedRight[receiver];
+        QVector<float> & s = computedSingularValues[receiver];
+        u.fill(complexFloat(0.0f),frequencies*computedRank);
+        w.fill(complexFloat(0.0f),computedRank*positions);
+        s.fill(0.0f,computedRank);
+        for ( int j=0; j<computedRank; j++ )
+        {
+            int column = order.at(j).second;
+            double sigma = std::sqrt(qMax(0.0,-order.at(j).first));
+            s[j] = static_cast<float>(sigma);
+            if ( sigma<=0.0 )
+                continue;
+            for ( int f=0; f<frequencies; f++ )
+            {
+                complex sum = 0.0;
+                for ( int i=0; i<sketch; i++ )
+                    sum += narrow.at(f*sketch+i)*vectors.at(i*sketch+column);
+                u[f*computedRank+j] = complexFloat(sum*sigma);
+            }
+            for ( int p=0; p<positions; p++ )
+            {
+                complex sum = 0.0;
+                for ( int i=0; i<sketch; i++ )
+                    sum += std::conj(vectors.at(i*sketch+column)*wide.at(p*sketch+i));
+                w[j*positions+p] = complexFloat(sum/sigma);
+            }
+        }
+    }
+
+    void run()
+    {
+        for ( int receiver=0; receiver<receivers && !cancelled.load(); receiver++ )
+        {
+            // Random +-1 sketch, reproducible for every receiver
+            quint32 state = 0x2014u+receiver;
+            for ( int i=0; i<wide.count(); i++ )
+            {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                wide[i] = (state & 0x80000000u) ? 1.0 : -1.0;
+            }
+            multiply(receiver);
+            orthonormalize(narrow,frequencies,sketch);
+            for ( int iteration=0; iteration<powerIterations; iteration++ )
+            {
+                adjoint(receiver);
+                orthonormalize(wide,positions,sketch);
+                multiply(receiver);
+                orthonormalize(narrow,frequencies,sketch);
+            }
+            adjoint(receiver);
+            if ( !cancelled.load() )
+                factorize(receiver);
+        }
+    }
+};
+
+void LowRankApproximation::Impl::Gather::operator()(Row & row) const
+{
+    int globalIndex = d->currentReceiver*d->frequencies+row.row;
+    row.data = d->systemMatrix->mappedData(globalIndex,d->computedCorrection);
+    if ( row.data )
+    {
+        row.factor = d->systemMatrix->calibrationFactor(globalIndex);
+        return;
+    }
+    // readBlock already applies the calibration
+    row.factor = 1.0;
+    row.copy.resize(d->positions);
+    if ( !d->systemMatrix->readBlock(globalIndex,d->computedCorrection,row.copy.data()) )
+    {
+        // Zeros would silently bias the factors, the remaining steps of the run are skipped
+        row.copy.fill(complex(0.0));
+        d->failed.testAndSetOrdered(0,globalIndex+1);
+        d->cancelled.store(1);
+    }
+    row.data = row.copy.constData();
+}
+
+void LowRankApproximation::Impl::Multiply::operator()(const Row & row) const
+{
+    if ( d->cancelled.load() )
+        return;
+    int l = d->sketch;
+    QVector<complex> sums(l,complex(0.0));
+    const complex * x = d->wide.constData();
+    for ( int p=0; p<d->positions; p++ )
+    {
+        complex a = row.data[p];
+        for ( int j=0; j<l; j++ )
+            sums[j] += a*x[p*l+j];
+    }
+    for ( int j=0; j<l; j++ )
+        d->narrow[row.row*l+j] = row.factor*sums.at(j);
+}
+
+void LowRankApproximation::Impl::Adjoint::operator()(int begin) const
+{
+    if ( d->cancelled.load() )
+        return;
+    int l = d->sketch;
+    int end = qMin(begin+voxelsPerTile,d->positions);
+    for ( int i=0; i<d->block.count(); i++ )
+    {
+        const complex * a = d->block.at(i).data;
+        const complex * y = d->scaled.constData()+i*l;
+        for ( int p=begin; p<end; p++ )
+        {
+            complex c = std::conj(a[p]);
+            complex * z = d->wide.data()+p*l;
+            for ( int j=0; j<l; j++ )
+                z[j] += c*y[j];
+        }
+    }
+}
+
+LowRankApproximation::LowRankApproximation(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->backgroundCorrection = true;
+    d->requestedRank = 32;
+    d->powerIterations = 1;
+    d->positions = d->frequencies = d->receivers = d->sketch = d->computedRank = 0;
+    d->computedCorrection = true;
+    d->currentReceiver = 0;
+    d->resultRank = d->resultPositions = d->resultFrequencies = 0;
+    d->resultBackgroundCorrection = true;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishComputation()));
+}
+
+LowRankApproximation::~LowRankApproximation()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void LowRankApproximation::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    cancel();
+    waitForFinished();
+    if ( d->systemMatrix )
+        disconnect(d->systemMatrix,0,this,0);
+    d->systemMatrix = systemMatrix;
+    d->left.clear();
+    d->right.clear();
+    d->singularValues.clear();
+    d->resultRank = 0;
+    if ( systemMatrix )
+        connect(systemMatrix,SIGNAL(componentsChanged(QList<int>)),SLOT(discard()));
+}
+
+void LowRankApproximation::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void LowRankApproximation::setRank(int rank)
+{
+    d->requestedRank = qMax(1,rank);
+}
+
+void LowRankApproximation::setPowerIterations(int iterations)
+{
+    d->powerIterations = qMax(0,iterations);
+}
+
+bool LowRankApproximation::isReady() const
+{
+    return d->systemMatrix && d->resultRank>0;
+}
+
+int LowRankApproximation::rank() const
+{
+    return d->resultRank;
+}
+
+bool LowRankApproximation::backgroundCorrection() const
+{
+    return d->resultBackgroundCorrection;
+}
+
+QVector<float> LowRankApproximation::singularValues(int receiver) const
+{
+    return d->singularValues.value(receiver);
+}
+
+bool LowRankApproximation::reconstruct(int globalIndex, complex * buffer) const
+{
+    if ( !isReady() || globalIndex<0 || globalIndex>=d->left.count()*d->resultFrequencies )
+        return false;
+    int receiver = globalIndex/d->resultFrequencies;
+    int row = globalIndex%d->resultFrequencies;
+    int k = d->resultRank, n = d->resultPositions;
+    const complexFloat * u = d->left.at(receiver).constData()+row*k;
+    const complexFloat * w = d->right.at(receiver).constData();
+    for ( int p=0; p<n; p++ )
+        buffer[p] = 0.0;
+    for ( int j=0; j<k; j++ )
+    {
+        complex c(u[j].real(),u[j].imag());
+        const complexFloat * v = w+j*n;
+        for ( int p=0; p<n; p++ )
+            buffer[p] += c*complex(v[p].real(),v[p].imag());
+    }
+    return true;
+}
+
+QString LowRankApproximation::defaultFileName(const SystemMatrix * systemMatrix)
+{
+    return SidecarFile::fileName(systemMatrix,".lowrank","lowRankFactors");
+}
+
+bool LowRankApproximation::load(const QString & fileName)
+{
+    d->error.clear();
+    if ( d->systemMatrix==0 || isRunning() )
+        return false;
+    SidecarFile file(fileName,fileMagic);
+    if ( !file.openForReading() )
+        return false;
+    QDataStream & in = file.stream();
+    if ( !file.hasMagic() )
+    {
+        d->error = tr("%1 is not a low rank approximation file.").arg(fileName);
+        return false;
+    }
+    quint32 rank, receivers, frequencies, positions, correction;
+    in >> rank >> receivers >> frequencies >> positions >> correction;
+    int matrixPositions = 1;
+    for ( int i=0; i<3; i++ )
+        matrixPositions *= d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+    if ( in.status()!=QDataStream::Ok || rank==0 || receivers!=static_cast<quint32>(d->systemMatrix->numberOfReceivers())
+         || frequencies!=static_cast<quint32>(d->systemMatrix->numberOfFrequencies()) || positions!=static_cast<quint32>(matrixPositions) )
+    {
+        d->error = tr("The low rank approximation %1 does not match the system matrix.").arg(fileName);
+        return false;
+    }
+    qint64 expected = static_cast<qint64>(receivers)*rank*(1+2*static_cast<qint64>(frequencies)+2*static_cast<qint64>(positions))*sizeof(float);
+    if ( file.bytesAvailable()!=expected )
+    {
+        d->error = tr("The low rank approximation %1 is damaged.").arg(fileName);
+        return false;
+    }
+    QVector<QVector<complexFloat> > u(receivers), w(receivers);
+    QVector<QVector<float> > s(receivers);
+    for ( quint32 r=0; r<receivers && in.status()==QDataStream::Ok; r++ )
+    {
+        s[r].resize(rank);
+        for ( quint32 j=0; j<rank; j++ )
+            in >> s[r][j];
+        u[r].resize(frequencies*rank);
+        for ( int i=0; i<u.at(r).count(); i++ )
+        {
+            float re, im;
+            in >> re >> im;
+            u[r][i] = complexFloat(re,im);
+        }
+        w[r].resize(rank*positions);
+        for ( int i=0; i<w.at(r).count(); i++ )
+        {
+            float re, im;
+            in >> re >> im;
+            w[r][i] = complexFloat(re,im);
+        }
+    }
+    if ( in.status()!=QDataStream::Ok )
+    {
+        d->error = tr("The low rank approximation %1 is damaged.").arg(fileName);
+        return false;
+    }
+    d->left = u;
+    d->right = w;
+    d->singularValues = s;
+    d->resultRank = rank;
+    d->resultFrequencies = frequencies;
+    d->resultPositions = positions;
+    d->resultBackgroundCorrection = correction!=0;
+    return true;
+}
+
+bool LowRankApproximation::save(const QString & fileName)
+{
+    d->error.clear();
+    if ( d->resultRank==0 )
+        return false;
+    SidecarFile file(fileName,fileMagic);
+    if ( !file.openForWriting(&d->error) )
+        return false;
+    QDataStream & out = file.stream();
+    out << static_cast<quint32>(d->resultRank) << static_cast<quint32>(d->left.count())
+        << static_cast<quint32>(d->resultFrequencies) << static_cast<quint32>(d->resultPositions)
+        << static_cast<quint32>(d->resultBackgroundCorrection?1:0);
+    for ( int r=0; r<d->left.count(); r++ )
+    {
+        foreach(float value, d->singularValues.at(r))
+            out << value;
+        foreach(const complexFloat & value, d->left.at(r))
+            out << value.real() << value.imag();
+        foreach(const complexFloat & value, d->right.at(r))
+            out << value.real() << value.imag();
+    }
+    return file.finishWriting(&d->error);
+}
+
+bool LowRankApproximation::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QString LowRankApproximation::errorString() const
+{
+    return d->error;
+}
+
+int LowRankApproximation::rowCount() const
+{
+    return d->receivers*d->frequencies*(2+2*d->powerIterations);
+}
+
+bool LowRankApproximation::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    d->positions = 1;
+    for ( int i=0; i<3; i++ )
+        d->positions *= d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+    d->frequencies = d->systemMatrix->numberOfFrequencies();
+    d->receivers = d->systemMatrix->numberOfReceivers();
+    d->sketch = qMin(d->requestedRank+oversampling,qMin(d->frequencies,d->positions));
+    d->computedRank = qMin(d->requestedRank,d->sketch);
+    if ( d->computedRank<1 || d->receivers<1 )
+    {
+        d->error = tr("The system matrix is empty.");
+        return false;
+    }
+    d->computedCorrection = d->backgroundCorrection;
+    d->wide.fill(complex(0.0),d->positions*d->sketch);
+    d->narrow.fill(complex(0.0),d->frequencies*d->sketch);
+    d->tiles.clear();
+    for ( int begin=0; begin<d->positions; begin+=voxelsPerTile )
+        d->tiles.append(begin);
+    d->computedLeft.clear();
+    d->computedLeft.resize(d->receivers);
+    d->computedRight.clear();
+    d->computedRight.resize(d->receivers);
+    d->computedSingularValues.clear();
+    d->computedSingularValues.resize(d->receivers);
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->failed.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void LowRankApproximation::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void LowRankApproximation::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void LowRankApproximation::finishComputation()
+{
+    int globalIndex = d->failed.load()-1;
+    if ( globalIndex>=0 )
+        d->error = tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+    bool success = d->cancelled.load()==0;
+    if ( success )
+    {
+        d->left = d->computedLeft;
+        d->right = d->computedRight;
+        d->singularValues = d->computedSingularValues;
+        d->resultRank = d->computedRank;
+        d->resultFrequencies = d->frequencies;
+        d->resultPositions = d->positions;
+        d->resultBackgroundCorrection = d->computedCorrection;
+    }
+    d->block.clear();
+    d->wide.clear();
+    d->narrow.clear();
+    d->scaled.clear();
+    d->computedLeft.clear();
+    d->computedRight.clear();
+    d->computedSingularValues.clear();
+    emit finished(success);
+}
+
+void LowRankApproximation::discard()
+{
+    if ( d->resultRank==0 && !isRunning() )
+        return;
+    cancel();
+    waitForFinished();
+    d->left.clear();
+    d->right.clear();
+    d->singularValues.clear();
+    d->resultRank = 0;
+    // The stored factors describe the unmodified matrix and must not be loaded again
+    QFile::remove(defaultFileName(d->systemMatrix));
+    emit discarded();
+}
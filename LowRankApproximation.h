@@ -0,0 +1,104 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef LOWRANKAPPROXIMATION_H
+#define LOWRANKAPPROXIMATION_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The LowRankApproximation class computes a truncated SVD of the calibrated system
+ *        matrix of every receiver with a randomized range finder and power iterations.
+ *        Each pass streams over blocks of components, so the matrix never has to fit into
+ *        memory. Components are rebuilt from the factors, which also removes most of the noise.
+ */
+class LowRankApproximation : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::complex<double> complex;
+    explicit LowRankApproximation(QObject * parent=0);
+    virtual ~LowRankApproximation();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setBackgroundCorrection(bool);
+    void setRank(int rank);
+    void setPowerIterations(int iterations);
+    /**
+     * @brief isReady True if factors of the current matrix are available
+     */
+    bool isReady() const;
+    /**
+     * @brief rank Rank of the available factors
+     */
+    int rank() const;
+    /**
+     * @brief backgroundCorrection Background correction of the available factors
+     */
+    bool backgroundCorrection() const;
+    /**
+     * @brief singularValues Singular values of a receiver, largest first
+     */
+    QVector<float> singularValues(int receiver) const;
+    /**
+     * @brief reconstruct Rank-k approximation of a component, x fastest
+     */
+    bool reconstruct(int globalIndex, complex * buffer) const;
+    /**
+     * @brief defaultFileName Sidecar file of the system matrix
+     */
+    static QString defaultFileName(const SystemMatrix * systemMatrix);
+    bool load(const QString & fileName);
+    bool save(const QString & fileName);
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief rowCount Components read by the current computation over all passes, progress() counts up to it
+     */
+    int rowCount() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+signals:
+    void progress(int rows);
+    void finished(bool success);
+    /**
+     * @brief discarded Emitted when the factors were dropped because components of the matrix changed
+     */
+    void discarded();
+private slots:
+    void finishComputation();
+    void discard();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // LOWRANKAPPROXIMATION_H
@@ -0,0 +1,775 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <cmath>
+#include <cstring>
+
+#ifdef SFVIEW_HAVE_HDF5
+// HDF5 includes
+#include <hdf5.h>
+#endif
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDateTime>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QSettings>
+#include <QtCore/QTextStream>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+#include <QtCore/QtEndian>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "MatrixExporter.h"
+#include "SystemMatrix.h"
+#ifdef SFVIEW_HAVE_HDF5
+#include "MdfStorage.h"
+#endif
+
+// Components converted per block and thread, two blocks are in memory at any time
+static const int blockRowsPerThread = 4;
+
+// Build the header of a NumPy .npy file (format version 1.0)
+static QByteArray npyHeader(const char * descr, const QList<qint64> & shape)
+{
+    QByteArray dict = "{'descr': '";
+    dict += descr;
+    dict += "', 'fortran_order': False, 'shape': (";
+    foreach(qint64 n, shape)
+        dict += QByteArray::number(n) + ", ";
+    dict += "), }";
+    // Magic, version and header length take 10 bytes, the total header must be aligned to 64 bytes
+    int total = 10 + dict.size() + 1;
+    dict += QByteArray((64-total%64)%64,' ');
+    dict += '\n';
+
+    QByteArray header("\x93NUMPY\x01\x00",8);
+    uchar length[2];
+    qToLittleEndian<quint16>(static_cast<quint16>(dict.size()),length);
+    header.append(reinterpret_cast<const char*>(length),2);
+    return header+dict;
+}
+
+struct MatrixExporter::Impl
+{
+    // Reads, converts and optionally compresses a single component in a worker thread
+    struct Encoder
+    {
+        typedef QByteArray result_type;
+        Encoder(const Impl * d, bool compress) : d(d), compress(compress) {}
+        QByteArray operator()(int globalIndex) const;
+        const Impl * d;
+        bool compress;
+    };
+
+    MatrixExporter * q;
+    QPointer<SystemMatrix> systemMatrix;
+    Format format;
+    Precision precision;
+    bool backgroundCorrection;
+    double minimumSnr;
+    RowOrder rowOrder;
+    int compressionLevel;
+    QString fileName;
+    int positions;           // Voxels of a component read from the matrix
+    int outputPositions;     // Voxels of a component written to the file
+    int outputGrid[3];
+    double outputFov[3];     // In mm like SystemMatrix::spatialExtent()
+    QList<int> frequencies;  // Exported frequency indices
+    QList<int> rows;         // Global indices in file order, all receivers for each exported frequency
+    SpatialFilter filter;
+    double filterSnrLimit;
+    QVector<double> filterNoise; // Noise of every global index to filter, -1 for the others
+    bool resample;
+    Resampler resampler;
+
+    QFutureWatcher<bool> watcher;
+    QAtomicInt cancelled;
+    mutable QMutex mutex;
+    QString error;
+
+    void fail(const QString & message)
+    {
+        QMutexLocker lock(&mutex);
+        if ( error.isEmpty() )
+            error = message;
+    }
+
+    void selectRows()
+    {
+        frequencies.clear();
+        rows.clear();
+        if ( rowOrder==SnrOrder && format!=Mdf )
+        {
+            // The SNR index is sorted, stop at the first component below the threshold
+            for ( int rank=0; rank<=systemMatrix->maxGlobalIndex(); rank++ )
+            {
+                int globalIndex = systemMatrix->globalIndex(rank);
+                if ( globalIndex<0 || systemMatrix->snr(globalIndex)<minimumSnr )
+                    break;
+                rows.append(globalIndex);
+            }
+            return;
+        }
+        int receivers = systemMatrix->numberOfReceivers();
+        for ( int k=0; k<systemMatrix->numberOfFrequencies(); k++ )
+        {
+            for ( int c=0; c<receivers; c++ )
+            {
+                if ( minimumSnr<=0.0 || systemMatrix->snr(systemMatrix->globalIndex(c,k))>=minimumSnr )
+                {
+                    frequencies.append(k);
+                    break;
+                }
+            }
+        }
+        for ( int c=0; c<receivers; c++ )
+            foreach(int k, frequencies)
+                rows.append(systemMatrix->globalIndex(c,k));
+    }
+
+    // Convert and write all rows in blocks. The next block is prepared by the thread pool
+    // while the current one is written.
+    template<typename Writer>
+    bool pipeline(Writer & writer, bool compress)
+    {
+        int blockSize = blockRowsPerThread*qMax(1,QThread::idealThreadCount());
+        Encoder encoder(this,compress);
+        QFuture<QByteArray> next = QtConcurrent::mapped(rows.mid(0,blockSize),encoder);
+        for ( int first=0; first<rows.count(); first+=blockSize )
+        {
+            next.waitForFinished();
+            QList<QByteArray> block = next.results();
+            if ( first+blockSize<rows.count() )
+                next = QtConcurrent::mapped(rows.mid(first+blockSize,blockSize),encoder);
+
+            bool ok = !cancelled.load();
+            for ( int i=0; i<block.count() && ok; i++ )
+            {
+                if ( block.at(i).isEmpty() )
+                {
+                    fail(MatrixExporter::tr("Cannot read component %1.").arg(rows.at(first+i)));
+                    ok = false;
+                }
+            }
+            if ( ok )
+                ok = writer.write(first,block);
+            if ( !ok )
+            {
+                cancelled.store(1);
+                next.waitForFinished();
+                return false;
+            }
+            emit q->progress(first+block.count());
+        }
+        return true;
+    }
+
+    // Sequential writer for NumPy and raw files
+    struct StreamWriter
+    {
+        StreamWriter(Impl * d, QFile * file) : d(d), file(file) {}
+        bool write(int, const QList<QByteArray> & block)
+        {
+            foreach(const QByteArray & row, block)
+            {
+                if ( file->write(row)!=row.size() )
+                {
+                    d->fail(MatrixExporter::tr("Cannot write file %1.").arg(file->fileName()));
+                    return false;
+                }
+            }
+            return true;
+        }
+        Impl * d;
+        QFile * file;
+    };
+
+    bool writeNpy()
+    {
+        QFile file(fileName);
+        if ( !file.open(QIODevice::WriteOnly|QIODevice::Truncate) )
+        {
+            fail(MatrixExporter::tr("Cannot open %1 for writing.").arg(fileName));
+            return false;
+        }
+        file.write(npyHeader(precision==Single?"<c8":"<c16",QList<qint64>() << rows.count() << outputPositions));
+        StreamWriter writer(this,&file);
+        if ( !pipeline(writer,false) )
+            return false;
+        file.close();
+
+        // Global indices of the rows
+        QFileInfo fi(fileName);
+        QFile index(fi.path()+"/"+fi.completeBaseName()+"_index.npy");
+        if ( !index.open(QIODevice::WriteOnly|QIODevice::Truncate) )
+        {
+            fail(MatrixExporter::tr("Cannot open %1 for writing.").arg(index.fileName()));
+            return false;
+        }
+        index.write(npyHeader("<i4",QList<qint64>() << rows.count()));
+        foreach(int globalIndex, rows)
+        {
+            uchar value[4];
+            qToLittleEndian<qint32>(globalIndex,value);
+            index.write(reinterpret_cast<const char*>(value),4);
+        }
+        return true;
+    }
+
+    bool writeRaw()
+    {
+        QFile file(fileName);
+        if ( !file.open(QIODevice::WriteOnly|QIODevice::Truncate) )
+        {
+            fail(MatrixExporter::tr("Cannot open %1 for writing.").arg(fileName));
+            return false;
+        }
+        StreamWriter writer(this,&file);
+        if ( !pipeline(writer,false) )
+            return false;
+        file.close();
+
+        // Text index describing layout and rows of the data file
+        QFileInfo fi(fileName);
+        QFile index(fi.path()+"/"+fi.completeBaseName()+"_index.txt");
+        if ( !index.open(QIODevice::WriteOnly|QIODevice::Truncate|QIODevice::Text) )
+        {
+            fail(MatrixExporter::tr("Cannot open %1 for writing.").arg(index.fileName()));
+            return false;
+        }
+        QTextStream out(&index);
+        out << "# SFView system matrix, dense row-major, little endian "
+            << (precision==Single ? "complex64" : "complex128") << "\n";
+        out << "# source " << systemMatrix->path() << "\n";
+        out << "# rows " << rows.count() << "\n";
+        out << "# columns " << outputPositions << "\n";
+        out << "# grid";
+        for ( int i=0; i<3; i++ )
+            out << " " << outputGrid[i];
+        out << "\n";
+        if ( resample )
+            out << "# resampled " << Resampler::name(resampler.kernel()) << " fov "
+                << outputFov[0] << " " << outputFov[1] << " " << outputFov[2] << "\n";
+        out << "# backgroundCorrection " << (backgroundCorrection ? 1 : 0) << "\n";
+        if ( filter.type()!=SpatialFilter::None )
+            out << "# spatialFilter " << SpatialFilter::name(filter.type()) << " strength " << filter.strength()
+                << " snrLimit " << filterSnrLimit << "\n";
+        out << "# globalIndex receiver frequencyIndex frequency snr\n";
+        foreach(int globalIndex, rows)
+            out << globalIndex << " " << systemMatrix->receiver(globalIndex) << " "
+                << systemMatrix->frequencyIndex(globalIndex) << " "
+                << systemMatrix->frequency(globalIndex) << " "
+                << systemMatrix->snr(globalIndex) << "\n";
+        out.flush();
+        if ( out.status()!=QTextStream::Ok )
+        {
+            fail(MatrixExporter::tr("Cannot write file %1.").arg(index.fileName()));
+            return false;
+        }
+        return true;
+    }
+
+#ifdef SFVIEW_HAVE_HDF5
+    hid_t file, linkCreation;
+
+    bool writeValues(const char * path, hid_t fileType, hid_t memType, const void * data, const QVector<hsize_t> & dims)
+    {
+        hid_t space = dims.isEmpty() ? H5Screate(H5S_SCALAR) : H5Screate_simple(dims.count(),dims.constData(),0);
+        hid_t dataset = H5Dcreate2(file,path,fileType,space,linkCreation,H5P_DEFAULT,H5P_DEFAULT);
+        herr_t status = -1;
+        if ( dataset>=0 )
+        {
+            status = H5Dwrite(dataset,memType,H5S_ALL,H5S_ALL,H5P_DEFAULT,data);
+            H5Dclose(dataset);
+        }
+        H5Sclose(space);
+        return status>=0;
+    }
+
+    bool writeDoubles(const char * path, const QVector<double> & values, QVector<hsize_t> dims=QVector<hsize_t>())
+    {
+        if ( dims.isEmpty() && values.count()!=1 )
+            dims << values.count();
+        return writeValues(path,H5T_IEEE_F64LE,H5T_NATIVE_DOUBLE,values.constData(),dims);
+    }
+
+    bool writeInts(const char * path, const QVector<qint64> & values, QVector<hsize_t> dims=QVector<hsize_t>())
+    {
+        if ( dims.isEmpty() && values.count()!=1 )
+            dims << values.count();
+        return writeValues(path,H5T_STD_I64LE,H5T_NATIVE_INT64,values.constData(),dims);
+    }
+
+    // Boolean values are stored as 8 bit integers
+    bool writeFlag(const char * path, bool value)
+    {
+        qint8 v = value ? 1 : 0;
+        return writeValues(path,H5T_STD_I8LE,H5T_NATIVE_INT8,&v,QVector<hsize_t>());
+    }
+
+    bool writeString(const char * path, const QString & value)
+    {
+        QByteArray text = value.toUtf8();
+        const char * p = text.constData();
+        hid_t type = H5Tcopy(H5T_C_S1);
+        H5Tset_size(type,H5T_VARIABLE);
+        H5Tset_cset(type,H5T_CSET_UTF8);
+        bool ok = writeValues(path,type,type,&p,QVector<hsize_t>());
+        H5Tclose(type);
+        return ok;
+    }
+
+    struct MdfWriter
+    {
+        MdfWriter(Impl * d, hid_t dataset, hid_t memType, bool direct) :
+            d(d), dataset(dataset), memType(memType), direct(direct) {}
+        bool write(int first, const QList<QByteArray> & block)
+        {
+            hsize_t offset[4] = { 0, 0, 0, 0 };
+            hsize_t count[4] = { 1, 1, 1, static_cast<hsize_t>(d->outputPositions) };
+            // Workers may be reading an MDF source at the same time
+            QMutexLocker lock(MdfStorage::libraryMutex());
+            for ( int i=0; i<block.count(); i++ )
+            {
+                offset[1] = (first+i)/d->frequencies.count();
+                offset[2] = (first+i)%d->frequencies.count();
+                herr_t status = -1;
+#if H5_VERSION_GE(1,10,3)
+                if ( direct )
+                {
+                    // Every chunk holds exactly one component and was compressed by a worker
+                    status = H5Dwrite_chunk(dataset,H5P_DEFAULT,0,offset,block.at(i).size(),block.at(i).constData());
+                }
+                else
+#endif
+                {
+                    hid_t fileSpace = H5Dget_space(dataset);
+                    H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,0,count,0);
+                    hid_t memSpace = H5Screate_simple(1,&count[3],0);
+                    status = H5Dwrite(dataset,memType,memSpace,fileSpace,H5P_DEFAULT,block.at(i).constData());
+                    H5Sclose(memSpace);
+                    H5Sclose(fileSpace);
+                }
+                if ( status<0 )
+                {
+                    d->fail(MatrixExporter::tr("Cannot write file %1.").arg(d->fileName));
+                    return false;
+                }
+            }
+            return true;
+        }
+        Impl * d;
+        hid_t dataset, memType;
+        bool direct;
+    };
+
+    bool writeMetadata()
+    {
+        const SystemMatrix * m = systemMatrix;
+        int receivers = m->numberOfReceivers();
+        bool ok = true;
+        ok &= writeString("/version","2.0");
+        ok &= writeString("/time",QDateTime::currentDateTimeUtc().toString("yyyy-MM-dd'T'HH:mm:ss.zzz"));
+        ok &= writeString("/study/time",m->experimentDate().toString("yyyy-MM-dd'T'HH:mm:ss"));
+        ok &= writeString("/experiment/name",m->experimentName());
+        ok &= writeString("/scanner/facility",m->institution());
+        ok &= writeString("/scanner/name",m->systemName());
+        ok &= writeString("/scanner/manufacturer",m->manufacturer());
+        ok &= writeString("/tracer/name",m->tracerName());
+        // MDF uses SI units
+        ok &= writeDoubles("/tracer/concentration",QVector<double>() << m->tracerConcentration());
+        ok &= writeDoubles("/tracer/volume",QVector<double>() << 1e-6*m->tracerVolume());
+
+        ok &= writeInts("/acquisition/numAverages",QVector<qint64>() << m->averages());
+        ok &= writeInts("/acquisition/receiver/numChannels",QVector<qint64>() << receivers);
+        ok &= writeInts("/acquisition/receiver/numSamplingPoints",QVector<qint64>() << 2*(m->numberOfFrequencies()-1));
+        ok &= writeDoubles("/acquisition/receiver/bandwidth",QVector<double>() << m->bandwidth());
+        QVector<double> strength;
+        for ( int i=0; i<3; i++ )
+            strength << 1e-3*m->driveField(i);
+        ok &= writeDoubles("/acquisition/drivefield/strength",strength,QVector<hsize_t>() << 1 << 3 << 1);
+        double g = m->selectionField();
+        QVector<double> gradient(9,0.0);
+        gradient[0] = gradient[4] = -0.5*g;
+        gradient[8] = g;
+        ok &= writeDoubles("/acquisition/gradient",gradient,QVector<hsize_t>() << 1 << 3 << 3);
+
+        QVector<qint64> size;
+        QVector<double> fov;
+        for ( int i=0; i<3; i++ )
+        {
+            size << outputGrid[i];
+            fov << 1e-3*outputFov[i];
+        }
+        ok &= writeInts("/calibration/size",size);
+        ok &= writeDoubles("/calibration/fieldOfView",fov);
+        QVector<double> snr;
+        foreach(int globalIndex, rows)
+            snr << m->snr(globalIndex);
+        ok &= writeDoubles("/calibration/snr",snr,QVector<hsize_t>() << 1 << receivers << frequencies.count());
+
+        ok &= writeFlag("/measurement/isFourierTransformed",true);
+        ok &= writeFlag("/measurement/isTransposed",true);
+        ok &= writeFlag("/measurement/isBackgroundCorrected",backgroundCorrection);
+        ok &= writeFlag("/measurement/isFrequencySelection",frequencies.count()<m->numberOfFrequencies());
+        // Frequency indices are one-based, as written by the reference implementation
+        QVector<qint64> selection;
+        foreach(int k, frequencies)
+            selection << k+1;
+        ok &= writeInts("/measurement/frequencySelection",selection);
+        QVector<qint8> background(outputPositions,0);
+        ok &= writeValues("/measurement/isBackgroundFrame",H5T_STD_I8LE,H5T_NATIVE_INT8,background.constData(),QVector<hsize_t>() << outputPositions);
+        return ok;
+    }
+
+    bool writeMdf()
+    {
+        QMutexLocker lock(MdfStorage::libraryMutex());
+        H5Eset_auto2(H5E_DEFAULT,0,0);
+        file = H5Fcreate(QFile::encodeName(fileName).constData(),H5F_ACC_TRUNC,H5P_DEFAULT,H5P_DEFAULT);
+        if ( file<0 )
+        {
+            fail(MatrixExporter::tr("Cannot open %1 for writing.").arg(fileName));
+            return false;
+        }
+        linkCreation = H5Pcreate(H5P_LINK_CREATE);
+        H5Pset_create_intermediate_group(linkCreation,1);
+
+        bool ok = writeMetadata();
+
+        // Complex values as compound of r and i, one component per chunk
+        size_t valueSize = precision==Single ? sizeof(float) : sizeof(double);
+        hid_t fileType = H5Tcreate(H5T_COMPOUND,2*valueSize);
+        H5Tinsert(fileType,"r",0,precision==Single?H5T_IEEE_F32LE:H5T_IEEE_F64LE);
+        H5Tinsert(fileType,"i",valueSize,precision==Single?H5T_IEEE_F32LE:H5T_IEEE_F64LE);
+        hid_t memType = H5Tcreate(H5T_COMPOUND,2*valueSize);
+        H5Tinsert(memType,"r",0,precision==Single?H5T_NATIVE_FLOAT:H5T_NATIVE_DOUBLE);
+        H5Tinsert(memType,"i",valueSize,precision==Single?H5T_NATIVE_FLOAT:H5T_NATIVE_DOUBLE);
+
+        hsize_t dims[4] = { 1, static_cast<hsize_t>(systemMatrix->numberOfReceivers()),
+                            static_cast<hsize_t>(frequencies.count()), static_cast<hsize_t>(outputPositions) };
+        hsize_t chunk[4] = { 1, 1, 1, static_cast<hsize_t>(outputPositions) };
+        hid_t space = H5Screate_simple(4,dims,0);
+        hid_t creation = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(creation,4,chunk);
+        if ( compressionLevel>0 )
+            H5Pset_deflate(creation,compressionLevel);
+        hid_t dataset = H5Dcreate2(file,"/measurement/data",fileType,space,linkCreation,creation,H5P_DEFAULT);
+        H5Pclose(creation);
+        H5Sclose(space);
+
+        if ( !ok || dataset<0 )
+            fail(MatrixExporter::tr("Cannot write file %1.").arg(fileName));
+        else
+        {
+            // Compress chunks in parallel and bypass the serial HDF5 filter pipeline if possible
+#if H5_VERSION_GE(1,10,3)
+            bool direct = compressionLevel>0;
+#else
+            bool direct = false;
+#endif
+            MdfWriter writer(this,dataset,memType,direct);
+            lock.unlock();
+            ok = pipeline(writer,direct);
+            lock.relock();
+        }
+
+        if ( dataset>=0 )
+            H5Dclose(dataset);
+        H5Tclose(memType);
+        H5Tclose(fileType);
+        H5Pclose(linkCreation);
+        if ( H5Fclose(file)<0 )
+            ok = false;
+        return ok && error.isEmpty();
+    }
+#endif
+
+    bool run()
+    {
+#ifdef SFVIEW_HAVE_HDF5
+        if ( format==Mdf )
+            return writeMdf();
+#endif
+        if ( format==Raw )
+            return writeRaw();
+        return writeNpy();
+    }
+};
+
+QByteArray MatrixExporter::Impl::Encoder::operator()(int globalIndex) const
+{
+    QByteArray result;
+    if ( d->cancelled.load() )
+        return result;
+    // Resampling reads mapped components directly and applies the calibration afterwards
+    bool filter = d->filterNoise.value(globalIndex,-1.0)>=0.0;
+    const SystemMatrix::complex * source = 0;
+    SystemMatrix::complex factor = 1.0;
+    if ( d->resample && !filter )
+    {
+        source = d->systemMatrix->mappedData(globalIndex,d->backgroundCorrection);
+        if ( source )
+            factor = d->systemMatrix->calibrationFactor(globalIndex);
+    }
+    QVector<SystemMatrix::complex> data;
+    if ( source==0 )
+    {
+        data.resize(d->positions);
+        if ( !d->systemMatrix->readBlock(globalIndex,d->backgroundCorrection,data.data()) )
+            return result;
+        if ( filter )
+            d->filter.apply(data.data(),d->filterNoise.at(globalIndex));
+        source = data.constData();
+    }
+    if ( d->resample )
+    {
+        QVector<SystemMatrix::complex> resampled(d->outputPositions);
+        d->resampler.apply(source,resampled.data());
+        if ( factor!=1.0 )
+            for ( int i=0; i<d->outputPositions; i++ )
+                resampled[i] *= factor;
+        data = resampled;
+        source = data.constData();
+    }
+
+    // Little endian, real and imaginary part interleaved
+    if ( d->precision==Single )
+    {
+        result.resize(d->outputPositions*2*sizeof(float));
+        uchar * p = reinterpret_cast<uchar*>(result.data());
+        for ( int i=0; i<d->outputPositions; i++ )
+        {
+            float v[2] = { static_cast<float>(source[i].real()), static_cast<float>(source[i].imag()) };
+            quint32 bits[2];
+            memcpy(bits,v,sizeof(v));
+            qToLittleEndian<quint32>(bits[0],p);
+            qToLittleEndian<quint32>(bits[1],p+4);
+            p += 8;
+        }
+    }
+    else
+    {
+        result.resize(d->outputPositions*sizeof(SystemMatrix::complex));
+        uchar * p = reinterpret_cast<uchar*>(result.data());
+        for ( int i=0; i<d->outputPositions; i++ )
+        {
+            double v[2] = { source[i].real(), source[i].imag() };
+            quint64 bits[2];
+            memcpy(bits,v,sizeof(v));
+            qToLittleEndian<quint64>(bits[0],p);
+            qToLittleEndian<quint64>(bits[1],p+8);
+            p += 16;
+        }
+    }
+
+    // qCompress prepends the uncompressed size to the zlib stream expected by the deflate filter
+    if ( compress )
+        result = qCompress(result,d->compressionLevel).mid(4);
+    return result;
+}
+
+MatrixExporter::MatrixExporter(QObject * parent) : QObject(parent), d(new Impl)
+{
+    QSettings settings;
+    d->q = this;
+    d->format = Npy;
+    d->precision = Single;
+    d->backgroundCorrection = true;
+    d->minimumSnr = 0.0;
+    d->rowOrder = FrequencyOrder;
+    d->filterSnrLimit = 0.0;
+    d->resample = false;
+    d->outputPositions = 0;
+    d->compressionLevel = qBound(0,settings.value("matrixExportCompression",4).toInt(),9);
+    d->positions = 0;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishExport()));
+}
+
+MatrixExporter::~MatrixExporter()
+{
+    cancel();
+    d->watcher.waitForFinished();
+    delete d;
+}
+
+bool MatrixExporter::isFormatSupported(Format format)
+{
+#ifdef SFVIEW_HAVE_HDF5
+    Q_UNUSED(format)
+    return true;
+#else
+    return format!=Mdf;
+#endif
+}
+
+void MatrixExporter::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+}
+
+void MatrixExporter::setFormat(Format format)
+{
+    d->format = format;
+}
+
+void MatrixExporter::setPrecision(Precision precision)
+{
+    d->precision = precision;
+}
+
+void MatrixExporter::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void MatrixExporter::setMinimumSnr(double snr)
+{
+    d->minimumSnr = snr;
+}
+
+void MatrixExporter::setRowOrder(RowOrder order)
+{
+    d->rowOrder = order;
+}
+
+void MatrixExporter::setSpatialFilter(SpatialFilter::Type type, double strength)
+{
+    d->filter.setType(type);
+    d->filter.setStrength(strength);
+}
+
+void MatrixExporter::setFilterSnrLimit(double snr)
+{
+    d->filterSnrLimit = snr;
+}
+
+void MatrixExporter::setTargetGrid(const int grid[3], const double fov[3], Resampler::Kernel kernel)
+{
+    d->resample = grid[0]>0 && grid[1]>0 && grid[2]>0;
+    for ( int i=0; i<3; i++ )
+    {
+        d->outputGrid[i] = grid[i];
+        d->outputFov[i] = fov[i];
+    }
+    d->resampler.setKernel(kernel);
+}
+
+void MatrixExporter::setFileName(const QString & fileName)
+{
+    d->fileName = fileName;
+}
+
+bool MatrixExporter::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QString MatrixExporter::errorString() const
+{
+    QMutexLocker lock(&d->mutex);
+    return d->error;
+}
+
+int MatrixExporter::rowCount() const
+{
+    return d->rows.count();
+}
+
+bool MatrixExporter::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    if ( !isFormatSupported(d->format) )
+    {
+        d->error = tr("This program was built without support for MDF files.");
+        return false;
+    }
+
+    d->positions = 1;
+    for ( int i=0; i<3; i++ )
+        d->positions *= d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+    d->selectRows();
+
+    int grid[3];
+    double fov[3];
+    for ( int i=0; i<3; i++ )
+    {
+        grid[i] = d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+        fov[i] = d->systemMatrix->spatialExtent(static_cast<Qt::Axis>(i));
+        if ( !d->resample )
+        {
+            d->outputGrid[i] = grid[i];
+            d->outputFov[i] = fov[i];
+        }
+    }
+    d->outputPositions = d->positions;
+    if ( d->resample )
+    {
+        d->resampler.setSource(grid,fov);
+        d->resampler.setTarget(d->outputGrid,d->outputFov);
+        d->outputPositions = d->resampler.targetPositions();
+    }
+    if ( d->rows.isEmpty() )
+    {
+        d->error = tr("No component exceeds the SNR threshold.");
+        return false;
+    }
+
+    // Noise levels are collected once here instead of in the worker threads. The filter works on the
+    // calibrated data of readBlock(), so the raw background noise is scaled by the calibration.
+    d->filterNoise.clear();
+    if ( d->filter.type()!=SpatialFilter::None )
+    {
+        d->filter.setGrid(d->systemMatrix->dimension(Qt::XAxis),d->systemMatrix->dimension(Qt::YAxis),d->systemMatrix->dimension(Qt::ZAxis));
+        d->filterNoise.fill(-1.0,d->systemMatrix->maxGlobalIndex()+1);
+        foreach(int globalIndex, d->rows)
+            if ( d->filterSnrLimit<=0.0 || d->systemMatrix->snr(globalIndex)<d->filterSnrLimit )
+                d->filterNoise[globalIndex] = std::sqrt(d->systemMatrix->backgroundVariance(globalIndex))
+                        *std::abs(d->systemMatrix->calibrationFactor(globalIndex));
+    }
+
+    d->cancelled.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void MatrixExporter::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void MatrixExporter::finishExport()
+{
+    bool success = d->watcher.result() && d->cancelled.load()==0;
+    if ( !success )
+        QFile::remove(d->fileName);
+    emit finished(success);
+}
@@ -0,0 +1,109 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef MATRIXEXPORTER_H
+#define MATRIXEXPORTER_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+#include <QtCore/QString>
+
+// Local includes
+#include "Resampler.h"
+#include "SpatialFilter.h"
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The MatrixExporter class writes the calibrated system matrix to a file in the
+ *        background. Components are read, converted and compressed block-wise by a thread pool
+ *        while the previous block is written, so memory use does not depend on the matrix size.
+ *        Raw files hold the dense row-major matrix without header, described by a text index.
+ */
+class MatrixExporter : public QObject
+{
+    Q_OBJECT
+public:
+    enum Format { Mdf, Npy, Raw };
+    enum Precision { Single, Double };
+    /**
+     * @brief The RowOrder enum selects which components are exported.
+     *        FrequencyOrder exports all receivers of every frequency above the SNR threshold,
+     *        SnrOrder only the components above the threshold, sorted by decreasing SNR.
+     *        MDF files always use FrequencyOrder.
+     */
+    enum RowOrder { FrequencyOrder, SnrOrder };
+    explicit MatrixExporter(QObject * parent=0);
+    virtual ~MatrixExporter();
+    /**
+     * @brief isFormatSupported MDF output requires HDF5 support at build time
+     */
+    static bool isFormatSupported(Format format);
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setFormat(Format format);
+    void setPrecision(Precision precision);
+    void setBackgroundCorrection(bool);
+    /**
+     * @brief setMinimumSnr Only export components reaching the given SNR, with FrequencyOrder
+     *                     all receivers of a frequency where at least one receiver reaches it
+     */
+    void setMinimumSnr(double snr);
+    void setRowOrder(RowOrder order);
+    /**
+     * @brief setSpatialFilter Denoise components before they are written
+     */
+    void setSpatialFilter(SpatialFilter::Type type, double strength);
+    /**
+     * @brief setFilterSnrLimit Only filter components below the given SNR, 0 filters all
+     */
+    void setFilterSnrLimit(double snr);
+    /**
+     * @brief setTargetGrid Resample components onto another grid, fov in mm like SystemMatrix::spatialExtent().
+     *                      A grid with a zero dimension writes the original grid.
+     */
+    void setTargetGrid(const int grid[3], const double fov[3], Resampler::Kernel kernel);
+    void setFileName(const QString & fileName);
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief rowCount Number of components written by the current export
+     */
+    int rowCount() const;
+    bool start();
+public slots:
+    void cancel();
+signals:
+    /**
+     * @brief progress Emitted after a block of components was written
+     * @param rows     Number of components written so far
+     */
+    void progress(int rows);
+    void finished(bool success);
+private slots:
+    void finishExport();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // MATRIXEXPORTER_H
@@ -0,0 +1,456 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <cstring>
+
+// HDF5 includes
+#include <hdf5.h>
+
+// Qt includes
+#include <QtCore/QBitArray>
+#include <QtCore/QCache>
+#include <QtCore/QFile>
+#include <QtCore/QMutex>
+#include <QtCore/QSettings>
+#include <QtCore/QStringList>
+
+// Local includes
+#include "MdfStorage.h"
+
+// Number of hash slots of the HDF5 chunk cache, should be a prime number
+static const size_t chunkCacheSlots = 12421;
+
+struct MdfStorage::Impl
+{
+    Impl() : file(-1), data(-1), complexType(-1) {}
+    hid_t file, data, complexType;
+    bool transposed;
+    int numChannels, numFrequencies, numFrames;
+    int grid[3];
+    QVector<int> foregroundFrames, backgroundFrames;
+
+    typedef QCache<int,QVector<complex> > ComponentCache;
+    ComponentCache cache;
+    QVector<complex> backgroundMean;
+    QVector<double> backgroundVariance;
+    QBitArray backgroundKnown;
+
+    hid_t openDataset(const QString & path) const
+    {
+        // H5Dopen fails loudly on missing intermediate groups, therefore check level by level
+        QStringList parts = path.split('/',QString::SkipEmptyParts);
+        QByteArray current;
+        foreach(const QString & part, parts)
+        {
+            current += "/" + part.toUtf8();
+            if ( H5Lexists(file,current.constData(),H5P_DEFAULT)<=0 )
+                return -1;
+        }
+        return H5Dopen2(file,current.constData(),H5P_DEFAULT);
+    }
+
+    // Read a boolean array, MDF stores them as 8 bit enums or integers
+    QVector<bool> flags(const QString & path) const
+    {
+        QVector<bool> result;
+        hid_t dataset = openDataset(path);
+        if ( dataset<0 )
+            return result;
+        hid_t space = H5Dget_space(dataset);
+        hssize_t n = H5Sget_simple_extent_npoints(space);
+        hid_t fileType = H5Dget_type(dataset);
+        hid_t memType = H5Tget_native_type(fileType,H5T_DIR_ASCEND);
+        if ( n>0 && H5Tget_size(memType)==1 )
+        {
+            QVector<unsigned char> raw(n);
+            if ( H5Dread(dataset,memType,H5S_ALL,H5S_ALL,H5P_DEFAULT,raw.data())>=0 )
+            {
+                result.resize(n);
+                for ( int i=0; i<n; i++ )
+                    result[i] = raw.at(i)!=0;
+            }
+        }
+        else if ( n>0 )
+        {
+            QVector<int> raw(n);
+            if ( H5Dread(dataset,H5T_NATIVE_INT,H5S_ALL,H5S_ALL,H5P_DEFAULT,raw.data())>=0 )
+            {
+                result.resize(n);
+                for ( int i=0; i<n; i++ )
+                    result[i] = raw.at(i)!=0;
+            }
+        }
+        H5Tclose(memType);
+        H5Tclose(fileType);
+        H5Sclose(space);
+        H5Dclose(dataset);
+        return result;
+    }
+
+    // Read all frames of a component including background frames, library mutex must be locked
+    bool readFrames(int globalIndex, QVector<complex> & frames)
+    {
+        int channel = globalIndex/numFrequencies;
+        int frequency = globalIndex%numFrequencies;
+        // Transposed data is stored as [J][C][K][N], otherwise as [N][J][C][K]
+        hsize_t start[4], count[4];
+        if ( transposed )
+        {
+            start[0]=0; start[1]=channel; start[2]=frequency; start[3]=0;
+            count[0]=1; count[1]=1; count[2]=1; count[3]=numFrames;
+        }
+        else
+        {
+            start[0]=0; start[1]=0; start[2]=channel; start[3]=frequency;
+            count[0]=numFrames; count[1]=1; count[2]=1; count[3]=1;
+        }
+        frames.resize(numFrames);
+        hid_t fileSpace = H5Dget_space(data);
+        H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,start,0,count,0);
+        hsize_t n = numFrames;
+        hid_t memSpace = H5Screate_simple(1,&n,0);
+        herr_t status = H5Dread(data,complexType,memSpace,fileSpace,H5P_DEFAULT,frames.data());
+        H5Sclose(memSpace);
+        H5Sclose(fileSpace);
+        return status>=0;
+    }
+
+    void updateBackground(int globalIndex, const QVector<complex> & frames)
+    {
+        if ( backgroundKnown.testBit(globalIndex) )
+            return;
+        complex mean = 0.0;
+        double variance = 0.0;
+        if ( !backgroundFrames.isEmpty() )
+        {
+            foreach(int frame, backgroundFrames)
+                mean += frames.at(frame);
+            mean /= backgroundFrames.count();
+            foreach(int frame, backgroundFrames)
+                variance += std::norm(frames.at(frame)-mean);
+            variance /= backgroundFrames.count();
+        }
+        backgroundMean[globalIndex] = mean;
+        backgroundVariance[globalIndex] = variance;
+        backgroundKnown.setBit(globalIndex);
+    }
+
+    // Background statistics without caching the component, so that it may be called from any thread.
+    // Library mutex must be locked.
+    bool ensureBackground(int globalIndex)
+    {
+        if ( backgroundKnown.testBit(globalIndex) )
+            return true;
+        QVector<complex> frames;
+        if ( !readFrames(globalIndex,frames) )
+            return false;
+        updateBackground(globalIndex,frames);
+        return true;
+    }
+
+    // Cached component data, library mutex must be locked
+    const QVector<complex> * load(int globalIndex, bool backgroundCorrection)
+    {
+        // Offset by one, so that both variants of component 0 get distinct keys
+        int key = backgroundCorrection ? -1-globalIndex : globalIndex;
+        if ( cache.contains(key) )
+            return cache.object(key);
+
+        QVector<complex> frames;
+        if ( !readFrames(globalIndex,frames) )
+            return 0;
+        updateBackground(globalIndex,frames);
+
+        // Both variants are cheap once the frames are read
+        QVector<complex> * uncorrected = new QVector<complex>(foregroundFrames.count());
+        QVector<complex> * corrected = new QVector<complex>(foregroundFrames.count());
+        complex mean = backgroundMean.at(globalIndex);
+        for ( int i=0; i<foregroundFrames.count(); i++ )
+        {
+            (*uncorrected)[i] = frames.at(foregroundFrames.at(i));
+            (*corrected)[i] = frames.at(foregroundFrames.at(i))-mean;
+        }
+        cache.insert(globalIndex,uncorrected);
+        cache.insert(-1-globalIndex,corrected);
+        return cache.object(key);
+    }
+};
+
+MdfStorage::MdfStorage(const QString & fileName) : d(new Impl)
+{
+    QSettings settings;
+    // Loading a component always caches both variants
+    d->cache.setMaxCost(qMax(2,settings.value("mdfComponentCache",64).toInt()));
+
+    // Errors are reported through return values
+    H5Eset_auto2(H5E_DEFAULT,0,0);
+
+    d->file = H5Fopen(QFile::encodeName(fileName).constData(),H5F_ACC_RDONLY,H5P_DEFAULT);
+    if ( d->file<0 )
+    {
+        setError(tr("Cannot open file %1.").arg(fileName));
+        return;
+    }
+
+    QVector<bool> isFourierTransformed = d->flags("/measurement/isFourierTransformed");
+    if ( isFourierTransformed.isEmpty() || !isFourierTransformed.first() )
+    {
+        setError(tr("%1 does not contain a system matrix in frequency space.").arg(fileName));
+        return;
+    }
+    QVector<bool> isTransposed = d->flags("/measurement/isTransposed");
+    d->transposed = !isTransposed.isEmpty() && isTransposed.first();
+
+    QVector<double> size = values("/calibration/size");
+    if ( size.count()!=3 )
+    {
+        setError(tr("%1 does not contain calibration data.").arg(fileName));
+        return;
+    }
+    int positions = 1;
+    for ( int i=0; i<3; i++ )
+    {
+        d->grid[i] = static_cast<int>(size.at(i));
+        positions *= d->grid[i];
+    }
+
+    // Large chunk cache, data is read-only
+    hid_t access = H5Pcreate(H5P_DATASET_ACCESS);
+    size_t cacheBytes = static_cast<size_t>(settings.value("mdfChunkCacheMB",64).toInt())<<20;
+    H5Pset_chunk_cache(access,chunkCacheSlots,cacheBytes,1.0);
+    if ( contains("/measurement/data") )
+        d->data = H5Dopen2(d->file,"/measurement/data",access);
+    H5Pclose(access);
+    if ( d->data<0 )
+    {
+        setError(tr("Cannot read measurement data from %1.").arg(fileName));
+        return;
+    }
+
+    hid_t space = H5Dget_space(d->data);
+    hsize_t dims[4];
+    int rank = H5Sget_simple_extent_ndims(space);
+    if ( rank==4 )
+        H5Sget_simple_extent_dims(space,dims,0);
+    H5Sclose(space);
+    hid_t type = H5Dget_type(d->data);
+    bool compound = H5Tget_class(type)==H5T_COMPOUND;
+    H5Tclose(type);
+    if ( rank!=4 || !compound )
+    {
+        setError(tr("Unsupported layout of measurement data in %1.").arg(fileName));
+        return;
+    }
+    if ( d->transposed )
+    {
+        d->numChannels = dims[1];
+        d->numFrequencies = dims[2];
+        d->numFrames = dims[3];
+    }
+    else
+    {
+        d->numFrames = dims[0];
+        d->numChannels = dims[2];
+        d->numFrequencies = dims[3];
+    }
+
+    // Complex values are stored as compound of r and i, HDF5 converts float to double
+    d->complexType = H5Tcreate(H5T_COMPOUND,sizeof(complex));
+    H5Tinsert(d->complexType,"r",0,H5T_NATIVE_DOUBLE);
+    H5Tinsert(d->complexType,"i",sizeof(double),H5T_NATIVE_DOUBLE);
+
+    QVector<bool> isBackground = d->flags("/measurement/isBackgroundFrame");
+    for ( int i=0; i<d->numFrames; i++ )
+    {
+        if ( i<isBackground.count() && isBackground.at(i) )
+            d->backgroundFrames.append(i);
+        else
+            d->foregroundFrames.append(i);
+    }
+    if ( d->foregroundFrames.count()!=positions )
+    {
+        setError(tr("Number of calibration positions in %1 does not match the grid size.").arg(fileName));
+        return;
+    }
+
+    setComponentSize(positions);
+    setNumberOfComponents(d->numChannels*d->numFrequencies);
+    d->backgroundMean.resize(numberOfComponents());
+    d->backgroundVariance.resize(numberOfComponents());
+    d->backgroundKnown.resize(numberOfComponents());
+}
+
+MdfStorage::~MdfStorage()
+{
+    if ( d->complexType>=0 )
+        H5Tclose(d->complexType);
+    if ( d->data>=0 )
+        H5Dclose(d->data);
+    if ( d->file>=0 )
+        H5Fclose(d->file);
+    delete d;
+}
+
+int MdfStorage::numberOfReceivers() const
+{
+    return d->numChannels;
+}
+
+int MdfStorage::numberOfFrequencies() const
+{
+    return d->numFrequencies;
+}
+
+int MdfStorage::dimension(int axis) const
+{
+    if ( axis<0 || axis>=3 )
+        return 1;
+    return d->grid[axis];
+}
+
+bool MdfStorage::contains(const QString & path) const
+{
+    hid_t dataset = d->openDataset(path);
+    if ( dataset<0 )
+        return false;
+    H5Dclose(dataset);
+    return true;
+}
+
+QVector<double> MdfStorage::values(const QString & path) const
+{
+    QVector<double> result;
+    hid_t dataset = d->openDataset(path);
+    if ( dataset<0 )
+        return result;
+    hid_t space = H5Dget_space(dataset);
+    hssize_t n = H5Sget_simple_extent_npoints(space);
+    if ( n>0 )
+    {
+        result.resize(n);
+        if ( H5Dread(dataset,H5T_NATIVE_DOUBLE,H5S_ALL,H5S_ALL,H5P_DEFAULT,result.data())<0 )
+            result.clear();
+    }
+    H5Sclose(space);
+    H5Dclose(dataset);
+    return result;
+}
+
+double MdfStorage::value(const QString & path, double defaultValue) const
+{
+    QVector<double> v = values(path);
+    if ( v.isEmpty() )
+        return defaultValue;
+    return v.first();
+}
+
+QString MdfStorage::stringValue(const QString & path) const
+{
+    QString result;
+    hid_t dataset = d->openDataset(path);
+    if ( dataset<0 )
+        return result;
+    hid_t type = H5Dget_type(dataset);
+    if ( H5Tget_class(type)==H5T_STRING )
+    {
+        if ( H5Tis_variable_str(type)>0 )
+        {
+            char * text = 0;
+            hid_t memType = H5Tcopy(H5T_C_S1);
+            H5Tset_size(memType,H5T_VARIABLE);
+            H5Tset_cset(memType,H5Tget_cset(type));
+            if ( H5Dread(dataset,memType,H5S_ALL,H5S_ALL,H5P_DEFAULT,&text)>=0 && text )
+            {
+                result = QString::fromUtf8(text);
+                H5free_memory(text);
+            }
+            H5Tclose(memType);
+        }
+        else
+        {
+            QByteArray text(static_cast<int>(H5Tget_size(type)),'\0');
+            if ( H5Dread(dataset,type,H5S_ALL,H5S_ALL,H5P_DEFAULT,text.data())>=0 )
+                result = QString::fromUtf8(text.constData());
+        }
+    }
+    H5Tclose(type);
+    H5Dclose(dataset);
+    return result.trimmed();
+}
+
+QMutex * MdfStorage::libraryMutex()
+{
+    static QMutex mutex;
+    return &mutex;
+}
+
+const SystemMatrixStorage::complex * MdfStorage::component(int globalIndex, bool backgroundCorrection)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() )
+        return 0;
+    QMutexLocker lock(libraryMutex());
+    const QVector<complex> * v = d->load(globalIndex,backgroundCorrection);
+    return v ? v->constData() : 0;
+}
+
+bool MdfStorage::readComponent(int globalIndex, bool backgroundCorrection, complex * buffer)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() || buffer==0 )
+        return false;
+    QMutexLocker lock(libraryMutex());
+    // Worker threads must not insert into the cache, that could delete data handed out by component()
+    int key = backgroundCorrection ? -1-globalIndex : globalIndex;
+    if ( d->cache.contains(key) )
+    {
+        const QVector<complex> * v = d->cache.object(key);
+        memcpy(buffer,v->constData(),v->count()*sizeof(complex));
+        return true;
+    }
+    QVector<complex> frames;
+    if ( !d->readFrames(globalIndex,frames) )
+        return false;
+    d->updateBackground(globalIndex,frames);
+    complex mean = backgroundCorrection ? d->backgroundMean.at(globalIndex) : complex(0.0);
+    for ( int i=0; i<d->foregroundFrames.count(); i++ )
+        buffer[i] = frames.at(d->foregroundFrames.at(i))-mean;
+    return true;
+}
+
+SystemMatrixStorage::complex MdfStorage::background(int globalIndex)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() )
+        return complex(0.0);
+    QMutexLocker lock(libraryMutex());
+    if ( !d->ensureBackground(globalIndex) )
+        return complex(0.0);
+    return d->backgroundMean.at(globalIndex);
+}
+
+double MdfStorage::backgroundVariance(int globalIndex)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() )
+        return 0.0;
+    QMutexLocker lock(libraryMutex());
+    if ( !d->ensureBackground(globalIndex) )
+        return 0.0;
+    return d->backgroundVariance.at(globalIndex);
+}
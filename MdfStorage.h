@@ -0,0 +1,75 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef MDFSTORAGE_H
+#define MDFSTORAGE_H
+
+// Qt includes
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+// Local includes
+#include "SystemMatrixStorage.h"
+
+// Forward declarations
+class QMutex;
+
+/**
+ * @brief The MdfStorage class reads system matrices from MDF (MPI data format) HDF5 files.
+ *        Components are read on demand as hyperslabs of /measurement/data and kept in a
+ *        cache, background frames give the background reference and variance.
+ *        The storage is read-only.
+ */
+class MdfStorage : public SystemMatrixStorage
+{
+public:
+    explicit MdfStorage(const QString & fileName);
+    virtual ~MdfStorage();
+    int numberOfReceivers() const;
+    int numberOfFrequencies() const;
+    int dimension(int axis) const;
+    /**
+     * @brief contains Check whether a dataset exists
+     * @param path     Absolute path of the dataset, e.g. "/acquisition/gradient"
+     */
+    bool contains(const QString & path) const;
+    /**
+     * @brief values Read a numeric dataset of arbitrary shape converted to double.
+     *               Returns an empty vector if the dataset does not exist.
+     */
+    QVector<double> values(const QString & path) const;
+    double value(const QString & path, double defaultValue=0.0) const;
+    QString stringValue(const QString & path) const;
+    /**
+     * @brief libraryMutex HDF5 is usually not built thread safe, all accesses from
+     *        more than one thread have to be serialized with this mutex
+     */
+    static QMutex * libraryMutex();
+    virtual const complex * component(int globalIndex, bool backgroundCorrection);
+    virtual bool readComponent(int globalIndex, bool backgroundCorrection, complex * buffer);
+    virtual complex background(int globalIndex);
+    virtual double backgroundVariance(int globalIndex);
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // MDFSTORAGE_H
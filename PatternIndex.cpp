@@ -0,0 +1,513 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDataStream>
+#include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QPointer>
+#include <QtCore/QVector>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "PatternIndex.h"
+#include "SidecarFile.h"
+#include "SystemMatrix.h"
+#include "VectorMath.h"
+
+typedef std::complex<double> complex;
+
+// Complex dimensions of a projection, components per task and voxels per chunk
+static const int dimensions = 64;
+static const int componentsPerTask = 8;
+static const int voxelsPerChunk = 512;
+// Candidates of the projected search ranked with their exact correlation, per requested result
+static const int refinementFactor = 4;
+static const quint32 defaultSeed = 0x2014u;
+static const char fileMagic[] = "SFPIDX01";
+
+// sum(r[j]*a[j]) over j in [0,n) with a real vector r
+static complex realDot(const float * r, const complex * a, int n)
+{
+#ifdef SFVIEW_USE_SSE2
+    const double * p = reinterpret_cast<const double*>(a);
+    __m128d sum = _mm_setzero_pd();
+    for ( int j=0; j<n; j++ )
+        sum = _mm_add_pd(sum,_mm_mul_pd(_mm_loadu_pd(p+2*j),_mm_set1_pd(r[j])));
+    double s[2];
+    _mm_storeu_pd(s,sum);
+    return complex(s[0],s[1]);
+#else
+    complex sum = 0.0;
+    for ( int j=0; j<n; j++ )
+        sum += static_cast<double>(r[j])*a[j];
+    return sum;
+#endif
+}
+
+struct PatternIndex::Impl
+{
+    struct Task
+    {
+        int first, count;  // Range in pending
+    };
+
+    // Projects a few components in a worker thread
+    struct Project
+    {
+        explicit Project(Impl * d) : d(d) {}
+        void operator()(const Task & task) const;
+        Impl * d;
+    };
+
+    // Replaces the projected score of a candidate by its exact correlation
+    struct Refine
+    {
+        Refine(Impl * d, const complex * query, double norm) : d(d), query(query), norm(norm) {}
+        void operator()(Similarity & candidate) const;
+        Impl * d;
+        const complex * query;
+        double norm;
+    };
+
+    PatternIndex * q;
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    int positions;
+
+    // Random +-1 projection, dimensions rows of positions values
+    quint32 seed;
+    QVector<float> projection;
+
+    // Current computation, target receives 2*dimensions floats per global index
+    QVector<int> pending;
+    QVector<Task> tasks;
+    QVector<float> computed;
+    float * target;
+    bool targetCorrection;
+    QList<int> changedWhileRunning;
+
+    // Result, unit length projections of all components
+    QVector<float> projections;
+    bool resultBackgroundCorrection;
+
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+    // Global index+1 of the first component that could not be read, 0 if none
+    QAtomicInt failed;
+    QString error;
+
+    int matrixPositions() const
+    {
+        int n = 1;
+        for ( int i=0; i<3; i++ )
+            n *= systemMatrix->dimension(static_cast<Qt::Axis>(i));
+        return n;
+    }
+
+    // xorshift generator, the projection only depends on the seed and is reproduced after loading
+    void setupProjection(quint32 newSeed, int newPositions)
+    {
+        if ( seed==newSeed && positions==newPositions && !projection.isEmpty() )
+            return;
+        seed = newSeed;
+        positions = newPositions;
+        projection.resize(dimensions*positions);
+        quint32 state = seed ? seed : defaultSeed;
+        for ( int i=0; i<projection.count(); i++ )
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            projection[i] = (state & 0x80000000u) ? 1.0f : -1.0f;
+        }
+    }
+
+    void setupTasks(const QVector<int> & globalIndices)
+    {
+        pending = globalIndices;
+        tasks.clear();
+        for ( int first=0; first<pending.count(); first+=componentsPerTask )
+        {
+            Task task;
+            task.first = first;
+            task.count = qMin(componentsPerTask,pending.count()-first);
+            tasks.append(task);
+        }
+    }
+
+    void run()
+    {
+        QtConcurrent::blockingMap(tasks,Project(this));
+    }
+
+    // Sets the error if a component could not be read
+    bool readFailed()
+    {
+        int globalIndex = failed.load()-1;
+        if ( globalIndex<0 )
+            return false;
+        error = PatternIndex::tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+        return true;
+    }
+};
+
+void PatternIndex::Impl::Project::operator()(const Task & task) const
+{
+    if ( d->cancelled.load() )
+        return;
+    const complex * data[componentsPerTask];
+    QVector<complex> copies[componentsPerTask];
+    for ( int c=0; c<task.count; c++ )
+    {
+        int globalIndex = d->pending.at(task.first+c);
+        // The calibration only changes the phase of a whole component and cancels in the normalized correlation
+        data[c] = d->systemMatrix->mappedData(globalIndex,d->targetCorrection);
+        if ( data[c]==0 )
+        {
+            copies[c].resize(d->positions);
+            if ( !d->systemMatrix->readBlock(globalIndex,d->targetCorrection,copies[c].data()) )
+            {
+                // A zero filled component would be indexed as similar to nothing
+                d->failed.testAndSetOrdered(0,globalIndex+1);
+                d->cancelled.store(1);
+                return;
+            }
+            data[c] = copies[c].constData();
+        }
+    }
+
+    // Chunks of the projection are shared by all components of the task while they are in cache
+    complex sums[componentsPerTask][dimensions];
+    for ( int c=0; c<task.count; c++ )
+        for ( int k=0; k<dimensions; k++ )
+            sums[c][k] = 0.0;
+    for ( int begin=0; begin<d->positions; begin+=voxelsPerChunk )
+    {
+        int length = qMin(voxelsPerChunk,d->positions-begin);
+        for ( int c=0; c<task.count; c++ )
+            for ( int k=0; k<dimensions; k++ )
+                sums[c][k] += realDot(d->projection.constData()+k*d->positions+begin,data[c]+begin,length);
+    }
+
+    for ( int c=0; c<task.count; c++ )
+    {
+        double norm = 0.0;
+        for ( int k=0; k<dimensions; k++ )
+            norm += std::norm(sums[c][k]);
+        norm = norm>0.0 ? 1.0/std::sqrt(norm) : 0.0;
+        float * p = d->target+2*dimensions*d->pending.at(task.first+c);
+        for ( int k=0; k<dimensions; k++ )
+        {
+            p[2*k] = static_cast<float>(sums[c][k].real()*norm);
+            p[2*k+1] = static_cast<float>(sums[c][k].imag()*norm);
+        }
+    }
+    emit d->q->progress(d->done.fetchAndAddOrdered(task.count)+task.count);
+}
+
+void PatternIndex::Impl::Refine::operator()(Similarity & candidate) const
+{
+    const complex * data = d->systemMatrix->mappedData(candidate.first,d->resultBackgroundCorrection);
+    QVector<complex> copy;
+    if ( data==0 )
+    {
+        copy.resize(d->positions);
+        if ( !d->systemMatrix->readBlock(candidate.first,d->resultBackgroundCorrection,copy.data()) )
+        {
+            d->failed.testAndSetOrdered(0,candidate.first+1);
+            return;
+        }
+        data = copy.constData();
+    }
+    double candidateNorm = std::sqrt(conjugateDot(data,data,d->positions).real());
+    double product = norm*candidateNorm;
+    candidate.second = product>0.0 ? static_cast<float>(std::abs(conjugateDot(query,data,d->positions))/product) : 0.0f;
+}
+
+PatternIndex::PatternIndex(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->backgroundCorrection = true;
+    d->resultBackgroundCorrection = true;
+    d->positions = 0;
+    d->seed = 0;
+    d->target = 0;
+    d->targetCorrection = true;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishBuild()));
+}
+
+PatternIndex::~PatternIndex()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void PatternIndex::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    cancel();
+    waitForFinished();
+    if ( d->systemMatrix )
+        disconnect(d->systemMatrix,0,this,0);
+    d->systemMatrix = systemMatrix;
+    d->projections.clear();
+    d->projection.clear();
+    d->changedWhileRunning.clear();
+    if ( systemMatrix )
+        connect(systemMatrix,SIGNAL(componentsChanged(QList<int>)),SLOT(updateComponents(QList<int>)));
+}
+
+void PatternIndex::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+bool PatternIndex::isReady() const
+{
+    return d->systemMatrix && !d->projections.isEmpty() && d->resultBackgroundCorrection==d->backgroundCorrection;
+}
+
+static bool moreSimilar(const PatternIndex::Similarity & a, const PatternIndex::Similarity & b)
+{
+    return a.second>b.second;
+}
+
+QList<PatternIndex::Similarity> PatternIndex::findSimilar(int globalIndex, int count) const
+{
+    QList<Similarity> result;
+    d->error.clear();
+    int n = d->projections.count()/(2*dimensions);
+    if ( !isReady() || globalIndex<0 || globalIndex>=n || count<=0 )
+        return result;
+
+    // |<p_i,p_q>|^2 of the unit projections estimates the squared correlation
+    const float * query = d->projections.constData()+2*dimensions*globalIndex;
+    QVector<Similarity> all;
+    all.reserve(n);
+    for ( int i=0; i<n; i++ )
+    {
+        if ( i==globalIndex )
+            continue;
+        const float * p = d->projections.constData()+2*dimensions*i;
+        float re = 0.0f, im = 0.0f;
+        for ( int k=0; k<2*dimensions; k+=2 )
+        {
+            re += query[k]*p[k]+query[k+1]*p[k+1];
+            im += query[k]*p[k+1]-query[k+1]*p[k];
+        }
+        all.append(qMakePair(i,re*re+im*im));
+    }
+    int candidates = qMin(refinementFactor*qMax(count,8),all.count());
+    std::partial_sort(all.begin(),all.begin()+candidates,all.end(),moreSimilar);
+    all.resize(candidates);
+
+    QVector<complex> copy;
+    const complex * data = d->systemMatrix->mappedData(globalIndex,d->resultBackgroundCorrection);
+    if ( data==0 )
+    {
+        copy.resize(d->positions);
+        if ( !d->systemMatrix->readBlock(globalIndex,d->resultBackgroundCorrection,copy.data()) )
+        {
+            d->error = tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+            return result;
+        }
+        data = copy.constData();
+    }
+    double norm = std::sqrt(conjugateDot(data,data,d->positions).real());
+    d->failed.store(0);
+    QtConcurrent::blockingMap(all,Impl::Refine(d,data,norm));
+    if ( d->readFailed() )
+        return result;
+    count = qMin(count,all.count());
+    std::partial_sort(all.begin(),all.begin()+count,all.end(),moreSimilar);
+    for ( int i=0; i<count; i++ )
+        result.append(all.at(i));
+    return result;
+}
+
+QString PatternIndex::defaultFileName(const SystemMatrix * systemMatrix)
+{
+    return SidecarFile::fileName(systemMatrix,".patterns","componentPatterns");
+}
+
+bool PatternIndex::load(const QString & fileName)
+{
+    d->error.clear();
+    if ( d->systemMatrix==0 || isRunning() )
+        return false;
+    SidecarFile file(fileName,fileMagic);
+    if ( !file.openForReading() )
+        return false;
+    QDataStream & in = file.stream();
+    if ( !file.hasMagic() )
+    {
+        d->error = tr("%1 is not a component pattern index.").arg(fileName);
+        return false;
+    }
+    quint32 dim, seed, correction, n, positions;
+    in >> dim >> seed >> correction >> n >> positions;
+    int components = d->systemMatrix->maxGlobalIndex()+1;
+    if ( in.status()!=QDataStream::Ok || dim!=static_cast<quint32>(dimensions)
+         || n!=static_cast<quint32>(components) || positions!=static_cast<quint32>(d->matrixPositions()) )
+    {
+        d->error = tr("The component pattern index %1 does not match the system matrix.").arg(fileName);
+        return false;
+    }
+    QVector<float> values;
+    if ( file.bytesAvailable()==static_cast<qint64>(n)*2*dimensions*sizeof(float) )
+    {
+        values.resize(n*2*dimensions);
+        for ( int i=0; i<values.count(); i++ )
+            in >> values[i];
+    }
+    if ( in.status()!=QDataStream::Ok || values.isEmpty() )
+    {
+        d->error = tr("The component pattern index %1 is damaged.").arg(fileName);
+        return false;
+    }
+    d->setupProjection(seed,positions);
+    d->projections = values;
+    d->resultBackgroundCorrection = correction!=0;
+    return true;
+}
+
+bool PatternIndex::save(const QString & fileName)
+{
+    d->error.clear();
+    if ( d->projections.isEmpty() )
+        return false;
+    SidecarFile file(fileName,fileMagic);
+    if ( !file.openForWriting(&d->error) )
+        return false;
+    QDataStream & out = file.stream();
+    out << static_cast<quint32>(dimensions) << d->seed << static_cast<quint32>(d->resultBackgroundCorrection?1:0)
+        << static_cast<quint32>(d->projections.count()/(2*dimensions)) << static_cast<quint32>(d->positions);
+    foreach(float value, d->projections)
+        out << value;
+    return file.finishWriting(&d->error);
+}
+
+bool PatternIndex::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QString PatternIndex::errorString() const
+{
+    return d->error;
+}
+
+int PatternIndex::componentCount() const
+{
+    return d->pending.count();
+}
+
+bool PatternIndex::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    int n = d->systemMatrix->maxGlobalIndex()+1;
+    if ( n<2 )
+    {
+        d->error = tr("At least two components are needed.");
+        return false;
+    }
+    d->setupProjection(defaultSeed,d->matrixPositions());
+    QVector<int> globalIndices(n);
+    for ( int i=0; i<n; i++ )
+        globalIndices[i] = i;
+    d->setupTasks(globalIndices);
+    d->computed.fill(0.0f,n*2*dimensions);
+    d->target = d->computed.data();
+    d->targetCorrection = d->backgroundCorrection;
+    d->changedWhileRunning.clear();
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->failed.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void PatternIndex::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void PatternIndex::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void PatternIndex::finishBuild()
+{
+    d->readFailed();
+    bool success = d->cancelled.load()==0;
+    if ( success )
+    {
+        d->projections = d->computed;
+        d->resultBackgroundCorrection = d->targetCorrection;
+    }
+    d->computed.clear();
+    d->target = 0;
+    QList<int> changed = d->changedWhileRunning;
+    d->changedWhileRunning.clear();
+    if ( success && !changed.isEmpty() )
+        updateComponents(changed);
+    emit finished(success);
+}
+
+void PatternIndex::updateComponents(const QList<int> & globalIndices)
+{
+    if ( isRunning() )
+    {
+        d->changedWhileRunning += globalIndices;
+        return;
+    }
+    if ( d->projections.isEmpty() || d->systemMatrix==0 )
+        return;
+    // Edited components are projected again right away, the sidecar file is out of date now
+    QVector<int> indices;
+    int n = d->projections.count()/(2*dimensions);
+    foreach(int globalIndex, globalIndices)
+        if ( globalIndex>=0 && globalIndex<n && !indices.contains(globalIndex) )
+            indices.append(globalIndex);
+    d->setupTasks(indices);
+    d->target = d->projections.data();
+    d->targetCorrection = d->resultBackgroundCorrection;
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->failed.store(0);
+    QtConcurrent::blockingMap(d->tasks,Impl::Project(d));
+    d->target = 0;
+    // Without the edited projections the index cannot be trusted anymore
+    if ( d->readFailed() )
+        d->projections.clear();
+    QFile::remove(defaultFileName(d->systemMatrix));
+}
@@ -0,0 +1,86 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef PATTERNINDEX_H
+#define PATTERNINDEX_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QString>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The PatternIndex class keeps a random projection of every component of a system
+ *        matrix to a few dimensions. The projections preserve the normalized correlation
+ *        |<a_i,a_j>|/(|a_i||a_j|) approximately, so similar components are found by scanning
+ *        the small index instead of the whole matrix. The best candidates are then ranked
+ *        with their exact correlation.
+ */
+class PatternIndex : public QObject
+{
+    Q_OBJECT
+public:
+    typedef QPair<int,float> Similarity;
+    explicit PatternIndex(QObject * parent=0);
+    virtual ~PatternIndex();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setBackgroundCorrection(bool);
+    /**
+     * @brief isReady True if the index covers the matrix with the current background correction
+     */
+    bool isReady() const;
+    /**
+     * @brief findSimilar Components most similar to globalIndex, best first, with their exact correlation,
+     *                    empty with errorString() set if a component could not be read
+     */
+    QList<Similarity> findSimilar(int globalIndex, int count) const;
+    /**
+     * @brief defaultFileName Sidecar file of the system matrix
+     */
+    static QString defaultFileName(const SystemMatrix * systemMatrix);
+    bool load(const QString & fileName);
+    bool save(const QString & fileName);
+    bool isRunning() const;
+    QString errorString() const;
+    /**
+     * @brief componentCount Number of components of the current build, progress() counts up to it
+     */
+    int componentCount() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+signals:
+    void progress(int components);
+    void finished(bool success);
+private slots:
+    void finishBuild();
+    void updateComponents(const QList<int> & globalIndices);
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // PATTERNINDEX_H
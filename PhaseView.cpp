@@ -39,21 +39,177 @@
 #include "PhaseView.h"
 #include "utility.h"
 
+// Maximum manhattan distance (in pixels) for picking a point with the mouse
+static const int captureRange=25;
+
+// Blend color c with the given alpha over the (opaque) pixel p
+static inline void blendPixel(QRgb & p, QRgb c, int alpha)
+{
+    if ( alpha>=255 )
+    {
+        p = c;
+        return;
+    }
+    int inv = 255-alpha;
+    p = qRgb((qRed(c)*alpha+qRed(p)*inv)/255,
+             (qGreen(c)*alpha+qGreen(p)*inv)/255,
+             (qBlue(c)*alpha+qBlue(p)*inv)/255);
+}
+
+// Draw a small cross for every point directly into the image memory
+static void rasterizePoints(QImage & image, const QVector<QPoint> & points, const QVector<QRgb> & colors, int alpha)
+{
+    const int armLength=3;
+    const int w=image.width();
+    const int h=image.height();
+    if ( w==0 || h==0 )
+        return;
+    QRgb * bits = reinterpret_cast<QRgb*>(image.bits());
+    const int stride = image.bytesPerLine()/sizeof(QRgb);
+    const QPoint * p = points.constData();
+    const QRgb * c = colors.constData();
+    const int n = points.count();
+
+    for ( int i=0; i<n; i++ )
+    {
+        const int x=p[i].x();
+        const int y=p[i].y();
+        const QRgb color = c[i] | 0xff000000;
+        if ( y>=0 && y<h )
+        {
+            QRgb * line = bits+y*stride;
+            for ( int k=std::max(x-armLength,0); k<=std::min(x+armLength,w-1); k++ )
+                blendPixel(line[k],color,alpha);
+        }
+        if ( x>=0 && x<w )
+        {
+            for ( int k=std::max(y-armLength,0); k<=std::min(y+armLength,h-1); k++ )
+            {
+                if ( k!=y )
+                    blendPixel(bits[k*stride+x],color,alpha);
+            }
+        }
+    }
+}
+
 struct PhaseView::Impl
 {
     QPointer<SystemMatrix> systemMatrix;
     int globalIndex;
     bool showHighlight;
     QPoint highlightPosition;
-    typedef QPair<QPoint,QColor> PositionEntry;
-    typedef QMap<MatrixPosition,PositionEntry > PositionMap;
-    PositionMap positionMap;
+    // Screen position and color of every voxel, indexed by the voxel offset within the data block
+    QVector<QPoint> points;
+    QVector<QRgb> colors;
+    int grid[3];
+    // Uniform grid over the screen positions used for hit-testing. Cells are captureRange
+    // pixels wide, so all candidates for a mouse position are found in the 3x3 neighbouring cells.
+    QPoint cellOrigin;
+    int cellColumns, cellRows;
+    QVector<int> cellStart; // Offset of each cell in cellItems, one additional entry at the end
+    QVector<int> cellItems; // Voxel offsets sorted by cell
     bool backgroundCorrection;
     int minDim,tickLen,gapSize;
     double dotsPerMM,tickLenMM,gapMM;
     SystemMatrix::complex maxVal;
     int variance;
     MatrixPosition lastPosition;
+    // Cached rendering of everything except the highlight cursor
+    QImage plot;
+    bool plotValid;
+
+    // Area covered by the highlight cursor
+    QRect highlightRect() const
+    {
+        return QRect(highlightPosition.x()-7,highlightPosition.y()-7,15,15);
+    }
+
+    void clear()
+    {
+        points.clear();
+        colors.clear();
+        cellStart.clear();
+        cellItems.clear();
+        cellColumns=cellRows=0;
+    }
+
+    MatrixPosition position(int offset) const
+    {
+        return MatrixPosition(offset%grid[0],(offset/grid[0])%grid[1],offset/(grid[0]*grid[1]));
+    }
+
+    int cell(const QPoint & p) const
+    {
+        return ((p.y()-cellOrigin.y())/captureRange)*cellColumns+(p.x()-cellOrigin.x())/captureRange;
+    }
+
+    void buildIndex()
+    {
+        cellStart.clear();
+        cellItems.clear();
+        if ( points.isEmpty() )
+            return;
+
+        QRect bounds(points.first(),QSize(1,1));
+        foreach( const QPoint & p, points )
+        {
+            bounds.setLeft(std::min(bounds.left(),p.x()));
+            bounds.setRight(std::max(bounds.right(),p.x()));
+            bounds.setTop(std::min(bounds.top(),p.y()));
+            bounds.setBottom(std::max(bounds.bottom(),p.y()));
+        }
+        cellOrigin = bounds.topLeft();
+        cellColumns = bounds.width()/captureRange+1;
+        cellRows = bounds.height()/captureRange+1;
+
+        // Counting sort of the voxel offsets by cell
+        int n = points.count();
+        QVector<int> cells(n);
+        cellStart.fill(0,cellColumns*cellRows+1);
+        for ( int i=0; i<n; i++ )
+        {
+            cells[i] = cell(points.at(i));
+            cellStart[cells.at(i)+1]++;
+        }
+        for ( int c=0; c<cellColumns*cellRows; c++ )
+            cellStart[c+1] += cellStart.at(c);
+        QVector<int> fill = cellStart;
+        cellItems.resize(n);
+        for ( int i=0; i<n; i++ )
+            cellItems[fill[cells.at(i)]++] = i;
+    }
+
+    int nearestPoint(const QPoint & pos) const
+    {
+        if ( cellStart.isEmpty() )
+            return -1;
+        int column = (pos.x()-cellOrigin.x());
+        int row = (pos.y()-cellOrigin.y());
+        // Floor division, positions left of or above the origin may still be in capture range
+        column = column<0 ? -1 : column/captureRange;
+        row = row<0 ? -1 : row/captureRange;
+
+        int best=-1, dist=captureRange+1;
+        for ( int r=std::max(row-1,0); r<=std::min(row+1,cellRows-1); r++ )
+        {
+            for ( int c=std::max(column-1,0); c<=std::min(column+1,cellColumns-1); c++ )
+            {
+                int index=r*cellColumns+c;
+                for ( int i=cellStart.at(index); i<cellStart.at(index+1); i++ )
+                {
+                    int offset=cellItems.at(i);
+                    int q=(points.at(offset)-pos).manhattanLength();
+                    // Prefer the higher offset on ties, as the former position map did
+                    if ( q<dist || (q==dist && offset>best) )
+                    {
+                        best=offset;
+                        dist=q;
+                    }
+                }
+            }
+        }
+        return best;
+    }
 };
 
 PhaseView::PhaseView(QWidget *parent) :
@@ -68,6 +224,10 @@ PhaseView::PhaseView(QWidget *parent) :
     d->gapMM=1.0;
     d->maxVal=1.0;
     d->variance=0.0;
+    d->cellColumns=d->cellRows=0;
+    d->plotValid=false;
+    for ( unsigned int i=0; i<3; i++ )
+        d->grid[i]=1;
 
     setMouseTracking( true );
 }
@@ -98,9 +258,12 @@ void PhaseView::setBackgroundCorrection(bool b)
 
 void PhaseView::highlightPosition(const MatrixPosition & pos, const SystemMatrix::complex &value)
 {
+    if ( d->showHighlight )
+        update(d->highlightRect());
     d->showHighlight=pos.isValid();
     d->highlightPosition=toQPoint(value);
-    update();
+    if ( d->showHighlight )
+        update(d->highlightRect());
 }
 
 const SystemMatrix * PhaseView::systemMatrix() const
@@ -120,58 +283,58 @@ bool PhaseView::backgroundCorrection() const
 
 void PhaseView::recalculate()
 {
-    d->positionMap.clear();
+    d->clear();
+    d->plotValid=false;
+    update();
     if ( d->systemMatrix.isNull() || d->globalIndex<0 || d->globalIndex>d->systemMatrix->maxGlobalIndex() )
         return;
 
     const SystemMatrix::complex * p = systemMatrix()->rawData(d->globalIndex,d->backgroundCorrection);
+    if ( 0==p )
+        return;
 
     int numVoxels=1;
     for ( unsigned int i=0; i<3; i++ )
     {
-        numVoxels *= systemMatrix()->dimension((Qt::Axis)i);
+        d->grid[i] = systemMatrix()->dimension((Qt::Axis)i);
+        numVoxels *= d->grid[i];
     }
 
-    double min = std::numeric_limits<double>::max();
+    // Find the maximum
     double maxAbs=0.0;
-    d->maxVal=0.0;
-
-    if ( false /* colorScale == PerFrame */ )
-    {
-    }
-    else
+    int maxOffset=0;
+    for ( int i = 0; i < numVoxels; i++ )
     {
-        for ( int i = 0; i < numVoxels; i++ )
+        double q = abs ( p[i] );
+        if ( q > maxAbs )
         {
-            double q = abs ( *(p+i) );
-            if ( q > maxAbs )
-            {
-                maxAbs = q;
-                d->maxVal = *(p+i);
-            }
-            if ( q < min )
-                min = q;
+            maxAbs = q;
+            maxOffset = i;
         }
     }
+    d->maxVal = p[maxOffset];
 
-    for ( int i=0; i<d->systemMatrix->dimension(Qt::XAxis); i++)
+    // Transform all voxels to screen positions and colors in one pass over the data block
+    d->points.resize(numVoxels);
+    d->colors.resize(numVoxels);
+    QPoint * points = d->points.data();
+    QRgb * colors = d->colors.data();
+    QRect g=geometry();
+    double scale = maxAbs>0.0 ? d->minDim/maxAbs : 0.0;
+    double centerX = g.width()/2+g.left();
+    double centerY = g.height()/2+g.top();
+    double invMaxAbs = maxAbs>0.0 ? 1.0/maxAbs : 0.0;
+    for ( int i = 0; i < numVoxels; i++ )
     {
-        for ( int j=0; j<d->systemMatrix->dimension(Qt::YAxis); j++)
-        {
-            for ( int k=0; k<d->systemMatrix->dimension(Qt::ZAxis); k++)
-            {
-                MatrixPosition pos(i,j,k);
-                SystemMatrix::complex c=d->systemMatrix->dataPoint(d->globalIndex,pos,d->backgroundCorrection);
-                double hue = 0.5 * arg( c ) / M_PI;
-                if ( hue<0.0 ) hue+=1.0;
-                double gray = abs( c ) / maxAbs;
-                d->positionMap.insert(pos,qMakePair(toQPoint(c),QColor::fromHsvF(hue,1.0,gray)));
-            }
-        }
+        const SystemMatrix::complex & c = p[i];
+        points[i] = QPoint(static_cast<int>(c.real()*scale+centerX),static_cast<int>(-c.imag()*scale+centerY));
+        double hue = 0.5 * arg( c ) / M_PI;
+        if ( hue<0.0 ) hue+=1.0;
+        colors[i] = QColor::fromHsvF(hue,1.0,abs( c )*invMaxAbs).rgb();
     }
+    d->buildIndex();
 
-
-    d->variance=sqrt(systemMatrix()->backgroundVariance(d->globalIndex))/maxAbs*d->minDim;
+    d->variance=sqrt(systemMatrix()->backgroundVariance(d->globalIndex))*invMaxAbs*d->minDim;
 
     update();
 }
@@ -203,36 +366,57 @@ void PhaseView::resizeEvent(QResizeEvent * ev)
 
 void PhaseView::mouseMoveEvent(QMouseEvent * ev)
 {
-    const int captureRange=25;
-    if ( d->positionMap.empty() )
+    if ( d->points.isEmpty() )
         return;
     MatrixPosition pos;
     QPoint p;
-    int dist=(d->positionMap.begin()->first-ev->pos()).manhattanLength();
-    for ( Impl::PositionMap::iterator i=d->positionMap.begin(); i!=d->positionMap.end(); ++i)
+    SystemMatrix::complex value(0.0,0.0);
+    int offset=d->nearestPoint(ev->pos());
+    if ( offset>=0 )
     {
-        int q=(i->first-ev->pos()).manhattanLength();
-        if ( q<=dist && q<=captureRange )
-        {
-            pos=i.key();
-            p=i.value().first;
-            dist=q;
-        }
+        pos=d->position(offset);
+        p=d->points.at(offset);
+        value=d->systemMatrix->rawData(d->globalIndex,d->backgroundCorrection)[offset];
     }
     if ( pos!=d->lastPosition )
     {
+        if ( d->showHighlight )
+            update(d->highlightRect());
         d->showHighlight = pos.isValid();
         d->highlightPosition = p;
-        emit currentPositionAndValue(pos,d->systemMatrix->dataPoint(d->globalIndex,pos,d->backgroundCorrection));
+        emit currentPositionAndValue(pos,value);
         d->lastPosition=pos;
-        update();
+        if ( d->showHighlight )
+            update(d->highlightRect());
     }
 }
 
-void PhaseView::paintEvent(QPaintEvent * /*ev*/)
+void PhaseView::paintEvent(QPaintEvent * ev)
 {
-    QSettings settings;
+    if ( !d->plotValid || d->plot.size()!=size() )
+        renderPlot();
+
     QPainter painter(this);
+    painter.drawImage(ev->rect(),d->plot,ev->rect());
+
+    if ( d->showHighlight )
+    {
+        int x=d->highlightPosition.x();
+        int y=d->highlightPosition.y();
+        painter.setPen( Qt::white );
+        painter.drawLine(x-7,y,x+7,y);
+        painter.drawLine(x,y-7,x,y+7);
+    }
+}
+
+void PhaseView::renderPlot()
+{
+    QSettings settings;
+    d->plot = QImage(size(),QImage::Format_ARGB32_Premultiplied);
+    d->plot.fill(Qt::black);
+    d->plotValid = true;
+    QPainter painter(&d->plot);
+    painter.setFont(font());
     QRect g=geometry();
 
     painter.setBackground( Qt::black );
@@ -256,7 +440,7 @@ void PhaseView::paintEvent(QPaintEvent * /*ev*/)
     painter.drawText(QRect(g.left(),g.top(),g.width(),g.height()/2-d->minDim-d->tickLen-d->gapSize),Qt::AlignBottom|Qt::AlignHCenter,QString("90")+QChar(0x00b0));
     painter.drawText(QRect(g.left(),g.top()+g.height()/2+d->minDim+d->tickLen+d->gapSize,g.width(),g.height()/2-d->minDim-d->tickLen-d->gapSize),Qt::AlignTop|Qt::AlignHCenter,QString("270")+QChar(0x00b0));
 
-    if ( d->positionMap.isEmpty() )
+    if ( d->points.isEmpty() )
         return;
 
     // Draw maximum value
@@ -298,14 +482,16 @@ void PhaseView::paintEvent(QPaintEvent * /*ev*/)
     painter.drawText(textArea, maxVal, align );
 
     // Draw actual data
-    foreach( Impl::PositionEntry p, d->positionMap )
+    painter.end();
+    int opacity=255;
+    if ( settings.value("phasePlotTranslucentPoints",true).toBool() )
     {
-        painter.setPen(p.second);
-        const int & x = p.first.x();
-        const int & y = p.first.y();
-        painter.drawLine(x-3,y,x+3,y);
-        painter.drawLine(x,y-3,x,y+3);
+        // One opacity for all points, lower for large grids, so that overlapping points stay distinguishable
+        const double referenceCount=2000.0;
+        opacity = qBound(48,static_cast<int>(255.0*sqrt(referenceCount/d->points.count())),255);
     }
+    rasterizePoints(d->plot,d->points,d->colors,opacity);
+    painter.begin(&d->plot);
 
     if ( settings.value("ShowVarianceInPhasePlot",true).toBool() )
     {
@@ -322,16 +508,5 @@ void PhaseView::paintEvent(QPaintEvent * /*ev*/)
             painter.drawEllipse(geometry().center(),v, v );
         }
     }
-
-    if ( d->showHighlight )
-    {
-        int x=d->highlightPosition.x();
-        int y=d->highlightPosition.y();
-        painter.setPen( Qt::white );
-        painter.drawLine(x-7,y,x+7,y);
-        painter.drawLine(x,y-7,x,y+7);
-    }
-
-
 }
 
@@ -52,6 +52,7 @@ protected:
 protected slots:
     void recalculate();
 private:
+    void renderPlot();
     struct Impl;
     Impl * d;
 };
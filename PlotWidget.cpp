@@ -19,6 +19,9 @@
  * $Id: PlotWidget.cpp 72 2017-02-28 22:45:42Z uhei $
  */
 
+// Standard includes
+#include <cmath>
+
 // Qt includes
 #include <QtGlobal>
 #include <QtCore/QFile>
@@ -62,7 +65,89 @@ struct PlotWidget::Impl {
     QStaticText title;
     QPicture decoration;
     QMap<Qt::Axis,QPair<Qt::Axis,Qt::Axis> > directions;
-    MatrixPosition highlightPosition;
+    MatrixPosition highlightPosition, lastMousePosition;
+    QVector<SystemMatrix::complex> volume;
+    // Cached rendering of everything except the highlight, and where its slice images were drawn
+    QImage base;
+    bool baseValid;
+    QList<QRect> imageRects;
+    QList<int> imageSlices;
+    // Voxels of the shown component changed in the editor, marked in the overlay
+    QList<MatrixPosition> editedPositions;
+    Qt::Axis axes[3];
+    int grid[3];
+    BrushShape brushShape;
+    int brushRadius;
+
+    // Half width in voxels of the brush in a slice at distance ds from its center, -1 if the slice is not touched
+    int brushExtent(int ds) const
+    {
+        if ( qAbs(ds)>brushRadius )
+            return -1;
+        if ( brushShape==SphereBrush )
+            return static_cast<int>(std::floor(std::sqrt(static_cast<double>(brushRadius*brushRadius-ds*ds))));
+        return brushRadius;
+    }
+
+    // Screen outline of the brush centered at pos in all visible slices it touches, clip holds the slice images
+    void brushOutlines(const MatrixPosition & pos, QList<QRect> * outlines, QList<QRect> * clips) const
+    {
+        if ( !pos.isValid() || brushShape==VoxelBrush || brushRadius<=0 )
+            return;
+        for ( int i=0; i<imageRects.count(); i++ )
+        {
+            int k = brushExtent(imageSlices.at(i)-pos.index(axes[2]));
+            if ( k<0 )
+                continue;
+            const QRect & r = imageRects.at(i);
+            double w = static_cast<double>(r.width())/grid[0];
+            double h = static_cast<double>(r.height())/grid[1];
+            QPoint topLeft(r.x()+qRound(w*(pos.index(axes[0])-k)),r.y()+qRound(h*(pos.index(axes[1])-k)));
+            QPoint bottomRight(r.x()+qRound(w*(pos.index(axes[0])+k+1))-1,r.y()+qRound(h*(pos.index(axes[1])+k+1))-1);
+            outlines->append(QRect(topLeft,bottomRight));
+            clips->append(r);
+        }
+    }
+
+    // Screen rectangles of the edit marker of pos in all visible slices
+    QList<QRect> editedRects(const MatrixPosition & pos) const
+    {
+        QList<QRect> rects;
+        for ( int i=0; i<imageRects.count(); i++ )
+        {
+            if ( imageSlices.at(i)!=pos.index(axes[2]) )
+                continue;
+            const QRect & r = imageRects.at(i);
+            int x = r.x()+qRound(static_cast<double>(r.width())/grid[0]*(0.5+pos.index(axes[0])));
+            int y = r.y()+qRound(static_cast<double>(r.height())/grid[1]*(0.5+pos.index(axes[1])));
+            rects.append(QRect(x-2,y-2,4,4));
+        }
+        return rects;
+    }
+
+    // Screen rectangles of the highlight marker of pos in all visible slices
+    QList<QRect> highlightRects(const MatrixPosition & pos) const
+    {
+        QList<QRect> rects;
+        if ( !pos.isValid() )
+            return rects;
+        for ( int i=0; i<imageRects.count(); i++ )
+        {
+            if ( imageSlices.at(i)!=pos.index(axes[2]) )
+                continue;
+            const QRect & r = imageRects.at(i);
+            int x = r.x()+(static_cast<double>(r.width())/grid[0]*(0.5+pos.index(axes[0]))-2.5);
+            int y = r.y()+(static_cast<double>(r.height())/grid[1]*(0.5+pos.index(axes[1]))-2.5);
+            rects.append(QRect(x-1,y-1,8,8));
+        }
+        return rects;
+    }
+
+    bool showVolume(const SystemMatrix * systemMatrix) const
+    {
+        return !volume.isEmpty() && volume.count()==systemMatrix->dimension(Qt::XAxis)
+                *systemMatrix->dimension(Qt::YAxis)*systemMatrix->dimension(Qt::ZAxis);
+    }
 };
 
 PlotWidget::PlotWidget(QWidget * parent) : QFrame(parent), d(new Impl)
@@ -75,6 +160,9 @@ PlotWidget::PlotWidget(QWidget * parent) : QFrame(parent), d(new Impl)
     d->legendWidth = 100;
     d->singleSlice = -1;
     d->showLegend = true;
+    d->baseValid = false;
+    d->brushShape = VoxelBrush;
+    d->brushRadius = 0;
     d->tickFont.setFamily( "Arial" );
     d->tickFont.setPointSize( 8 );
     d->labelFont.setFamily( "Arial" );
@@ -130,7 +218,41 @@ Qt::Axis PlotWidget::sliceDirection() const
 void PlotWidget::setBackgroundCorrection(bool b)
 {
     d->renderer->setBackgroundCorrection(b);
-    update();
+    refresh();
+}
+
+void PlotWidget::setLowRankView(bool b)
+{
+    d->renderer->setLowRankView(b);
+    refresh();
+}
+
+void PlotWidget::setPercentileWindow(bool b)
+{
+    d->renderer->setPercentileWindow(b);
+    refresh();
+}
+
+bool PlotWidget::percentileWindow() const
+{
+    return d->renderer->percentileWindow();
+}
+
+void PlotWidget::setLogMagnitude(bool b)
+{
+    d->renderer->setLogMagnitude(b);
+    refresh();
+}
+
+bool PlotWidget::logMagnitude() const
+{
+    return d->renderer->logMagnitude();
+}
+
+void PlotWidget::setLowRankApproximation(const LowRankApproximation * approximation)
+{
+    d->renderer->setLowRankApproximation(approximation);
+    refresh();
 }
 
 bool PlotWidget::backgroundCorrection() const
@@ -144,7 +266,7 @@ void PlotWidget::setSmoothScaling(bool b)
         d->transformationMode = Qt::SmoothTransformation;
     else
         d->transformationMode = Qt::FastTransformation;
-    update();
+    refresh();
 }
 
 bool PlotWidget::smoothScaling() const
@@ -167,7 +289,13 @@ SystemMatrix* PlotWidget::systemMatrix() const
 void PlotWidget::setGlobalIndex(int index)
 {
     d->index = index;
-    update();
+    refresh();
+}
+
+void PlotWidget::setVolume(const QVector<SystemMatrix::complex> & volume)
+{
+    d->volume = volume;
+    refresh();
 }
 
 int PlotWidget::index() const
@@ -213,7 +341,73 @@ void PlotWidget::showAllSlices()
 
 void PlotWidget::setHighlightPosition(const MatrixPosition & pos)
 {
+    // Only the old and the new marker are repainted from the base layer
+    QList<QRect> outlines, clips;
+    d->brushOutlines(d->highlightPosition,&outlines,&clips);
+    d->brushOutlines(pos,&outlines,&clips);
+    foreach(const QRect & r, outlines)
+        update(r.adjusted(-1,-1,1,1));
+    foreach(const QRect & r, d->highlightRects(d->highlightPosition))
+        update(r);
     d->highlightPosition=pos;
+    foreach(const QRect & r, d->highlightRects(pos))
+        update(r);
+}
+
+void PlotWidget::setBrush(BrushShape shape, int radius)
+{
+    // Erase the outline of the old brush
+    QList<QRect> outlines, clips;
+    d->brushOutlines(d->highlightPosition,&outlines,&clips);
+    d->brushShape = shape;
+    d->brushRadius = qMax(0,radius);
+    d->brushOutlines(d->highlightPosition,&outlines,&clips);
+    foreach(const QRect & r, outlines)
+        update(r.adjusted(-1,-1,1,1));
+}
+
+PlotWidget::BrushShape PlotWidget::brushShape() const
+{
+    return d->brushShape;
+}
+
+int PlotWidget::brushRadius() const
+{
+    return d->brushRadius;
+}
+
+QList<MatrixPosition> PlotWidget::brushRegion(const MatrixPosition & pos) const
+{
+    QList<MatrixPosition> region;
+    if ( 0==systemMatrix() || !systemMatrix()->validPosition(pos) )
+        return region;
+    int r = d->brushShape==VoxelBrush ? 0 : d->brushRadius;
+    // Clip the brush to [0,dimension) on every axis
+    int first[3], last[3];
+    for ( int a=0; a<3; a++ )
+    {
+        first[a] = qMax(0,pos.index(a)-r)-pos.index(a);
+        last[a] = qMin(systemMatrix()->dimension(static_cast<Qt::Axis>(a))-1,pos.index(a)+r)-pos.index(a);
+    }
+    for ( int k=first[2]; k<=last[2]; k++ )
+    {
+        for ( int j=first[1]; j<=last[1]; j++ )
+        {
+            for ( int i=first[0]; i<=last[0]; i++ )
+            {
+                if ( d->brushShape==SphereBrush && i*i+j*j+k*k>r*r )
+                    continue;
+                region.append(MatrixPosition(pos.x()+i,pos.y()+j,pos.z()+k));
+            }
+        }
+    }
+    return region;
+}
+
+void PlotWidget::refresh()
+{
+    d->baseValid=false;
+    d->lastMousePosition=MatrixPosition();
     update();
 }
 
@@ -296,14 +490,56 @@ void PlotWidget::relayout()
             d->areaList.append(QRect(QPoint(x,y),availableSize));
         }
     }
-    update();
+    refresh();
 }
 
 void PlotWidget::paintEvent(QPaintEvent* ev)
 {
-    QFontMetrics tickFontMetrics(d->tickFont);
+    if ( !d->baseValid || d->base.size()!=size() )
+        renderBase();
+
     QPainter p(this);
-    p.fillRect(ev->rect(),Qt::white);
+    p.drawImage(ev->rect(),d->base,ev->rect());
+
+    // Overlay, drawn on every paint
+    if ( !d->editedPositions.isEmpty() )
+    {
+        p.setPen( Qt::magenta );
+        foreach(const MatrixPosition & pos, d->editedPositions)
+            foreach(const QRect & r, d->editedRects(pos))
+                if ( ev->rect().intersects(r.adjusted(0,0,1,1)) )
+                    p.drawRect(r);
+    }
+    if ( d->highlightPosition.isValid() )
+    {
+        p.setPen( Qt::white );
+        foreach(const QRect & r, d->highlightRects(d->highlightPosition))
+            p.drawEllipse(r.x()+1,r.y()+1,5,5);
+
+        QList<QRect> outlines, clips;
+        d->brushOutlines(d->highlightPosition,&outlines,&clips);
+        p.setPen( QPen(Qt::white,1,Qt::DashLine) );
+        for ( int i=0; i<outlines.count(); i++ )
+        {
+            p.setClipRect(clips.at(i));
+            if ( d->brushShape==SphereBrush )
+                p.drawEllipse(outlines.at(i));
+            else
+                p.drawRect(outlines.at(i));
+        }
+    }
+}
+
+void PlotWidget::renderBase()
+{
+    d->base = QImage(size(),QImage::Format_RGB32);
+    d->baseValid = true;
+    d->imageRects.clear();
+    d->imageSlices.clear();
+    d->editedPositions.clear();
+    QFontMetrics tickFontMetrics(d->tickFont);
+    QPainter p(&d->base);
+    p.fillRect(d->base.rect(),Qt::white);
     if ( 0==systemMatrix() )
     {
         QPoint pos = contentsRect().center();
@@ -313,6 +549,13 @@ void PlotWidget::paintEvent(QPaintEvent* ev)
         p.drawStaticText(pos,d->title);
         return;
     }
+    d->axes[0] = horizontalAxis();
+    d->axes[1] = verticalAxis();
+    d->axes[2] = sliceDirection();
+    for ( int i=0; i<3; i++ )
+        d->grid[i] = systemMatrix()->dimension(d->axes[i]);
+    if ( !d->showVolume(systemMatrix()) )
+        d->editedPositions = systemMatrix()->editedPositions(d->index);
     int slice=0;
     SFRenderer::Colorization cm = SFRenderer::PerFrame;
     foreach(QRect r, d->areaList)
@@ -322,7 +565,12 @@ void PlotWidget::paintEvent(QPaintEvent* ev)
             slice=d->singleSlice;
             cm = SFRenderer::PerSlice;
         }
-        QImage image = d->renderer->image( d->index, slice, cm ).scaled(d->sliceSize,Qt::IgnoreAspectRatio, d->transformationMode );
+        // Smooth scaling interpolates the data before the color lookup, fast scaling repeats the voxels
+        QSize size = d->transformationMode==Qt::SmoothTransformation ? d->sliceSize : QSize();
+        QImage image = d->showVolume(systemMatrix()) ? d->renderer->image( d->volume.constData(), slice, size, cm )
+                                                     : d->renderer->image( d->index, slice, size, cm );
+        if ( image.size()!=d->sliceSize )
+            image = image.scaled(d->sliceSize,Qt::IgnoreAspectRatio, Qt::FastTransformation );
         p.drawPicture( r.topLeft(),d->decoration);
         if ( ! d->decoration.isNull() )
         {
@@ -340,15 +588,8 @@ void PlotWidget::paintEvent(QPaintEvent* ev)
         pos.rx()-= image.width()/2;
         pos.ry()-= image.height()/2;
         p.drawImage(pos,image);
-        if ( d->highlightPosition.isValid() && d->highlightPosition.index(sliceDirection())==slice )
-        {
-            p.save();
-            p.setPen( Qt::white );
-            int x = pos.x()+(static_cast<double>(image.width())/(systemMatrix()->dimension(horizontalAxis()))*(0.5+d->highlightPosition.index(horizontalAxis()))-2.5);
-            int y = pos.y()+(static_cast<double>(image.height())/(systemMatrix()->dimension(verticalAxis()))*(0.5+d->highlightPosition.index(verticalAxis()))-2.5);
-            p.drawEllipse(x,y,5,5);
-            p.restore();
-        }
+        d->imageRects.append(QRect(pos,image.size()));
+        d->imageSlices.append(slice);
         slice++;
     }
     if ( d->showLegend )
@@ -357,7 +598,10 @@ void PlotWidget::paintEvent(QPaintEvent* ev)
         int slice=-1;
         if ( cm == SFRenderer::PerSlice )
             slice=d->singleSlice;
-        d->renderer->plotLegend( &p,r, d->index, slice );
+        if ( d->showVolume(systemMatrix()) )
+            d->renderer->plotLegend( &p,r, d->volume.constData(), slice );
+        else
+            d->renderer->plotLegend( &p,r, d->index, slice );
     }
 }
 
@@ -469,8 +713,18 @@ void PlotWidget::mouseMoveEvent(QMouseEvent * mouseEvent)
 {
     MatrixPosition pos;
     SystemMatrix::complex c;
-    if ( isVoxel(mouseEvent->pos(),&pos ) )
-        c = systemMatrix()->dataPoint(d->index,pos,backgroundCorrection());
+    isVoxel(mouseEvent->pos(),&pos);
+    // Moves within the same voxel change nothing for the receivers
+    if ( pos==d->lastMousePosition )
+        return;
+    d->lastMousePosition = pos;
+    if ( pos.isValid() )
+    {
+        if ( d->showVolume(systemMatrix()) )
+            c = d->volume.at((pos.z()*systemMatrix()->dimension(Qt::YAxis)+pos.y())*systemMatrix()->dimension(Qt::XAxis)+pos.x());
+        else
+            c = systemMatrix()->dataPoint(d->index,pos,backgroundCorrection());
+    }
     emit currentPositionAndValue(pos,c);
 }
 
@@ -479,6 +733,8 @@ void PlotWidget::mousePressEvent(QMouseEvent * mouseEvent)
     MatrixPosition pos;
     if ( isVoxel(mouseEvent->pos(),&pos) && mouseEvent->button() == Qt::RightButton )
         emit requestContextMenu(mouseEvent->globalPos(),pos);
+    else if ( isVoxel(mouseEvent->pos(),&pos) && mouseEvent->button() == Qt::LeftButton )
+        emit voxelSelected(pos);
 }
 
 void PlotWidget::mouseDoubleClickEvent(QMouseEvent * mouseEvent)
@@ -29,6 +29,7 @@
 #else
 #include <QtGui/QFrame>
 #endif
+#include <QtCore/QVector>
 
 // Local includes
 #include "SystemMatrix.h"
@@ -37,11 +38,17 @@
 // Forward declarations
 class ColorScale;
 class ColorScaleManager;
+class LowRankApproximation;
 
 class PlotWidget : public QFrame
 {
     Q_OBJECT
 public:
+    /**
+     * @brief The BrushShape enum: region corrected around the voxel under the cursor, the radius is
+     *        given in voxels
+     */
+    enum BrushShape { VoxelBrush, BoxBrush, SphereBrush };
     PlotWidget( QWidget * parent=0);
     virtual ~PlotWidget();
     Qt::Axis horizontalAxis() const;
@@ -54,13 +61,25 @@ public:
     int visibleSlice() const;
     bool legendEnabled() const;
     bool ticksEnabled() const;
+    bool percentileWindow() const;
+    bool logMagnitude() const;
     bool isVoxel(const QPoint & p, MatrixPosition * pos=0) const;
     int slice(const QPoint & p) const;
+    BrushShape brushShape() const;
+    int brushRadius() const;
+    /**
+     * @brief brushRegion Voxels inside the grid covered by the brush centered at pos
+     */
+    QList<MatrixPosition> brushRegion(const MatrixPosition & pos) const;
+    void setLowRankApproximation(const LowRankApproximation * approximation);
 public slots:
     void setTitle(const QString & text);
     void setSliceDirection(Qt::Axis);
     void setSmoothScaling(bool);
     void setBackgroundCorrection(bool);
+    void setLowRankView(bool);
+    void setPercentileWindow(bool);
+    void setLogMagnitude(bool);
     void setGlobalIndex(int);
     void setSystemMatrix(SystemMatrix *);
     void setTicksEnabled(bool);
@@ -69,9 +88,20 @@ public slots:
     void showSingleSlice(int);
     void showAllSlices();
     void setHighlightPosition(const MatrixPosition & pos);
+    void setBrush(BrushShape shape, int radius);
+    /**
+     * @brief setVolume Show the given volume instead of a component of the system matrix,
+     *                  an empty vector switches back to the current component
+     */
+    void setVolume(const QVector<SystemMatrix::complex> & volume);
+    /**
+     * @brief refresh Render the slices again, needed after the data or the color scale changed
+     */
+    void refresh();
 signals:
     void currentPositionAndValue(const MatrixPosition & pos, const SystemMatrix::complex & value);
     void requestContextMenu(const QPoint & p, const MatrixPosition & pos);
+    void voxelSelected(const MatrixPosition & pos);
 protected:
     virtual void paintEvent(QPaintEvent* );
     virtual void resizeEvent(QResizeEvent *);
@@ -84,6 +114,7 @@ private:
     const ColorScaleManager * colorScaleManager();
     const ColorScale * currentColorScale();
     void relayout();
+    void renderBase();
     void drawTicks( QPainter *, QPoint, QSize );
     struct Impl;
     Impl * d;
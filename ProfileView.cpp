@@ -0,0 +1,310 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Qt includes
+#include <QtCore/QPointer>
+#include <QtCore/QSettings>
+#include <QtWidgets/QComboBox>
+#include <QtWidgets/QFormLayout>
+#include <QtWidgets/QLabel>
+#include <QtWidgets/QVBoxLayout>
+
+#include <QtCharts/QChart>
+#include <QtCharts/QChartView>
+#include <QtCharts/QLineSeries>
+#include <QtCharts/QLogValueAxis>
+#include <QtCharts/QValueAxis>
+
+// Local includes
+#include "ProfileView.h"
+#include "SystemMatrix.h"
+#include "VoxelSpectrum.h"
+
+struct ProfileView::Impl
+{
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    int globalIndex;
+    MatrixPosition position;
+    VoxelSpectrum * spectrum;
+    // A new voxel was requested while the last one was still gathered
+    bool restart;
+
+    QComboBox * axis, * abscissa;
+    QLabel * status;
+
+    QtCharts::QChart * profileChart;
+    QtCharts::QLineSeries * magnitude, * phase;
+    QtCharts::QValueAxis * positionAxis, * magnitudeAxis, * phaseAxis;
+
+    QtCharts::QChart * spectrumChart;
+    QtCharts::QLineSeries * spectrumSeries;
+    QtCharts::QValueAxis * spectrumAxis;
+    QtCharts::QLogValueAxis * spectrumMagnitudeAxis;
+
+    static bool lessX(const QPointF & a, const QPointF & b) { return a.x()<b.x(); }
+
+    QString positionText() const
+    {
+        return QString("[%1,%2,%3]").arg(position.x()).arg(position.y()).arg(position.z());
+    }
+};
+
+ProfileView::ProfileView(QWidget *parent) : QWidget(parent), d(new Impl)
+{
+    QSettings settings;
+    d->backgroundCorrection = true;
+    d->globalIndex = -1;
+    d->restart = false;
+    d->spectrum = new VoxelSpectrum(this);
+    connect(d->spectrum,SIGNAL(finished(bool)),SLOT(spectrumFinished(bool)));
+
+    QVBoxLayout * layout = new QVBoxLayout(this);
+    QFormLayout * form = new QFormLayout;
+    d->axis = new QComboBox;
+    d->axis->addItem(tr("X"));
+    d->axis->addItem(tr("Y"));
+    d->axis->addItem(tr("Z"));
+    d->axis->setCurrentIndex(settings.value("profileAxis",0).toInt());
+    connect(d->axis,SIGNAL(currentIndexChanged(int)),SLOT(updateProfile()));
+    form->addRow(tr("Profile direction"),d->axis);
+    d->abscissa = new QComboBox;
+    d->abscissa->addItem(tr("Frequency"));
+    d->abscissa->addItem(tr("SNR rank"));
+    d->abscissa->setCurrentIndex(settings.value("voxelSpectrumAbscissa",0).toInt());
+    connect(d->abscissa,SIGNAL(currentIndexChanged(int)),SLOT(showSpectrum()));
+    form->addRow(tr("Spectrum versus"),d->abscissa);
+    layout->addLayout(form);
+    d->status = new QLabel(tr("Click a voxel to show its profile and spectrum."));
+    d->status->setWordWrap(true);
+    layout->addWidget(d->status);
+
+    d->profileChart = new QtCharts::QChart;
+    d->profileChart->legend()->setAlignment(Qt::AlignBottom);
+    d->positionAxis = new QtCharts::QValueAxis;
+    d->positionAxis->setTitleText(tr("Position / mm"));
+    d->profileChart->addAxis(d->positionAxis,Qt::AlignBottom);
+    d->magnitudeAxis = new QtCharts::QValueAxis;
+    d->magnitudeAxis->setTitleText(tr("Magnitude"));
+    d->profileChart->addAxis(d->magnitudeAxis,Qt::AlignLeft);
+    d->phaseAxis = new QtCharts::QValueAxis;
+    d->phaseAxis->setTitleText(tr("Phase / %1").arg(QChar(0xb0)));
+    d->phaseAxis->setRange(-180.0,180.0);
+    d->phaseAxis->setTickCount(5);
+    d->profileChart->addAxis(d->phaseAxis,Qt::AlignRight);
+    d->magnitude = new QtCharts::QLineSeries;
+    d->magnitude->setName(tr("Magnitude"));
+    d->profileChart->addSeries(d->magnitude);
+    d->magnitude->attachAxis(d->positionAxis);
+    d->magnitude->attachAxis(d->magnitudeAxis);
+    d->phase = new QtCharts::QLineSeries;
+    d->phase->setName(tr("Phase"));
+    d->profileChart->addSeries(d->phase);
+    d->phase->attachAxis(d->positionAxis);
+    d->phase->attachAxis(d->phaseAxis);
+    QtCharts::QChartView * profileView = new QtCharts::QChartView(d->profileChart);
+    profileView->setRenderHint(QPainter::Antialiasing);
+    layout->addWidget(profileView,1);
+
+    d->spectrumChart = new QtCharts::QChart;
+    d->spectrumChart->legend()->hide();
+    d->spectrumAxis = new QtCharts::QValueAxis;
+    d->spectrumChart->addAxis(d->spectrumAxis,Qt::AlignBottom);
+    d->spectrumMagnitudeAxis = new QtCharts::QLogValueAxis;
+    d->spectrumMagnitudeAxis->setTitleText(tr("Magnitude"));
+    d->spectrumMagnitudeAxis->setBase(10);
+    d->spectrumChart->addAxis(d->spectrumMagnitudeAxis,Qt::AlignLeft);
+    d->spectrumSeries = new QtCharts::QLineSeries;
+    d->spectrumChart->addSeries(d->spectrumSeries);
+    d->spectrumSeries->attachAxis(d->spectrumAxis);
+    d->spectrumSeries->attachAxis(d->spectrumMagnitudeAxis);
+    QtCharts::QChartView * spectrumView = new QtCharts::QChartView(d->spectrumChart);
+    spectrumView->setRubberBand(QtCharts::QChartView::RectangleRubberBand);
+    layout->addWidget(spectrumView,1);
+}
+
+ProfileView::~ProfileView()
+{
+    delete d;
+}
+
+void ProfileView::setSystemMatrix(SystemMatrix *s)
+{
+    d->spectrum->cancel();
+    d->spectrum->waitForFinished();
+    d->restart = false;
+    d->systemMatrix = s;
+    d->spectrum->setSystemMatrix(s);
+    d->globalIndex = -1;
+    d->position = MatrixPosition();
+    d->magnitude->clear();
+    d->phase->clear();
+    d->spectrumSeries->clear();
+    d->status->setText(tr("Click a voxel to show its profile and spectrum."));
+}
+
+void ProfileView::setBackgroundCorrection(bool b)
+{
+    if ( b==d->backgroundCorrection )
+        return;
+    d->backgroundCorrection = b;
+    updateProfile();
+    updateSpectrum();
+}
+
+void ProfileView::setGlobalIndex(int globalIndex)
+{
+    bool receiverChanged = d->systemMatrix==0 || d->globalIndex<0
+            || d->systemMatrix->receiver(globalIndex)!=d->systemMatrix->receiver(d->globalIndex);
+    d->globalIndex = globalIndex;
+    updateProfile();
+    if ( receiverChanged )
+        updateSpectrum();
+}
+
+void ProfileView::setPosition(const MatrixPosition & pos)
+{
+    if ( !pos.isValid() )
+        return;
+    d->position = pos;
+    updateProfile();
+    updateSpectrum();
+}
+
+void ProfileView::showEvent(QShowEvent * ev)
+{
+    QWidget::showEvent(ev);
+    updateProfile();
+    updateSpectrum();
+}
+
+void ProfileView::updateProfile()
+{
+    if ( !isVisible() )
+        return;
+    QSettings settings;
+    settings.setValue("profileAxis",d->axis->currentIndex());
+    SystemMatrix * s = d->systemMatrix;
+    if ( s==0 || !s->validPosition(d->position) || d->globalIndex<0 || d->globalIndex>s->maxGlobalIndex() )
+    {
+        d->magnitude->clear();
+        d->phase->clear();
+        return;
+    }
+
+    // The component is cached by the system matrix, reading it here is cheap
+    Qt::Axis axis = static_cast<Qt::Axis>(d->axis->currentIndex());
+    MatrixPosition pos = d->position;
+    QVector<QPointF> magnitude, phase;
+    double maxMagnitude = 0.0;
+    for ( int i=0; i<s->dimension(axis); i++ )
+    {
+        pos.set(axis,i);
+        SystemMatrix::complex v = s->dataPoint(d->globalIndex,pos,d->backgroundCorrection);
+        double x = s->slicePosition(axis,i);
+        magnitude.append(QPointF(x,std::abs(v)));
+        phase.append(QPointF(x,std::arg(v)*180.0/M_PI));
+        maxMagnitude = qMax(maxMagnitude,std::abs(v));
+    }
+    std::sort(magnitude.begin(),magnitude.end(),Impl::lessX);
+    std::sort(phase.begin(),phase.end(),Impl::lessX);
+    d->magnitude->replace(magnitude);
+    d->phase->replace(phase);
+    double first = magnitude.first().x(), last = magnitude.last().x();
+    if ( last<=first )
+        last = first+1.0;
+    d->positionAxis->setRange(first,last);
+    d->magnitudeAxis->setRange(0.0,maxMagnitude>0.0 ? 1.05*maxMagnitude : 1.0);
+}
+
+void ProfileView::updateSpectrum()
+{
+    if ( !isVisible() )
+        return;
+    SystemMatrix * s = d->systemMatrix;
+    if ( s==0 || !s->validPosition(d->position) || d->globalIndex<0 || d->globalIndex>s->maxGlobalIndex() )
+        return;
+    if ( d->spectrum->isRunning() )
+    {
+        // Gather the new voxel as soon as the old one has stopped
+        d->restart = true;
+        d->spectrum->cancel();
+        return;
+    }
+    d->spectrum->setBackgroundCorrection(d->backgroundCorrection);
+    d->spectrum->setReceiver(s->receiver(d->globalIndex));
+    d->spectrum->setPosition(d->position);
+    if ( d->spectrum->start() )
+        d->status->setText(tr("Reading voxel %1 of receiver %2...").arg(d->positionText()).arg(d->spectrum->receiver()+1));
+}
+
+void ProfileView::spectrumFinished(bool success)
+{
+    if ( d->restart )
+    {
+        d->restart = false;
+        updateSpectrum();
+        return;
+    }
+    if ( success )
+        showSpectrum();
+}
+
+void ProfileView::showSpectrum()
+{
+    QSettings settings;
+    settings.setValue("voxelSpectrumAbscissa",d->abscissa->currentIndex());
+    SystemMatrix * s = d->systemMatrix;
+    QVector<SystemMatrix::complex> values = d->spectrum->result();
+    if ( s==0 || values.isEmpty() )
+        return;
+
+    bool bySnr = d->abscissa->currentIndex()==1;
+    d->spectrumAxis->setTitleText(bySnr ? tr("SNR rank") : tr("Frequency / kHz"));
+    QVector<QPointF> points;
+    points.reserve(values.count());
+    double minMagnitude = std::numeric_limits<double>::max(), maxMagnitude = 0.0;
+    for ( int k=0; k<values.count(); k++ )
+    {
+        double m = std::abs(values.at(k));
+        // Zeros cannot be shown on the logarithmic axis
+        if ( m<=0.0 )
+            continue;
+        int globalIndex = s->globalIndex(d->spectrum->receiver(),k);
+        double x = bySnr ? s->snrIndex(globalIndex) : s->frequency(globalIndex)/1e3;
+        points.append(QPointF(x,m));
+        minMagnitude = qMin(minMagnitude,m);
+        maxMagnitude = qMax(maxMagnitude,m);
+    }
+    std::sort(points.begin(),points.end(),Impl::lessX);
+    d->spectrumSeries->replace(points);
+    if ( !points.isEmpty() )
+    {
+        d->spectrumAxis->setRange(points.first().x(),qMax(points.last().x(),points.first().x()+1.0));
+        d->spectrumMagnitudeAxis->setRange(minMagnitude,qMax(maxMagnitude,1.1*minMagnitude));
+    }
+    d->status->setText(tr("Voxel %1, receiver %2").arg(d->positionText()).arg(d->spectrum->receiver()+1));
+}
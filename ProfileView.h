@@ -0,0 +1,62 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef PROFILEVIEW_H
+#define PROFILEVIEW_H
+
+// Qt includes
+#include <QWidget>
+
+// Local includes
+#include "MatrixPosition.h"
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The ProfileView class shows magnitude and phase of the current component along a
+ *        line through the selected voxel, and the spectrum of that voxel over all components
+ *        of the current receiver, versus frequency or SNR rank
+ */
+class ProfileView : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit ProfileView(QWidget *parent = 0);
+    virtual ~ProfileView();
+public slots:
+    void setSystemMatrix(SystemMatrix * s);
+    void setBackgroundCorrection(bool b);
+    void setGlobalIndex(int globalIndex);
+    void setPosition(const MatrixPosition & pos);
+    void updateProfile();
+    void updateSpectrum();
+private slots:
+    void spectrumFinished(bool success);
+    void showSpectrum();
+protected:
+    virtual void showEvent(QShowEvent *);
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // PROFILEVIEW_H
@@ -0,0 +1,211 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Qt includes
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSettings>
+#include <QtWidgets/QCheckBox>
+#include <QtWidgets/QDoubleSpinBox>
+#include <QtWidgets/QFileDialog>
+#include <QtWidgets/QFormLayout>
+#include <QtWidgets/QHBoxLayout>
+#include <QtWidgets/QLabel>
+#include <QtWidgets/QPlainTextEdit>
+#include <QtWidgets/QPushButton>
+#include <QtWidgets/QSpinBox>
+#include <QtWidgets/QSplitter>
+#include <QtWidgets/QVBoxLayout>
+
+// Local includes
+#include "ReconstructionView.h"
+#include "KaczmarzSolver.h"
+#include "PlotWidget.h"
+#include "SystemMatrix.h"
+
+struct ReconstructionView::Impl
+{
+    KaczmarzSolver * solver;
+    SystemMatrix * systemMatrix;
+    bool backgroundCorrection;
+    QLabel * measurementName;
+    QPushButton * loadButton;
+    QSpinBox * iterations;
+    QDoubleSpinBox * lambda;
+    QDoubleSpinBox * minimumSnr;
+    QCheckBox * realPositive;
+    QPushButton * startButton;
+    QPlainTextEdit * log;
+    PlotWidget * plot;
+    QElapsedTimer timer;
+};
+
+ReconstructionView::ReconstructionView(QWidget *parent) : QWidget(parent), d(new Impl)
+{
+    QSettings settings;
+    d->systemMatrix = 0;
+    d->backgroundCorrection = true;
+    d->solver = new KaczmarzSolver(this);
+    connect(d->solver,SIGNAL(iterationFinished(int,double,double)),SLOT(showIteration(int,double,double)));
+    connect(d->solver,SIGNAL(finished(bool)),SLOT(reconstructionFinished(bool)));
+
+    QWidget * controls = new QWidget;
+    QFormLayout * form = new QFormLayout(controls);
+    QHBoxLayout * measurement = new QHBoxLayout;
+    d->measurementName = new QLabel(tr("none"));
+    d->loadButton = new QPushButton(tr("Load..."));
+    connect(d->loadButton,SIGNAL(clicked()),SLOT(loadMeasurement()));
+    measurement->addWidget(d->measurementName,1);
+    measurement->addWidget(d->loadButton);
+    form->addRow(tr("Measurement"),measurement);
+    d->iterations = new QSpinBox;
+    d->iterations->setRange(1,1000);
+    d->iterations->setValue(settings.value("reconstructionIterations",3).toInt());
+    form->addRow(tr("Iterations"),d->iterations);
+    d->lambda = new QDoubleSpinBox;
+    d->lambda->setDecimals(6);
+    d->lambda->setRange(0.0,100.0);
+    d->lambda->setSingleStep(0.001);
+    d->lambda->setValue(settings.value("reconstructionLambda",1e-3).toDouble());
+    d->lambda->setToolTip(tr("Tikhonov parameter relative to the mean row energy per voxel"));
+    form->addRow(tr("Regularization"),d->lambda);
+    d->minimumSnr = new QDoubleSpinBox;
+    d->minimumSnr->setRange(0.0,1e6);
+    d->minimumSnr->setDecimals(1);
+    d->minimumSnr->setValue(settings.value("reconstructionSnrThreshold",3.0).toDouble());
+    form->addRow(tr("Minimum SNR"),d->minimumSnr);
+    d->realPositive = new QCheckBox(tr("Real and non-negative"));
+    d->realPositive->setChecked(settings.value("reconstructionRealPositive",true).toBool());
+    form->addRow(d->realPositive);
+    d->startButton = new QPushButton(tr("Reconstruct"));
+    d->startButton->setEnabled(false);
+    connect(d->startButton,SIGNAL(clicked()),SLOT(reconstruct()));
+    form->addRow(d->startButton);
+    d->log = new QPlainTextEdit;
+    d->log->setReadOnly(true);
+    d->log->setMaximumBlockCount(1000);
+    form->addRow(d->log);
+
+    d->plot = new PlotWidget;
+    d->plot->setTitle(tr("Load a measurement to reconstruct it"));
+    d->plot->setTicksEnabled(false);
+
+    QSplitter * splitter = new QSplitter;
+    splitter->addWidget(controls);
+    splitter->addWidget(d->plot);
+    splitter->setStretchFactor(1,1);
+    QVBoxLayout * layout = new QVBoxLayout(this);
+    layout->setContentsMargins(0,0,0,0);
+    layout->addWidget(splitter);
+}
+
+ReconstructionView::~ReconstructionView()
+{
+    delete d;
+}
+
+void ReconstructionView::setSystemMatrix(SystemMatrix *s)
+{
+    // The solver reads the previous matrix until it has stopped
+    d->solver->cancel();
+    d->solver->waitForFinished();
+    d->systemMatrix = s;
+    d->solver->setSystemMatrix(s);
+    d->plot->setVolume(QVector<SystemMatrix::complex>());
+    d->plot->setSystemMatrix(0);
+    d->measurementName->setText(tr("none"));
+    d->startButton->setEnabled(false);
+}
+
+void ReconstructionView::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void ReconstructionView::loadMeasurement()
+{
+    if ( d->systemMatrix==0 )
+        return;
+    QSettings settings;
+    QString fileName = QFileDialog::getOpenFileName(this,tr("Load measurement"),
+                                                    settings.value("measurementDirectory",QDir::homePath()).toString(),
+                                                    tr("Measurements (*.bin *.raw);;All files (*)"));
+    if ( fileName.isEmpty() )
+        return;
+    settings.setValue("measurementDirectory",QFileInfo(fileName).path());
+    if ( d->solver->loadMeasurement(fileName) )
+    {
+        d->measurementName->setText(QFileInfo(fileName).fileName());
+        d->startButton->setEnabled(true);
+    }
+    else
+        d->log->appendPlainText(d->solver->errorString());
+}
+
+void ReconstructionView::reconstruct()
+{
+    if ( d->solver->isRunning() )
+    {
+        d->solver->cancel();
+        return;
+    }
+    QSettings settings;
+    settings.setValue("reconstructionIterations",d->iterations->value());
+    settings.setValue("reconstructionLambda",d->lambda->value());
+    settings.setValue("reconstructionSnrThreshold",d->minimumSnr->value());
+    settings.setValue("reconstructionRealPositive",d->realPositive->isChecked());
+
+    d->solver->setBackgroundCorrection(d->backgroundCorrection);
+    d->solver->setIterations(d->iterations->value());
+    d->solver->setRegularization(d->lambda->value());
+    d->solver->setMinimumSnr(d->minimumSnr->value());
+    d->solver->setRealPositive(d->realPositive->isChecked());
+    d->timer.start();
+    if ( !d->solver->start() )
+    {
+        d->log->appendPlainText(d->solver->errorString());
+        return;
+    }
+    d->startButton->setText(tr("Cancel"));
+    d->loadButton->setEnabled(false);
+}
+
+void ReconstructionView::showIteration(int iteration, double residual, double milliseconds)
+{
+    d->log->appendPlainText(tr("Iteration %1: residual %2, %3 ms").arg(iteration).arg(residual,0,'g',4).arg(milliseconds,0,'f',1));
+}
+
+void ReconstructionView::reconstructionFinished(bool success)
+{
+    d->startButton->setText(tr("Reconstruct"));
+    d->loadButton->setEnabled(true);
+    QString status = success ? tr("finished") : tr("stopped");
+    d->log->appendPlainText(tr("Reconstruction with %1 components %2 after %3 s.")
+                            .arg(d->solver->rowCount()).arg(status).arg(d->timer.elapsed()*1e-3,0,'f',2));
+    if ( !d->solver->errorString().isEmpty() )
+        d->log->appendPlainText(d->solver->errorString());
+    QVector<SystemMatrix::complex> result = d->solver->result();
+    if ( result.isEmpty() )
+        return;
+    d->plot->setSystemMatrix(d->systemMatrix);
+    d->plot->setVolume(result);
+}
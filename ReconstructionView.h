@@ -0,0 +1,54 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef RECONSTRUCTIONVIEW_H
+#define RECONSTRUCTIONVIEW_H
+
+// Qt includes
+#include <QWidget>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The ReconstructionView class reconstructs a measurement with the current system
+ *        matrix and shows the concentration, so the effect of edits can be judged directly
+ */
+class ReconstructionView : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit ReconstructionView(QWidget *parent = 0);
+    virtual ~ReconstructionView();
+public slots:
+    void setSystemMatrix(SystemMatrix * s);
+    void setBackgroundCorrection(bool b);
+    void loadMeasurement();
+    void reconstruct();
+private slots:
+    void showIteration(int iteration, double residual, double milliseconds);
+    void reconstructionFinished(bool success);
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // RECONSTRUCTIONVIEW_H
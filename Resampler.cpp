@@ -0,0 +1,257 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <cmath>
+
+// Qt includes
+#include <QtCore/QVector>
+
+// Local includes
+#include "Resampler.h"
+#include "VectorMath.h"
+
+typedef Resampler::complex complex;
+
+static const double pi = 3.14159265358979323846;
+
+static double sinc(double x)
+{
+    if ( std::fabs(x)<1e-12 )
+        return 1.0;
+    return std::sin(pi*x)/(pi*x);
+}
+
+// Kernel value at distance t in source voxels and its radius
+static double kernelValue(Resampler::Kernel kernel, double t)
+{
+    t = std::fabs(t);
+    switch ( kernel )
+    {
+    case Resampler::Trilinear:
+        return t<1.0 ? 1.0-t : 0.0;
+    case Resampler::Tricubic:
+        // Keys cubic convolution with a=-0.5
+        if ( t<1.0 )
+            return (1.5*t-2.5)*t*t+1.0;
+        if ( t<2.0 )
+            return ((-0.5*t+2.5)*t-4.0)*t+2.0;
+        return 0.0;
+    case Resampler::BandLimited:
+        return t<3.0 ? sinc(t)*sinc(t/3.0) : 0.0;
+    }
+    return 0.0;
+}
+
+static double kernelRadius(Resampler::Kernel kernel)
+{
+    switch ( kernel )
+    {
+    case Resampler::Trilinear:
+        return 1.0;
+    case Resampler::Tricubic:
+        return 2.0;
+    case Resampler::BandLimited:
+        return 3.0;
+    }
+    return 1.0;
+}
+
+struct Resampler::Impl
+{
+    // Sparse weights of one axis, taps of target index j are [start[j],start[j+1])
+    struct Axis
+    {
+        QVector<int> start, index;
+        QVector<double> weight;
+    };
+
+    Kernel kernel;
+    int sourceGrid[3], targetGrid[3];
+    double sourceFov[3], targetFov[3];
+    Axis axes[3];
+
+    void update()
+    {
+        for ( int a=0; a<3; a++ )
+        {
+            Axis & axis = axes[a];
+            int n = sourceGrid[a], m = targetGrid[a];
+            axis.start.fill(0,m+1);
+            axis.index.clear();
+            axis.weight.clear();
+            if ( n<1 || m<1 )
+                continue;
+            double sourceStep = sourceFov[a]/n, targetStep = targetFov[a]/m;
+            // Widen the band-limited kernel when the target is coarser than the source
+            double stretch = (kernel==BandLimited && sourceStep>0.0) ? qMax(1.0,targetStep/sourceStep) : 1.0;
+            double radius = kernelRadius(kernel)*stretch;
+            for ( int j=0; j<m; j++ )
+            {
+                axis.start[j] = axis.index.count();
+                // Continuous source index of the target voxel center, the centers of both fields of view coincide
+                double u = n==1 || sourceStep<=0.0 ? 0.0 : ((j+0.5)*targetStep-0.5*targetFov[a]+0.5*sourceFov[a])/sourceStep-0.5;
+                if ( u<-0.5 || u>n-0.5 )
+                    continue;
+                QVector<double> w(n,0.0);
+                double sum = 0.0;
+                for ( int i=static_cast<int>(std::floor(u-radius))+1; i<=static_cast<int>(std::floor(u+radius)); i++ )
+                {
+                    double v = kernelValue(kernel,(u-i)/stretch);
+                    // Taps beyond the border repeat the edge voxel
+                    w[qBound(0,i,n-1)] += v;
+                    sum += v;
+                }
+                if ( n==1 )
+                {
+                    w[0] = 1.0;
+                    sum = 1.0;
+                }
+                if ( sum==0.0 )
+                    continue;
+                for ( int i=0; i<n; i++ )
+                {
+                    if ( w.at(i)!=0.0 )
+                    {
+                        axis.index.append(i);
+                        axis.weight.append(w.at(i)/sum);
+                    }
+                }
+            }
+            axis.start[m] = axis.index.count();
+        }
+    }
+
+    // Resamples along one axis, dims holds the size of the input and is updated to the output
+    void resampleAxis(const complex * in, complex * out, int dims[3], int a) const
+    {
+        const Axis & axis = axes[a];
+        int inner = 1;
+        for ( int i=0; i<a; i++ )
+            inner *= dims[i];
+        int outer = 1;
+        for ( int i=a+1; i<3; i++ )
+            outer *= dims[i];
+        int n = dims[a], m = targetGrid[a];
+        for ( int o=0; o<outer; o++ )
+        {
+            const complex * src = in+o*n*inner;
+            complex * dst = out+o*m*inner;
+            for ( int j=0; j<m; j++ )
+            {
+                int first = axis.start.at(j), last = axis.start.at(j+1);
+                for ( int i=0; i<inner; i++ )
+                {
+#ifdef SFVIEW_USE_SSE2
+                    // A complex value fills one register
+                    __m128d sum = _mm_setzero_pd();
+                    for ( int t=first; t<last; t++ )
+                        sum = _mm_add_pd(sum,_mm_mul_pd(_mm_set1_pd(axis.weight.at(t)),
+                                                        _mm_loadu_pd(reinterpret_cast<const double*>(src+axis.index.at(t)*inner+i))));
+                    _mm_storeu_pd(reinterpret_cast<double*>(dst+j*inner+i),sum);
+#else
+                    complex sum = 0.0;
+                    for ( int t=first; t<last; t++ )
+                        sum += axis.weight.at(t)*src[axis.index.at(t)*inner+i];
+                    dst[j*inner+i] = sum;
+#endif
+                }
+            }
+        }
+        dims[a] = m;
+    }
+};
+
+Resampler::Resampler() : d(new Impl)
+{
+    d->kernel = Trilinear;
+    for ( int i=0; i<3; i++ )
+    {
+        d->sourceGrid[i] = d->targetGrid[i] = 0;
+        d->sourceFov[i] = d->targetFov[i] = 0.0;
+    }
+}
+
+Resampler::~Resampler()
+{
+    delete d;
+}
+
+QString Resampler::name(Kernel kernel)
+{
+    switch ( kernel )
+    {
+    case Trilinear:
+        return tr("Trilinear");
+    case Tricubic:
+        return tr("Tricubic");
+    case BandLimited:
+        return tr("Band-limited (Lanczos)");
+    }
+    return QString();
+}
+
+void Resampler::setKernel(Kernel kernel)
+{
+    d->kernel = kernel;
+    d->update();
+}
+
+Resampler::Kernel Resampler::kernel() const
+{
+    return d->kernel;
+}
+
+void Resampler::setSource(const int grid[3], const double fov[3])
+{
+    for ( int i=0; i<3; i++ )
+    {
+        d->sourceGrid[i] = grid[i];
+        d->sourceFov[i] = fov[i];
+    }
+    d->update();
+}
+
+void Resampler::setTarget(const int grid[3], const double fov[3])
+{
+    for ( int i=0; i<3; i++ )
+    {
+        d->targetGrid[i] = grid[i];
+        d->targetFov[i] = fov[i];
+    }
+    d->update();
+}
+
+int Resampler::targetPositions() const
+{
+    return d->targetGrid[0]*d->targetGrid[1]*d->targetGrid[2];
+}
+
+void Resampler::apply(const complex * source, complex * target) const
+{
+    int dims[3] = { d->sourceGrid[0], d->sourceGrid[1], d->sourceGrid[2] };
+    // x, y and z in turn, each pass only changes the size of its own axis
+    QVector<complex> first(d->targetGrid[0]*dims[1]*dims[2]);
+    d->resampleAxis(source,first.data(),dims,0);
+    QVector<complex> second(dims[0]*d->targetGrid[1]*dims[2]);
+    d->resampleAxis(first.constData(),second.data(),dims,1);
+    d->resampleAxis(second.constData(),target,dims,2);
+}
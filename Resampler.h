@@ -0,0 +1,72 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QCoreApplication>
+#include <QtCore/QString>
+
+/**
+ * @brief The Resampler class interpolates a component onto another voxel grid. Both fields of
+ *        view share their center, target voxels outside the source field of view are zero.
+ *        The kernel weights are computed once per axis and applied one axis after the other.
+ *        apply() only uses local buffers and may be called from several threads at once.
+ */
+class Resampler
+{
+    Q_DECLARE_TR_FUNCTIONS(Resampler)
+public:
+    typedef std::complex<double> complex;
+    /**
+     * @brief The Kernel enum: BandLimited is a Lanczos windowed sinc, widened when the target
+     *        grid is coarser so that it also acts as anti-aliasing filter
+     */
+    enum Kernel { Trilinear, Tricubic, BandLimited };
+    Resampler();
+    ~Resampler();
+    static QString name(Kernel kernel);
+    void setKernel(Kernel kernel);
+    Kernel kernel() const;
+    /**
+     * @brief setSource Grid and field of view of the input, the unit of fov is arbitrary but shared with setTarget()
+     */
+    void setSource(const int grid[3], const double fov[3]);
+    void setTarget(const int grid[3], const double fov[3]);
+    /**
+     * @brief targetPositions Number of values written by apply()
+     */
+    int targetPositions() const;
+    /**
+     * @brief apply Resample source, x fastest, into target
+     */
+    void apply(const complex * source, complex * target) const;
+private:
+    Q_DISABLE_COPY(Resampler)
+    struct Impl;
+    Impl * d;
+};
+
+#endif // RESAMPLER_H
@@ -20,6 +20,7 @@
  */
 
 // Standard includes
+#include <cmath>
 #include <limits>
 
 // Qt includes
@@ -34,6 +35,7 @@
 #include <QtCore/QMap>
 #include <QtCore/QPointer>
 #include <QtCore/QSettings>
+#include <QtCore/QVector>
 #include <QtGui/QColor>
 #include <QtGui/QPainter>
 
@@ -43,12 +45,24 @@
 #include "SystemMatrix.h"
 #include "ColorScale.h"
 #include "ColorScaleManager.h"
+#include "LowRankApproximation.h"
+#include "VectorMath.h"
 
 struct SFRenderer::Impl {
         QPointer<SystemMatrix> systemMatrix;
         Qt::Axis horizontalAxis,verticalAxis,sliceDirection;
         bool smoothScaling;
         bool backgroundCorrection;
+        const ColorScale * colorScale;
+        const LowRankApproximation * lowRank;
+        bool lowRankView;
+        int lowRankIndex;
+        QVector<SystemMatrix::complex> lowRankData;
+        bool percentileWindow, logMagnitude;
+        double lowerPercentile, upperPercentile;
+        // Color windows of the last component by slice, -1 for the whole frame
+        int windowIndex;
+        QMap<int,QPair<double,double> > windows;
         mutable QPointer<ColorScaleManager> m_colorScaleManager;
         ColorScaleManager * colorScaleManager() const
         {
@@ -66,20 +80,217 @@ struct SFRenderer::Impl {
 
         const ColorScale * currentColorScale() const
         {
+            if ( colorScale )
+                return colorScale;
             ColorScaleManager * csm = colorScaleManager();
             if ( csm )
                 return csm->currentColorScale();
             return 0;
         }
 
-        QColor color(const SystemMatrix::complex & v) const
+        // Components of the rank-k view are rebuilt from the factors, the last one is kept for further slices
+        const SystemMatrix::complex * data(int globalIndex, bool backgroundCorrection)
         {
-            const ColorScale * cs = currentColorScale();
-            if ( cs )
-                return cs->color(v);
-            return Qt::black;
+            if ( lowRankView && lowRank && lowRank->isReady() && lowRank->backgroundCorrection()==backgroundCorrection )
+            {
+                if ( lowRankIndex==globalIndex )
+                    return lowRankData.constData();
+                lowRankData.resize(systemMatrix->dimension(Qt::XAxis)*systemMatrix->dimension(Qt::YAxis)*systemMatrix->dimension(Qt::ZAxis));
+                if ( lowRank->reconstruct(globalIndex,lowRankData.data()) )
+                {
+                    lowRankIndex = globalIndex;
+                    return lowRankData.constData();
+                }
+            }
+            return systemMatrix->rawData(globalIndex,backgroundCorrection);
+        }
+
+        // Magnitude window of the whole block for slice -1, otherwise of the slice
+        void window(const SystemMatrix::complex * p, int slice, double & min, double & max) const
+        {
+            int grid[3], direction[3], inc[3];
+            for ( unsigned int i=0; i<3; i++ )
+                grid[i] = systemMatrix->dimension((Qt::Axis)i);
+            direction[0] = static_cast<int>(horizontalAxis);
+            direction[1] = static_cast<int>(verticalAxis);
+            direction[2] = static_cast<int>(sliceDirection);
+            for ( unsigned int i = 0; i < 3; i++ ) {
+                inc[i] = 1;
+                for ( int j = 0; j < direction[i]; j++ )
+                    inc[i] *= grid[j];
+            }
+
+            QVector<double> magnitudes;
+            if ( slice == -1 )
+            {
+                int block = grid[0] * grid[1] * grid[2];
+                magnitudes.resize(block);
+                for ( int i = 0; i < block; i++ )
+                    magnitudes[i] = abs ( p[i] );
+            }
+            else
+            {
+                magnitudes.reserve(grid[direction[0]]*grid[direction[1]]);
+                for ( int i = 0; i < grid[direction[0]]; i++ )
+                    for ( int j = 0; j < grid[direction[1]]; j++ )
+                        magnitudes.append( abs ( p[i * inc[0] + j * inc[1] + slice * inc[2]] ) );
+            }
+
+            min = std::numeric_limits<double>::max();
+            max = 0;
+            foreach ( double q, magnitudes )
+            {
+                if ( q > max )
+                    max = q;
+                if ( q < min )
+                    min = q;
+            }
+
+            if ( percentileWindow && max > min )
+            {
+                // Percentiles from a histogram of the magnitudes, interpolated within the bins
+                const int bins = 1024;
+                QVector<int> histogram(bins,0);
+                double scale = bins / ( max - min );
+                foreach ( double q, magnitudes )
+                    histogram[qMin(static_cast<int>((q-min)*scale),bins-1)]++;
+                double bounds[2];
+                double percentiles[2] = { lowerPercentile, upperPercentile };
+                for ( int k=0; k<2; k++ )
+                {
+                    double target = 0.01 * percentiles[k] * magnitudes.count();
+                    int sum = 0, bin = 0;
+                    while ( bin < bins-1 && sum + histogram.at(bin) < target )
+                        sum += histogram.at(bin++);
+                    double fraction = histogram.at(bin)>0 ? qBound(0.0,(target-sum)/histogram.at(bin),1.0) : 0.0;
+                    bounds[k] = min + ( bin + fraction ) / scale;
+                }
+                min = bounds[0];
+                max = qMax(bounds[1],bounds[0]);
+            }
+            else if ( QSettings().value("startColorScaleAtZero",true).toBool() )
+                min=0.0;
+        }
+
+        void cachedWindow(int globalIndex, const SystemMatrix::complex * p, int slice, double & min, double & max)
+        {
+            if ( windowIndex != globalIndex )
+            {
+                windows.clear();
+                windowIndex = globalIndex;
+            }
+            if ( !windows.contains(slice) )
+            {
+                window(p,slice,min,max);
+                windows.insert(slice,qMakePair(min,max));
+            }
+            min = windows.value(slice).first;
+            max = windows.value(slice).second;
+        }
+
+        void clearWindows()
+        {
+            windows.clear();
+            windowIndex = -1;
+        }
+
+        // Magnitude a mapped to [0,1] inside the window, logarithmic over at most three decades
+        double scaled(double a, double min, double max) const
+        {
+            if ( logMagnitude )
+            {
+                double lower = qMax(min,1e-3*max);
+                if ( a <= lower || max <= lower )
+                    return 0.0;
+                return qMin(std::log(a/lower)/std::log(max/lower),1.0);
+            }
+            if ( max <= min )
+                return a > min ? 1.0 : 0.0;
+            return qBound(0.0,(a-min)/(max-min),1.0);
+        }
+
+        // Linear interpolation between voxel centers, weights per axis are kept for the next slice
+        QSize weightSource, weightTarget;
+        QVector<int> columnIndex, rowIndex;
+        QVector<double> columnWeight, rowWeight;
+
+        static void linearWeights(int n, int m, QVector<int> & index, QVector<double> & weight)
+        {
+            index.resize(m);
+            weight.resize(m);
+            for ( int k=0; k<m; k++ )
+            {
+                double u = (k+0.5)*n/m-0.5;
+                int i = static_cast<int>(std::floor(u));
+                double w = u-i;
+                if ( i<0 )
+                {
+                    i = 0;
+                    w = 0.0;
+                }
+                if ( i>=n-1 )
+                {
+                    i = n-1;
+                    w = 0.0;
+                }
+                index[k] = i;
+                weight[k] = w;
+            }
         }
 
+        QVector<SystemMatrix::complex> interpolate(const QVector<SystemMatrix::complex> & plane, int width, int height, const QSize & size)
+        {
+            if ( weightSource!=QSize(width,height) || weightTarget!=size )
+            {
+                linearWeights(width,size.width(),columnIndex,columnWeight);
+                linearWeights(height,size.height(),rowIndex,rowWeight);
+                weightSource = QSize(width,height);
+                weightTarget = size;
+            }
+            int w = size.width(), h = size.height();
+            // Horizontal pass on the source rows, then vertical pass; a complex value fills one SSE2 register
+            QVector<SystemMatrix::complex> rows(w*height), result(w*h);
+            const double * src = reinterpret_cast<const double*>(plane.constData());
+            double * tmp = reinterpret_cast<double*>(rows.data());
+            for ( int j=0; j<height; j++ )
+            {
+                for ( int k=0; k<w; k++ )
+                {
+                    int i = columnIndex.at(k);
+                    int next = qMin(i+1,width-1);
+                    double b = columnWeight.at(k);
+                    const double * a0 = src+2*(j*width+i);
+                    const double * a1 = src+2*(j*width+next);
+#ifdef SFVIEW_USE_SSE2
+                    _mm_storeu_pd(tmp+2*(j*w+k),_mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0-b),_mm_loadu_pd(a0)),
+                                                          _mm_mul_pd(_mm_set1_pd(b),_mm_loadu_pd(a1))));
+#else
+                    tmp[2*(j*w+k)] = (1.0-b)*a0[0]+b*a1[0];
+                    tmp[2*(j*w+k)+1] = (1.0-b)*a0[1]+b*a1[1];
+#endif
+                }
+            }
+            double * dst = reinterpret_cast<double*>(result.data());
+            for ( int r=0; r<h; r++ )
+            {
+                int j = rowIndex.at(r);
+                double b = rowWeight.at(r);
+                const double * r0 = tmp+2*j*w;
+                const double * r1 = tmp+2*qMin(j+1,height-1)*w;
+                double * out = dst+2*r*w;
+#ifdef SFVIEW_USE_SSE2
+                __m128d wa = _mm_set1_pd(1.0-b), wb = _mm_set1_pd(b);
+                for ( int k=0; k<2*w; k+=2 )
+                    _mm_storeu_pd(out+k,_mm_add_pd(_mm_mul_pd(wa,_mm_loadu_pd(r0+k)),_mm_mul_pd(wb,_mm_loadu_pd(r1+k))));
+#else
+                for ( int k=0; k<2*w; k++ )
+                    out[k] = (1.0-b)*r0[k]+b*r1[k];
+#endif
+            }
+            return result;
+        }
+
+
 };
 
 SFRenderer::SFRenderer(QObject* parent): QObject(parent), d(new Impl)
@@ -90,6 +301,16 @@ SFRenderer::SFRenderer(QObject* parent): QObject(parent), d(new Impl)
     d->sliceDirection=Qt::ZAxis;
     d->smoothScaling=false;
     d->backgroundCorrection=false;
+    d->colorScale=0;
+    d->lowRank=0;
+    d->lowRankView=false;
+    d->lowRankIndex=-1;
+    QSettings settings;
+    d->percentileWindow=settings.value("percentileWindow",false).toBool();
+    d->logMagnitude=settings.value("logMagnitude",false).toBool();
+    d->lowerPercentile=settings.value("colorWindowLowerPercentile",1.0).toDouble();
+    d->upperPercentile=settings.value("colorWindowUpperPercentile",99.5).toDouble();
+    d->windowIndex=-1;
 }
 
 SFRenderer::~SFRenderer() {
@@ -98,7 +319,13 @@ SFRenderer::~SFRenderer() {
 
 void SFRenderer::setSystemMatrix(SystemMatrix* systemMatrix)
 {
+    if ( d->systemMatrix )
+        disconnect(d->systemMatrix,0,this,0);
     d->systemMatrix=systemMatrix;
+    d->lowRankIndex=-1;
+    d->clearWindows();
+    if ( systemMatrix )
+        connect(systemMatrix,SIGNAL(dataChange()),SLOT(clearWindows()));
 }
 
 SystemMatrix* SFRenderer::systemMatrix() const
@@ -116,6 +343,7 @@ void SFRenderer::setAxes(Qt::Axis horizontal, Qt::Axis vertical)
         d->sliceDirection = Qt::YAxis;
     else
         d->sliceDirection = Qt::ZAxis;
+    d->clearWindows();
 }
 
 Qt::Axis SFRenderer::horizontalAxis() const
@@ -136,6 +364,7 @@ Qt::Axis SFRenderer::sliceDirection() const
 void SFRenderer::setBackgroundCorrection(bool b)
 {
     d->backgroundCorrection=b;
+    d->clearWindows();
 }
 
 bool SFRenderer::backgroundCorrection() const
@@ -143,10 +372,94 @@ bool SFRenderer::backgroundCorrection() const
     return d->backgroundCorrection;
 }
 
-QImage SFRenderer::image(int globalIndex, int slice, Colorization colorScale)
+void SFRenderer::setLowRankApproximation(const LowRankApproximation * approximation)
+{
+    d->lowRank=approximation;
+    d->lowRankIndex=-1;
+    d->clearWindows();
+}
+
+void SFRenderer::setLowRankView(bool b)
+{
+    d->lowRankView=b;
+    d->lowRankIndex=-1;
+    d->clearWindows();
+}
+
+bool SFRenderer::lowRankView() const
+{
+    return d->lowRankView;
+}
+
+void SFRenderer::setPercentileWindow(bool b)
 {
     QSettings settings;
+    d->percentileWindow=b;
+    d->lowerPercentile=settings.value("colorWindowLowerPercentile",1.0).toDouble();
+    d->upperPercentile=settings.value("colorWindowUpperPercentile",99.5).toDouble();
+    d->clearWindows();
+}
+
+bool SFRenderer::percentileWindow() const
+{
+    return d->percentileWindow;
+}
+
+void SFRenderer::setLogMagnitude(bool b)
+{
+    d->logMagnitude=b;
+}
+
+bool SFRenderer::logMagnitude() const
+{
+    return d->logMagnitude;
+}
+
+void SFRenderer::clearWindows()
+{
+    d->clearWindows();
+}
 
+// A fixed color scale replaces the lookup of the ColorScaleManager, which is only safe in the GUI thread
+void SFRenderer::setColorScale(const ColorScale * colorScale)
+{
+    d->colorScale=colorScale;
+}
+
+QImage SFRenderer::image(int globalIndex, int slice, Colorization colorScale)
+{
+    return image(globalIndex,slice,QSize(),colorScale);
+}
+
+QImage SFRenderer::image(int globalIndex, int slice, const QSize & size, Colorization colorScale)
+{
+    const SystemMatrix::complex * p = d->data(globalIndex,backgroundCorrection());
+    if ( 0==p )
+    {
+        QSize matrixSize = size.isEmpty() ? systemMatrix()->sliceMatrix(d->horizontalAxis,d->verticalAxis) : size;
+        QImage image ( matrixSize.width(), matrixSize.height(), QImage::Format_RGB32 );
+        image.fill( Qt::black );
+        return image;
+    }
+    double min, max;
+    d->cachedWindow(globalIndex,p,colorScale==PerFrame ? -1 : slice,min,max);
+    return render(p,slice,size,min,max);
+}
+
+QImage SFRenderer::image(const SystemMatrix::complex * p, int slice, Colorization colorScale)
+{
+    return image(p,slice,QSize(),colorScale);
+}
+
+QImage SFRenderer::image(const SystemMatrix::complex * p, int slice, const QSize & size, Colorization colorScale)
+{
+    double min, max;
+    d->window(p,colorScale==PerFrame ? -1 : slice,min,max);
+    return render(p,slice,size,min,max);
+}
+
+QImage SFRenderer::render(const SystemMatrix::complex * p, int slice, const QSize & size, double min, double max)
+{
     int direction[3], inc[3], grid[3];
 
     for ( unsigned int i=0; i<3; i++ )
@@ -172,60 +485,34 @@ QImage SFRenderer::image(int globalIndex, int slice, Colorization colorScale)
             inc[i] *= grid[j];
     }
 
-    QImage image ( grid[direction[0]], grid[direction[1]], QImage::Format_RGB32 );
+    int width = grid[direction[0]], height = grid[direction[1]];
 
-    const SystemMatrix::complex * p = systemMatrix()->rawData(globalIndex,backgroundCorrection());
-    if ( 0==p )
-    {
-        image.fill( Qt::black );
-        return image;
-    }
-
-    double min = std::numeric_limits<double>::max(), max = 0;
+    // Interpolating the complex values instead of the colors keeps phase and magnitude consistent
+    QVector<SystemMatrix::complex> plane(width*height);
+    for ( int j = 0; j < height; j++ )
+        for ( int i = 0; i < width; i++ )
+            plane[j*width+i] = p[i * inc[0] + j * inc[1] + slice * inc[2]];
 
-    if ( colorScale == PerFrame )
-    {
-        int block = grid[0] * grid[1] * grid[2];
-        for ( int i = 0; i < block; i++ ) {
-            double q = abs ( p[i] );
-
-            if ( q > max )
-                max = q;
-
-            if ( q < min )
-                min = q;
-        }
-    }
-    else
+    if ( size.isValid() && !size.isEmpty() && size!=QSize(width,height) )
     {
-        for ( int i = 0; i < grid[direction[0]]; i++ )
-        {
-            for ( int j = 0; j < grid[direction[1]]; j++ )
-            {
-                int index = i * inc[0] + j * inc[1] + slice * inc[2];
-                double q = abs ( p[index] );
-
-                if ( q > max )
-                    max = q;
-
-                if ( q < min )
-                    min = q;
-            }
-        }
+        plane = d->interpolate(plane,width,height,size);
+        width = size.width();
+        height = size.height();
     }
 
-    if ( settings.value("startColorScaleAtZero",true).toBool() )
-        min=0.0;
+    QImage image ( width, height, QImage::Format_RGB32 );
+    const ColorScale * cs = d->currentColorScale();
 
-    for ( int i = 0; i < grid[direction[0]]; i++ ) {
-        for ( int j = 0; j < grid[direction[1]]; j++ ) {
-            int index = i * inc[0] + j * inc[1] + slice * inc[2];
+    for ( int j = 0; j < height; j++ ) {
+        QRgb * line = reinterpret_cast<QRgb*>(image.scanLine(j));
+        const SystemMatrix::complex * v = plane.constData() + j * width;
 
-            SystemMatrix::complex v = p[index];
-            double q = ( abs ( v ) - min ) / ( max - min );
-            v = std::polar(q,arg(v));
+        for ( int i = 0; i < width; i++ ) {
+            // Same as polar(scaled(|v|),arg(v)) without the trigonometric functions
+            double a = abs ( v[i] );
+            SystemMatrix::complex q = a > 0.0 ? v[i] * ( d->scaled(a,min,max) / a ) : SystemMatrix::complex(0.0);
 
-            image.setPixel ( i, j, d->color(v).rgb() );
+            line[i] = cs ? cs->rgb(q) : qRgb(0,0,0);
         }
     }
 
@@ -234,70 +521,19 @@ QImage SFRenderer::image(int globalIndex, int slice, Colorization colorScale)
 
 void SFRenderer::plotLegend (QPainter * p, const QRect & area, int globalIndex , int slice)
 {
-    QSettings settings;
-
-    const SystemMatrix::complex * c = systemMatrix()->rawData(globalIndex, backgroundCorrection());
+    const SystemMatrix::complex * c = d->data(globalIndex, backgroundCorrection());
     if ( 0==c )
     {
         return;
     }
+    double min, max;
+    d->cachedWindow(globalIndex,c,slice,min,max);
+    d->currentColorScale()->drawLegend(p,area,min,max,d->logMagnitude);
+}
 
-    int direction[3], inc[3], grid[3];
-
-    for ( unsigned int i=0; i<3; i++ )
-    {
-        grid[i] = systemMatrix()->dimension((Qt::Axis)i);
-    }
-
-    direction[0] = static_cast<int>(d->horizontalAxis);
-    direction[1] = static_cast<int>(d->verticalAxis);
-    direction[2] = static_cast<int>(d->sliceDirection);
-
-    for ( unsigned int i = 0; i < 3; i++ ) {
-        inc[i] = 1;
-
-        for ( int j = 0; j < direction[i]; j++ )
-            inc[i] *= grid[j];
-    }
-
-    int block = 1;
-    for ( unsigned int i=0; i<3; i++ )
-        block *= grid[i];
-
-    double min = std::numeric_limits<double>::max(), max = 0;
-
-    if ( slice==-1 )
-    {
-        for ( int i = 0; i < block; i++ ) {
-            double q = abs ( c[i] );
-
-            if ( q > max )
-                max = q;
-
-            if ( q < min )
-                min = q;
-        }
-    }
-    else
-    {
-        for ( int i = 0; i < grid[direction[0]]; i++ )
-        {
-            for ( int j = 0; j < grid[direction[1]]; j++ )
-            {
-                int index = i * inc[0] + j * inc[1] + slice * inc[2];
-                double q = abs ( c[index] );
-
-                if ( q > max )
-                    max = q;
-
-                if ( q < min )
-                    min = q;
-            }
-        }
-    }
-
-    if ( settings.value("startColorScaleAtZero",true).toBool() )
-        min=0.0;
-
-    d->currentColorScale()->drawLegend(p,area,min,max);
+void SFRenderer::plotLegend (QPainter * p, const QRect & area, const SystemMatrix::complex * c, int slice)
+{
+    double min, max;
+    d->window(c,slice,min,max);
+    d->currentColorScale()->drawLegend(p,area,min,max,d->logMagnitude);
 }
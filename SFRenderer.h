@@ -22,6 +22,9 @@
 #ifndef SFRENDERER_H
 #define SFRENDERER_H
 
+// Standard includes
+#include <complex>
+
 // Qt includes
 #include <QtCore/QObject>
 #include <QtCore/QStringList>
@@ -30,9 +33,11 @@
 // Forward declarations
 class ColorScale;
 class ColorScaleManager;
+class LowRankApproximation;
 class SystemMatrix;
 class QPainter;
 class QRect;
+class QSize;
 
 class SFRenderer : public QObject
 {
@@ -46,13 +51,41 @@ public:
     Qt::Axis verticalAxis() const;
     Qt::Axis sliceDirection() const;
     bool backgroundCorrection() const;
+    bool lowRankView() const;
+    bool percentileWindow() const;
+    bool logMagnitude() const;
+    /**
+     * @brief setLowRankApproximation Factors used for the rank-k view, call again after they changed
+     */
+    void setLowRankApproximation(const LowRankApproximation * approximation);
     QImage image ( int globalIndex, int slice, Colorization colorScale=PerFrame );
+    QImage image ( const std::complex<double> * data, int slice, Colorization colorScale=PerFrame );
+    /**
+     * @brief image Slice interpolated to size in the data domain before the colors are looked up
+     */
+    QImage image ( int globalIndex, int slice, const QSize & size, Colorization colorScale=PerFrame );
+    QImage image ( const std::complex<double> * data, int slice, const QSize & size, Colorization colorScale=PerFrame );
     void plotLegend( QPainter *, const QRect &, int globalIndex, int slice=-1 );
+    void plotLegend( QPainter *, const QRect &, const std::complex<double> * data, int slice=-1 );
 public slots:
     void setSystemMatrix (SystemMatrix * systemMatrix);
     void setAxes(Qt::Axis horizontal, Qt::Axis vertical);
     void setBackgroundCorrection(bool);
+    void setColorScale(const ColorScale *);
+    void setLowRankView(bool);
+    /**
+     * @brief setPercentileWindow Map the colors between the percentiles set by colorWindowLowerPercentile
+     *                            and colorWindowUpperPercentile instead of minimum and maximum
+     */
+    void setPercentileWindow(bool);
+    /**
+     * @brief setLogMagnitude Logarithmic color mapping of the magnitude over at most three decades
+     */
+    void setLogMagnitude(bool);
+private slots:
+    void clearWindows();
 private:
+    QImage render(const std::complex<double> * data, int slice, const QSize & size, double min, double max);
     struct Impl;
     Impl * d;
 };
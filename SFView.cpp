@@ -34,10 +34,12 @@
 #include <QtWidgets/QMenu>
 #include <QtWidgets/QMenuBar>
 #include <QtWidgets/QAction>
+#include <QtWidgets/QHBoxLayout>
 #include <QtWidgets/QVBoxLayout>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QMessageBox>
 #include <QtWidgets/QRadioButton>
+#include <QtGui/QCursor>
 #include <QtGui/QDragEnterEvent>
 #include <QtWidgets/QTableWidget>
 #include <QtWidgets/QTabWidget>
@@ -45,7 +47,11 @@
 #include <QtGui/QVector3D>
 #include <QtCore/QMimeData>
 #include <QtWidgets/QStatusBar>
-#include <QtWidgets/QProgressBar>
+#include <QtWidgets/QProgressDialog>
+#include <QtWidgets/QDialogButtonBox>
+#include <QtWidgets/QDoubleSpinBox>
+#include <QtWidgets/QCheckBox>
+#include <QtCore/QEventLoop>
 
 #include <QDebug>
 
@@ -60,6 +66,16 @@
 #include "ui_SettingsDialog.h"
 #include "SpectralPlot.h"
 #include "PhaseView.h"
+#include "ExportEngine.h"
+#include "MatrixExporter.h"
+#include "ReconstructionView.h"
+#include "SimilarityView.h"
+#include "ProfileView.h"
+#include "SnrStatistics.h"
+#include "SnrStatisticsView.h"
+#include "PatternIndex.h"
+#include "LowRankApproximation.h"
+#include "UndoAllJob.h"
 #include "utility.h"
 
 #define TO_STRING(s) X_TO_STRING(s)
@@ -72,8 +88,21 @@ struct SFView::Impl
     Impl() : receiver ( 0 ),
              frame ( 0 ),
              undoAction( 0 ),
+             brushShapeGroup( 0 ),
+             brushRadiusGroup( 0 ),
              spectralPlot( 0 ),
              phaseView( 0 ),
+             reconstructionView( 0 ),
+             reconstructionTool( 0 ),
+             similarityView( 0 ),
+             similarityTool( 0 ),
+             profileView( 0 ),
+             profileTool( 0 ),
+             snrStatistics( 0 ),
+             snrStatisticsView( 0 ),
+             snrStatisticsTool( 0 ),
+             patternIndex( 0 ),
+             lowRank( 0 ),
              colorScaleManager( 0 ),
              systemMatrix ( 0 ), ui(0) {}
     QButtonGroup * receiverSelect;
@@ -83,9 +112,26 @@ struct SFView::Impl
     int frame;
     QAction * recentFiles[SFView::MaxRecentFiles];
     QAction * undoAction, * undoAllAction;
+    QAction * exportAction;
+    QAction * exportMatrixAction;
+    QAction * findSimilarAction;
+    QAction * lowRankAction, * lowRankViewAction;
+    QAction * percentileWindowAction, * logMagnitudeAction;
+    QActionGroup * brushShapeGroup, * brushRadiusGroup;
     PlotWidget * plotWidget;
     SpectralPlot * spectralPlot;
     PhaseView * phaseView;
+    ReconstructionView * reconstructionView;
+    QDockWidget * reconstructionTool;
+    SimilarityView * similarityView;
+    QDockWidget * similarityTool;
+    ProfileView * profileView;
+    QDockWidget * profileTool;
+    SnrStatistics * snrStatistics;
+    SnrStatisticsView * snrStatisticsView;
+    QDockWidget * snrStatisticsTool;
+    PatternIndex * patternIndex;
+    LowRankApproximation * lowRank;
     ColorScaleManager * colorScaleManager;
     SystemMatrix * systemMatrix;
     SFView::Mode mode;
@@ -170,7 +216,7 @@ void SFView::setupGui()
     d->plotWidget->setMouseTracking( true );
     d->plotWidget->installEventFilter( this );
     d->plotWidget->setTitle( d->about );
-    connect( d->colorScaleManager, SIGNAL(colorScaleChanged()),d->plotWidget,SLOT(update()));
+    connect( d->colorScaleManager, SIGNAL(colorScaleChanged()),d->plotWidget,SLOT(refresh()));
 
     d->phaseView = new PhaseView;
     d->ui->phaseViewTool->setWidget(d->phaseView);
@@ -180,6 +226,49 @@ void SFView::setupGui()
     d->ui->spectrumViewTool->setWidget(d->spectralPlot);
     connect(d->spectralPlot,SIGNAL(globalIndexSelect(int)),SLOT(setGlobalIndex(int)));
 
+    d->reconstructionView = new ReconstructionView;
+    d->reconstructionTool = new QDockWidget(tr("Reconstruction"),this);
+    d->reconstructionTool->setObjectName("reconstructionTool");
+    d->reconstructionTool->setWidget(d->reconstructionView);
+    addDockWidget(Qt::BottomDockWidgetArea,d->reconstructionTool);
+    d->reconstructionTool->hide();
+    d->ui->menuTools->addAction(d->reconstructionTool->toggleViewAction());
+
+    d->similarityView = new SimilarityView;
+    d->similarityTool = new QDockWidget(tr("Similar components"),this);
+    d->similarityTool->setObjectName("similarityTool");
+    d->similarityTool->setWidget(d->similarityView);
+    addDockWidget(Qt::RightDockWidgetArea,d->similarityTool);
+    d->similarityTool->hide();
+    d->ui->menuTools->addAction(d->similarityTool->toggleViewAction());
+    connect(d->similarityView,SIGNAL(globalIndexSelect(int)),SLOT(setGlobalIndex(int)));
+
+    d->profileView = new ProfileView;
+    d->profileTool = new QDockWidget(tr("Profiles"),this);
+    d->profileTool->setObjectName("profileTool");
+    d->profileTool->setWidget(d->profileView);
+    addDockWidget(Qt::RightDockWidgetArea,d->profileTool);
+    d->profileTool->hide();
+    d->ui->menuTools->addAction(d->profileTool->toggleViewAction());
+    connect(d->plotWidget,SIGNAL(voxelSelected(MatrixPosition)),d->profileView,SLOT(setPosition(MatrixPosition)));
+
+    d->snrStatistics = new SnrStatistics(this);
+    d->snrStatisticsView = new SnrStatisticsView;
+    d->snrStatisticsView->setStatistics(d->snrStatistics);
+    d->snrStatisticsTool = new QDockWidget(tr("SNR statistics"),this);
+    d->snrStatisticsTool->setObjectName("snrStatisticsTool");
+    d->snrStatisticsTool->setWidget(d->snrStatisticsView);
+    addDockWidget(Qt::BottomDockWidgetArea,d->snrStatisticsTool);
+    d->snrStatisticsTool->hide();
+    d->ui->menuTools->addAction(d->snrStatisticsTool->toggleViewAction());
+
+    d->patternIndex = new PatternIndex(this);
+    connect(d->patternIndex,SIGNAL(finished(bool)),SLOT(patternIndexFinished(bool)));
+
+    d->lowRank = new LowRankApproximation(this);
+    d->plotWidget->setLowRankApproximation(d->lowRank);
+    connect(d->lowRank,SIGNAL(discarded()),SLOT(updateLowRankView()));
+
     d->positionOutput = new QLabel;
     d->positionOutput->setFrameStyle( QFrame::StyledPanel | QFrame::Sunken );
     statusBar()->addWidget(d->positionOutput);
@@ -209,6 +298,23 @@ void SFView::setupActions()
 
     connect( d->ui->actionCopy, SIGNAL(triggered()), d->plotWidget, SLOT( imageToClipboard() ));
 
+    if ( d->mode == Viewer )
+    {
+        QAction * openMdf = new QAction( tr("Open MDF file..."), this );
+        connect(openMdf,SIGNAL(triggered()),SLOT(openMdfFile()));
+        d->ui->menuFile->insertAction( d->ui->recentFiles->menuAction(), openMdf );
+    }
+
+    d->exportAction = new QAction( tr("Export images..."), this );
+    d->exportAction->setEnabled( false );
+    connect(d->exportAction,SIGNAL(triggered()),SLOT(exportImages()));
+    d->ui->menuFile->insertAction( d->ui->fileQuit, d->exportAction );
+    d->exportMatrixAction = new QAction( tr("Export matrix..."), this );
+    d->exportMatrixAction->setEnabled( false );
+    connect(d->exportMatrixAction,SIGNAL(triggered()),SLOT(exportMatrix()));
+    d->ui->menuFile->insertAction( d->ui->fileQuit, d->exportMatrixAction );
+    d->ui->menuFile->insertSeparator( d->ui->fileQuit );
+
     if ( d->mode == Editor )
     {
         d->undoAction = new QAction( tr("Undo"), this );
@@ -221,8 +327,70 @@ void SFView::setupActions()
         d->undoAllAction->setEnabled( false );
         connect(d->undoAllAction,SIGNAL(triggered()),SLOT(undoAll()));
         d->ui->menuEdit->addAction( d->undoAllAction );
+
+        // Region interpolated around the voxel under the cursor
+        QMenu * brushMenu = d->ui->menuEdit->addMenu( tr("Brush") );
+        int shape = settings.value("brushShape",PlotWidget::VoxelBrush).toInt();
+        int radius = settings.value("brushRadius",1).toInt();
+        d->brushShapeGroup = new QActionGroup( this );
+        QStringList shapes = QStringList() << tr("Single voxel") << tr("Box") << tr("Sphere");
+        for ( int i=0; i<shapes.count(); i++ )
+        {
+            QAction * a = d->brushShapeGroup->addAction( shapes.at(i) );
+            a->setCheckable( true );
+            a->setChecked( i==shape );
+            a->setData( i );
+        }
+        brushMenu->addActions( d->brushShapeGroup->actions() );
+        brushMenu->addSeparator();
+        d->brushRadiusGroup = new QActionGroup( this );
+        for ( int r=1; r<=4; r++ )
+        {
+            QAction * a = d->brushRadiusGroup->addAction( tr("Radius %n voxel(s)","",r) );
+            a->setCheckable( true );
+            a->setChecked( r==radius );
+            a->setData( r );
+        }
+        brushMenu->addActions( d->brushRadiusGroup->actions() );
+        connect( d->brushShapeGroup, SIGNAL(triggered(QAction*)), SLOT(updateBrush()) );
+        connect( d->brushRadiusGroup, SIGNAL(triggered(QAction*)), SLOT(updateBrush()) );
+        updateBrush();
     }
 
+    d->findSimilarAction = new QAction( tr("Find similar components"), this );
+    d->findSimilarAction->setEnabled( false );
+    d->findSimilarAction->setShortcut(QKeySequence::Find);
+    connect(d->findSimilarAction,SIGNAL(triggered()),SLOT(findSimilarComponents()));
+    d->ui->menuEdit->addAction( d->findSimilarAction );
+
+    d->lowRankAction = new QAction( tr("Low-rank approximation..."), this );
+    d->lowRankAction->setEnabled( false );
+    connect(d->lowRankAction,SIGNAL(triggered()),SLOT(computeLowRankApproximation()));
+    d->ui->menuTools->addSeparator();
+    d->ui->menuTools->addAction( d->lowRankAction );
+
+    d->lowRankViewAction = new QAction( tr("Rank-k view"), this );
+    d->lowRankViewAction->setCheckable( true );
+    d->lowRankViewAction->setEnabled( false );
+    d->lowRankViewAction->setToolTip( tr("Show components rebuilt from the low-rank approximation") );
+    connect(d->lowRankViewAction,SIGNAL(toggled(bool)),d->plotWidget,SLOT(setLowRankView(bool)));
+    d->ui->menuView->addAction( d->lowRankViewAction );
+
+    d->percentileWindowAction = new QAction( tr("Percentile color window"), this );
+    d->percentileWindowAction->setCheckable( true );
+    d->percentileWindowAction->setChecked( d->plotWidget->percentileWindow() );
+    d->percentileWindowAction->setToolTip( tr("Map the colors between the %1th and %2th percentile of the magnitude, so single spikes do not darken the image")
+                                           .arg(settings.value("colorWindowLowerPercentile",1.0).toDouble())
+                                           .arg(settings.value("colorWindowUpperPercentile",99.5).toDouble()) );
+    connect(d->percentileWindowAction,SIGNAL(toggled(bool)),d->plotWidget,SLOT(setPercentileWindow(bool)));
+    d->ui->menuView->addAction( d->percentileWindowAction );
+
+    d->logMagnitudeAction = new QAction( tr("Logarithmic magnitude"), this );
+    d->logMagnitudeAction->setCheckable( true );
+    d->logMagnitudeAction->setChecked( d->plotWidget->logMagnitude() );
+    connect(d->logMagnitudeAction,SIGNAL(toggled(bool)),d->plotWidget,SLOT(setLogMagnitude(bool)));
+    d->ui->menuView->addAction( d->logMagnitudeAction );
+
     bool b = settings.value("backgroundCorrection").toBool();
     d->ui->backgroundCorrection->setChecked( b );
     d->plotWidget->setBackgroundCorrection(b);
@@ -281,9 +449,15 @@ void SFView::storeSettings()
     settings.setValue("windowState", saveState());
     settings.setValue("backgroundCorrection", backgroundCorrection());
     settings.setValue("smoothScaling", d->plotWidget->smoothScaling());
+    settings.setValue("percentileWindow", d->plotWidget->percentileWindow());
+    settings.setValue("logMagnitude", d->plotWidget->logMagnitude());
     settings.setValue("legend", d->plotWidget->legendEnabled());
     settings.setValue("showTicks", d->plotWidget->ticksEnabled());
     settings.setValue("interpolationThreshold", d->interpolationThreshold);
+    if ( d->brushShapeGroup && d->brushShapeGroup->checkedAction() )
+        settings.setValue("brushShape", d->brushShapeGroup->checkedAction()->data());
+    if ( d->brushRadiusGroup && d->brushRadiusGroup->checkedAction() )
+        settings.setValue("brushRadius", d->brushRadiusGroup->checkedAction()->data());
 }
 
 void SFView::setIconSize(int size)
@@ -315,6 +489,8 @@ void SFView::setGlobalIndex(int index, MixingUpdate updateMixingTerms)
 {
     d->plotWidget->setGlobalIndex(index);
     d->phaseView->setGlobalIndex(index);
+    d->similarityView->setGlobalIndex(index);
+    d->profileView->setGlobalIndex(index);
     d->spectralPlot->highlightGlobalIndex(index);
 
     updateNavigation( index, updateMixingTerms );
@@ -324,6 +500,22 @@ void SFView::setBackgroundCorrection(bool b)
 {
     d->plotWidget->setBackgroundCorrection(b);
     d->phaseView->setBackgroundCorrection(b);
+    d->reconstructionView->setBackgroundCorrection(b);
+    d->similarityView->setBackgroundCorrection(b);
+    d->profileView->setBackgroundCorrection(b);
+    d->patternIndex->setBackgroundCorrection(b);
+    if ( d->spectralPlot )
+        d->spectralPlot->setBackgroundCorrection(b);
+    updateLowRankView();
+}
+
+void SFView::updateLowRankView()
+{
+    // The factors only replace the components shown with the same background correction
+    bool available = d->lowRank->isReady() && d->lowRank->backgroundCorrection()==backgroundCorrection();
+    d->lowRankViewAction->setEnabled(available);
+    if ( !available )
+        d->lowRankViewAction->setChecked(false);
 }
 
 void SFView::setSliceDirection ( int a ) {
@@ -412,11 +604,30 @@ void SFView::loadSystemMatrix ( const QString & procnoPath ) {
         return;
     }
 
+    d->plotWidget->setSystemMatrix(0);
+    d->reconstructionView->setSystemMatrix(0);
+    d->similarityView->setSystemMatrix(0);
+    d->profileView->setSystemMatrix(0);
+    d->snrStatistics->setSystemMatrix(0);
+    d->patternIndex->setSystemMatrix(0);
+    d->lowRank->setSystemMatrix(0);
     if ( d->systemMatrix )
         delete d->systemMatrix;
     d->systemMatrix = newMatrix;
     d->plotWidget->setSystemMatrix(newMatrix);
     d->phaseView->setSystemMatrix(newMatrix);
+    d->reconstructionView->setSystemMatrix(newMatrix);
+    d->similarityView->setSystemMatrix(newMatrix);
+    d->profileView->setSystemMatrix(newMatrix);
+    d->snrStatistics->setSystemMatrix(newMatrix);
+    d->patternIndex->setSystemMatrix(newMatrix);
+    d->patternIndex->setBackgroundCorrection(backgroundCorrection());
+    if ( !d->patternIndex->load(PatternIndex::defaultFileName(newMatrix)) && QSettings().value("patternIndexOnLoad",false).toBool() )
+        d->patternIndex->start();
+    d->lowRank->setSystemMatrix(newMatrix);
+    d->lowRank->load(LowRankApproximation::defaultFileName(newMatrix));
+    d->plotWidget->setLowRankApproximation(d->lowRank);
+    updateLowRankView();
     if ( d->spectralPlot )
         d->spectralPlot->setSystemMatrix(newMatrix);
 
@@ -430,6 +641,10 @@ void SFView::loadSystemMatrix ( const QString & procnoPath ) {
     d->ui->informationTool->widget()->setEnabled( true );
     d->ui->actionCopy->setEnabled( true );
     d->ui->actionModifiable->setEnabled( true );
+    d->exportAction->setEnabled( true );
+    d->exportMatrixAction->setEnabled( true );
+    d->findSimilarAction->setEnabled( true );
+    d->lowRankAction->setEnabled( true );
 
     if ( d->mode == Editor )
         updateUndo();
@@ -476,6 +691,13 @@ void SFView::openFile() {
     setSnrIndex ( 0 );
 }
 
+void SFView::openMdfFile() {
+    QString fileName = QFileDialog::getOpenFileName ( this, tr("Select MDF file"), QString(), tr("MDF files (*.mdf *.h5 *.hdf5)") );
+
+    if ( ! fileName.isEmpty() )
+        loadSystemMatrix ( fileName );
+}
+
 void SFView::updateRecentFiles() {
     QSettings settings;
     QStringList files = settings.value("recentFileList").toStringList();
@@ -502,6 +724,10 @@ void SFView::hideEvent(QHideEvent * ev)
     d->dockWidgetVisibility[d->ui->informationTool]=d->ui->informationTool->isVisible();
     d->dockWidgetVisibility[d->ui->phaseViewTool]=d->ui->phaseViewTool->isVisible();
     d->dockWidgetVisibility[d->ui->spectrumViewTool]=d->ui->spectrumViewTool->isVisible();
+    d->dockWidgetVisibility[d->reconstructionTool]=d->reconstructionTool->isVisible();
+    d->dockWidgetVisibility[d->similarityTool]=d->similarityTool->isVisible();
+    d->dockWidgetVisibility[d->profileTool]=d->profileTool->isVisible();
+    d->dockWidgetVisibility[d->snrStatisticsTool]=d->snrStatisticsTool->isVisible();
     QMainWindow::hideEvent(ev);
 }
 
@@ -578,7 +804,11 @@ void SFView::showContextMenu(const QPoint & pos, const MatrixPosition & matrixPo
     int globalIndex = systemMatrix()->globalIndex(d->receiver,d->frame);
     QMenu popup;
     QAction * interpolateOneFrequency=popup.addAction(tr("Interpolate this voxel for this frequency"));
-    QAction * interpolateAllFrequencies=popup.addAction(tr("Interpolate this voxel for all frequencies..."));
+    QAction * interpolateAllFrequencies=0;
+    if ( d->plotWidget->brushRegion(matrixPos).count()>1 )
+        interpolateAllFrequencies=popup.addAction(tr("Interpolate the brush region for all frequencies..."));
+    else
+        interpolateAllFrequencies=popup.addAction(tr("Interpolate this voxel for all frequencies..."));
     QAction * selected = popup.exec(pos);
     if ( selected==interpolateOneFrequency )
     {
@@ -723,23 +953,15 @@ void SFView::updateInfo()
     QStringList headers;
     headers << tr("Treshold") << tr("X") << tr ("Y") << tr("Z") << tr("Total");
     d->ui->snrTable->setHorizontalHeaderLabels(headers);
-    int index=0, i=0;
+    int index=0;
     double threshold;
-    int countX=0, countY=0, countZ=0, row=0;
+    int row=0;
+    // The thresholds are edges of the histogram bins, so the counts are exact
     while ( (threshold=steps[index%3]*factor) >= 1.0 )
     {
-        int globalIndex = systemMatrix()->globalIndex(i);
-        while ( systemMatrix()->snr(globalIndex)> threshold )
-        {
-            switch( systemMatrix()->receiver(globalIndex) )
-            {
-                case 0 : countX++; break;
-                case 1 : countY++; break;
-                case 2 : countZ++; break;
-                default: break;
-            }
-            globalIndex = systemMatrix()->globalIndex(++i);
-        }
+        int countX = d->snrStatistics->countAbove(0,threshold);
+        int countY = d->snrStatistics->countAbove(1,threshold);
+        int countZ = d->snrStatistics->countAbove(2,threshold);
         int totalCount = countX+countY+countZ;
 
         if ( totalCount>0 )
@@ -795,16 +1017,19 @@ bool SFView::interpolate(const MatrixPosition &pos, int globalIndex)
     }
     else
     {
-        int numChanges=CorrectionDialog::performCorrection(systemMatrix(),d->receiver,pos,this);
+        int numChanges=CorrectionDialog::performCorrection(systemMatrix(),d->receiver,pos,d->plotWidget->brushRegion(pos),this);
         if ( numChanges>0 )
         {
-            statusBar()->showMessage(tr("Voxel changed for %1 frequencies.").arg(numChanges),10000);
+            int voxels, receivers, frequencies;
+            systemMatrix()->lastChangeExtent(&voxels,&receivers,&frequencies);
+            statusBar()->showMessage(tr("%1 voxels changed for %2 receivers and %3 frequencies.")
+                                     .arg(voxels).arg(receivers).arg(frequencies),10000);
             changed=true;
         }
     }
     if ( changed )
     {
-        d->plotWidget->update();
+        d->plotWidget->refresh();
         updateNavigation(globalIndex,KeepMixingTerms);
         updateInfo();
         updateUndo();
@@ -833,13 +1058,28 @@ void SFView::updateUndo()
 
 }
 
+void SFView::updateBrush()
+{
+    if ( 0==d->brushShapeGroup || 0==d->brushRadiusGroup )
+        return;
+    PlotWidget::BrushShape shape = PlotWidget::VoxelBrush;
+    if ( d->brushShapeGroup->checkedAction() )
+        shape = static_cast<PlotWidget::BrushShape>(d->brushShapeGroup->checkedAction()->data().toInt());
+    int radius = 1;
+    if ( d->brushRadiusGroup->checkedAction() )
+        radius = d->brushRadiusGroup->checkedAction()->data().toInt();
+    d->plotWidget->setBrush(shape,radius);
+    // The radius does not matter for single voxels
+    d->brushRadiusGroup->setEnabled(shape!=PlotWidget::VoxelBrush);
+}
+
 void SFView::undo()
 {
     if ( 0==systemMatrix() )
         return;
     systemMatrix()->undoLastChange();
     int index = systemMatrix()->globalIndex( d->receiver, d->frame );
-    d->plotWidget->update();
+    d->plotWidget->refresh();
     updateNavigation(index,KeepMixingTerms);
     updateInfo();
     updateUndo();
@@ -855,17 +1095,20 @@ void SFView::undoAll()
                                tr("Reverting all changes, are you sure?"),
                                QMessageBox::Yes | QMessageBox::No) )
         return;
-    QProgressBar * progress = new QProgressBar;
-    progress->setRange(0,100);
-    statusBar()->addWidget(progress,1);
-    progress->show();
-    qApp->setOverrideCursor(Qt::BusyCursor);
-    systemMatrix()->undoAllChanges(progress,"setValue");
-    qApp->restoreOverrideCursor();
-    delete progress;
+    // The original SNR is computed in the background, the values are written back when all are done
+    UndoAllJob job;
+    job.setSystemMatrix(systemMatrix());
+    if ( !job.start() )
+    {
+        QMessageBox::warning(this,tr("Undo all"),job.errorString());
+        return;
+    }
+    runJob(&job,tr("Reverting all changes..."),job.componentCount());
+    if ( !job.errorString().isEmpty() )
+        QMessageBox::warning(this,tr("Undo all"),job.errorString());
 
     int index = systemMatrix()->globalIndex( d->receiver, d->frame );
-    d->plotWidget->update();
+    d->plotWidget->refresh();
     updateNavigation(index,KeepMixingTerms);
     updateInfo();
     updateUndo();
@@ -901,6 +1144,373 @@ void SFView::configure()
      dialog.exec();
 }
 
+void SFView::exportImages()
+{
+    if ( 0==systemMatrix() )
+        return;
+
+    QSettings settings;
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("Export images"));
+    QFormLayout * form = new QFormLayout(&dialog);
+    QDoubleSpinBox * snrThreshold = new QDoubleSpinBox;
+    snrThreshold->setRange(0.0,1e6);
+    snrThreshold->setDecimals(1);
+    snrThreshold->setValue(settings.value("exportSnrThreshold",10.0).toDouble());
+    form->addRow(tr("Minimum SNR"),snrThreshold);
+    QComboBox * layout = new QComboBox;
+    layout->addItem(tr("One image per slice"),ExportEngine::Tiles);
+    layout->addItem(tr("One atlas per component"),ExportEngine::Atlas);
+    layout->setCurrentIndex(settings.value("exportLayout",ExportEngine::Tiles).toInt());
+    form->addRow(tr("Layout"),layout);
+    QSpinBox * scale = new QSpinBox;
+    scale->setRange(1,32);
+    scale->setValue(settings.value("exportScaleFactor",1).toInt());
+    form->addRow(tr("Magnification"),scale);
+    QDialogButtonBox * buttons = new QDialogButtonBox(QDialogButtonBox::Ok|QDialogButtonBox::Cancel);
+    connect(buttons,SIGNAL(accepted()),&dialog,SLOT(accept()));
+    connect(buttons,SIGNAL(rejected()),&dialog,SLOT(reject()));
+    form->addRow(buttons);
+
+    if ( dialog.exec()!=QDialog::Accepted )
+        return;
+
+    QString directory = QFileDialog::getExistingDirectory(this,tr("Select export directory"),
+                                                          settings.value("exportDirectory",QDir::homePath()).toString());
+    if ( directory.isEmpty() )
+        return;
+
+    settings.setValue("exportSnrThreshold",snrThreshold->value());
+    settings.setValue("exportLayout",layout->currentIndex());
+    settings.setValue("exportScaleFactor",scale->value());
+    settings.setValue("exportDirectory",directory);
+
+    // Components are taken in SNR order up to the threshold
+    QList<int> globalIndices;
+    for ( int rank=0; rank<=systemMatrix()->maxGlobalIndex(); rank++ )
+    {
+        int globalIndex=systemMatrix()->globalIndex(rank);
+        if ( globalIndex<0 || systemMatrix()->snr(globalIndex)<snrThreshold->value() )
+            break;
+        globalIndices.append(globalIndex);
+    }
+    if ( globalIndices.isEmpty() )
+    {
+        QMessageBox::information(this,tr("Export images"),tr("No component exceeds the SNR threshold."));
+        return;
+    }
+
+    ExportEngine engine;
+    engine.setSystemMatrix(systemMatrix());
+    engine.setColorScale(d->colorScaleManager->currentColorScale());
+    engine.setBackgroundCorrection(backgroundCorrection());
+    engine.setLayout(static_cast<ExportEngine::Layout>(layout->itemData(layout->currentIndex()).toInt()));
+    engine.setScaleFactor(scale->value());
+    engine.setOutputDirectory(directory);
+
+    if ( !engine.start(globalIndices) )
+    {
+        QMessageBox::warning(this,tr("Export images"),engine.errorString());
+        return;
+    }
+    bool canceled = !runJob(&engine,tr("Exporting %1 components...").arg(globalIndices.count()),globalIndices.count());
+
+    if ( !engine.errorString().isEmpty() )
+        QMessageBox::warning(this,tr("Export images"),engine.errorString());
+    else if ( !canceled )
+        statusBar()->showMessage(tr("%1 components exported to %2.").arg(globalIndices.count()).arg(directory),10000);
+}
+
+void SFView::exportMatrix()
+{
+    if ( 0==systemMatrix() )
+        return;
+
+    QSettings settings;
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("Export matrix"));
+    QFormLayout * form = new QFormLayout(&dialog);
+    QComboBox * format = new QComboBox;
+    if ( MatrixExporter::isFormatSupported(MatrixExporter::Mdf) )
+        format->addItem(tr("MDF (HDF5)"),MatrixExporter::Mdf);
+    format->addItem(tr("NumPy array"),MatrixExporter::Npy);
+    format->addItem(tr("Raw matrix with index"),MatrixExporter::Raw);
+    int formatIndex = format->findData(settings.value("matrixExportFormat",MatrixExporter::Mdf).toInt());
+    format->setCurrentIndex(qMax(0,formatIndex));
+    form->addRow(tr("Format"),format);
+    QComboBox * precision = new QComboBox;
+    precision->addItem(tr("Single (complex64)"),MatrixExporter::Single);
+    precision->addItem(tr("Double (complex128)"),MatrixExporter::Double);
+    precision->setCurrentIndex(settings.value("matrixExportPrecision",MatrixExporter::Single).toInt());
+    form->addRow(tr("Precision"),precision);
+    QDoubleSpinBox * snrThreshold = new QDoubleSpinBox;
+    snrThreshold->setRange(0.0,1e6);
+    snrThreshold->setDecimals(1);
+    snrThreshold->setValue(settings.value("matrixExportSnrThreshold",0.0).toDouble());
+    form->addRow(tr("Minimum SNR"),snrThreshold);
+    QCheckBox * snrOrder = new QCheckBox(tr("Only components above threshold, sorted by SNR"));
+    snrOrder->setToolTip(tr("MDF files always contain all receivers of the selected frequencies"));
+    snrOrder->setChecked(settings.value("matrixExportSnrOrder",false).toBool());
+    form->addRow(snrOrder);
+    QCheckBox * correction = new QCheckBox(tr("Background correction"));
+    correction->setChecked(backgroundCorrection());
+    form->addRow(correction);
+    QComboBox * filter = new QComboBox;
+    for ( int type=SpatialFilter::None; type<=SpatialFilter::NonLocalMeans; type++ )
+        filter->addItem(SpatialFilter::name(static_cast<SpatialFilter::Type>(type)),type);
+    filter->setCurrentIndex(qMax(0,filter->findData(settings.value("matrixExportFilter",SpatialFilter::None).toInt())));
+    form->addRow(tr("Spatial filter"),filter);
+    QDoubleSpinBox * filterStrength = new QDoubleSpinBox;
+    filterStrength->setRange(0.1,10.0);
+    filterStrength->setSingleStep(0.1);
+    filterStrength->setValue(settings.value("matrixExportFilterStrength",1.0).toDouble());
+    filterStrength->setToolTip(tr("Width of the Gaussian in voxels, for non-local means in units of the background noise"));
+    form->addRow(tr("Filter strength"),filterStrength);
+    QDoubleSpinBox * filterSnrLimit = new QDoubleSpinBox;
+    filterSnrLimit->setRange(0.0,1e6);
+    filterSnrLimit->setDecimals(1);
+    filterSnrLimit->setSpecialValueText(tr("All components"));
+    filterSnrLimit->setValue(settings.value("matrixExportFilterSnrLimit",0.0).toDouble());
+    form->addRow(tr("Filter components below SNR"),filterSnrLimit);
+    QCheckBox * resample = new QCheckBox(tr("Resample to another grid"));
+    resample->setChecked(settings.value("matrixExportResample",false).toBool());
+    form->addRow(resample);
+    QHBoxLayout * gridLayout = new QHBoxLayout;
+    QHBoxLayout * fovLayout = new QHBoxLayout;
+    QSpinBox * targetGrid[3];
+    QDoubleSpinBox * targetFov[3];
+    for ( int i=0; i<3; i++ )
+    {
+        targetGrid[i] = new QSpinBox;
+        targetGrid[i]->setRange(1,1024);
+        targetGrid[i]->setValue(systemMatrix()->dimension(static_cast<Qt::Axis>(i)));
+        gridLayout->addWidget(targetGrid[i]);
+        targetFov[i] = new QDoubleSpinBox;
+        targetFov[i]->setRange(0.1,10000.0);
+        targetFov[i]->setSuffix(tr(" mm"));
+        targetFov[i]->setValue(systemMatrix()->spatialExtent(static_cast<Qt::Axis>(i)));
+        fovLayout->addWidget(targetFov[i]);
+        targetGrid[i]->setEnabled(resample->isChecked());
+        targetFov[i]->setEnabled(resample->isChecked());
+        connect(resample,SIGNAL(toggled(bool)),targetGrid[i],SLOT(setEnabled(bool)));
+        connect(resample,SIGNAL(toggled(bool)),targetFov[i],SLOT(setEnabled(bool)));
+    }
+    form->addRow(tr("Target grid"),gridLayout);
+    form->addRow(tr("Target field of view"),fovLayout);
+    QComboBox * kernel = new QComboBox;
+    for ( int k=Resampler::Trilinear; k<=Resampler::BandLimited; k++ )
+        kernel->addItem(Resampler::name(static_cast<Resampler::Kernel>(k)),k);
+    kernel->setCurrentIndex(qMax(0,kernel->findData(settings.value("matrixExportKernel",Resampler::Tricubic).toInt())));
+    kernel->setEnabled(resample->isChecked());
+    connect(resample,SIGNAL(toggled(bool)),kernel,SLOT(setEnabled(bool)));
+    form->addRow(tr("Interpolation"),kernel);
+    QDialogButtonBox * buttons = new QDialogButtonBox(QDialogButtonBox::Ok|QDialogButtonBox::Cancel);
+    connect(buttons,SIGNAL(accepted()),&dialog,SLOT(accept()));
+    connect(buttons,SIGNAL(rejected()),&dialog,SLOT(reject()));
+    form->addRow(buttons);
+
+    if ( dialog.exec()!=QDialog::Accepted )
+        return;
+
+    MatrixExporter::Format fileFormat = static_cast<MatrixExporter::Format>(format->itemData(format->currentIndex()).toInt());
+    QString filter, suffix;
+    switch ( fileFormat )
+    {
+    case MatrixExporter::Mdf:
+        filter = tr("MDF files (*.mdf *.h5)");
+        suffix = ".mdf";
+        break;
+    case MatrixExporter::Npy:
+        filter = tr("NumPy arrays (*.npy)");
+        suffix = ".npy";
+        break;
+    case MatrixExporter::Raw:
+        filter = tr("Raw data (*.raw)");
+        suffix = ".raw";
+        break;
+    }
+    QString fileName = QFileDialog::getSaveFileName(this,tr("Export matrix"),
+                                                    settings.value("matrixExportDirectory",QDir::homePath()).toString(),filter);
+    if ( fileName.isEmpty() )
+        return;
+    if ( QFileInfo(fileName).suffix().isEmpty() )
+        fileName += suffix;
+
+    settings.setValue("matrixExportFormat",fileFormat);
+    settings.setValue("matrixExportPrecision",precision->currentIndex());
+    settings.setValue("matrixExportSnrThreshold",snrThreshold->value());
+    settings.setValue("matrixExportSnrOrder",snrOrder->isChecked());
+    settings.setValue("matrixExportFilter",filter->itemData(filter->currentIndex()).toInt());
+    settings.setValue("matrixExportFilterStrength",filterStrength->value());
+    settings.setValue("matrixExportFilterSnrLimit",filterSnrLimit->value());
+    settings.setValue("matrixExportResample",resample->isChecked());
+    settings.setValue("matrixExportKernel",kernel->itemData(kernel->currentIndex()).toInt());
+    settings.setValue("matrixExportDirectory",QFileInfo(fileName).path());
+
+    MatrixExporter exporter;
+    exporter.setSystemMatrix(systemMatrix());
+    exporter.setFormat(fileFormat);
+    exporter.setPrecision(static_cast<MatrixExporter::Precision>(precision->itemData(precision->currentIndex()).toInt()));
+    exporter.setBackgroundCorrection(correction->isChecked());
+    exporter.setMinimumSnr(snrThreshold->value());
+    exporter.setRowOrder(snrOrder->isChecked() ? MatrixExporter::SnrOrder : MatrixExporter::FrequencyOrder);
+    exporter.setSpatialFilter(static_cast<SpatialFilter::Type>(filter->itemData(filter->currentIndex()).toInt()),filterStrength->value());
+    exporter.setFilterSnrLimit(filterSnrLimit->value());
+    if ( resample->isChecked() )
+    {
+        int grid[3];
+        double fov[3];
+        for ( int i=0; i<3; i++ )
+        {
+            grid[i] = targetGrid[i]->value();
+            fov[i] = targetFov[i]->value();
+        }
+        exporter.setTargetGrid(grid,fov,static_cast<Resampler::Kernel>(kernel->itemData(kernel->currentIndex()).toInt()));
+    }
+    exporter.setFileName(fileName);
+
+    if ( !exporter.start() )
+    {
+        QMessageBox::warning(this,tr("Export matrix"),exporter.errorString());
+        return;
+    }
+    bool canceled = !runJob(&exporter,tr("Exporting system matrix..."),exporter.rowCount());
+
+    if ( !exporter.errorString().isEmpty() )
+        QMessageBox::warning(this,tr("Export matrix"),exporter.errorString());
+    else if ( !canceled )
+        statusBar()->showMessage(tr("%1 components exported to %2.").arg(exporter.rowCount()).arg(fileName),10000);
+}
+
+void SFView::findSimilarComponents()
+{
+    if ( 0==systemMatrix() )
+        return;
+
+    if ( !d->patternIndex->isReady() )
+    {
+        if ( !d->patternIndex->isRunning() && !d->patternIndex->start() )
+        {
+            QMessageBox::warning(this,tr("Find similar components"),d->patternIndex->errorString());
+            return;
+        }
+        runJob(d->patternIndex,tr("Indexing component patterns..."),d->patternIndex->componentCount());
+        if ( !d->patternIndex->isReady() )
+            return;
+    }
+
+    int globalIndex = systemMatrix()->globalIndex(d->receiver,d->frame);
+    int count = QSettings().value("findSimilarCount",10).toInt();
+    QList<PatternIndex::Similarity> similar = d->patternIndex->findSimilar(globalIndex,count);
+    if ( similar.isEmpty() )
+    {
+        if ( !d->patternIndex->errorString().isEmpty() )
+            QMessageBox::warning(this,tr("Find similar components"),d->patternIndex->errorString());
+        return;
+    }
+
+    QMenu popup;
+    foreach(const PatternIndex::Similarity & s, similar)
+    {
+        QAction * a = popup.addAction(tr("%L1  receiver %2, %L3 kHz, SNR %L4")
+                                      .arg(s.second,0,'f',3)
+                                      .arg(systemMatrix()->receiver(s.first)+1)
+                                      .arg(systemMatrix()->frequency(s.first)/1000.0,0,'f',3)
+                                      .arg(systemMatrix()->snr(s.first),0,'f',1));
+        a->setData(s.first);
+    }
+    QAction * selected = popup.exec(QCursor::pos());
+    if ( selected )
+        setGlobalIndex(selected->data().toInt());
+}
+
+void SFView::patternIndexFinished(bool success)
+{
+    if ( !success )
+    {
+        if ( !d->patternIndex->errorString().isEmpty() )
+            statusBar()->showMessage(d->patternIndex->errorString(),10000);
+        return;
+    }
+    QString fileName = PatternIndex::defaultFileName(systemMatrix());
+    if ( !d->patternIndex->save(fileName) )
+        statusBar()->showMessage(d->patternIndex->errorString(),10000);
+}
+
+void SFView::computeLowRankApproximation()
+{
+    if ( 0==systemMatrix() )
+        return;
+
+    QSettings settings;
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("Low-rank approximation"));
+    QFormLayout * form = new QFormLayout(&dialog);
+    QSpinBox * rank = new QSpinBox;
+    rank->setRange(1,qMin(1000,systemMatrix()->numberOfFrequencies()));
+    rank->setValue(settings.value("lowRankRank",32).toInt());
+    form->addRow(tr("Rank per receiver"),rank);
+    QSpinBox * iterations = new QSpinBox;
+    iterations->setRange(0,10);
+    iterations->setValue(settings.value("lowRankPowerIterations",1).toInt());
+    iterations->setToolTip(tr("Each iteration reads the matrix twice but improves the accuracy of the factors"));
+    form->addRow(tr("Power iterations"),iterations);
+    QCheckBox * correction = new QCheckBox(tr("Background correction"));
+    correction->setChecked(backgroundCorrection());
+    form->addRow(correction);
+    QDialogButtonBox * buttons = new QDialogButtonBox(QDialogButtonBox::Ok|QDialogButtonBox::Cancel);
+    connect(buttons,SIGNAL(accepted()),&dialog,SLOT(accept()));
+    connect(buttons,SIGNAL(rejected()),&dialog,SLOT(reject()));
+    form->addRow(buttons);
+
+    if ( dialog.exec()!=QDialog::Accepted )
+        return;
+
+    settings.setValue("lowRankRank",rank->value());
+    settings.setValue("lowRankPowerIterations",iterations->value());
+
+    d->lowRank->setRank(rank->value());
+    d->lowRank->setPowerIterations(iterations->value());
+    d->lowRank->setBackgroundCorrection(correction->isChecked());
+
+    if ( !d->lowRank->start() )
+    {
+        QMessageBox::warning(this,tr("Low-rank approximation"),d->lowRank->errorString());
+        return;
+    }
+    if ( !runJob(d->lowRank,tr("Computing low-rank approximation..."),d->lowRank->rowCount()) )
+        return;
+    if ( !d->lowRank->errorString().isEmpty() )
+    {
+        QMessageBox::warning(this,tr("Low-rank approximation"),d->lowRank->errorString());
+        return;
+    }
+
+    d->plotWidget->setLowRankApproximation(d->lowRank);
+    updateLowRankView();
+    QString fileName = LowRankApproximation::defaultFileName(systemMatrix());
+    if ( !d->lowRank->save(fileName) )
+        QMessageBox::warning(this,tr("Low-rank approximation"),d->lowRank->errorString());
+    else
+        statusBar()->showMessage(tr("Rank %1 approximation stored in %2.").arg(d->lowRank->rank()).arg(fileName),10000);
+}
+
+bool SFView::runJob(QObject * job, const QString & label, int maximum)
+{
+    // finished() arrives through the event loop, so the job may already have been started
+    QProgressDialog progress(label,tr("Cancel"),0,maximum,this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(0);
+    connect(job,SIGNAL(progress(int)),&progress,SLOT(setValue(int)));
+    connect(&progress,SIGNAL(canceled()),job,SLOT(cancel()));
+    QEventLoop loop;
+    connect(job,SIGNAL(finished(bool)),&loop,SLOT(quit()));
+    loop.exec();
+    bool canceled = progress.wasCanceled();
+    progress.reset();
+    return !canceled;
+}
+
 void SFView::showAbout()
 {
     QMessageBox::about(this,tr("About SFView"),d->about);
@@ -63,18 +63,26 @@ protected slots:
     void setSnrIndex(int);
     void setMixing(int);
     void openFile();
+    void openMdfFile();
     void openRecentFile();
     void showAbout();
     void configure();
     void showContextMenu(const QPoint &, const MatrixPosition & pos);
     void undo();
     void undoAll();
+    void updateBrush();
     void showPositionAndValue(const MatrixPosition & pos, const SystemMatrix::complex & value);
     void setBackgroundCorrection(bool b);
     void setIconSize(int size);
     void setToolButtonStyle(int);
     void setToolButtonStyle(Qt::ToolButtonStyle style);
     void checkForUpdates(bool initialCheck=false);
+    void exportImages();
+    void exportMatrix();
+    void findSimilarComponents();
+    void patternIndexFinished(bool success);
+    void computeLowRankApproximation();
+    void updateLowRankView();
 protected slots:
     void setGlobalIndex(int, MixingUpdate updateMixingTerms=UpdateMixingTerms);
     void updateCheckResult(int);
@@ -95,6 +103,12 @@ protected:
     virtual void closeEvent(QCloseEvent * ev);
     virtual bool eventFilter( QObject *, QEvent * );
     bool interpolate(const MatrixPosition & pos, int globalIndex=-1);
+    /**
+     * @brief runJob Show a modal progress dialog until a started job emits finished(bool), the job
+     *               needs a progress(int) signal and a cancel() slot
+     * @return       False if the user cancelled the job
+     */
+    bool runJob(QObject * job, const QString & label, int maximum);
 private:
     enum { MaxRecentFiles = 10 };
     struct Impl;
@@ -19,7 +19,7 @@
 # $Id: SFView.pro 86 2017-03-18 21:44:25Z uhei $
 #
 
-QT       += core gui charts
+QT       += core gui charts concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets svg
 
@@ -70,7 +70,26 @@ SOURCES += main.cpp PlotWidget.cpp PvParameterFile.cpp SFRenderer.cpp SFView.cpp
     PhaseView.cpp \
     ColorScale.cpp \
     ColorScaleManager.cpp \
-    TransferFunction.cpp
+    TransferFunction.cpp \
+    ExportEngine.cpp \
+    SystemMatrixStorage.cpp \
+    MatrixExporter.cpp \
+    KaczmarzSolver.cpp \
+    ReconstructionView.cpp \
+    ForwardSimulator.cpp \
+    GramMatrix.cpp \
+    SimilarityView.cpp \
+    PatternIndex.cpp \
+    LowRankApproximation.cpp \
+    SpatialFilter.cpp \
+    Resampler.cpp \
+    VoxelSpectrum.cpp \
+    ProfileView.cpp \
+    SnrStatistics.cpp \
+    SnrStatisticsView.cpp \
+    CorrectionJob.cpp \
+    UndoAllJob.cpp \
+    SidecarFile.cpp
 
 HEADERS  += PlotWidget.h PvParameterFile.h SFRenderer.h SFView.h SystemMatrix.h \
     MatrixPosition.h \
@@ -82,7 +101,35 @@ HEADERS  += PlotWidget.h PvParameterFile.h SFRenderer.h SFView.h SystemMatrix.h
     ColorScale.h \
     ColorScaleManager.h \
     utility.h \
-    TransferFunction.h
+    TransferFunction.h \
+    ExportEngine.h \
+    SystemMatrixStorage.h \
+    MatrixExporter.h \
+    KaczmarzSolver.h \
+    ReconstructionView.h \
+    ForwardSimulator.h \
+    GramMatrix.h \
+    SimilarityView.h \
+    PatternIndex.h \
+    LowRankApproximation.h \
+    SpatialFilter.h \
+    Resampler.h \
+    VoxelSpectrum.h \
+    ProfileView.h \
+    SnrStatistics.h \
+    SnrStatisticsView.h \
+    CorrectionJob.h \
+    UndoAllJob.h \
+    SidecarFile.h \
+    VectorMath.h
+
+# Support for MDF files, enable with qmake CONFIG+=hdf5
+hdf5 {
+    DEFINES += SFVIEW_HAVE_HDF5
+    SOURCES += MdfStorage.cpp
+    HEADERS += MdfStorage.h
+    LIBS += -lhdf5
+}
 
 TRANSLATIONS = SFView_de.ts
 
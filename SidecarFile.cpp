@@ -0,0 +1,88 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Local includes
+#include "SidecarFile.h"
+#include "SystemMatrix.h"
+
+QString SidecarFile::fileName(const SystemMatrix * systemMatrix, const QString & mdfSuffix, const QString & procnoName)
+{
+    if ( systemMatrix==0 )
+        return QString();
+    if ( SystemMatrix::isMdfFile(systemMatrix->path()) )
+        return systemMatrix->path()+mdfSuffix;
+    return systemMatrix->path()+"/"+procnoName;
+}
+
+SidecarFile::SidecarFile(const QString & fileName, const char * magic) :
+    file(fileName), magic(magic), magicFound(false)
+{
+    data.setByteOrder(QDataStream::LittleEndian);
+    data.setFloatingPointPrecision(QDataStream::SinglePrecision);
+}
+
+bool SidecarFile::openForReading()
+{
+    magicFound = false;
+    if ( !file.open(QIODevice::ReadOnly) )
+        return false;
+    data.setDevice(&file);
+    magicFound = file.read(magic.size())==magic;
+    return true;
+}
+
+bool SidecarFile::hasMagic() const
+{
+    return magicFound;
+}
+
+bool SidecarFile::openForWriting(QString * error)
+{
+    if ( !file.open(QIODevice::WriteOnly|QIODevice::Truncate) )
+    {
+        *error = tr("Cannot open %1 for writing.").arg(file.fileName());
+        return false;
+    }
+    data.setDevice(&file);
+    data.writeRawData(magic.constData(),magic.size());
+    return true;
+}
+
+bool SidecarFile::finishWriting(QString * error)
+{
+    file.flush();
+    if ( data.status()!=QDataStream::Ok || file.error()!=QFile::NoError )
+    {
+        *error = tr("Cannot write file %1.").arg(file.fileName());
+        return false;
+    }
+    return true;
+}
+
+QDataStream & SidecarFile::stream()
+{
+    return data;
+}
+
+qint64 SidecarFile::bytesAvailable() const
+{
+    return file.size()-file.pos();
+}
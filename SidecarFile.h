@@ -0,0 +1,77 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef SIDECARFILE_H
+#define SIDECARFILE_H
+
+// Qt includes
+#include <QtCore/QByteArray>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDataStream>
+#include <QtCore/QFile>
+#include <QtCore/QString>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The SidecarFile class reads and writes the files with precomputed results that are
+ *        stored next to a system matrix. They start with a magic of eight characters, followed
+ *        by little endian values with floating point numbers in single precision.
+ */
+class SidecarFile
+{
+    Q_DECLARE_TR_FUNCTIONS(SidecarFile)
+public:
+    /**
+     * @brief fileName Sidecar of a system matrix, next to an MDF file or inside the procno
+     * @param mdfSuffix  Appended to the name of an MDF file, e.g. ".similarity"
+     * @param procnoName Name of the file in a procno directory
+     */
+    static QString fileName(const SystemMatrix * systemMatrix, const QString & mdfSuffix, const QString & procnoName);
+    SidecarFile(const QString & fileName, const char * magic);
+    /**
+     * @brief openForReading Open the file and read the magic
+     * @return               false if the file cannot be opened, the magic is checked by hasMagic()
+     */
+    bool openForReading();
+    bool hasMagic() const;
+    /**
+     * @brief openForWriting Create the file and write the magic
+     */
+    bool openForWriting(QString * error);
+    /**
+     * @brief finishWriting Check that all values were written
+     */
+    bool finishWriting(QString * error);
+    QDataStream & stream();
+    /**
+     * @brief bytesAvailable Bytes not yet read
+     */
+    qint64 bytesAvailable() const;
+private:
+    QFile file;
+    QDataStream data;
+    QByteArray magic;
+    bool magicFound;
+};
+
+#endif // SIDECARFILE_H
@@ -0,0 +1,226 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Qt includes
+#include <QtCore/QSettings>
+#include <QtWidgets/QDoubleSpinBox>
+#include <QtWidgets/QFormLayout>
+#include <QtWidgets/QHeaderView>
+#include <QtWidgets/QLabel>
+#include <QtWidgets/QProgressBar>
+#include <QtWidgets/QPushButton>
+#include <QtWidgets/QSpinBox>
+#include <QtWidgets/QTableWidget>
+#include <QtWidgets/QVBoxLayout>
+
+// Local includes
+#include "SimilarityView.h"
+#include "GramMatrix.h"
+#include "SystemMatrix.h"
+
+struct SimilarityView::Impl
+{
+    GramMatrix * gram;
+    SystemMatrix * systemMatrix;
+    bool backgroundCorrection;
+    int globalIndex;
+    QDoubleSpinBox * minimumSnr;
+    QSpinBox * maxComponents;
+    QPushButton * computeButton;
+    QProgressBar * progress;
+    QLabel * status;
+    QTableWidget * table;
+};
+
+SimilarityView::SimilarityView(QWidget *parent) : QWidget(parent), d(new Impl)
+{
+    QSettings settings;
+    d->systemMatrix = 0;
+    d->backgroundCorrection = true;
+    d->globalIndex = -1;
+    d->gram = new GramMatrix(this);
+    connect(d->gram,SIGNAL(finished(bool)),SLOT(computationFinished(bool)));
+    connect(d->gram,SIGNAL(updated()),SLOT(correlationsUpdated()));
+
+    QVBoxLayout * layout = new QVBoxLayout(this);
+    QFormLayout * form = new QFormLayout;
+    d->minimumSnr = new QDoubleSpinBox;
+    d->minimumSnr->setRange(0.0,1e6);
+    d->minimumSnr->setDecimals(1);
+    d->minimumSnr->setValue(settings.value("similaritySnrThreshold",5.0).toDouble());
+    form->addRow(tr("Minimum SNR"),d->minimumSnr);
+    d->maxComponents = new QSpinBox;
+    d->maxComponents->setRange(2,20000);
+    d->maxComponents->setValue(settings.value("similarityMaxComponents",4000).toInt());
+    form->addRow(tr("Maximum components"),d->maxComponents);
+    layout->addLayout(form);
+    d->computeButton = new QPushButton(tr("Compute"));
+    d->computeButton->setEnabled(false);
+    connect(d->computeButton,SIGNAL(clicked()),SLOT(compute()));
+    layout->addWidget(d->computeButton);
+    d->progress = new QProgressBar;
+    d->progress->hide();
+    connect(d->gram,SIGNAL(progress(int)),d->progress,SLOT(setValue(int)));
+    layout->addWidget(d->progress);
+    d->status = new QLabel;
+    d->status->setWordWrap(true);
+    layout->addWidget(d->status);
+
+    d->table = new QTableWidget(0,5);
+    QStringList headers;
+    headers << tr("Correlation") << tr("Receiver") << tr("Frequency / kHz") << tr("SNR") << tr("Global index");
+    d->table->setHorizontalHeaderLabels(headers);
+    d->table->verticalHeader()->hide();
+    d->table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    d->table->setSelectionBehavior(QAbstractItemView::SelectRows);
+    d->table->setToolTip(tr("Double-click to select the component"));
+    connect(d->table,SIGNAL(cellDoubleClicked(int,int)),SLOT(selectRow(int)));
+    layout->addWidget(d->table,1);
+}
+
+SimilarityView::~SimilarityView()
+{
+    delete d;
+}
+
+void SimilarityView::setSystemMatrix(SystemMatrix *s)
+{
+    d->systemMatrix = s;
+    d->gram->setSystemMatrix(s);
+    d->computeButton->setEnabled(s!=0);
+    d->computeButton->setText(tr("Compute"));
+    d->progress->hide();
+    d->status->clear();
+    // Reuse correlations computed in an earlier session
+    if ( s && d->gram->load(GramMatrix::defaultFileName(s)) )
+        d->status->setText(tr("%1 components loaded.").arg(d->gram->components().count()));
+    else
+        d->status->setText(d->gram->errorString());
+    updateTable();
+}
+
+void SimilarityView::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+    d->gram->setBackgroundCorrection(b);
+}
+
+void SimilarityView::setGlobalIndex(int globalIndex)
+{
+    d->globalIndex = globalIndex;
+    if ( isVisible() )
+        updateTable();
+}
+
+void SimilarityView::showEvent(QShowEvent * ev)
+{
+    QWidget::showEvent(ev);
+    updateTable();
+}
+
+void SimilarityView::compute()
+{
+    if ( d->systemMatrix==0 )
+        return;
+    if ( d->gram->isRunning() )
+    {
+        d->gram->cancel();
+        return;
+    }
+    QSettings settings;
+    settings.setValue("similaritySnrThreshold",d->minimumSnr->value());
+    settings.setValue("similarityMaxComponents",d->maxComponents->value());
+
+    QList<int> components;
+    for ( int rank=0; rank<=d->systemMatrix->maxGlobalIndex() && components.count()<d->maxComponents->value(); rank++ )
+    {
+        int globalIndex = d->systemMatrix->globalIndex(rank);
+        if ( globalIndex<0 || d->systemMatrix->snr(globalIndex)<d->minimumSnr->value() )
+            break;
+        components.append(globalIndex);
+    }
+    d->gram->setComponents(components);
+    d->gram->setBackgroundCorrection(d->backgroundCorrection);
+    if ( !d->gram->start() )
+    {
+        d->status->setText(d->gram->errorString());
+        return;
+    }
+    d->progress->setRange(0,d->gram->tileCount());
+    d->progress->setValue(0);
+    d->progress->show();
+    d->computeButton->setText(tr("Cancel"));
+    d->status->setText(tr("Correlating %1 components...").arg(components.count()));
+}
+
+void SimilarityView::computationFinished(bool success)
+{
+    d->progress->hide();
+    d->computeButton->setText(tr("Compute"));
+    if ( !success )
+    {
+        d->status->setText(d->gram->errorString().isEmpty() ? tr("Canceled.") : d->gram->errorString());
+        return;
+    }
+    d->status->setText(tr("%1 components correlated.").arg(d->gram->components().count()));
+    if ( !d->gram->save(GramMatrix::defaultFileName(d->systemMatrix)) )
+        d->status->setText(d->status->text()+" "+d->gram->errorString());
+    updateTable();
+}
+
+void SimilarityView::correlationsUpdated()
+{
+    if ( d->gram->components().isEmpty() )
+        d->status->setText(d->gram->errorString());
+    else if ( !d->gram->save(GramMatrix::defaultFileName(d->systemMatrix)) )
+        d->status->setText(d->gram->errorString());
+    if ( isVisible() )
+        updateTable();
+}
+
+void SimilarityView::selectRow(int row)
+{
+    QTableWidgetItem * item = d->table->item(row,4);
+    if ( item )
+        emit globalIndexSelect(item->text().toInt());
+}
+
+void SimilarityView::updateTable()
+{
+    d->table->setRowCount(0);
+    if ( d->systemMatrix==0 || !d->gram->contains(d->globalIndex) )
+        return;
+    QSettings settings;
+    QList<GramMatrix::Similarity> similar = d->gram->mostSimilar(d->globalIndex,settings.value("similarityListLength",20).toInt());
+    d->table->setRowCount(similar.count());
+    int row=0;
+    foreach(const GramMatrix::Similarity & s, similar)
+    {
+        int globalIndex = s.first;
+        d->table->setItem(row,0,new QTableWidgetItem(QString::number(s.second,'f',3)));
+        d->table->setItem(row,1,new QTableWidgetItem(QString::number(d->systemMatrix->receiver(globalIndex)+1)));
+        d->table->setItem(row,2,new QTableWidgetItem(QString::number(d->systemMatrix->frequency(globalIndex)/1e3,'f',3)));
+        d->table->setItem(row,3,new QTableWidgetItem(QString::number(d->systemMatrix->snr(globalIndex),'f',1)));
+        d->table->setItem(row,4,new QTableWidgetItem(QString::number(globalIndex)));
+        row++;
+    }
+    d->table->resizeColumnsToContents();
+}
@@ -0,0 +1,60 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef SIMILARITYVIEW_H
+#define SIMILARITYVIEW_H
+
+// Qt includes
+#include <QWidget>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The SimilarityView class lists the components most similar to the current one,
+ *        based on the normalized correlations of the components above an SNR threshold
+ */
+class SimilarityView : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit SimilarityView(QWidget *parent = 0);
+    virtual ~SimilarityView();
+signals:
+    void globalIndexSelect(int globalIndex);
+public slots:
+    void setSystemMatrix(SystemMatrix * s);
+    void setBackgroundCorrection(bool b);
+    void setGlobalIndex(int globalIndex);
+    void compute();
+private slots:
+    void computationFinished(bool success);
+    void correlationsUpdated();
+    void selectRow(int row);
+protected:
+    virtual void showEvent(QShowEvent *);
+private:
+    void updateTable();
+    struct Impl;
+    Impl * d;
+};
+
+#endif // SIMILARITYVIEW_H
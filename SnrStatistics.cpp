@@ -0,0 +1,192 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <limits>
+
+// Qt includes
+#include <QtCore/QPointer>
+#include <QtCore/QVector>
+#include <QtConcurrent/QtConcurrentMap>
+
+// Local includes
+#include "SnrStatistics.h"
+#include "SystemMatrix.h"
+
+// Components per task of the histogram pass
+static const int componentsPerTask = 4096;
+// Decades covered by the bins, values outside fall into the first or last bin
+static const int firstDecade = -2;
+static const int lastDecade = 9;
+
+struct SnrStatistics::Impl
+{
+    struct Task
+    {
+        int first, count;      // Range in global indices
+        QVector<int> counts;   // Partial histogram, receivers*bins
+    };
+
+    // Bins the SNR values of a task in a worker thread
+    struct Histogram
+    {
+        explicit Histogram(Impl * d) : d(d) {}
+        void operator()(Task & task) const
+        {
+            task.counts.fill(0,d->receivers*d->bins);
+            for ( int globalIndex=task.first; globalIndex<task.first+task.count; globalIndex++ )
+            {
+                int bin = d->bin(d->systemMatrix->snr(globalIndex));
+                d->binOf[globalIndex] = bin;
+                task.counts[d->systemMatrix->receiver(globalIndex)*d->bins+bin]++;
+            }
+        }
+        Impl * d;
+    };
+
+    QPointer<SystemMatrix> systemMatrix;
+    QVector<double> edges;
+    int bins, receivers;
+    QVector<int> counts;       // receivers*bins
+    QVector<int> binOf;        // Bin of every global index
+
+    int bin(double snr) const
+    {
+        return std::lower_bound(edges.constBegin(),edges.constEnd(),snr)-edges.constBegin();
+    }
+};
+
+SnrStatistics::SnrStatistics(QObject * parent) : QObject(parent), d(new Impl)
+{
+    static const double r10[10] = { 1.0, 1.25, 1.6, 2.0, 2.5, 3.15, 4.0, 5.0, 6.3, 8.0 };
+    double decade = 1.0;
+    for ( int k=0; k>firstDecade; k-- )
+        decade /= 10.0;
+    for ( int k=firstDecade; k<lastDecade; k++, decade*=10.0 )
+        for ( int j=0; j<10; j++ )
+            d->edges.append(r10[j]*decade);
+    d->edges.append(decade);
+    d->bins = d->edges.count()+1;
+    d->receivers = 0;
+}
+
+SnrStatistics::~SnrStatistics()
+{
+    delete d;
+}
+
+void SnrStatistics::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    if ( d->systemMatrix )
+        disconnect(d->systemMatrix,0,this,0);
+    d->systemMatrix = systemMatrix;
+    d->receivers = 0;
+    d->counts.clear();
+    d->binOf.clear();
+    if ( systemMatrix )
+    {
+        connect(systemMatrix,SIGNAL(componentsChanged(QList<int>)),SLOT(updateComponents(QList<int>)));
+        d->receivers = systemMatrix->numberOfReceivers();
+        int numComponents = d->receivers*systemMatrix->numberOfFrequencies();
+        d->binOf.resize(numComponents);
+        QVector<Impl::Task> tasks;
+        for ( int first=0; first<numComponents; first+=componentsPerTask )
+        {
+            Impl::Task task;
+            task.first = first;
+            task.count = qMin(componentsPerTask,numComponents-first);
+            tasks.append(task);
+        }
+        QtConcurrent::blockingMap(tasks,Impl::Histogram(d));
+        d->counts.fill(0,d->receivers*d->bins);
+        foreach(const Impl::Task & task, tasks)
+            for ( int i=0; i<d->counts.count(); i++ )
+                d->counts[i] += task.counts.at(i);
+    }
+    emit changed();
+}
+
+int SnrStatistics::receivers() const
+{
+    return d->receivers;
+}
+
+int SnrStatistics::binCount() const
+{
+    return d->bins;
+}
+
+double SnrStatistics::lowerEdge(int bin) const
+{
+    if ( bin<=0 )
+        return 0.0;
+    return d->edges.at(qMin(bin,d->edges.count())-1);
+}
+
+double SnrStatistics::upperEdge(int bin) const
+{
+    if ( bin>=d->edges.count() )
+        return std::numeric_limits<double>::infinity();
+    return d->edges.at(qMax(bin,0));
+}
+
+int SnrStatistics::count(int receiver, int bin) const
+{
+    if ( receiver<0 || receiver>=d->receivers || bin<0 || bin>=d->bins )
+        return 0;
+    return d->counts.at(receiver*d->bins+bin);
+}
+
+int SnrStatistics::countAbove(int receiver, double threshold) const
+{
+    if ( receiver<0 || receiver>=d->receivers )
+        return 0;
+    // First bin whose values are all above the edge at or below threshold
+    int first = std::upper_bound(d->edges.constBegin(),d->edges.constEnd(),threshold)-d->edges.constBegin();
+    int sum = 0;
+    for ( int bin=first; bin<d->bins; bin++ )
+        sum += d->counts.at(receiver*d->bins+bin);
+    return sum;
+}
+
+void SnrStatistics::updateComponents(const QList<int> & globalIndices)
+{
+    if ( d->systemMatrix==0 )
+        return;
+    bool modified = false;
+    foreach(int globalIndex, globalIndices)
+    {
+        if ( globalIndex<0 || globalIndex>=d->binOf.count() )
+            continue;
+        int bin = d->bin(d->systemMatrix->snr(globalIndex));
+        int old = d->binOf.at(globalIndex);
+        if ( bin==old )
+            continue;
+        int offset = d->systemMatrix->receiver(globalIndex)*d->bins;
+        d->counts[offset+old]--;
+        d->counts[offset+bin]++;
+        d->binOf[globalIndex] = bin;
+        modified = true;
+    }
+    if ( modified )
+        emit changed();
+}
@@ -0,0 +1,68 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef SNRSTATISTICS_H
+#define SNRSTATISTICS_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QList>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The SnrStatistics class keeps a histogram of the SNR values per receiver with ten
+ *        logarithmic bins per decade. The edges are the R10 preferred numbers, so 1, 2 and 5
+ *        times a power of ten are edges and counts above these thresholds are exact. The
+ *        histogram is built in one parallel pass and updated when components change.
+ */
+class SnrStatistics : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SnrStatistics(QObject * parent=0);
+    virtual ~SnrStatistics();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    int receivers() const;
+    int binCount() const;
+    /**
+     * @brief lowerEdge Bin b holds the SNR values in (lowerEdge(b),upperEdge(b)], the first
+     *                  bin starts at 0 and the last one is unbounded
+     */
+    double lowerEdge(int bin) const;
+    double upperEdge(int bin) const;
+    int count(int receiver, int bin) const;
+    /**
+     * @brief countAbove Number of components of a receiver with an SNR above threshold,
+     *                   thresholds between two edges are rounded down to the lower edge
+     */
+    int countAbove(int receiver, double threshold) const;
+public slots:
+    void updateComponents(const QList<int> & globalIndices);
+signals:
+    void changed();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // SNRSTATISTICS_H
@@ -0,0 +1,171 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Qt includes
+#include <QtCore/QPointer>
+#include <QtCore/QSettings>
+#include <QtWidgets/QCheckBox>
+#include <QtWidgets/QVBoxLayout>
+
+#include <QtCharts/QChart>
+#include <QtCharts/QChartView>
+#include <QtCharts/QLineSeries>
+#include <QtCharts/QLogValueAxis>
+#include <QtCharts/QValueAxis>
+
+// Local includes
+#include "SnrStatisticsView.h"
+#include "SnrStatistics.h"
+
+struct SnrStatisticsView::Impl
+{
+    QPointer<const SnrStatistics> statistics;
+    QList<QColor> stdColors;
+    QCheckBox * cumulative;
+    QtCharts::QChart * chart;
+    QtCharts::QLogValueAxis * snrAxis;
+    QtCharts::QValueAxis * countAxis;
+    QList<QtCharts::QLineSeries*> traces;
+};
+
+SnrStatisticsView::SnrStatisticsView(QWidget *parent) : QWidget(parent), d(new Impl)
+{
+    QSettings settings;
+    d->stdColors << Qt::red << Qt::green << Qt::blue << Qt::yellow << Qt::cyan << Qt::magenta;
+
+    QVBoxLayout * layout = new QVBoxLayout(this);
+    d->cumulative = new QCheckBox(tr("Components above SNR"));
+    d->cumulative->setChecked(settings.value("snrStatisticsCumulative",false).toBool());
+    connect(d->cumulative,SIGNAL(toggled(bool)),SLOT(setCumulative(bool)));
+    layout->addWidget(d->cumulative);
+
+    d->chart = new QtCharts::QChart;
+    d->chart->legend()->setAlignment(Qt::AlignBottom);
+    d->snrAxis = new QtCharts::QLogValueAxis;
+    d->snrAxis->setTitleText(tr("SNR"));
+    d->snrAxis->setBase(10);
+    d->snrAxis->setLabelFormat("%g");
+    d->chart->addAxis(d->snrAxis,Qt::AlignBottom);
+    d->countAxis = new QtCharts::QValueAxis;
+    d->countAxis->setLabelFormat("%d");
+    d->chart->addAxis(d->countAxis,Qt::AlignLeft);
+    QtCharts::QChartView * chartView = new QtCharts::QChartView(d->chart);
+    chartView->setRubberBand(QtCharts::QChartView::RectangleRubberBand);
+    layout->addWidget(chartView,1);
+}
+
+SnrStatisticsView::~SnrStatisticsView()
+{
+    delete d;
+}
+
+void SnrStatisticsView::setStatistics(const SnrStatistics * statistics)
+{
+    if ( d->statistics )
+        disconnect(d->statistics,0,this,0);
+    d->statistics = statistics;
+    if ( statistics )
+        connect(statistics,SIGNAL(changed()),SLOT(updateChart()));
+    updateChart();
+}
+
+void SnrStatisticsView::setCumulative(bool b)
+{
+    QSettings settings;
+    settings.setValue("snrStatisticsCumulative",b);
+    updateChart();
+}
+
+void SnrStatisticsView::updateChart()
+{
+    const SnrStatistics * s = d->statistics;
+    int receivers = s ? s->receivers() : 0;
+    while ( d->traces.count()>receivers )
+    {
+        QtCharts::QLineSeries * series = d->traces.takeLast();
+        d->chart->removeSeries(series);
+        delete series;
+    }
+    while ( d->traces.count()<receivers )
+    {
+        int receiver = d->traces.count();
+        QtCharts::QLineSeries * series = new QtCharts::QLineSeries;
+        series->setName(receiver<3 ? QString(QChar('X'+receiver)) : tr("Receiver %1").arg(receiver+1));
+        series->setColor(d->stdColors.at(receiver%d->stdColors.count()));
+        d->chart->addSeries(series);
+        series->attachAxis(d->snrAxis);
+        series->attachAxis(d->countAxis);
+        d->traces.append(series);
+    }
+    if ( receivers==0 )
+        return;
+
+    bool cumulative = d->cumulative->isChecked();
+    d->countAxis->setTitleText(cumulative ? tr("Components above SNR") : tr("Components per bin"));
+    // Only bins with finite, positive edges can be placed on the logarithmic axis
+    int firstBin = -1, lastBin = -1, maxCount = 0;
+    for ( int bin=1; bin<s->binCount()-1; bin++ )
+    {
+        for ( int r=0; r<receivers; r++ )
+        {
+            if ( s->count(r,bin)>0 )
+            {
+                if ( firstBin<0 )
+                    firstBin = bin;
+                lastBin = bin;
+            }
+        }
+    }
+    if ( firstBin<0 )
+    {
+        foreach(QtCharts::QLineSeries * series, d->traces)
+            series->clear();
+        return;
+    }
+
+    for ( int r=0; r<receivers; r++ )
+    {
+        QVector<QPointF> points;
+        if ( cumulative )
+        {
+            for ( int bin=firstBin; bin<=lastBin+1; bin++ )
+            {
+                int n = s->countAbove(r,s->lowerEdge(bin));
+                points.append(QPointF(s->lowerEdge(bin),n));
+                maxCount = qMax(maxCount,n);
+            }
+        }
+        else
+        {
+            // Steps, each bin is drawn as a horizontal line between its edges
+            for ( int bin=firstBin; bin<=lastBin; bin++ )
+            {
+                int n = s->count(r,bin);
+                points.append(QPointF(s->lowerEdge(bin),n));
+                points.append(QPointF(s->upperEdge(bin),n));
+                maxCount = qMax(maxCount,n);
+            }
+        }
+        d->traces.at(r)->replace(points);
+    }
+    d->snrAxis->setRange(s->lowerEdge(firstBin),s->upperEdge(lastBin));
+    d->countAxis->setRange(0,qMax(maxCount,1));
+}
@@ -0,0 +1,50 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef SNRSTATISTICSVIEW_H
+#define SNRSTATISTICSVIEW_H
+
+// Qt includes
+#include <QWidget>
+
+// Forward declarations
+class SnrStatistics;
+
+/**
+ * @brief The SnrStatisticsView class plots the SNR histogram of every receiver on a
+ *        logarithmic SNR axis, or the number of components above each SNR
+ */
+class SnrStatisticsView : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit SnrStatisticsView(QWidget *parent = 0);
+    virtual ~SnrStatisticsView();
+    void setStatistics(const SnrStatistics * statistics);
+public slots:
+    void setCumulative(bool b);
+    void updateChart();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // SNRSTATISTICSVIEW_H
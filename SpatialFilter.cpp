@@ -0,0 +1,298 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+
+// Qt includes
+#include <QtCore/QVector>
+
+// Local includes
+#include "SpatialFilter.h"
+#include "VectorMath.h"
+
+typedef SpatialFilter::complex complex;
+
+// Patch and search radius of non-local means, small enough for grids of 20 to 40 voxels
+static const int patchRadius = 1;
+static const int searchRadius = 2;
+
+// dst[i*stride] = sum(w[|k|]*src[(i+k)*stride]) / sum(w[|k|]) over the k inside the line
+static void convolveLine(const complex * src, complex * dst, int length, int stride, const double * w, int radius)
+{
+    for ( int i=0; i<length; i++ )
+    {
+        int first = qMax(-radius,-i), last = qMin(radius,length-1-i);
+        double weight = 0.0;
+#ifdef SFVIEW_USE_SSE2
+        // A complex value fills one register, real and imaginary part are weighted together
+        __m128d sum = _mm_setzero_pd();
+        for ( int k=first; k<=last; k++ )
+        {
+            double wk = w[k<0?-k:k];
+            sum = _mm_add_pd(sum,_mm_mul_pd(_mm_set1_pd(wk),_mm_loadu_pd(reinterpret_cast<const double*>(src+(i+k)*stride))));
+            weight += wk;
+        }
+        _mm_storeu_pd(reinterpret_cast<double*>(dst+i*stride),_mm_mul_pd(sum,_mm_set1_pd(1.0/weight)));
+#else
+        complex sum = 0.0;
+        for ( int k=first; k<=last; k++ )
+        {
+            double wk = w[k<0?-k:k];
+            sum += wk*src[(i+k)*stride];
+            weight += wk;
+        }
+        dst[i*stride] = sum/weight;
+#endif
+    }
+}
+
+// sum(|a[o[j]]-b[o[j]]|^2) over the patch offsets o
+static double patchDistance(const complex * a, const complex * b, const int * offsets, int count)
+{
+#ifdef SFVIEW_USE_SSE2
+    __m128d sum = _mm_setzero_pd();
+    for ( int j=0; j<count; j++ )
+    {
+        __m128d diff = _mm_sub_pd(_mm_loadu_pd(reinterpret_cast<const double*>(a+offsets[j])),
+                                  _mm_loadu_pd(reinterpret_cast<const double*>(b+offsets[j])));
+        sum = _mm_add_pd(sum,_mm_mul_pd(diff,diff));
+    }
+    double s[2];
+    _mm_storeu_pd(s,sum);
+    return s[0]+s[1];
+#else
+    double sum = 0.0;
+    for ( int j=0; j<count; j++ )
+        sum += std::norm(a[offsets[j]]-b[offsets[j]]);
+    return sum;
+#endif
+}
+
+struct SpatialFilter::Impl
+{
+    Type type;
+    double strength;
+    int grid[3];
+
+    int positions() const
+    {
+        return grid[0]*grid[1]*grid[2];
+    }
+
+    // Real and imaginary part are filtered independently, border voxels use the neighbours inside the grid
+    void median(complex * data) const
+    {
+        QVector<complex> result(positions());
+        double re[27], im[27];
+        for ( int z=0; z<grid[2]; z++ )
+        {
+            for ( int y=0; y<grid[1]; y++ )
+            {
+                for ( int x=0; x<grid[0]; x++ )
+                {
+                    int n = 0;
+                    for ( int k=qMax(0,z-1); k<=qMin(grid[2]-1,z+1); k++ )
+                    {
+                        for ( int j=qMax(0,y-1); j<=qMin(grid[1]-1,y+1); j++ )
+                        {
+                            const complex * row = data+(k*grid[1]+j)*grid[0];
+                            for ( int i=qMax(0,x-1); i<=qMin(grid[0]-1,x+1); i++ )
+                            {
+                                re[n] = row[i].real();
+                                im[n] = row[i].imag();
+                                n++;
+                            }
+                        }
+                    }
+                    std::nth_element(re,re+n/2,re+n);
+                    std::nth_element(im,im+n/2,im+n);
+                    result[(z*grid[1]+y)*grid[0]+x] = complex(re[n/2],im[n/2]);
+                }
+            }
+        }
+        std::copy(result.constBegin(),result.constEnd(),data);
+    }
+
+    // Separable, one pass per axis with more than one voxel
+    void gaussian(complex * data) const
+    {
+        if ( strength<=0.0 )
+            return;
+        int radius = qMax(1,static_cast<int>(std::ceil(2.5*strength)));
+        QVector<double> w(radius+1);
+        for ( int k=0; k<=radius; k++ )
+            w[k] = std::exp(-0.5*k*k/(strength*strength));
+        QVector<complex> buffer(positions());
+        complex * src = data;
+        complex * dst = buffer.data();
+        int stride[3] = { 1, grid[0], grid[0]*grid[1] };
+        for ( int axis=0; axis<3; axis++ )
+        {
+            if ( grid[axis]<2 )
+                continue;
+            int r = qMin(radius,grid[axis]-1);
+            // Lines along axis start at every voxel whose coordinate on that axis is 0
+            for ( int start=0; start<positions(); start++ )
+                if ( (start/stride[axis])%grid[axis]==0 )
+                    convolveLine(src+start,dst+start,grid[axis],stride[axis],w.constData(),r);
+            std::swap(src,dst);
+        }
+        if ( src!=data )
+            std::copy(src,src+positions(),data);
+    }
+
+    // Weights exp(-max(d-2 noise^2,0)/h^2) with the mean squared patch difference d and h=strength*noise
+    void nonLocalMeans(complex * data, double noise) const
+    {
+        if ( noise<=0.0 || strength<=0.0 )
+            return;
+        // Edge replicated copy, patches and search windows never leave it
+        const int pad = patchRadius+searchRadius;
+        int size[3];
+        for ( int i=0; i<3; i++ )
+            size[i] = grid[i]+2*pad;
+        QVector<complex> padded(size[0]*size[1]*size[2]);
+        for ( int z=0; z<size[2]; z++ )
+        {
+            int sz = qBound(0,z-pad,grid[2]-1);
+            for ( int y=0; y<size[1]; y++ )
+            {
+                int sy = qBound(0,y-pad,grid[1]-1);
+                for ( int x=0; x<size[0]; x++ )
+                    padded[(z*size[1]+y)*size[0]+x] = data[(sz*grid[1]+sy)*grid[0]+qBound(0,x-pad,grid[0]-1)];
+            }
+        }
+        int offsets[27];
+        int count = 0;
+        for ( int k=-patchRadius; k<=patchRadius; k++ )
+            for ( int j=-patchRadius; j<=patchRadius; j++ )
+                for ( int i=-patchRadius; i<=patchRadius; i++ )
+                    offsets[count++] = (k*size[1]+j)*size[0]+i;
+
+        double variance2 = 2.0*noise*noise;
+        double h2 = strength*strength*noise*noise;
+        const complex * p = padded.constData();
+        for ( int z=0; z<grid[2]; z++ )
+        {
+            for ( int y=0; y<grid[1]; y++ )
+            {
+                for ( int x=0; x<grid[0]; x++ )
+                {
+                    int center = ((z+pad)*size[1]+y+pad)*size[0]+x+pad;
+                    complex sum = 0.0;
+                    double weight = 0.0;
+                    for ( int k=qMax(-searchRadius,-z); k<=qMin(searchRadius,grid[2]-1-z); k++ )
+                    {
+                        for ( int j=qMax(-searchRadius,-y); j<=qMin(searchRadius,grid[1]-1-y); j++ )
+                        {
+                            for ( int i=qMax(-searchRadius,-x); i<=qMin(searchRadius,grid[0]-1-x); i++ )
+                            {
+                                int other = center+(k*size[1]+j)*size[0]+i;
+                                double distance = patchDistance(p+center,p+other,offsets,count)/count;
+                                double w = std::exp(-qMax(distance-variance2,0.0)/h2);
+                                sum += w*p[other];
+                                weight += w;
+                            }
+                        }
+                    }
+                    data[(z*grid[1]+y)*grid[0]+x] = sum/weight;
+                }
+            }
+        }
+    }
+};
+
+SpatialFilter::SpatialFilter() : d(new Impl)
+{
+    d->type = None;
+    d->strength = 1.0;
+    d->grid[0] = d->grid[1] = d->grid[2] = 0;
+}
+
+SpatialFilter::~SpatialFilter()
+{
+    delete d;
+}
+
+QString SpatialFilter::name(Type type)
+{
+    switch ( type )
+    {
+    case None:
+        return tr("None");
+    case Median:
+        return tr("3D median");
+    case Gaussian:
+        return tr("Gaussian");
+    case NonLocalMeans:
+        return tr("Non-local means");
+    }
+    return QString();
+}
+
+void SpatialFilter::setType(Type type)
+{
+    d->type = type;
+}
+
+SpatialFilter::Type SpatialFilter::type() const
+{
+    return d->type;
+}
+
+void SpatialFilter::setStrength(double strength)
+{
+    d->strength = strength;
+}
+
+double SpatialFilter::strength() const
+{
+    return d->strength;
+}
+
+void SpatialFilter::setGrid(int x, int y, int z)
+{
+    d->grid[0] = x;
+    d->grid[1] = y;
+    d->grid[2] = z;
+}
+
+void SpatialFilter::apply(complex * data, double noise) const
+{
+    if ( d->positions()<=0 )
+        return;
+    switch ( d->type )
+    {
+    case None:
+        break;
+    case Median:
+        d->median(data);
+        break;
+    case Gaussian:
+        d->gaussian(data);
+        break;
+    case NonLocalMeans:
+        d->nonLocalMeans(data,noise);
+        break;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef SPATIALFILTER_H
+#define SPATIALFILTER_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QCoreApplication>
+#include <QtCore/QString>
+
+/**
+ * @brief The SpatialFilter class denoises a single component on the voxel grid of a system
+ *        matrix with a 3x3x3 median of real and imaginary part taken independently, a separable
+ *        Gaussian or non-local means with 3x3x3 patches. apply() only uses local buffers and
+ *        may be called for different components from several threads at once.
+ */
+class SpatialFilter
+{
+    Q_DECLARE_TR_FUNCTIONS(SpatialFilter)
+public:
+    typedef std::complex<double> complex;
+    enum Type { None, Median, Gaussian, NonLocalMeans };
+    SpatialFilter();
+    ~SpatialFilter();
+    static QString name(Type type);
+    void setType(Type type);
+    Type type() const;
+    /**
+     * @brief setStrength Width of the Gaussian in voxels, for non-local means the filter
+     *                    parameter in units of the noise standard deviation. Not used by the median.
+     */
+    void setStrength(double strength);
+    double strength() const;
+    void setGrid(int x, int y, int z);
+    /**
+     * @brief apply Filter a component in place, x fastest
+     * @param noise Standard deviation of a single value, required by non-local means
+     */
+    void apply(complex * data, double noise) const;
+private:
+    Q_DISABLE_COPY(SpatialFilter)
+    struct Impl;
+    Impl * d;
+};
+
+#endif // SPATIALFILTER_H
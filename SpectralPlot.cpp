@@ -20,13 +20,23 @@
  */
 
 // System includes
+#include <algorithm>
+#include <cmath>
 #include <limits>
 
 // Qt includes
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
 #include <QtCore/QPointer>
 #include <QtCore/QDebug>
+#include <QtCore/QHash>
+#include <QtCore/QSettings>
 #include <QtGui/QPainter>
 #include <QtGui/QPaintEvent>
+#include <QtGui/QMouseEvent>
+#include <QtWidgets/QApplication>
+#include <QtWidgets/QFileDialog>
+#include <QtWidgets/QMessageBox>
 #include <QtWidgets/QToolBar>
 #include <QtWidgets/QVBoxLayout>
 
@@ -39,6 +49,7 @@
 // Local includes
 #include "SpectralPlot.h"
 #include "SystemMatrix.h"
+#include "ForwardSimulator.h"
 
 
 struct SpectralPlot::Impl
@@ -56,6 +67,83 @@ struct SpectralPlot::Impl
     QtCharts::QLogValueAxis * snrAxis;
 
     QToolBar * toolBar;
+
+    // Overlay of a simulated spectrum, one dashed trace per receiver
+    ForwardSimulator * simulator;
+    QAction * simulateAction, * clearSimulationAction;
+    QList<QtCharts::QLineSeries*> simulatedTraces;
+    bool backgroundCorrection;
+
+    // Full resolution data of a trace and the part of it currently handed to the chart
+    struct TraceData
+    {
+        TraceData() : first(0), last(0), bucketSize(1) {}
+        QVector<QPointF> points; // Sorted by frequency
+        int first, last;         // Visible window [first,last) in points
+        int bucketSize;          // Points per min/max bucket, 1 for full resolution
+    };
+    QHash<QtCharts::QLineSeries*,TraceData> traceData;
+
+    static bool lessFrequency(const QPointF & p, double x) { return p.x()<x; }
+
+    // Index of the point with the frequency closest to x, -1 for empty traces
+    static int nearestIndex(const QVector<QPointF> & points, double x)
+    {
+        if ( points.isEmpty() )
+            return -1;
+        int i = std::lower_bound(points.constBegin(),points.constEnd(),x,lessFrequency)-points.constBegin();
+        if ( i==points.count() )
+            return i-1;
+        if ( i>0 && x-points.at(i-1).x() < points.at(i).x()-x )
+            return i-1;
+        return i;
+    }
+
+    // Append the minimum and maximum of points [begin,end) in frequency order.
+    // Always appends two points, so that each bucket has a fixed position in the series.
+    static void appendEnvelope(QVector<QPointF> & out, const QVector<QPointF> & points, int begin, int end)
+    {
+        int minIndex=begin, maxIndex=begin;
+        for ( int i=begin+1; i<end; i++ )
+        {
+            double y=points.at(i).y();
+            if ( y<points.at(minIndex).y() )
+                minIndex=i;
+            if ( y>points.at(maxIndex).y() )
+                maxIndex=i;
+        }
+        out.append(points.at(std::min(minIndex,maxIndex)));
+        out.append(points.at(std::max(minIndex,maxIndex)));
+    }
+
+    // Replace the series data by the visible window, reduced to a min/max envelope
+    // whenever it contains more than two points per pixel
+    void decimate(QtCharts::QLineSeries * series, TraceData & t, double min, double max, int pixels)
+    {
+        const QVector<QPointF> & p=t.points;
+        int n=p.count();
+        // Include one point beyond either side of the window, so that lines leave the plot area correctly
+        t.first = std::lower_bound(p.constBegin(),p.constEnd(),min,lessFrequency)-p.constBegin();
+        t.first = std::max(t.first-1,0);
+        t.last = std::lower_bound(p.constBegin()+t.first,p.constEnd(),max,lessFrequency)-p.constBegin();
+        t.last = std::min(t.last+1,n);
+
+        int count=t.last-t.first;
+        QVector<QPointF> out;
+        if ( count<=2*pixels )
+        {
+            t.bucketSize=1;
+            out=p.mid(t.first,count);
+        }
+        else
+        {
+            t.bucketSize=(count+pixels-1)/pixels;
+            out.reserve(2*((count+t.bucketSize-1)/t.bucketSize));
+            for ( int b=t.first; b<t.last; b+=t.bucketSize )
+                appendEnvelope(out,p,b,std::min(b+t.bucketSize,t.last));
+        }
+        series->replace(out);
+    }
 };
 
 SpectralPlot::SpectralPlot(QWidget *parent) :
@@ -89,6 +177,12 @@ SpectralPlot::SpectralPlot(QWidget *parent) :
     d->chartView->setRubberBand(QtCharts::QChartView::RectangleRubberBand);
     d->chartView->show();
 
+    d->chartView->viewport()->installEventFilter(this);
+    d->chartView->setToolTip(tr("Double-click to select the nearest component"));
+
+    connect(d->frequencyAxis,SIGNAL(rangeChanged(qreal,qreal)),SLOT(updateLevelOfDetail()));
+    connect(d->chart,SIGNAL(plotAreaChanged(QRectF)),SLOT(updateLevelOfDetail()));
+
     QAction * a = new QAction(QIcon(":/zoomReset"),tr("Reset zoom"));
     d->toolBar->addAction(a);
     connect(a,SIGNAL(triggered(bool)),SLOT(resetZoom()));
@@ -100,6 +194,20 @@ SpectralPlot::SpectralPlot(QWidget *parent) :
     a = new QAction(QIcon(":/zoomOut"),tr("Zoom out"));
     d->toolBar->addAction(a);
     connect(a,SIGNAL(triggered(bool)),SLOT(zoomOut()));
+
+    d->backgroundCorrection = true;
+    d->simulator = new ForwardSimulator(this);
+    connect(d->simulator,SIGNAL(finished(bool)),SLOT(simulationFinished(bool)));
+    d->simulateAction = new QAction(tr("Simulate"),this);
+    d->simulateAction->setToolTip(tr("Overlay the spectrum of a phantom"));
+    d->simulateAction->setEnabled(false);
+    d->toolBar->addAction(d->simulateAction);
+    connect(d->simulateAction,SIGNAL(triggered(bool)),SLOT(simulatePhantom()));
+    d->clearSimulationAction = new QAction(tr("Clear"),this);
+    d->clearSimulationAction->setToolTip(tr("Remove the simulated spectrum"));
+    d->clearSimulationAction->setEnabled(false);
+    d->toolBar->addAction(d->clearSimulationAction);
+    connect(d->clearSimulationAction,SIGNAL(triggered(bool)),SLOT(clearSimulatedSpectrum()));
 }
 
 SpectralPlot::~SpectralPlot()
@@ -109,9 +217,18 @@ SpectralPlot::~SpectralPlot()
 
 void SpectralPlot::setSystemMatrix(const SystemMatrix *s)
 {
+    d->simulator->cancel();
+    d->simulator->waitForFinished();
+    d->simulator->setSystemMatrix(const_cast<SystemMatrix*>(s));
+    d->simulateAction->setEnabled(s!=0);
+    d->clearSimulationAction->setEnabled(false);
+    d->simulatedTraces.clear();
     d->systemMatrix = const_cast<SystemMatrix*>(s);
+    if ( d->systemMatrix )
+        connect(d->systemMatrix,SIGNAL(componentsChanged(QList<int>)),SLOT(updateComponents(QList<int>)),Qt::UniqueConnection);
     d->channelOrder.clear();
     d->traces.clear();
+    d->traceData.clear();
     foreach(QAction * a,d->traceActions.keys())
         delete a;
     d->traceActions.clear();
@@ -161,10 +278,12 @@ void SpectralPlot::setSystemMatrix(const SystemMatrix *s)
            d->traceActions.insert(traceAction,trace);
            connect(trace,SIGNAL(clicked(QPointF)),SLOT(selectPoint(QPointF)));
 
+           Impl::TraceData & data = d->traceData[trace];
+           data.points.resize(d->systemMatrix->numberOfFrequencies());
            for ( int i=0; i<d->systemMatrix->numberOfFrequencies(); i++)
            {
                int globalIndex = d->systemMatrix->globalIndex(receiver,i);
-               trace->append(d->systemMatrix->frequency(globalIndex)/1000,d->systemMatrix->snr(globalIndex));
+               data.points[i] = QPointF(d->systemMatrix->frequency(globalIndex)/1000,d->systemMatrix->snr(globalIndex));
            }
            d->chart->addSeries(trace);
            trace->attachAxis(d->frequencyAxis);
@@ -179,9 +298,21 @@ void SpectralPlot::setSystemMatrix(const SystemMatrix *s)
        d->chart->legend()->hide();
        d->markerLine->setColor(Qt::black);
 
+       updateLevelOfDetail();
     }
 }
 
+void SpectralPlot::updateLevelOfDetail()
+{
+    int pixels = static_cast<int>(d->chart->plotArea().width());
+    if ( pixels<1 )
+        pixels = std::max(d->chartView->width(),1);
+    double min=d->frequencyAxis->min();
+    double max=d->frequencyAxis->max();
+    for ( QHash<QtCharts::QLineSeries*,Impl::TraceData>::iterator i=d->traceData.begin(); i!=d->traceData.end(); ++i )
+        d->decimate(i.key(),i.value(),min,max,pixels);
+}
+
 const SystemMatrix * SpectralPlot::systemMatrix() const
 {
     return d->systemMatrix;
@@ -202,6 +333,41 @@ void SpectralPlot::highlightGlobalIndex(int globalIndex)
 
 }
 
+void SpectralPlot::updateComponents(const QList<int> & globalIndices)
+{
+    if ( !d->systemMatrix )
+        return;
+    foreach(int globalIndex, globalIndices)
+    {
+        int receiver = d->systemMatrix->receiver(globalIndex);
+        if ( receiver<0 || receiver>=d->traces.count() )
+            continue;
+        QtCharts::QLineSeries * trace = d->traces.at(receiver);
+        if ( !d->traceData.contains(trace) )
+            continue;
+        Impl::TraceData & t = d->traceData[trace];
+        int i = d->systemMatrix->frequencyIndex(globalIndex);
+        t.points[i].setY(d->systemMatrix->snr(globalIndex));
+
+        // Patch the displayed point or min/max bucket containing this frequency
+        if ( i<t.first || i>=t.last )
+            continue;
+        if ( t.bucketSize==1 )
+        {
+            trace->replace(i-t.first,t.points.at(i));
+        }
+        else
+        {
+            int bucket=(i-t.first)/t.bucketSize;
+            int begin=t.first+bucket*t.bucketSize;
+            QVector<QPointF> envelope;
+            Impl::appendEnvelope(envelope,t.points,begin,std::min(begin+t.bucketSize,t.last));
+            trace->replace(2*bucket,envelope.at(0));
+            trace->replace(2*bucket+1,envelope.at(1));
+        }
+    }
+}
+
 void SpectralPlot::selectPoint(const QPointF & p)
 {
     int receiver=-1;
@@ -218,20 +384,83 @@ void SpectralPlot::selectPoint(const QPointF & p)
             break;
         }
     }
-    if ( receiver==-1 || trace==0 )
+    if ( receiver==-1 || trace==0 || !d->traceData.contains(trace) )
         return;
-    int index=0;
     double delta=0.5e-3*d->systemMatrix->bandwidth()/(d->systemMatrix->numberOfFrequencies()-1);
 
-    foreach( const QPointF & q, trace->points() )
+    const QVector<QPointF> & points = d->traceData[trace].points;
+    int index = Impl::nearestIndex(points,p.x());
+    if ( index>=0 && fabs(points.at(index).x()-p.x())<=delta )
+        emit globalIndexSelect(d->systemMatrix->globalIndex(receiver,index));
+}
+
+int SpectralPlot::nearestComponent(const QPointF & value, double minSnr) const
+{
+    if ( !d->systemMatrix )
+        return -1;
+
+    // Map chart values to pixels directly, frequency axis is linear, SNR axis logarithmic
+    QRectF area = d->chart->plotArea();
+    double xMin = d->frequencyAxis->min();
+    double xScale = area.width()/(d->frequencyAxis->max()-xMin);
+    double yMin = log(d->snrAxis->min());
+    double yScale = area.height()/(log(d->snrAxis->max())-yMin);
+    if ( value.y()<=0.0 || xScale<=0.0 || yScale<=0.0 )
+        return -1;
+    double targetX = area.left()+(value.x()-xMin)*xScale;
+    double targetY = area.bottom()-(log(value.y())-yMin)*yScale;
+
+    QList<QtCharts::QAbstractSeries*> visible = d->chart->series();
+    double best = std::numeric_limits<double>::max();
+    int result = -1;
+    for ( int receiver=0; receiver<d->traces.count(); receiver++ )
     {
-        if (  fabs(q.x()-p.x())<=delta )
+        QtCharts::QLineSeries * trace = d->traces.at(receiver);
+        if ( !visible.contains(trace) || !d->traceData.contains(trace) )
+            continue;
+        const QVector<QPointF> & points = d->traceData[trace].points;
+        int start = Impl::nearestIndex(points,value.x());
+        if ( start<0 )
+            continue;
+
+        // Walk outwards from the nearest frequency until the horizontal distance alone
+        // exceeds the best match or the point leaves the viewport
+        for ( int direction=-1; direction<=1; direction+=2 )
         {
-            emit globalIndexSelect(d->systemMatrix->globalIndex(receiver,index));
-            return;
+            for ( int i=(direction>0)?start:start-1; i>=0 && i<points.count(); i+=direction )
+            {
+                const QPointF & q = points.at(i);
+                double dx = area.left()+(q.x()-xMin)*xScale-targetX;
+                if ( dx*dx>=best || q.x()<xMin || q.x()>d->frequencyAxis->max() )
+                    break;
+                if ( q.y()<minSnr || q.y()<d->snrAxis->min() || q.y()>d->snrAxis->max() )
+                    continue;
+                double dy = area.bottom()-(log(q.y())-yMin)*yScale-targetY;
+                if ( dx*dx+dy*dy<best )
+                {
+                    best = dx*dx+dy*dy;
+                    result = d->systemMatrix->globalIndex(receiver,i);
+                }
+            }
         }
-        index++;
     }
+    return result;
+}
+
+bool SpectralPlot::eventFilter(QObject * obj, QEvent * ev)
+{
+    if ( obj==d->chartView->viewport() && ev->type()==QEvent::MouseButtonDblClick )
+    {
+        // Navigate to the nearest component with sufficient SNR
+        QMouseEvent * mouseEvent = static_cast<QMouseEvent*>(ev);
+        QPointF value = d->chart->mapToValue(d->chart->mapFromScene(d->chartView->mapToScene(mouseEvent->pos())));
+        QSettings settings;
+        int globalIndex = nearestComponent(value,settings.value("spectralPlotPickingSnr",3.0).toDouble());
+        if ( globalIndex>=0 )
+            emit globalIndexSelect(globalIndex);
+        return true;
+    }
+    return QWidget::eventFilter(obj,ev);
 }
 
 void SpectralPlot::zoomIn()
@@ -274,3 +503,95 @@ void SpectralPlot::setTraceVisible(bool b)
             chart->removeSeries( trace );
     }
 }
+
+void SpectralPlot::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void SpectralPlot::setSimulatedSpectrum(const QVector<SystemMatrix::complex> & spectrum)
+{
+    foreach(QtCharts::QLineSeries * trace, d->simulatedTraces)
+    {
+        d->traceData.remove(trace);
+        d->chart->removeSeries(trace);
+        delete trace;
+    }
+    d->simulatedTraces.clear();
+    d->clearSimulationAction->setEnabled(false);
+    int numComponents = d->systemMatrix ? d->systemMatrix->numberOfReceivers()*d->systemMatrix->numberOfFrequencies() : 0;
+    if ( spectrum.count()!=numComponents || numComponents==0 )
+        return;
+
+    for ( int receiver=0; receiver<d->systemMatrix->numberOfReceivers(); receiver++ )
+    {
+        QtCharts::QLineSeries * trace = new QtCharts::QLineSeries(this);
+        QPen pen(d->stdColors.at(receiver % d->stdColors.count()));
+        pen.setStyle(Qt::DashLine);
+        trace->setPen(pen);
+        Impl::TraceData & data = d->traceData[trace];
+        for ( int i=0; i<d->systemMatrix->numberOfFrequencies(); i++ )
+        {
+            // Expected SNR of the phantom, components without simulation or noise estimate are left out
+            int globalIndex = d->systemMatrix->globalIndex(receiver,i);
+            double noise = sqrt(d->systemMatrix->backgroundVariance(globalIndex));
+            double value = std::abs(spectrum.at(globalIndex));
+            if ( noise>0.0 && value>0.0 )
+                data.points.append(QPointF(d->systemMatrix->frequency(globalIndex)/1000,value/noise));
+        }
+        d->chart->addSeries(trace);
+        trace->attachAxis(d->frequencyAxis);
+        trace->attachAxis(d->snrAxis);
+        d->simulatedTraces.append(trace);
+    }
+    d->clearSimulationAction->setEnabled(true);
+    updateLevelOfDetail();
+}
+
+void SpectralPlot::clearSimulatedSpectrum()
+{
+    setSimulatedSpectrum(QVector<SystemMatrix::complex>());
+}
+
+void SpectralPlot::simulatePhantom()
+{
+    if ( !d->systemMatrix || d->simulator->isRunning() )
+        return;
+    QSettings settings;
+    QString fileName = QFileDialog::getOpenFileName(this,tr("Load phantom"),
+                                                    settings.value("phantomDirectory",QDir::homePath()).toString(),
+                                                    tr("Phantoms (*.bin *.raw);;All files (*)"));
+    if ( fileName.isEmpty() )
+        return;
+    settings.setValue("phantomDirectory",QFileInfo(fileName).path());
+
+    // Only components above the threshold, a full matrix product reads the whole matrix
+    double threshold = settings.value("simulationSnrThreshold",3.0).toDouble();
+    QList<int> components;
+    for ( int rank=0; rank<=d->systemMatrix->maxGlobalIndex(); rank++ )
+    {
+        int globalIndex = d->systemMatrix->globalIndex(rank);
+        if ( globalIndex<0 || d->systemMatrix->snr(globalIndex)<threshold )
+            break;
+        components.append(globalIndex);
+    }
+    d->simulator->setComponents(components);
+    d->simulator->setBackgroundCorrection(d->backgroundCorrection);
+    if ( !d->simulator->loadPhantom(fileName) || !d->simulator->start() )
+    {
+        QMessageBox::warning(this,tr("Simulate phantom"),d->simulator->errorString());
+        return;
+    }
+    d->simulateAction->setEnabled(false);
+    QApplication::setOverrideCursor(Qt::BusyCursor);
+}
+
+void SpectralPlot::simulationFinished(bool success)
+{
+    QApplication::restoreOverrideCursor();
+    d->simulateAction->setEnabled(d->systemMatrix!=0);
+    if ( success )
+        setSimulatedSpectrum(d->simulator->result());
+    else if ( !d->simulator->errorString().isEmpty() )
+        QMessageBox::warning(this,tr("Simulate phantom"),d->simulator->errorString());
+}
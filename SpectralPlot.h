@@ -35,17 +35,31 @@ public:
     explicit SpectralPlot(QWidget *parent = 0);
     virtual ~SpectralPlot();
     const SystemMatrix * systemMatrix() const;
+    int nearestComponent(const QPointF & value, double minSnr) const;
 signals:
     void globalIndexSelect(int globalIndex);
 public slots:
     void setSystemMatrix( const SystemMatrix * s );
     void highlightGlobalIndex(int globalIndex);
+    void updateComponents(const QList<int> & globalIndices);
+    void setBackgroundCorrection(bool b);
+    /**
+     * @brief setSimulatedSpectrum Overlay a spectrum in global index order as dashed traces,
+     *                             scaled by the background noise. An empty vector removes it.
+     */
+    void setSimulatedSpectrum(const QVector<SystemMatrix::complex> & spectrum);
+    void clearSimulatedSpectrum();
+    void simulatePhantom();
 private slots:
+    void simulationFinished(bool success);
     void selectPoint(const QPointF &);
     void setTraceVisible(bool);
     void zoomIn();
     void zoomOut();
     void resetZoom();
+    void updateLevelOfDetail();
+protected:
+    virtual bool eventFilter(QObject *, QEvent *);
 private:
     struct Impl;
     Impl * d;
@@ -26,8 +26,11 @@
 #include <QtCore/QSettings>
 #include <QtCore/QCache>
 #include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QSet>
 #include <QtGui/QVector3D>
 #include <QtWidgets/QMessageBox>
+#include <QtConcurrent/QtConcurrentMap>
 
 // Local includes
 #include "SystemMatrix.h"
@@ -35,13 +38,17 @@
 #include "ChangeListV1.h"
 #include "ChangeList.h"
 #include "TransferFunction.h"
+#include "SystemMatrixStorage.h"
+#ifdef SFVIEW_HAVE_HDF5
+#include "MdfStorage.h"
+#endif
 
 static int lcm(int n, int * a);
 
 // Change if phase correction should modify amplitudes as well
 static const bool correctPhaseOnly = true;
 
-static const unsigned int changeTableVersion = 0x02;
+static const unsigned int changeTableVersion = 0x03;
 
 template<typename T>
 static T sqr(const T & a ) { return a*a; }
@@ -51,8 +58,7 @@ struct SystemMatrix::Impl {
     int baseFrequencyIndex[3];
     int maxMixingOrder;
     QString procnoPath;
-    complex * rawDataUncorrected;
-    complex * rawDataCorrected;
+    SystemMatrixStorage * storage;
     typedef QCache<int,QByteArray> DataCache;
     DataCache dataCache;
     int grid[3];
@@ -61,11 +67,12 @@ struct SystemMatrix::Impl {
     int numFrequencies, numChannels, positions, numBgPositions;
     double bandwidth;
     double * snrValueTable;
+    QVector<double> snrValues; // Storage of snrValueTable if not mapped from a file
     QList<int> snrIndexTable;
-    const complex * backgroundReference;
     const complex * allBackground;
-    const double * backgroundVariance;
     QVector<double> backgroundNoise_;
+    double driveFieldStrength[3], selectionFieldGradient;
+    int div[3];
     typedef QMap<int,QVector3D> MixTableType;
     MixTableType mixTable;
     PvParameterFile * methRecoParameters, * recoParameters, * acqpParameters, * methodParameters;
@@ -79,6 +86,11 @@ struct SystemMatrix::Impl {
     QDateTime experimentDate;
     double tracerConcentration,tracerVolume;
     int averages;
+    int changeDepth; // Nesting level of beginChanges()
+    QSet<int> pendingChanges; // Modified components not yet announced
+    // Number of change table items per changed voxel by component, the voxel is its data offset
+    typedef QHash<int, QHash<int,int> > EditedVoxels;
+    EditedVoxels editedVoxels;
 
     template<typename T>
     qint64 mapFile(const QString & fileName, T ** p, QFile::OpenMode mode, QString * error=0)
@@ -101,29 +113,14 @@ struct SystemMatrix::Impl {
         }
 
         QFile * file = new QFile(fileName);
-        if ( ! file->exists() )
-        {
-             if ( error ) *error = tr ( "File %1 does not exist.").arg(fileName);
-             delete file;
-             return 0;
-        }
-        if ( !file->open(mode) )
+        uchar * q = SystemMatrixStorage::mapFile(*file,mode,error);
+        if ( 0 == q )
         {
-            if ( error ) * error = tr ( "Cannot open file %1.").arg(fileName);
             delete file;
             return 0;
         }
-
-        uchar * q = file->map(0,file->size());
-        if ( 0 == q )
-        {
-             if ( error ) *error = tr ("Cannot map file %1 into memory.").arg(fileName);
-             delete file;
-             return 0;
-        }
         *p = reinterpret_cast<T*>(q);
         mappedFiles.insert(file,q);
-        file->close();
         return file->size();
     }
 
@@ -162,6 +159,8 @@ struct SystemMatrix::Impl {
 
     bool validPosition(const MatrixPosition & pos) const
     {
+        if ( !pos.isValid() )
+            return false;
         for ( unsigned int i=0; i<3; i++ )
         {
             if ( static_cast<int>(pos.index(i))>=grid[i] )
@@ -172,20 +171,14 @@ struct SystemMatrix::Impl {
 
     double driveField(unsigned int channel) const
     {
-        if ( ! methodParameters->isValid() )
+        if ( channel>=3 )
             return 0.0;
-        if ( ! methodParameters->isArray("PVM_MPI_DriveFieldStrength") )
-            return 0.0;
-        if ( static_cast<int>(channel) >= methodParameters->dimension("PVM_MPI_DriveFieldStrength") )
-            return 0.0;
-        return methodParameters->value<double>("PVM_MPI_DriveFieldStrength", channel);
+        return driveFieldStrength[channel];
     }
 
     double selectionField() const
     {
-        if ( methodParameters->isValid() )
-            return methodParameters->value<double>("PVM_MPI_SelectionFieldGradient");
-        return 0.0;
+        return selectionFieldGradient;
     }
 
     complex dataPoint(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const
@@ -193,69 +186,83 @@ struct SystemMatrix::Impl {
         complex result(0.0,0.0);
         if ( validPosition(pos) && globalIndex>=0 && globalIndex < numChannels*numFrequencies )
         {
-            size_t block = grid[0] * grid[1] * grid[2];
-            complex * p = rawDataUncorrected;
-            if (backgroundCorrection)
-                p = rawDataCorrected;
-            p += block*globalIndex;
+            const complex * p = storage->component(globalIndex,backgroundCorrection);
+            if ( p==0 )
+                return result;
             int offset=(pos.z()*grid[1]+pos.y())*grid[0]+pos.x();
-            p+=offset;
-            result = *p;
+            result = p[offset];
         }
         return result;
     }
 
+    // Index of a valid position in the data of a component
+    size_t dataOffset(const MatrixPosition & pos) const
+    {
+        return (static_cast<size_t>(pos.z())*grid[1]+pos.y())*grid[0]+pos.x();
+    }
+
     bool setDataPoint(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection, const complex & value)
     {
         if ( !validPosition(pos) || mode==Viewer )
             return false;
         if ( globalIndex<0 || globalIndex>=numFrequencies*numChannels )
             return false;
-        size_t block=grid[0]*grid[1]*grid[2];
-        size_t offset=(pos.z()*grid[1]+pos.y())*grid[0]+pos.x();
-        complex * p=rawDataUncorrected;
-        if ( backgroundCorrection)
-            p = rawDataCorrected;
-
-        p += block*globalIndex+offset;
+        complex * p=storage->writableComponent(globalIndex,backgroundCorrection);
+        if ( p==0 )
+            return false;
 
-        *p = value;
+        p[dataOffset(pos)] = value;
         return true;
     }
 
-    complex interpolated(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const
+    // Offsets of the neighbours of pos inside the grid and their normalized inverse distance weights
+    int neighbours(const MatrixPosition & pos, int offsets[26], double weights[26]) const
     {
-        MatrixPosition p;
-        complex res(0.0,0.0);
+        int n=0;
         double weight=0.0;
-
-        for ( int i=-1; i<=1; i++ )
+        for ( int k=-1; k<=1; k++ )
         {
-            p.setX(pos.x()+i);
-            double dist=sqr(i*fov[0]/grid[0]);
             for ( int j=-1; j<=1; j++ )
             {
-                p.setY(pos.y()+j);
-                dist += sqr(j*fov[1]/grid[1]);
-                for ( int k=-1; k<=1; k++ )
+                for ( int i=-1; i<=1; i++ )
                 {
-                    p.setZ(pos.z()+k);
-                    dist += sqr(k*fov[2]/grid[2]);
+                    MatrixPosition p(pos.x()+i,pos.y()+j,pos.z()+k);
                     if ( i==0 && j==0 && k==0 )
                         continue;
-                    dist=sqrt(dist);
-                    if ( validPosition(p) )
-                    {
-                        double w=1.0/dist;
-                        res+=w*dataPoint(globalIndex,p,backgroundCorrection);
-                        weight+=w;
-                    }
+                    if ( !validPosition(p) )
+                        continue;
+                    double dist=sqrt(sqr(i*fov[0]/grid[0])+sqr(j*fov[1]/grid[1])+sqr(k*fov[2]/grid[2]));
+                    offsets[n]=(p.z()*grid[1]+p.y())*grid[0]+p.x();
+                    weights[n]=1.0/dist;
+                    weight+=weights[n];
+                    n++;
                 }
             }
         }
-        if (weight==0.0)
-            return res;
-        return res/weight;
+        for ( int i=0; i<n; i++ )
+            weights[i]/=weight;
+        return n;
+    }
+
+    complex interpolated(const complex * p, int count, const int * offsets, const double * weights) const
+    {
+        complex res(0.0,0.0);
+        for ( int i=0; i<count; i++ )
+            res+=weights[i]*p[offsets[i]];
+        return res;
+    }
+
+    complex interpolated(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const
+    {
+        if ( !validPosition(pos) || globalIndex<0 || globalIndex>=numChannels*numFrequencies )
+            return complex(0.0,0.0);
+        const complex * p = storage->component(globalIndex,backgroundCorrection);
+        if ( p==0 )
+            return complex(0.0,0.0);
+        int offsets[26];
+        double weights[26];
+        int count=neighbours(pos,offsets,weights);
+        return interpolated(p,count,offsets,weights);
     }
 
     double backgroundNoise(int globalIndex)
@@ -338,6 +345,15 @@ struct SystemMatrix::Impl {
     {
         if ( globalIndex<0 || globalIndex>= numChannels*numFrequencies )
             return;
+        const complex * p = storage->component(globalIndex,true);
+        if ( p==0 )
+            return;
+        snrValueTable[globalIndex] = snr(globalIndex,p);
+    }
+
+    // Mean magnitude of the background corrected component p inside the SNR region over the background noise
+    double snr(int globalIndex, const complex * p)
+    {
         double dfFov[3];
         for ( unsigned int i=0; i<3; i++)
         {
@@ -346,10 +362,6 @@ struct SystemMatrix::Impl {
                 dfFov[i] *= 2.0;
         }
 
-        size_t block=grid[0]*grid[1]*grid[2];
-        complex * p = rawDataCorrected;
-        p+=block*globalIndex;
-
         double v=0.0;
         int count = 0;
         for ( int k=0; k<grid[2]; k++ )
@@ -378,7 +390,25 @@ struct SystemMatrix::Impl {
         }
         v /= count;
         v /= backgroundNoise(globalIndex);
-        snrValueTable[globalIndex] = v;
+        return v;
+    }
+
+    // Recalculates the SNR of one component in a worker thread
+    struct RecalcSNR
+    {
+        explicit RecalcSNR(Impl * d) : d(d) {}
+        void operator()(int globalIndex) const { d->recalcSNR(globalIndex); }
+        Impl * d;
+    };
+
+    // Each component writes its own entry of the SNR table, so components are processed in parallel
+    void recalcSNR(const QList<int> & globalIndices)
+    {
+        // The noise is cached on first use, fill the cache before the worker threads read it
+        foreach(int globalIndex, globalIndices)
+            backgroundNoise(globalIndex);
+        QList<int> indices = globalIndices;
+        QtConcurrent::blockingMap(indices,RecalcSNR(this));
     }
 
 
@@ -394,6 +424,33 @@ struct SystemMatrix::Impl {
             snrIndexTable.prepend ( index );
     }
 
+    // Adds (delta=1) or removes (delta=-1) the voxels of a change table entry
+    void countEdits(const ChangeListEntry & e, int delta)
+    {
+        foreach(const ChangeListItem & i, e.changeItems)
+        {
+            MatrixPosition p = i.position_.isValid() ? i.position_ : e.position;
+            if ( !validPosition(p) )
+                continue;
+            QHash<int,int> & voxels = editedVoxels[i.globalIndex_];
+            int voxel = static_cast<int>(dataOffset(p));
+            int count = voxels.value(voxel)+delta;
+            if ( count>0 )
+                voxels.insert(voxel,count);
+            else
+                voxels.remove(voxel);
+            if ( voxels.isEmpty() )
+                editedVoxels.remove(i.globalIndex_);
+        }
+    }
+
+    void rebuildEditedVoxels()
+    {
+        editedVoxels.clear();
+        foreach(const ChangeListEntry & e, changeList)
+            countEdits(e,1);
+    }
+
     void importChangeTableV1(QDataStream & ds)
     {
         QMap<MatrixPosition,ChangeListV1> changes;
@@ -412,7 +469,7 @@ struct SystemMatrix::Impl {
                     value[1]=v;
                 value[2]=e1.oldValue;
                 value[3]=e1.newValue;
-                changeItems.append(ChangeListItem(e1.globalIndex,value));
+                changeItems.append(ChangeListItem(pos,e1.globalIndex,value));
                 recalcSNR(e1.globalIndex);
             }
             changeList.append(ChangeListEntry(pos,changeItems));
@@ -427,6 +484,59 @@ struct SystemMatrix::Impl {
 SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * parent ) : QObject(parent), d(new Impl)
 {
     d->mode = mode;
+    d->storage = 0;
+    d->snrValueTable = 0;
+    d->allBackground = 0;
+    d->methRecoParameters = d->recoParameters = d->acqpParameters = d->methodParameters = 0;
+    d->tracerVolume = 0.0;
+    d->tracerConcentration = 0.0;
+    d->averages = 0;
+    d->changeDepth = 0;
+    d->snrInDFFOV = false;
+    d->numBgPositions = 0;
+    d->selectionFieldGradient = 0.0;
+    for ( unsigned int i=0; i<3; i++ )
+    {
+        d->driveFieldStrength[i] = 0.0;
+        d->div[i] = 1;
+    }
+    d->dataCache.setMaxCost(10);
+
+    if ( isMdfFile(procnoPath) )
+        loadMdf(procnoPath);
+    else
+        loadBruker(procnoPath);
+    if ( !d->error.isEmpty() )
+        return;
+
+    for ( unsigned int i=0; i<3; i++ )
+        d->baseFrequencyIndex[i]=lcm(3,d->div)/d->div[i];
+    
+    QSettings settings;
+    d->maxMixingOrder=settings.value("maxMixingOrder",50).toInt();
+
+    for ( int i=-d->maxMixingOrder; i<=d->maxMixingOrder; i++ )
+        for ( int j=-d->maxMixingOrder+abs(i); j<=d->maxMixingOrder-abs(i); j++ )
+            for ( int k=-d->maxMixingOrder+abs(i)+abs(j); k<=d->maxMixingOrder-abs(i)-abs(j); k++ )
+            {
+                int index=d->baseFrequencyIndex[0]*i+d->baseFrequencyIndex[1]*j+d->baseFrequencyIndex[2]*k;
+                if ( index<0 || index>=d->numFrequencies )
+                    continue;
+                d->mixTable.insertMulti(index,QVector3D(i,j,k));
+            }
+}
+
+bool SystemMatrix::isMdfFile(const QString & path)
+{
+    QFileInfo fi(path);
+    if ( !fi.isFile() )
+        return false;
+    QString suffix = fi.suffix().toLower();
+    return suffix=="mdf" || suffix=="h5" || suffix=="hdf5";
+}
+
+void SystemMatrix::loadBruker(const QString & procnoPath)
+{
     QFileInfo fi(procnoPath);
     if ( fi.isDir() )
         d->procnoPath = procnoPath;
@@ -434,16 +544,6 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
         d->procnoPath = fi.path();
     if ( ! d->procnoPath.contains("pdata") )
         d->procnoPath.append("/pdata/1");
-    d->rawDataUncorrected = 0;
-    d->rawDataCorrected = 0;
-    d->snrValueTable = 0;
-    d->backgroundReference = 0;
-    d->backgroundVariance = 0;
-    d->allBackground = 0;
-    d->tracerVolume = 0.0;
-    d->tracerConcentration = 0.0;
-    d->averages = 0;
-    d->dataCache.setMaxCost(10);
 
     QDir expno ( d->procnoPath );
     expno.cdUp();
@@ -489,6 +589,13 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
     d->snrInDFFOV = d->methodParameters->value<QString>( "PVM_MPI_ActivateSNRWithinDFFov" )=="Yes";
     d->numBgPositions = d->methodParameters->value<int>("PVM_MPI_NrBackgroundMeasurementCalibrationAllScans") -
                         d->methodParameters->value<int>("PVM_MPI_NrBackgroundMeasurementCalibrationAdditionalScans");
+    d->selectionFieldGradient = d->methodParameters->value<double>("PVM_MPI_SelectionFieldGradient");
+    if ( d->methodParameters->isArray("PVM_MPI_DriveFieldStrength") )
+    {
+        int channels = qMin(3,d->methodParameters->dimension("PVM_MPI_DriveFieldStrength"));
+        for ( int i=0; i<channels; i++ )
+            d->driveFieldStrength[i] = d->methodParameters->value<double>("PVM_MPI_DriveFieldStrength", i);
+    }
 
     for ( unsigned int i = 0; i < 3; i++ )
         d->grid[i] = 1;
@@ -507,34 +614,20 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
     if ( d->mode==Viewer )
         fileMode=QIODevice::ReadOnly;
 
-    // Map uncorrected raw data
-    qint64 dataSize1 = d->mapFile( d->procnoPath+"/systemMatrix", &d->rawDataUncorrected,fileMode,& d->error);
-    if ( dataSize1==0 )
+    // Map raw data and background reference
+    d->storage = new MappedStorage( d->procnoPath, d->positions, d->mode==Editor );
+    if ( !d->storage->isValid( & d->error ) )
         return;
 
-    // Map corrected raw data
-    qint64 dataSize2 = d->mapFile( d->procnoPath+"/systemMatrixBG", &d->rawDataCorrected,fileMode, & d->error);
-    if ( dataSize2==0 )
-        return;
-
-    if ( dataSize1!=dataSize2 )
-    {
-        d->error = tr ( "Sizes of corrected and uncorrected system matrices do not match.");
-        return;
-    }
-
     // Compute number of channels from raw data.
     // This would better be done from acqp parameters, but is more complicated that way with our simple parser,
-    qint64 channels = dataSize1;
-    channels /= sizeof(complex);
-    channels /= d->positions;
-    channels /= d->numFrequencies;
+    int channels = d->storage->numberOfComponents() / d->numFrequencies;
     d->numChannels = channels;
 
     d->transferFunction.resize(channels);
 
     // Load transfer functions
-    for ( unsigned int i=0; i<channels; i++)
+    for ( int i=0; i<channels; i++)
     {
         d->transferFunction[i]=0;
         QString calibFile = QString("%1/chan%2.rxcal").arg(expno.absolutePath()).arg(i+1);
@@ -558,32 +651,8 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
     }
     d->rebuildSNRIndex();
 
-    // Load background reference
-    mappedSize=d->mapFile( d->procnoPath + "/backgroundReference", & d->backgroundReference, QFile::ReadOnly, & d->error);
-    if ( mappedSize==0 )
-        return;
-
-    expectedSize = static_cast<qint64>(d->numFrequencies)*d->numChannels*sizeof(complex);
-    if ( expectedSize != mappedSize )
-    {
-        d->error = tr ("Background reference file has wrong file size (%1 bytes instead of expected %2 bytes).").arg(mappedSize).arg(expectedSize);
-        return;
-    }
-
-    // Load background variance
-    mappedSize=d->mapFile( d->procnoPath + "/backgroundVariance", &d->backgroundVariance, QFile::ReadOnly, & d->error );
-    if ( mappedSize==0 )
-        return;
-
-    expectedSize = static_cast<qint64>(d->numFrequencies)*d->numChannels*sizeof(double);
-    if ( expectedSize != mappedSize )
-    {
-        d->error = tr ("Background variance file has wrong file size (%1 bytes instead of expected %2 bytes).").arg(mappedSize).arg(expectedSize);
-        return;
-    }
-
     // Load all background data, required for SNR recalculation in case of editor
-    if ( mode==Editor )
+    if ( d->mode==Editor )
     {
         mappedSize = d->mapFile( d->procnoPath + "/background", & d->allBackground, QFile::ReadOnly, & d->error );
         if ( mappedSize == 0 )
@@ -600,7 +669,7 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
     }
 
     // Load previous modification table
-    if ( mode==Editor )
+    if ( d->mode==Editor )
     {
         QFile modificationTable ( d->procnoPath + "/modificationTable.bin" );
         if ( modificationTable.exists() )
@@ -619,6 +688,9 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
                 case 0x01:
                     d->importChangeTableV1(ds);
                     break;
+                case 0x02:
+                    readChangeListV2(ds,d->changeList);
+                    break;
                 case changeTableVersion:
                     ds >> d->changeList;
                     break;
@@ -626,31 +698,84 @@ SystemMatrix::SystemMatrix (const QString & procnoPath, Mode mode, QObject * par
                     d->error = tr ( "Cannot read modification table version %1.").arg(version);
                     break;
             }
+            d->rebuildEditedVoxels();
         }
     }
 
-    int div[3];
     for ( unsigned int i=0; i<3; i++ )
-        div[i] = d->acqpParameters->value<int>("ACQ_MPI_div",i);
-    for ( unsigned int i=0; i<3; i++ )
-        d->baseFrequencyIndex[i]=lcm(3,div)/div[i];
-    
-    QSettings settings;
-    d->maxMixingOrder=settings.value("maxMixingOrder",50).toInt();
+        d->div[i] = d->acqpParameters->value<int>("ACQ_MPI_div",i);
+}
 
-    for ( int i=-d->maxMixingOrder; i<=d->maxMixingOrder; i++ )
-        for ( int j=-d->maxMixingOrder+abs(i); j<=d->maxMixingOrder-abs(i); j++ )
-            for ( int k=-d->maxMixingOrder+abs(i)+abs(j); k<=d->maxMixingOrder-abs(i)-abs(j); k++ )
-            {
-                int index=d->baseFrequencyIndex[0]*i+d->baseFrequencyIndex[1]*j+d->baseFrequencyIndex[2]*k;
-                if ( index<0 || index>=d->numFrequencies )
-                    continue;
-                d->mixTable.insertMulti(index,QVector3D(i,j,k));
-            }
+void SystemMatrix::loadMdf(const QString & fileName)
+{
+    d->procnoPath = fileName;
+#ifdef SFVIEW_HAVE_HDF5
+    if ( d->mode==Editor )
+    {
+        d->error = tr ( "MDF files can only be opened in the viewer." );
+        return;
+    }
+
+    MdfStorage * mdf = new MdfStorage( fileName );
+    d->storage = mdf;
+    if ( !mdf->isValid( & d->error ) )
+        return;
+
+    setInstitution(mdf->stringValue("/scanner/facility"));
+    setSystemName(mdf->stringValue("/scanner/name"));
+    setManufacturer(mdf->stringValue("/scanner/manufacturer"));
+    setExperimentName(mdf->stringValue("/experiment/name"));
+    QString date = mdf->stringValue("/study/time");
+    if ( date.isEmpty() )
+        date = mdf->stringValue("/time");
+    setExperimentDate(QDateTime::fromString(date.left(19),"yyyy-MM-dd'T'HH:mm:ss"));
+    setAverages(static_cast<int>(mdf->value("/acquisition/numAverages",1)));
+    setTracerName(mdf->stringValue("/tracer/name"));
+    setTracerConcentration(mdf->value("/tracer/concentration"));
+    // MDF uses SI units, the viewer mm, mT and microL
+    setTracerVolume(mdf->value("/tracer/volume")*1e6);
+
+    d->numFrequencies = mdf->numberOfFrequencies();
+    d->numChannels = mdf->numberOfReceivers();
+    d->bandwidth = mdf->value("/acquisition/receiver/bandwidth");
+    d->positions = 1;
+    QVector<double> fov = mdf->values("/calibration/fieldOfView");
+    QVector<double> center = mdf->values("/calibration/fieldOfViewCenter");
+    for ( int i=0; i<3; i++ )
+    {
+        d->grid[i] = mdf->dimension(i);
+        d->positions *= d->grid[i];
+        d->fov[i] = i<fov.count() ? 1e3*fov.at(i) : 0.0;
+        d->offset[i] = i<center.count() ? 1e3*center.at(i) : 0.0;
+    }
+
+    QVector<double> strength = mdf->values("/acquisition/drivefield/strength");
+    for ( int i=0; i<3 && i<strength.count(); i++ )
+        d->driveFieldStrength[i] = 1e3*fabs(strength.at(i));
+    foreach(double g, mdf->values("/acquisition/gradient"))
+        d->selectionFieldGradient = qMax(d->selectionFieldGradient,fabs(g));
+    QVector<double> divider = mdf->values("/acquisition/drivefield/divider");
+    for ( int i=0; i<3 && i<divider.count(); i++ )
+        d->div[i] = static_cast<int>(divider.at(i));
+
+    d->transferFunction.fill(0,d->numChannels);
+
+    d->snrValues = mdf->values("/calibration/snr");
+    if ( d->snrValues.count()!=d->numChannels*d->numFrequencies )
+    {
+        qWarning() << "No valid SNR data in" << fileName;
+        d->snrValues.fill(0.0,d->numChannels*d->numFrequencies);
+    }
+    d->snrValueTable = d->snrValues.data();
+    d->rebuildSNRIndex();
+#else
+    d->error = tr ( "This program was built without support for MDF files." );
+#endif
 }
 
 SystemMatrix::~SystemMatrix() {
     d->unmapAll();
+    delete d->storage;
     delete d;
 }
 
@@ -896,37 +1021,75 @@ const SystemMatrix::complex* SystemMatrix::rawData(int globalIndex, bool backgro
             return reinterpret_cast<const complex*>(d->dataCache.object(cacheKey)->constData());
     }
     size_t block=d->grid[0]*d->grid[1]*d->grid[2];
-    complex * p = backgroundCorrection?d->rawDataCorrected:d->rawDataUncorrected;
+    const complex * p = d->storage->component(globalIndex,backgroundCorrection);
+    if ( p==0 )
+        return 0;
     if ( tf )
     {
-        QByteArray * data=new QByteArray(reinterpret_cast<char*>(p+block*globalIndex),static_cast<int>(block*sizeof(complex)));
-        p = reinterpret_cast<complex*>(data->data());
+        QByteArray * data=new QByteArray(reinterpret_cast<const char*>(p),static_cast<int>(block*sizeof(complex)));
+        complex * q = reinterpret_cast<complex*>(data->data());
         complex corr = tf->correctionFactor(frequency(globalIndex));
         if ( correctPhaseOnly )
             corr = std::polar(1.0,arg(corr));
-        for ( size_t i=0; i<block; i++, p++)
+        for ( size_t i=0; i<block; i++, q++)
         {
-            *p *= corr;
+            *q *= corr;
         }
         d->dataCache.insert(cacheKey,data);
         return reinterpret_cast<const complex*>(data->constData());
     }
     else
-        return p+block*globalIndex;
+        return p;
+}
+
+bool SystemMatrix::readBlock(int globalIndex, bool backgroundCorrection, complex * buffer) const
+{
+    if ( globalIndex<0 || globalIndex>= d->numChannels*d->numFrequencies || buffer==0 )
+        return false;
+    if ( !d->storage->readComponent(globalIndex,backgroundCorrection,buffer) )
+        return false;
+    size_t block=d->grid[0]*d->grid[1]*d->grid[2];
+    complex corr=calibrationFactor(globalIndex);
+    if ( corr!=1.0 )
+    {
+        for ( size_t i=0; i<block; i++ )
+            buffer[i] *= corr;
+    }
+    return true;
+}
+
+const SystemMatrix::complex * SystemMatrix::mappedData(int globalIndex, bool backgroundCorrection) const
+{
+    if ( globalIndex<0 || globalIndex>= d->numChannels*d->numFrequencies || d->storage==0 || !d->storage->isMapped() )
+        return 0;
+    return d->storage->component(globalIndex,backgroundCorrection);
+}
+
+SystemMatrix::complex SystemMatrix::calibrationFactor(int globalIndex) const
+{
+    complex corr=1.0;
+    TransferFunction * tf = d->transferFunction[receiver(globalIndex)];
+    if ( tf )
+    {
+        corr = tf->correctionFactor(frequency(globalIndex));
+        if ( correctPhaseOnly )
+            corr = std::polar(1.0,arg(corr));
+    }
+    return corr;
 }
 
 SystemMatrix::complex SystemMatrix::background(int globalIndex) const
 {
     if ( globalIndex<0 || globalIndex>= d->numChannels*d->numFrequencies )
         return complex(0.0);
-    return d->backgroundReference[globalIndex];
+    return d->storage->background(globalIndex);
 }
 
 double SystemMatrix::backgroundVariance(int globalIndex) const
 {
     if ( globalIndex<0 || globalIndex>= d->numChannels*d->numFrequencies )
         return 0.0;
-    return d->backgroundVariance[globalIndex];
+    return d->storage->backgroundVariance(globalIndex);
 }
 
 double SystemMatrix::backgroundNoise(int globalIndex) const
@@ -961,10 +1124,7 @@ double SystemMatrix::backgroundNoise(int globalIndex) const
 
 bool SystemMatrix::validPosition(const MatrixPosition &pos) const
 {
-    for ( unsigned int i=0; i<3; i++ )
-        if ( static_cast<int>(pos.index(i))>=d->grid[i] )
-            return false;
-    return true;
+    return d->validPosition(pos);
 }
 
 SystemMatrix::complex SystemMatrix::dataPoint(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const
@@ -977,118 +1137,94 @@ SystemMatrix::complex SystemMatrix::dataPoint(int globalIndex, const MatrixPosit
 
 SystemMatrix::complex SystemMatrix::interpolated(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const
 {
-    complex corr=1.0;
-    int channel = receiver(globalIndex);
-    TransferFunction * tf = d->transferFunction[channel];
-    if ( tf )
-    {
-        corr = tf->correctionFactor(frequency(globalIndex));
-        if ( correctPhaseOnly )
-            corr = std::polar(1.0,arg(corr));
-    }
-    return corr*d->interpolated(globalIndex,pos,backgroundCorrection);
+    return calibrationFactor(globalIndex)*d->interpolated(globalIndex,pos,backgroundCorrection);
 }
 
 bool SystemMatrix::interpolateDatapoint(int globalIndex, const MatrixPosition &pos, double threshold)
 {
-    bool changed=false;
-    if ( validPosition(pos) && d->mode==Editor )
-    {
-        complex corr=1.0;
-        int channel = receiver(globalIndex);
-        TransferFunction * tf = d->transferFunction[channel];
-        if ( tf )
-        {
-            corr = tf->correctionFactor(frequency(globalIndex));
-            if ( correctPhaseOnly )
-                corr = std::polar(1.0,arg(corr));
-        }
+    ChangeListItem item;
+    if ( !computeCorrection(globalIndex,pos,threshold,&item) )
+        return false;
+    return commitCorrections(pos,QList<ChangeListItem>() << item)>0;
+}
 
-        complex value [4];
-        for ( int b=0; b<2; b++ )
-        {
-            bool backgroundCorrection = (b!=0);
-            complex oldValue=value[2*b]=value[2*b+1]=dataPoint(globalIndex,pos,backgroundCorrection);
-            complex newValue=interpolated(globalIndex,pos,backgroundCorrection);
-            if ( abs(newValue)<abs(oldValue) &&
-                 abs(oldValue-newValue)/abs(oldValue)>threshold ) // perform change if the reduction exceeds the threshold
-            {
-                value[2*b+1]=newValue;
-                // Reverse calibration
-                for ( int i=0; i<4; i++ )
-                    value[i]/=corr;
-                d->setDataPoint(globalIndex,pos,backgroundCorrection,newValue);
-                changed=true;
-            }
-        }
-        if ( changed )
-        {
-            d->changeList.append(ChangeListEntry(pos,globalIndex,value));
-            d->recalcSNR(globalIndex);
-            d->rebuildSNRIndex();
-            QString error = d->writeModificationTable();
-            if ( !error.isEmpty() )
-                QMessageBox::warning(0,tr("File error"), error);
-            emit dataChange();
-        }
-    }
-    return changed;
+bool SystemMatrix::computeCorrection(int globalIndex, const MatrixPosition & pos, double threshold, ChangeListItem * item) const
+{
+    QList<ChangeListItem> items;
+    if ( computeCorrections(QList<int>() << globalIndex,pos,threshold,&items)==0 )
+        return false;
+    if ( item!=0 )
+        *item = items.first();
+    return true;
 }
 
-int SystemMatrix::interpolateDatapoints(const QList<int> & indices, const MatrixPosition &pos, double threshold, QObject * progressReceiver, const char * progressSlot)
+int SystemMatrix::computeCorrections(const QList<int> & globalIndices, const MatrixPosition & pos, double threshold, QList<ChangeListItem> * items) const
 {
-    if ( !validPosition(pos) || d->mode==Viewer )
+    if ( !validPosition(pos) || d->mode!=Editor || !d->storage->isMapped() )
         return 0;
-    QList<ChangeListItem> changes;
-    foreach(int globalIndex, indices)
-    {
-        complex corr=1.0;
-        int channel = receiver(globalIndex);
-        TransferFunction * tf = d->transferFunction[channel];
-        if ( tf )
-        {
-            corr = tf->correctionFactor(frequency(globalIndex));
-            if ( correctPhaseOnly )
-                corr = std::polar(1.0,arg(corr));
-        }
 
+    // The neighbours are the same for all components
+    int offsets[26];
+    double weights[26];
+    int count=d->neighbours(pos,offsets,weights);
+    int offset=(pos.z()*d->grid[1]+pos.y())*d->grid[0]+pos.x();
+
+    int changes=0;
+    foreach(int globalIndex, globalIndices)
+    {
+        if ( globalIndex<0 || globalIndex>=d->numChannels*d->numFrequencies )
+            continue;
+        // Uncalibrated values as stored in the change table. The calibration is a common factor
+        // of the old and the interpolated value and does not affect the relative reduction.
         complex value[4];
         bool changed=false;
         for ( int b=0; b<2; b++ )
         {
             bool backgroundCorrection=(b!=0);
-            complex oldValue=value[2*b]=value[2*b+1]=dataPoint(globalIndex,pos,backgroundCorrection);
-            complex newValue=interpolated(globalIndex,pos,backgroundCorrection);
+            const complex * p=d->storage->component(globalIndex,backgroundCorrection);
+            if ( p==0 )
+                continue;
+            complex oldValue=value[2*b]=value[2*b+1]=p[offset];
+            complex newValue=d->interpolated(p,count,offsets,weights);
             if ( abs(newValue)<abs(oldValue) &&
                  abs(oldValue-newValue)/abs(oldValue)>threshold ) // perform change if the reduction exceeds the threshold
             {
                 value[2*b+1]=newValue;
-                // Reverse calibration
-                for ( int i=0; i<4; i++ )
-                    value[i]/=corr;
-                d->setDataPoint(globalIndex,pos,backgroundCorrection,newValue);
                 changed=true;
             }
         }
-        if (changed)
+        if ( changed )
         {
-            changes.append(ChangeListItem(globalIndex,value));
-            d->recalcSNR(globalIndex);
-            if ( progressReceiver!=0 && progressSlot!=0 )
-            {
-                QMetaObject::invokeMethod(progressReceiver,progressSlot,Q_ARG(int,changes.count()));
-            }
-            emit dataChange();
+            if ( items!=0 )
+                items->append(ChangeListItem(pos,globalIndex,value));
+            changes++;
         }
     }
-    if ( !changes.empty() )
+    return changes;
+}
+
+int SystemMatrix::commitCorrections(const MatrixPosition & pos, const QList<ChangeListItem> & changes)
+{
+    if ( !validPosition(pos) || d->mode!=Editor || changes.isEmpty() )
+        return 0;
+    // Listeners are notified once, after the SNR and the change table are up to date
+    SystemMatrixChangeBatch batch(this);
+    QSet<int> changed;
+    foreach(const ChangeListItem & i, changes)
     {
-        d->changeList.append(ChangeListEntry(pos,changes));
-        d->rebuildSNRIndex();
-        QString error = d->writeModificationTable();
-        if ( !error.isEmpty() )
-            QMessageBox::warning(0,tr("File error"), error);
+        MatrixPosition p = i.position_.isValid() ? i.position_ : pos;
+        d->setDataPoint(i.globalIndex_,p,false,i.values_[1]);
+        d->setDataPoint(i.globalIndex_,p,true,i.values_[3]);
+        changed.insert(i.globalIndex_);
     }
+    notifyChange(changed.toList());
+    d->recalcSNR(changed.toList());
+    d->changeList.append(ChangeListEntry(pos,changes));
+    d->countEdits(d->changeList.last(),1);
+    d->rebuildSNRIndex();
+    QString error = d->writeModificationTable();
+    if ( !error.isEmpty() )
+        QMessageBox::warning(0,tr("File error"), error);
     return changes.count();
 }
 
@@ -1172,10 +1308,22 @@ QString SystemMatrix::lastChangeDescription() const
         if ( last.changeItems.count()>0 )
         {
             ts << "[" << last.position << "] / ";
-            ts << "Receiver " << 1+receiver(last.changeItems.first().globalIndex_) << " / ";
-            if ( last.changeItems.count()>1 )
+            int voxels = last.positions().count();
+            if ( voxels>1 )
+                ts << voxels << " Voxels / ";
+            QSet<int> receivers, frequencies;
+            foreach(const ChangeListItem & i, last.changeItems)
             {
-                ts << last.changeItems.count() << " Frequencies";
+                receivers.insert(receiver(i.globalIndex_));
+                frequencies.insert(frequencyIndex(i.globalIndex_));
+            }
+            if ( receivers.count()>1 )
+                ts << receivers.count() << " Receivers / ";
+            else
+                ts << "Receiver " << 1+receiver(last.changeItems.first().globalIndex_) << " / ";
+            if ( frequencies.count()>1 )
+            {
+                ts << frequencies.count() << " Frequencies";
             }
             else
             {
@@ -1186,45 +1334,163 @@ QString SystemMatrix::lastChangeDescription() const
     return res;
 }
 
+void SystemMatrix::lastChangeExtent(int * voxels, int * receivers, int * frequencies) const
+{
+    *voxels = *receivers = *frequencies = 0;
+    if ( d->changeList.isEmpty() )
+        return;
+    const ChangeListEntry & last = d->changeList.back();
+    QSet<int> receiverSet, frequencySet;
+    foreach(const ChangeListItem & i, last.changeItems)
+    {
+        receiverSet.insert(receiver(i.globalIndex_));
+        frequencySet.insert(frequencyIndex(i.globalIndex_));
+    }
+    *voxels = last.positions().count();
+    *receivers = receiverSet.count();
+    *frequencies = frequencySet.count();
+}
+
+QList<MatrixPosition> SystemMatrix::editedPositions(int globalIndex) const
+{
+    QList<MatrixPosition> res;
+    Impl::EditedVoxels::const_iterator it = d->editedVoxels.constFind(globalIndex);
+    if ( it==d->editedVoxels.constEnd() )
+        return res;
+    int nx = d->grid[0];
+    int ny = d->grid[1];
+    res.reserve(it.value().count());
+    foreach(int voxel, it.value().keys())
+        res.append(MatrixPosition(voxel%nx,(voxel/nx)%ny,voxel/(nx*ny)));
+    return res;
+}
+
 void SystemMatrix::undoLastChange()
 {
-    if ( d->mode!=Editor )
+    if ( d->mode!=Editor || d->changeList.isEmpty() )
         return;
+    SystemMatrixChangeBatch batch(this);
     ChangeListEntry last=d->changeList.takeLast();
+    d->countEdits(last,-1);
+    QSet<int> changed;
     foreach(ChangeListItem i,last.changeItems)
     {
         // No calibration correction here, since the change list contains the raw data.
-        d->setDataPoint(i.globalIndex_,last.position,false,i.values_[0]);
-        d->setDataPoint(i.globalIndex_,last.position,true,i.values_[2]);
-        d->recalcSNR(i.globalIndex_);
+        d->setDataPoint(i.globalIndex_,i.position_,false,i.values_[0]);
+        d->setDataPoint(i.globalIndex_,i.position_,true,i.values_[2]);
+        changed.insert(i.globalIndex_);
     }
+    notifyChange(changed.toList());
+    d->recalcSNR(changed.toList());
     d->rebuildSNRIndex();
     d->writeModificationTable();
-    emit dataChange();
 }
 
-void SystemMatrix::undoAllChanges(QObject * progressReceiver, const char * progressSlot)
+QList<ChangeListItem> SystemMatrix::originalValues() const
 {
-    if ( d->mode!=Editor )
-        return;
-    int total=d->changeList.count();
-    int c=0;
-    foreach(ChangeListEntry e, d->changeList)
+    QList<ChangeListItem> res;
+    QHash<qint64,int> index; // Item in res by component and voxel
+    foreach(const ChangeListEntry & e, d->changeList)
     {
-        foreach(ChangeListItem i,e.changeItems)
+        foreach(const ChangeListItem & i, e.changeItems)
         {
-            // No calibration correction here, since the change list contains the raw data.
-            d->setDataPoint(i.globalIndex_,e.position,false,i.values_[0]);
-            d->setDataPoint(i.globalIndex_,e.position,true,i.values_[2]);
-            d->recalcSNR(i.globalIndex_);
+            MatrixPosition p = i.position_.isValid() ? i.position_ : e.position;
+            if ( !validPosition(p) )
+                continue;
+            qint64 key = static_cast<qint64>(i.globalIndex_)*d->positions+d->dataOffset(p);
+            QHash<qint64,int>::const_iterator it = index.constFind(key);
+            if ( it==index.constEnd() )
+            {
+                index.insert(key,res.count());
+                res.append(ChangeListItem(p,i.globalIndex_,i.values_));
+            }
+            else
+            {
+                // The oldest change holds the original values, the newest one the current values
+                res[it.value()].values_[1] = i.values_[1];
+                res[it.value()].values_[3] = i.values_[3];
+            }
         }
-        if ( progressReceiver && progressSlot )
-            QMetaObject::invokeMethod(progressReceiver,progressSlot,Q_ARG(int,100*c/total));
     }
+    return res;
+}
+
+bool SystemMatrix::computeOriginalSnr(int globalIndex, const QList<ChangeListItem> & items, double * snr) const
+{
+    if ( globalIndex<0 || globalIndex>= d->numChannels*d->numFrequencies || snr==0 )
+        return false;
+    QVector<complex> buffer(d->positions);
+    if ( !d->storage->readComponent(globalIndex,true,buffer.data()) )
+        return false;
+    foreach(const ChangeListItem & i, items)
+        if ( i.globalIndex_==globalIndex && validPosition(i.position_) )
+            buffer[d->dataOffset(i.position_)] = i.values_[2];
+    *snr = d->snr(globalIndex,buffer.constData());
+    return true;
+}
+
+void SystemMatrix::commitUndoAll(const QList<ChangeListItem> & items, const QMap<int,double> & snr)
+{
+    if ( d->mode!=Editor )
+        return;
+    SystemMatrixChangeBatch batch(this);
+    QSet<int> changed;
+    foreach(const ChangeListItem & i, items)
+    {
+        // No calibration correction here, since the change list contains the raw data.
+        d->setDataPoint(i.globalIndex_,i.position_,false,i.values_[0]);
+        d->setDataPoint(i.globalIndex_,i.position_,true,i.values_[2]);
+        changed.insert(i.globalIndex_);
+    }
+    QList<int> missing;
+    foreach(int globalIndex, changed)
+    {
+        if ( snr.contains(globalIndex) )
+            d->snrValueTable[globalIndex] = snr.value(globalIndex);
+        else
+            missing.append(globalIndex);
+    }
+    d->recalcSNR(missing);
+    notifyChange(changed.toList());
     d->changeList.clear();
+    d->editedVoxels.clear();
     d->rebuildSNRIndex();
-    d->writeModificationTable();
+    QString error = d->writeModificationTable();
+    if ( !error.isEmpty() )
+        QMessageBox::warning(0,tr("File error"), error);
+}
+
+void SystemMatrix::beginChanges()
+{
+    d->changeDepth++;
+}
+
+void SystemMatrix::endChanges()
+{
+    if ( d->changeDepth==0 || --d->changeDepth>0 || d->pendingChanges.isEmpty() )
+        return;
+    QList<int> globalIndices = d->pendingChanges.toList();
+    qSort(globalIndices.begin(),globalIndices.end());
+    d->pendingChanges.clear();
+    emit dataChange();
+    emit componentsChanged(globalIndices);
+}
+
+void SystemMatrix::notifyChange(const QList<int> & globalIndices)
+{
+    // Calibrated copies of modified components are outdated now
+    foreach(int globalIndex, globalIndices)
+    {
+        d->dataCache.remove(globalIndex);
+        d->dataCache.remove(-globalIndex);
+    }
+    if ( d->changeDepth>0 )
+    {
+        d->pendingChanges.unite(QSet<int>::fromList(globalIndices));
+        return;
+    }
     emit dataChange();
+    emit componentsChanged(globalIndices);
 }
 
 // Local static helper functions
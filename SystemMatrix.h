@@ -29,12 +29,16 @@
 #include <QtCore/QObject>
 #include <QtCore/QSize>
 #include <QtCore/QList>
+#include <QtCore/QMap>
 #include <QtCore/QDateTime>
 #include <QtGui/QVector3D>
 
 // Local includes
 #include "MatrixPosition.h"
 
+// Forward declarations
+struct ChangeListItem;
+
 class SystemMatrix  : public QObject {
         Q_OBJECT
     public:
@@ -42,6 +46,10 @@ class SystemMatrix  : public QObject {
         typedef std::complex<double> complex;
         SystemMatrix ( const QString & procnoPath, Mode=Viewer, QObject * parent=0 );
         virtual ~SystemMatrix();
+        /**
+         * @brief isMdfFile Check whether a path refers to an MDF (HDF5) file instead of a Bruker procno
+         */
+        static bool isMdfFile(const QString & path);
         QString path() const;
         QString institution() const;
         QString systemName() const;
@@ -77,7 +85,34 @@ class SystemMatrix  : public QObject {
         double bandwidth() const;
         bool isModified() const;
         bool isValid ( QString * errorMsg = 0 ) const;
+        /**
+         * @brief rawData              Data of a component with the transfer function applied, x fastest
+         * @return                     0 if the data cannot be read. With MDF storage or a transfer function
+         *                             the data lives in a cache, so the pointer may become invalid by the
+         *                             next call of rawData(), dataPoint() or a modification of the matrix.
+         *                             Use readBlock() to keep a copy.
+         */
         const complex * rawData(int globalIndex, bool backgroundCorrection ) const;
+        /**
+         * @brief readBlock            Copy the calibrated data of a component, bypassing the data cache.
+         *                             Unlike rawData() this may be called from worker threads.
+         * @param globalIndex          Global index of the component
+         * @param backgroundCorrection Read background corrected data
+         * @param buffer               Destination for dimension(X)*dimension(Y)*dimension(Z) values
+         * @return                     false if the global index is invalid
+         */
+        bool readBlock(int globalIndex, bool backgroundCorrection, complex * buffer) const;
+        /**
+         * @brief mappedData           Uncalibrated data of a component if the matrix is memory mapped.
+         *                             The pointer stays valid while the matrix exists and may be used
+         *                             from worker threads. 0 for other storage types.
+         */
+        const complex * mappedData(int globalIndex, bool backgroundCorrection) const;
+        /**
+         * @brief calibrationFactor    Factor applied to the raw data of a component by the receiver
+         *                             transfer function, 1 if the receiver is not calibrated
+         */
+        complex calibrationFactor(int globalIndex) const;
         complex background( int globalIndex ) const;
         double backgroundVariance( int globalIndex ) const;
         double backgroundNoise( int globalIndex ) const;
@@ -85,11 +120,63 @@ class SystemMatrix  : public QObject {
         complex dataPoint(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const;
         complex interpolated(int globalIndex, const MatrixPosition & pos, bool backgroundCorrection) const;
         bool interpolateDatapoint(int globalIndex, const MatrixPosition & pos, double threshold=0.0);
-        int interpolateDatapoints(const QList<int> & indices, const MatrixPosition & pos, double threshold, QObject * progressReceiver=0, const char * progressSlot=0);
+        /**
+         * @brief computeCorrection Determine the uncalibrated old and new values of a voxel replaced by the
+         *                          interpolation of its neighbours without modifying the matrix. May be
+         *                          called from worker threads.
+         * @return                  false if the reduction exceeds the threshold in neither data set
+         */
+        bool computeCorrection(int globalIndex, const MatrixPosition & pos, double threshold, ChangeListItem * item) const;
+        /**
+         * @brief computeCorrections Like computeCorrection() for several components, which share the
+         *                           neighbour offsets and weights of pos. Corrections are appended to items.
+         * @return                   Number of changed components
+         */
+        int computeCorrections(const QList<int> & globalIndices, const MatrixPosition & pos, double threshold, QList<ChangeListItem> * items) const;
+        /**
+         * @brief commitCorrections Write corrections of one position as a single change, update the
+         *                          change table and notify once
+         * @return                  Number of changes, one per modified voxel and component
+         */
+        int commitCorrections(const MatrixPosition & pos, const QList<ChangeListItem> & changes);
         int increment( Qt::Axis direction) const;
         QString lastChangeDescription() const;
+        /**
+         * @brief lastChangeExtent Number of distinct voxels, receivers and frequencies of the last change,
+         *                         all 0 if the change table is empty
+         */
+        void lastChangeExtent(int * voxels, int * receivers, int * frequencies) const;
+        /**
+         * @brief editedPositions Distinct voxels whose values of the component were changed
+         *                        by the entries of the change table, kept up to date with the table
+         */
+        QList<MatrixPosition> editedPositions(int globalIndex) const;
         void undoLastChange();
-        void undoAllChanges(QObject * progressReceiver=0, const char * progressSlot=0);
+        /**
+         * @brief originalValues One item per voxel and component of the change table, the old values
+         *                       are those before its first change, the new values the current ones
+         */
+        QList<ChangeListItem> originalValues() const;
+        /**
+         * @brief computeOriginalSnr SNR of a component with the old values of its items written back,
+         *                           thread safe as long as the matrix is not changed. backgroundNoise()
+         *                           of the component must have been called before.
+         */
+        bool computeOriginalSnr(int globalIndex, const QList<ChangeListItem> & items, double * snr) const;
+        /**
+         * @brief commitUndoAll Write the old values of originalValues() back, take over the SNR computed for
+         *                      them, clear the change table and notify once. Components without an SNR are
+         *                      recalculated.
+         */
+        void commitUndoAll(const QList<ChangeListItem> & items, const QMap<int,double> & snr);
+        /**
+         * @brief beginChanges Start a batch of modifications, dataChange() and componentsChanged() are
+         *                     held back until the matching endChanges() and then emitted once for all
+         *                     modified components. Calls may be nested, SystemMatrixChangeBatch
+         *                     pairs them within a scope.
+         */
+        void beginChanges();
+        void endChanges();
     protected:
         /**
          * @brief setInstitution Set the name of the institution that operated the scanner
@@ -143,9 +230,37 @@ class SystemMatrix  : public QObject {
         void setAverages(int averages);
     signals:
         void dataChange();
+        /**
+         * @brief componentsChanged Emitted together with dataChange() after values were modified
+         * @param globalIndices     Global indices of all modified components
+         */
+        void componentsChanged(const QList<int> & globalIndices);
     private:
+        void loadBruker(const QString & procnoPath);
+        void loadMdf(const QString & fileName);
+        void notifyChange(const QList<int> & globalIndices);
         struct Impl;
         Impl * d;
 };
 
+/**
+ * @brief The SystemMatrixChangeBatch class holds back the change notifications of a system matrix
+ *        while it exists, see SystemMatrix::beginChanges()
+ */
+class SystemMatrixChangeBatch
+{
+public:
+    explicit SystemMatrixChangeBatch(SystemMatrix * matrix) : m_matrix(matrix)
+    {
+        m_matrix->beginChanges();
+    }
+    ~SystemMatrixChangeBatch()
+    {
+        m_matrix->endChanges();
+    }
+private:
+    Q_DISABLE_COPY(SystemMatrixChangeBatch)
+    SystemMatrix * m_matrix;
+};
+
 #endif // SYSTEMMATRIX_H
@@ -0,0 +1,250 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Standard includes
+#include <cstring>
+
+// Local includes
+#include "SystemMatrixStorage.h"
+
+struct SystemMatrixStorage::Impl
+{
+    int componentSize, numberOfComponents;
+    QString error;
+};
+
+SystemMatrixStorage::SystemMatrixStorage() : d(new Impl)
+{
+    d->componentSize = 0;
+    d->numberOfComponents = 0;
+}
+
+SystemMatrixStorage::~SystemMatrixStorage()
+{
+    delete d;
+}
+
+uchar * SystemMatrixStorage::mapFile(QFile & file, QIODevice::OpenMode mode, QString * error)
+{
+    if ( ! file.exists() )
+    {
+         if ( error ) *error = tr ( "File %1 does not exist.").arg(file.fileName());
+         return 0;
+    }
+    if ( !file.open(mode) )
+    {
+        if ( error ) *error = tr ( "Cannot open file %1.").arg(file.fileName());
+        return 0;
+    }
+    uchar * q = file.map(0,file.size());
+    if ( 0 == q )
+    {
+         if ( error ) *error = tr ("Cannot map file %1 into memory.").arg(file.fileName());
+         file.close();
+         return 0;
+    }
+    file.close();
+    return q;
+}
+
+bool SystemMatrixStorage::isValid(QString * errorMsg) const
+{
+    if ( d->error.isEmpty() )
+        return true;
+    if ( errorMsg!=0 )
+        *errorMsg = d->error;
+    return false;
+}
+
+int SystemMatrixStorage::componentSize() const
+{
+    return d->componentSize;
+}
+
+int SystemMatrixStorage::numberOfComponents() const
+{
+    return d->numberOfComponents;
+}
+
+SystemMatrixStorage::complex * SystemMatrixStorage::writableComponent(int, bool)
+{
+    return 0;
+}
+
+bool SystemMatrixStorage::isMapped() const
+{
+    return false;
+}
+
+void SystemMatrixStorage::setComponentSize(int n)
+{
+    d->componentSize = n;
+}
+
+void SystemMatrixStorage::setNumberOfComponents(int n)
+{
+    d->numberOfComponents = n;
+}
+
+void SystemMatrixStorage::setError(const QString & error)
+{
+    d->error = error;
+}
+
+struct MappedStorage::Impl
+{
+    QFile uncorrectedFile, correctedFile, referenceFile, varianceFile;
+    complex * uncorrected, * corrected;
+    const complex * backgroundReference;
+    const double * backgroundVariance;
+    bool writable;
+
+    template<typename T>
+    qint64 map(QFile & file, T ** p, QFile::OpenMode mode, QString * error)
+    {
+        uchar * q = mapFile(file,mode,error);
+        if ( 0 == q )
+            return 0;
+        *p = reinterpret_cast<T*>(q);
+        return file.size();
+    }
+};
+
+MappedStorage::MappedStorage(const QString & procnoPath, int componentSize, bool writable) :
+    d(new Impl)
+{
+    setComponentSize(componentSize);
+    d->uncorrected = d->corrected = 0;
+    d->backgroundReference = 0;
+    d->backgroundVariance = 0;
+    d->writable = writable;
+    d->uncorrectedFile.setFileName(procnoPath+"/systemMatrix");
+    d->correctedFile.setFileName(procnoPath+"/systemMatrixBG");
+    d->referenceFile.setFileName(procnoPath+"/backgroundReference");
+    d->varianceFile.setFileName(procnoPath+"/backgroundVariance");
+
+    QString error;
+    QIODevice::OpenMode fileMode = writable ? QIODevice::ReadWrite : QIODevice::ReadOnly;
+
+    // Map uncorrected raw data
+    qint64 dataSize1 = d->map( d->uncorrectedFile, &d->uncorrected, fileMode, &error );
+    if ( dataSize1==0 )
+    {
+        setError(error);
+        return;
+    }
+
+    // Map corrected raw data
+    qint64 dataSize2 = d->map( d->correctedFile, &d->corrected, fileMode, &error );
+    if ( dataSize2==0 )
+    {
+        setError(error);
+        return;
+    }
+
+    if ( dataSize1!=dataSize2 )
+    {
+        setError(tr ( "Sizes of corrected and uncorrected system matrices do not match."));
+        return;
+    }
+    qint64 components = dataSize1/sizeof(complex)/componentSize;
+    setNumberOfComponents(static_cast<int>(components));
+
+    // Load background reference
+    qint64 mappedSize = d->map( d->referenceFile, &d->backgroundReference, QFile::ReadOnly, &error );
+    if ( mappedSize==0 )
+    {
+        setError(error);
+        return;
+    }
+
+    qint64 expectedSize = components*sizeof(complex);
+    if ( expectedSize != mappedSize )
+    {
+        setError(tr ("Background reference file has wrong file size (%1 bytes instead of expected %2 bytes).").arg(mappedSize).arg(expectedSize));
+        return;
+    }
+
+    // Load background variance
+    mappedSize = d->map( d->varianceFile, &d->backgroundVariance, QFile::ReadOnly, &error );
+    if ( mappedSize==0 )
+    {
+        setError(error);
+        return;
+    }
+
+    expectedSize = components*sizeof(double);
+    if ( expectedSize != mappedSize )
+    {
+        setError(tr ("Background variance file has wrong file size (%1 bytes instead of expected %2 bytes).").arg(mappedSize).arg(expectedSize));
+        return;
+    }
+}
+
+MappedStorage::~MappedStorage()
+{
+    // QFile unmaps all mapped regions when destroyed
+    delete d;
+}
+
+const SystemMatrixStorage::complex * MappedStorage::component(int globalIndex, bool backgroundCorrection)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() )
+        return 0;
+    const complex * p = backgroundCorrection ? d->corrected : d->uncorrected;
+    return p + static_cast<size_t>(componentSize())*globalIndex;
+}
+
+SystemMatrixStorage::complex * MappedStorage::writableComponent(int globalIndex, bool backgroundCorrection)
+{
+    if ( !d->writable || globalIndex<0 || globalIndex>=numberOfComponents() )
+        return 0;
+    complex * p = backgroundCorrection ? d->corrected : d->uncorrected;
+    return p + static_cast<size_t>(componentSize())*globalIndex;
+}
+
+bool MappedStorage::readComponent(int globalIndex, bool backgroundCorrection, complex * buffer)
+{
+    const complex * p = component(globalIndex,backgroundCorrection);
+    if ( p==0 || buffer==0 )
+        return false;
+    memcpy(buffer,p,componentSize()*sizeof(complex));
+    return true;
+}
+
+bool MappedStorage::isMapped() const
+{
+    return true;
+}
+
+SystemMatrixStorage::complex MappedStorage::background(int globalIndex)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() )
+        return complex(0.0);
+    return d->backgroundReference[globalIndex];
+}
+
+double MappedStorage::backgroundVariance(int globalIndex)
+{
+    if ( globalIndex<0 || globalIndex>=numberOfComponents() )
+        return 0.0;
+    return d->backgroundVariance[globalIndex];
+}
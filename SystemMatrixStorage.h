@@ -0,0 +1,105 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef SYSTEMMATRIXSTORAGE_H
+#define SYSTEMMATRIXSTORAGE_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+#include <QtCore/QString>
+
+/**
+ * @brief The SystemMatrixStorage class provides access to the uncalibrated data of the
+ *        components of a system matrix, independent of the file format. A component is a
+ *        block of componentSize() values with x as the fastest varying index.
+ */
+class SystemMatrixStorage
+{
+    // Messages share their translations with the SystemMatrix class
+    Q_DECLARE_TR_FUNCTIONS(SystemMatrix)
+public:
+    typedef std::complex<double> complex;
+    virtual ~SystemMatrixStorage();
+    /**
+     * @brief mapFile Map a whole file into memory, the mapping stays valid while file exists
+     * @return        Start of the mapped data, 0 if the file cannot be mapped
+     */
+    static uchar * mapFile(QFile & file, QIODevice::OpenMode mode, QString * error=0);
+    bool isValid(QString * errorMsg=0) const;
+    int componentSize() const;
+    int numberOfComponents() const;
+    /**
+     * @brief component            Data of a component
+     * @param globalIndex          Global index of the component
+     * @param backgroundCorrection Return background corrected data
+     * @return                     Pointer to componentSize() values, which may become invalid by
+     *                             subsequent calls. 0 if the data cannot be read.
+     */
+    virtual const complex * component(int globalIndex, bool backgroundCorrection) = 0;
+    /**
+     * @brief writableComponent Modifiable data of a component, 0 for read-only storage
+     */
+    virtual complex * writableComponent(int globalIndex, bool backgroundCorrection);
+    /**
+     * @brief readComponent Copy the data of a component to buffer. May be called from any thread.
+     */
+    virtual bool readComponent(int globalIndex, bool backgroundCorrection, complex * buffer) = 0;
+    /**
+     * @brief isMapped true if component() returns pointers into memory mapped files, which
+     *        stay valid while the storage exists and may be read from any thread
+     */
+    virtual bool isMapped() const;
+    virtual complex background(int globalIndex) = 0;
+    virtual double backgroundVariance(int globalIndex) = 0;
+protected:
+    SystemMatrixStorage();
+    void setComponentSize(int n);
+    void setNumberOfComponents(int n);
+    void setError(const QString & error);
+private:
+    struct Impl;
+    Impl * d;
+};
+
+/**
+ * @brief The MappedStorage class maps the raw files of a Bruker ParaVision procno into memory
+ */
+class MappedStorage : public SystemMatrixStorage
+{
+public:
+    MappedStorage(const QString & procnoPath, int componentSize, bool writable);
+    virtual ~MappedStorage();
+    virtual const complex * component(int globalIndex, bool backgroundCorrection);
+    virtual complex * writableComponent(int globalIndex, bool backgroundCorrection);
+    virtual bool readComponent(int globalIndex, bool backgroundCorrection, complex * buffer);
+    virtual bool isMapped() const;
+    virtual complex background(int globalIndex);
+    virtual double backgroundVariance(int globalIndex);
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // SYSTEMMATRIXSTORAGE_H
@@ -0,0 +1,200 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QMap>
+#include <QtCore/QPointer>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "UndoAllJob.h"
+#include "SystemMatrix.h"
+#include "ChangeList.h"
+
+// Interval of progress reports in ms, the workers only count
+static const int progressInterval = 100;
+
+struct UndoAllJob::Impl
+{
+    // Computes the original SNR of one component in a worker thread
+    struct Compute
+    {
+        explicit Compute(Impl * d) : d(d) {}
+        void operator()(int index) const;
+        Impl * d;
+    };
+
+    QPointer<SystemMatrix> systemMatrix;
+    QList<ChangeListItem> items;
+    QVector<int> components;
+    QVector< QList<ChangeListItem> > componentItems;
+    QVector<double> snr;
+    QVector<int> tasks;
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+    // Global index+1 of the first component that could not be read, 0 if none
+    QAtomicInt failed;
+    QTimer progressTimer;
+    int reported;
+    QString error;
+
+    void run()
+    {
+        QtConcurrent::blockingMap(tasks,Compute(this));
+    }
+};
+
+void UndoAllJob::Impl::Compute::operator()(int index) const
+{
+    if ( d->cancelled.load() )
+        return;
+    int globalIndex = d->components.at(index);
+    if ( !d->systemMatrix->computeOriginalSnr(globalIndex,d->componentItems.at(index),&d->snr[index]) )
+    {
+        d->failed.testAndSetOrdered(0,globalIndex+1);
+        d->cancelled.store(1);
+        return;
+    }
+    d->done.fetchAndAddOrdered(1);
+}
+
+UndoAllJob::UndoAllJob(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->reported = 0;
+    d->progressTimer.setInterval(progressInterval);
+    connect(&d->progressTimer,SIGNAL(timeout()),SLOT(reportProgress()));
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishUndo()));
+}
+
+UndoAllJob::~UndoAllJob()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void UndoAllJob::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+}
+
+bool UndoAllJob::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+int UndoAllJob::componentCount() const
+{
+    return d->components.count();
+}
+
+QString UndoAllJob::errorString() const
+{
+    return d->error;
+}
+
+bool UndoAllJob::start()
+{
+    if ( isRunning() || d->systemMatrix==0 )
+        return false;
+    d->error.clear();
+    d->items = d->systemMatrix->originalValues();
+    if ( d->items.isEmpty() )
+    {
+        d->error = tr("There are no changes to undo.");
+        return false;
+    }
+
+    // Items grouped by component
+    QMap<int,int> index;
+    d->components.clear();
+    d->componentItems.clear();
+    foreach(const ChangeListItem & i, d->items)
+    {
+        if ( !index.contains(i.globalIndex_) )
+        {
+            index.insert(i.globalIndex_,d->components.count());
+            d->components.append(i.globalIndex_);
+            d->componentItems.append(QList<ChangeListItem>());
+        }
+        d->componentItems[index.value(i.globalIndex_)].append(i);
+    }
+    // The noise is cached on first use, fill the cache before the worker threads read it
+    foreach(int globalIndex, d->components)
+        d->systemMatrix->backgroundNoise(globalIndex);
+
+    d->snr.fill(0.0,d->components.count());
+    d->tasks.clear();
+    for ( int k=0; k<d->components.count(); k++ )
+        d->tasks.append(k);
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->failed.store(0);
+    d->reported = 0;
+    d->progressTimer.start();
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void UndoAllJob::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void UndoAllJob::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void UndoAllJob::reportProgress()
+{
+    int done = d->done.load();
+    if ( done==d->reported )
+        return;
+    d->reported = done;
+    emit progress(done);
+}
+
+void UndoAllJob::finishUndo()
+{
+    d->progressTimer.stop();
+    reportProgress();
+    int globalIndex = d->failed.load()-1;
+    if ( globalIndex>=0 )
+        d->error = tr("Cannot read component %1 of the system matrix.").arg(globalIndex);
+    bool success = d->cancelled.load()==0 && d->systemMatrix!=0;
+    if ( success )
+    {
+        QMap<int,double> snr;
+        for ( int k=0; k<d->components.count(); k++ )
+            snr.insert(d->components.at(k),d->snr.at(k));
+        d->systemMatrix->commitUndoAll(d->items,snr);
+    }
+    d->items.clear();
+    d->componentItems.clear();
+    d->tasks.clear();
+    emit finished(success);
+}
@@ -0,0 +1,69 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef UNDOALLJOB_H
+#define UNDOALLJOB_H
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QString>
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The UndoAllJob class reverts all changes of a system matrix. Worker threads compute the SNR
+ *        of the modified components with their original values, the values are written back and
+ *        the change table is cleared in one step when all of them are done. A cancelled job leaves
+ *        the matrix unchanged.
+ */
+class UndoAllJob : public QObject
+{
+    Q_OBJECT
+public:
+    explicit UndoAllJob(QObject * parent=0);
+    virtual ~UndoAllJob();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    bool isRunning() const;
+    /**
+     * @brief componentCount Number of modified components, known after start()
+     */
+    int componentCount() const;
+    QString errorString() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+signals:
+    /**
+     * @brief progress Number of processed components, emitted at most every 100 ms
+     */
+    void progress(int components);
+    void finished(bool success);
+private slots:
+    void finishUndo();
+    void reportProgress();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // UNDOALLJOB_H
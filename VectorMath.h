@@ -0,0 +1,63 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef VECTORMATH_H
+#define VECTORMATH_H
+
+// Standard includes
+#include <complex>
+
+// SSE2 is part of every x86-64 target, on 32 bit x86 it has to be enabled by the compiler
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define SFVIEW_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief conjugateDot sum(conj(a[j])*b[j]) over j in [0,n), the inner product of two components
+ */
+inline std::complex<double> conjugateDot(const std::complex<double> * a, const std::complex<double> * b, int n)
+{
+#ifdef SFVIEW_USE_SSE2
+    // (ar*br, ai*bi) and (ar*bi, ai*br) give real and imaginary part of the product
+    const double * p = reinterpret_cast<const double*>(a);
+    const double * q = reinterpret_cast<const double*>(b);
+    __m128d same = _mm_setzero_pd(), crossed = _mm_setzero_pd();
+    for ( int j=0; j<n; j++ )
+    {
+        __m128d x = _mm_loadu_pd(p+2*j);
+        __m128d y = _mm_loadu_pd(q+2*j);
+        same = _mm_add_pd(same,_mm_mul_pd(x,y));
+        crossed = _mm_add_pd(crossed,_mm_mul_pd(x,_mm_shuffle_pd(y,y,1)));
+    }
+    double s[2], c[2];
+    _mm_storeu_pd(s,same);
+    _mm_storeu_pd(c,crossed);
+    return std::complex<double>(s[0]+s[1],c[0]-c[1]);
+#else
+    std::complex<double> sum = 0.0;
+    for ( int j=0; j<n; j++ )
+        sum += std::conj(a[j])*b[j];
+    return sum;
+#endif
+}
+
+#endif // VECTORMATH_H
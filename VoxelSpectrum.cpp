@@ -0,0 +1,217 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+// Qt includes
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QPointer>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+
+// Local includes
+#include "VoxelSpectrum.h"
+#include "SystemMatrix.h"
+#include "VectorMath.h"
+
+typedef VoxelSpectrum::complex complex;
+
+// Components per task, and how many components ahead the voxel is prefetched
+static const int componentsPerTask = 256;
+static const int prefetchDistance = 8;
+
+struct VoxelSpectrum::Impl
+{
+    struct Task
+    {
+        int first, count;  // Range in frequency indices
+    };
+
+    // Gathers the voxel from the components of a task in a worker thread
+    struct Gather
+    {
+        explicit Gather(Impl * d) : d(d) {}
+        void operator()(const Task & task) const;
+        Impl * d;
+    };
+
+    VoxelSpectrum * q;
+    QPointer<SystemMatrix> systemMatrix;
+    bool backgroundCorrection;
+    int receiver;
+    MatrixPosition position;
+    int positions, offset;
+
+    QVector<complex> spectrum;
+    QFutureWatcher<void> watcher;
+    QAtomicInt cancelled, done;
+
+    void run()
+    {
+        QVector<Task> tasks;
+        for ( int first=0; first<spectrum.count(); first+=componentsPerTask )
+        {
+            Task task;
+            task.first = first;
+            task.count = qMin(componentsPerTask,spectrum.count()-first);
+            tasks.append(task);
+        }
+        QtConcurrent::blockingMap(tasks,Gather(this));
+    }
+};
+
+void VoxelSpectrum::Impl::Gather::operator()(const Task & task) const
+{
+    if ( d->cancelled.load() )
+        return;
+    const complex * voxels[componentsPerTask];
+    bool mapped = true;
+    for ( int k=0; k<task.count; k++ )
+    {
+        const complex * p = d->systemMatrix->mappedData(d->systemMatrix->globalIndex(d->receiver,task.first+k),d->backgroundCorrection);
+        if ( p==0 )
+        {
+            mapped = false;
+            break;
+        }
+        voxels[k] = p+d->offset;
+    }
+
+    if ( mapped )
+    {
+        for ( int k=0; k<task.count; k++ )
+        {
+#ifdef SFVIEW_USE_SSE2
+            // Each value lies on its own page, the hardware prefetcher does not follow such strides
+            if ( k+prefetchDistance<task.count )
+                _mm_prefetch(reinterpret_cast<const char*>(voxels[k+prefetchDistance]),_MM_HINT_T0);
+#endif
+            int globalIndex = d->systemMatrix->globalIndex(d->receiver,task.first+k);
+            d->spectrum[task.first+k] = d->systemMatrix->calibrationFactor(globalIndex)*(*voxels[k]);
+        }
+    }
+    else
+    {
+        // Not memory mapped, whole components have to be read
+        QVector<complex> buffer(d->positions);
+        for ( int k=0; k<task.count && !d->cancelled.load(); k++ )
+        {
+            int globalIndex = d->systemMatrix->globalIndex(d->receiver,task.first+k);
+            if ( d->systemMatrix->readBlock(globalIndex,d->backgroundCorrection,buffer.data()) )
+                d->spectrum[task.first+k] = buffer.at(d->offset);
+        }
+    }
+    emit d->q->progress(d->done.fetchAndAddOrdered(task.count)+task.count);
+}
+
+VoxelSpectrum::VoxelSpectrum(QObject * parent) : QObject(parent), d(new Impl)
+{
+    d->q = this;
+    d->backgroundCorrection = true;
+    d->receiver = 0;
+    d->positions = 0;
+    d->offset = 0;
+    connect(&d->watcher,SIGNAL(finished()),SLOT(finishGather()));
+}
+
+VoxelSpectrum::~VoxelSpectrum()
+{
+    cancel();
+    waitForFinished();
+    delete d;
+}
+
+void VoxelSpectrum::setSystemMatrix(SystemMatrix * systemMatrix)
+{
+    d->systemMatrix = systemMatrix;
+    d->spectrum.clear();
+}
+
+void VoxelSpectrum::setBackgroundCorrection(bool b)
+{
+    d->backgroundCorrection = b;
+}
+
+void VoxelSpectrum::setReceiver(int receiver)
+{
+    d->receiver = receiver;
+}
+
+int VoxelSpectrum::receiver() const
+{
+    return d->receiver;
+}
+
+void VoxelSpectrum::setPosition(const MatrixPosition & pos)
+{
+    d->position = pos;
+}
+
+MatrixPosition VoxelSpectrum::position() const
+{
+    return d->position;
+}
+
+bool VoxelSpectrum::isRunning() const
+{
+    return d->watcher.isRunning();
+}
+
+QVector<complex> VoxelSpectrum::result() const
+{
+    if ( isRunning() )
+        return QVector<complex>();
+    return d->spectrum;
+}
+
+bool VoxelSpectrum::start()
+{
+    if ( isRunning() || d->systemMatrix==0 || !d->systemMatrix->validPosition(d->position)
+         || d->receiver<0 || d->receiver>=d->systemMatrix->numberOfReceivers() )
+        return false;
+    int grid[3];
+    for ( int i=0; i<3; i++ )
+        grid[i] = d->systemMatrix->dimension(static_cast<Qt::Axis>(i));
+    d->positions = grid[0]*grid[1]*grid[2];
+    d->offset = (d->position.z()*grid[1]+d->position.y())*grid[0]+d->position.x();
+    d->spectrum.fill(complex(0.0),d->systemMatrix->numberOfFrequencies());
+    d->cancelled.store(0);
+    d->done.store(0);
+    d->watcher.setFuture(QtConcurrent::run(d,&Impl::run));
+    return true;
+}
+
+void VoxelSpectrum::waitForFinished()
+{
+    d->watcher.waitForFinished();
+}
+
+void VoxelSpectrum::cancel()
+{
+    d->cancelled.store(1);
+}
+
+void VoxelSpectrum::finishGather()
+{
+    bool success = d->cancelled.load()==0;
+    if ( !success )
+        d->spectrum.clear();
+    emit finished(success);
+}
@@ -0,0 +1,75 @@
+/*
+ * SF Viewer - A program to visualize MPI system matrices
+ * Copyright (C) 2014-2017  Ulrich Heinen <ulrich.heinen@hs-pforzheim.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * $Id$
+ */
+
+#ifndef VOXELSPECTRUM_H
+#define VOXELSPECTRUM_H
+
+// Standard includes
+#include <complex>
+
+// Qt includes
+#include <QtCore/QObject>
+#include <QtCore/QVector>
+
+// Local includes
+#include "MatrixPosition.h"
+
+// Forward declarations
+class SystemMatrix;
+
+/**
+ * @brief The VoxelSpectrum class gathers the calibrated values of a single voxel from all
+ *        components of a receiver. The voxel is read with the component size as stride,
+ *        so the worker threads prefetch the voxels of the following components.
+ */
+class VoxelSpectrum : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::complex<double> complex;
+    explicit VoxelSpectrum(QObject * parent=0);
+    virtual ~VoxelSpectrum();
+    void setSystemMatrix(SystemMatrix * systemMatrix);
+    void setBackgroundCorrection(bool);
+    void setReceiver(int receiver);
+    int receiver() const;
+    void setPosition(const MatrixPosition & pos);
+    MatrixPosition position() const;
+    bool isRunning() const;
+    /**
+     * @brief result Value of the voxel for every frequency index of the receiver
+     */
+    QVector<complex> result() const;
+    bool start();
+    void waitForFinished();
+public slots:
+    void cancel();
+signals:
+    void progress(int components);
+    void finished(bool success);
+private slots:
+    void finishGather();
+private:
+    struct Impl;
+    Impl * d;
+};
+
+#endif // VOXELSPECTRUM_H
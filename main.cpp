@@ -28,12 +28,104 @@
 #endif
 #include <QtCore/QTranslator>
 #include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QTextStream>
 
 // Local includes
 #include "SFView.h"
+#include "SystemMatrix.h"
+#include "ForwardSimulator.h"
+
+// Value following an option on the command line, empty if the option is missing
+static QString optionValue(const QStringList & arguments, const QString & option)
+{
+    int i = arguments.indexOf(option);
+    if ( i<0 || i+1>=arguments.count() )
+        return QString();
+    return arguments.at(i+1);
+}
+
+// Headless forward simulation: SFView -simulate phantom -o spectrum [-snr threshold] [-nobg] matrix
+static int simulate(const QStringList & arguments)
+{
+    QTextStream out(stdout), err(stderr);
+    QString phantom = optionValue(arguments,"-simulate");
+    QString output = optionValue(arguments,"-o");
+    QString matrixPath;
+    for ( int i=1; i<arguments.count(); i++ )
+    {
+        if ( arguments.at(i).startsWith("-") )
+        {
+            if ( arguments.at(i)!="-nobg" )
+                i++;
+            continue;
+        }
+        matrixPath = arguments.at(i);
+    }
+    if ( phantom.isEmpty() || output.isEmpty() || matrixPath.isEmpty() )
+    {
+        err << "Usage: " << arguments.first() << " -simulate phantom -o spectrum [-snr threshold] [-nobg] matrix\n";
+        return 1;
+    }
+
+    QString error;
+    SystemMatrix matrix(matrixPath);
+    if ( !matrix.isValid(&error) )
+    {
+        err << error << "\n";
+        return 1;
+    }
+    ForwardSimulator simulator;
+    simulator.setSystemMatrix(&matrix);
+    simulator.setBackgroundCorrection(!arguments.contains("-nobg"));
+    QString snr = optionValue(arguments,"-snr");
+    if ( !snr.isEmpty() )
+    {
+        // Components in SNR order down to the threshold
+        QList<int> components;
+        for ( int rank=0; rank<=matrix.maxGlobalIndex(); rank++ )
+        {
+            int globalIndex = matrix.globalIndex(rank);
+            if ( globalIndex<0 || matrix.snr(globalIndex)<snr.toDouble() )
+                break;
+            components.append(globalIndex);
+        }
+        if ( components.isEmpty() )
+        {
+            // An empty selection would simulate all components
+            err << "No component reaches an SNR of " << snr << "\n";
+            return 1;
+        }
+        simulator.setComponents(components);
+    }
+    QElapsedTimer timer;
+    timer.start();
+    if ( !simulator.loadPhantom(phantom) || !simulator.start() )
+    {
+        err << simulator.errorString() << "\n";
+        return 1;
+    }
+    if ( !simulator.waitForFinished() || !simulator.saveResult(output) )
+    {
+        err << simulator.errorString() << "\n";
+        return 1;
+    }
+    out << "Simulated spectrum written to " << output << " in " << timer.elapsed() << " ms\n";
+    return 0;
+}
 
 
 int main ( int argc, char ** argv ) {
+    for ( int i=1; i<argc; i++ )
+    {
+        if ( qstrcmp(argv[i],"-simulate")==0 )
+        {
+            QCoreApplication app ( argc, argv );
+            app.setOrganizationName("HS_Pforzheim");
+            app.setApplicationName("SFView");
+            return simulate(app.arguments());
+        }
+    }
     QApplication app ( argc, argv );
     QStringList arguments = app.arguments();
     bool editor=(arguments.first().contains("SFEdit")) ||